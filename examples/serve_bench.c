@@ -0,0 +1,146 @@
+/***
+ * Throughput benchmark for sxupdate-serve: opens many concurrent keep-alive loopback
+ * connections that each repeatedly GET the same path, and reports requests/s and MB/s
+ *
+ * Usage: serve_bench <port> <path> [connections] [requests per connection]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+struct bench_conn {
+  int fd;
+  int remaining;      // requests still to send
+  char buff[16384];
+  size_t len;         // header bytes buffered
+  long long body_left; // -1 while reading headers
+};
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_send_request(struct bench_conn *c, const char *path) {
+  char req[1024];
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+  c->len = 0;
+  c->body_left = -1;
+  return send(c->fd, req, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 3) {
+    fprintf(stderr, "Usage: %s <port> <path> [connections] [requests per connection]\n", argv[0]);
+    return 1;
+  }
+  int port = atoi(argv[1]);
+  const char *path = argv[2];
+  int nconns = argc > 3 ? atoi(argv[3]) : 200;
+  int nreqs = argc > 4 ? atoi(argv[4]) : 50;
+
+  int ep = epoll_create1(0);
+  struct bench_conn *conns = calloc(nconns, sizeof(*conns));
+  if(ep < 0 || !conns)
+    return 1;
+
+  struct sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  double start = bench_now();
+  int active = 0;
+  for(int i = 0; i < nconns; i++) {
+    struct bench_conn *c = &conns[i];
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      perror("connect");
+      return 1;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    c->remaining = nreqs - 1;
+    if(bench_send_request(c, path))
+      return 1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    active++;
+  }
+
+  long long responses = 0, bytes = 0, errors = 0;
+  struct epoll_event events[256];
+  while(active > 0) {
+    int n = epoll_wait(ep, events, 256, 10000);
+    if(n <= 0) {
+      fprintf(stderr, "timed out with %i connections active\n", active);
+      break;
+    }
+    for(int i = 0; i < n; i++) {
+      struct bench_conn *c = events[i].data.ptr;
+      int done = 0;
+      while(!done) {
+        char tmp[65536];
+        char *dst = c->body_left < 0 ? c->buff + c->len : tmp;
+        size_t cap = c->body_left < 0 ? sizeof(c->buff) - c->len - 1 : sizeof(tmp);
+        ssize_t r = recv(c->fd, dst, cap, 0);
+        if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+        if(r <= 0) {
+          errors++;
+          done = 1;
+          break;
+        }
+        bytes += r;
+        if(c->body_left < 0) {
+          c->len += r;
+          c->buff[c->len] = '\0';
+          char *eoh = strstr(c->buff, "\r\n\r\n");
+          if(!eoh)
+            continue;
+          if(strncmp(c->buff, "HTTP/1.1 200", 12))
+            errors++;
+          char *cl = strcasestr(c->buff, "Content-Length:");
+          long long content_length = cl ? atoll(cl + 15) : 0;
+          size_t body_have = c->len - (eoh + 4 - c->buff);
+          c->body_left = content_length - (long long)body_have;
+        } else
+          c->body_left -= r;
+
+        if(c->body_left == 0) {
+          responses++;
+          if(c->remaining-- > 0) {
+            if(bench_send_request(c, path)) {
+              errors++;
+              done = 1;
+            }
+          } else
+            done = 1;
+        }
+      }
+      if(done) {
+        close(c->fd);
+        active--;
+      }
+    }
+  }
+  double elapsed = bench_now() - start;
+
+  printf("connections: %i, requests: %lli, errors: %lli\n", nconns, responses, errors);
+  printf("elapsed: %.3fs, %.0f req/s, %.1f MB/s\n", elapsed,
+         responses / elapsed, bytes / elapsed / (1024 * 1024));
+  free(conns);
+  return errors ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sxupdate/api.h>
+#include "test_options.h"
 
 static char *fgets_no_trailing_white(char * restrict str, int size, FILE * restrict stream) {
   char *s = fgets(str, size, stream);
@@ -33,15 +34,99 @@ static void interaction_handler(sxupdate_t handle, enum sxupdate_step step,
   }
 }
 
+/* SXUPDATE_SOAK=n: run n periodic checks and verify that memory use stays flat */
+static struct {
+  unsigned long checks;
+  unsigned long errors;
+  struct sxupdate_memory_stats baseline; // after the second check, once caches are warm
+  struct sxupdate_memory_stats last;
+} soak;
+
+static void soak_completion_handler(sxupdate_t handle, enum sxupdate_status stat) {
+  if(stat != sxupdate_status_ok)
+    soak.errors++;
+  sxupdate_get_memory_stats(handle, &soak.last);
+  if(++soak.checks == 2)
+    soak.baseline = soak.last;
+}
+
+static int soak_run(sxupdate_t sxu, unsigned long checks) {
+  struct sxupdate_periodic_options opts = { 0 };
+  opts.max_checks = checks;
+  sxupdate_set_completion_handler(sxu, soak_completion_handler);
+  sxupdate_run_periodic(sxu, &opts);
+  if(soak.checks < 3 || soak.errors || soak.last.bytes != soak.baseline.bytes
+     || soak.last.peak_bytes != soak.baseline.peak_bytes) {
+    printf("Soak: Fail! %lu checks, %lu errors, %zu => %zu bytes, peak %zu => %zu bytes\n",
+           soak.checks, soak.errors, soak.baseline.bytes, soak.last.bytes,
+           soak.baseline.peak_bytes, soak.last.peak_bytes);
+    return 1;
+  }
+  printf("Soak: Success (%lu checks, %zu bytes, peak %zu bytes)\n",
+         soak.checks, soak.last.bytes, soak.last.peak_bytes);
+  return 0;
+}
+
 struct sxupdate_semantic_version get_version() {
   struct sxupdate_semantic_version v = {};
   v.major = 1;
   v.minor = 1;
   v.patch = 1;
   v.prerelease = "alpha";
+
+  // SXUPDATE_CURRENT_VERSION=major.minor.patch to pretend to be another version
+  const char *s = getenv("SXUPDATE_CURRENT_VERSION");
+  if(s && sscanf(s, "%d.%d.%d", &v.major, &v.minor, &v.patch) == 3)
+    v.prerelease = NULL;
   return v;
 }
 
+/* SXUPDATE_BATCH=id,id,...: check several products, all at the current version, from one catalog */
+#define BATCH_MAX_PRODUCTS 16
+
+static void batch_completion_handler(sxupdate_t handle, enum sxupdate_status stat) {
+  fprintf(stderr, "Product %s: %s\n", sxupdate_get_product_id(handle),
+          stat == sxupdate_status_ok ? "done" : "failed");
+}
+
+static int batch_run(sxupdate_t sxu, const char *ids) {
+  struct sxupdate_product products[BATCH_MAX_PRODUCTS];
+  char buff[1024];
+  size_t count = 0;
+  memset(products, 0, sizeof(products));
+  snprintf(buff, sizeof(buff), "%s", ids);
+  for(char *id = strtok(buff, ","); id && count < BATCH_MAX_PRODUCTS; id = strtok(NULL, ",")) {
+    products[count].id = id;
+    products[count].current_version = get_version();
+    products[count].interaction_handler = interaction_handler;
+    count++;
+  }
+  sxupdate_set_completion_handler(sxu, batch_completion_handler);
+  return sxupdate_execute_batch(sxu, products, count) != sxupdate_status_ok;
+}
+
+/* SXUPDATE_EVENT_RING=capacity: print the events the update wrote to the ring, as a UI would */
+static void events_print(sxupdate_t sxu) {
+  static const char *phases[] = { "none", "checking", "checked", "downloading", "downloaded",
+                                  "verifying", "verified", "installing", "done" };
+  struct sxupdate_event events[16];
+  size_t n;
+  while((n = sxupdate_poll_events(sxu, events, sizeof(events) / sizeof(*events))))
+    for(size_t i = 0; i < n; i++)
+      if(events[i].type == sxupdate_event_phase)
+        fprintf(stderr, "Event: %s %d at %.3fs\n", phases[events[i].phase], events[i].status, events[i].time);
+      else if(events[i].type == sxupdate_event_progress)
+        fprintf(stderr, "Event: progress %lld/%lld at %.0f bytes/s\n", events[i].bytes, events[i].total,
+                events[i].bytes_per_second);
+      else
+        fprintf(stderr, "Event: error %s while %s\n", events[i].error, phases[events[i].phase]);
+
+  struct sxupdate_event_ring_stats stats;
+  sxupdate_get_event_ring_stats(sxu, &stats);
+  fprintf(stderr, "Events: %llu published, %llu coalesced, %llu dropped\n",
+          stats.published, stats.coalesced, stats.dropped);
+}
+
 int main(int argc, const char *argv[]) {
   char url[1024];
   const char *envvar;
@@ -103,10 +188,14 @@ int main(int argc, const char *argv[]) {
     }
   }
 
+  // count memory allocated by libcurl, OpenSSL and yajl too
+  if((getenv("SXUPDATE_STATS") || getenv("SXUPDATE_SOAK")) && sxupdate_set_allocator(NULL) != sxupdate_status_ok)
+    fprintf(stderr, "Unable to set allocator\n");
+
   sxupdate_t sxu = sxupdate_new();
   if(sxu) {
     int err = 0;
-    sxupdate_set_verbosity(sxu, 5);
+    sxupdate_set_verbosity(sxu, getenv("SXUPDATE_SOAK") ? 0 : 5);
 
     if(*pem_path == '\0')
       sxupdate_set_public_key(sxu, NULL);
@@ -118,18 +207,39 @@ int main(int argc, const char *argv[]) {
     if(*installer_arg)
       sxupdate_add_installer_arg(sxu, installer_arg);
 
+    if(test_options_apply(sxu)) // optional features, as set in the environment
+      err = 1;
+
     if(!err) {
       sxupdate_set_current_version(sxu, get_version);
       sxupdate_set_interaction_handler(sxu, interaction_handler);
       sxupdate_set_url(sxu, url);
       if(have_custom_header)
         sxupdate_add_header(sxu, header_name, header_value);
-      if(sxupdate_execute(sxu)) {
+      if((envvar = getenv("SXUPDATE_SOAK")))
+        err = soak_run(sxu, strtoul(envvar, NULL, 10));
+      else if((envvar = getenv("SXUPDATE_BATCH")))
+        err = batch_run(sxu, envvar);
+      else if(sxupdate_execute(sxu)) {
         char *err_msg = sxupdate_err_msg(sxu);
         fprintf(stderr, "Error: %s\n", err_msg ? err_msg : "Unknown");
         free(err_msg);
       }
+      if(getenv("SXUPDATE_STATS")) {
+        char *stats = sxupdate_stats_to_json(sxu);
+        if(stats)
+          fprintf(stderr, "Stats: %s\n", stats);
+        free(stats);
+
+        struct sxupdate_memory_stats mem;
+        sxupdate_get_memory_stats(sxu, &mem);
+        fprintf(stderr, "Memory: %zu bytes in %zu blocks, peak %zu bytes, %zu allocations\n",
+                mem.bytes, mem.allocations, mem.peak_bytes, mem.total_allocations);
+      }
+      if(getenv("SXUPDATE_EVENT_RING"))
+        events_print(sxu);
     }
     sxupdate_delete(sxu);
+    return err;
   }
 }
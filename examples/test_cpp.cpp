@@ -0,0 +1,119 @@
+// The C++20 layer (sxupdate/api.hpp): an update taken through each stage by a coroutine,
+// on a handle driven by a poll() loop, without blocking or a thread of its own.
+//
+// SXUPDATE_URL and SXUPDATE_PEMFILE as for test.c. SXUPDATE_KEEP=1 stops once the installer
+// is verified, and prints its path, instead of running it
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <map>
+#include <poll.h>
+#include <vector>
+#include <sxupdate/api.hpp>
+
+/* the caller's event loop: the sockets to watch, and a single timer */
+static struct {
+  std::map<int, short> fds;
+  long timeout_ms = -1;
+  bool done = false;
+} loop;
+
+static void socket_cb(sxupdate_t, sxupdate_socket_t fd, enum sxupdate_poll what, void *) {
+  if(what == sxupdate_poll_remove)
+    loop.fds.erase(fd);
+  else
+    loop.fds[fd] = (what & sxupdate_poll_in ? POLLIN : 0) | (what & sxupdate_poll_out ? POLLOUT : 0);
+}
+
+static void timer_cb(sxupdate_t, long timeout_ms, void *) {
+  loop.timeout_ms = timeout_ms;
+}
+
+static void run_loop(sxupdate_t h) {
+  while(!loop.done) {
+    std::vector<struct pollfd> pfds;
+    for(auto &[fd, events] : loop.fds)
+      pfds.push_back({ fd, events, 0 });
+    int n = poll(pfds.data(), pfds.size(), loop.timeout_ms < 0 ? 1000 : (int)loop.timeout_ms);
+    if(n <= 0) {
+      if(loop.timeout_ms >= 0) {
+        loop.timeout_ms = -1;
+        sxupdate_socket_action(h, SXUPDATE_SOCKET_TIMEOUT, 0);
+      }
+      continue;
+    }
+    for(auto &p : pfds)
+      if(p.revents)
+        sxupdate_socket_action(h, p.fd, (p.revents & POLLIN ? sxupdate_socket_event_in : 0)
+                               | (p.revents & POLLOUT ? sxupdate_socket_event_out : 0)
+                               | (p.revents & (POLLERR | POLLHUP) ? sxupdate_socket_event_err : 0));
+  }
+}
+
+/* a coroutine that starts straight away, and that nobody waits for */
+struct task {
+  struct promise_type {
+    task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static struct sxupdate_semantic_version get_version() {
+  struct sxupdate_semantic_version v = {};
+  v.major = 1;
+  v.minor = 1;
+  v.patch = 1;
+  v.prerelease = (char *)"alpha";
+  return v;
+}
+
+static int result = 1;
+
+static task update(sxupdate::handle &h, bool keep) {
+  auto checked = co_await h.check();
+  if(!checked.newer()) {
+    fprintf(stderr, "Check: %s\n", checked ? "up to date" : h.error_message().c_str());
+    loop.done = true;
+    co_return;
+  }
+  fprintf(stderr, "Newer version %d.%d.%d (%.*s), %zu bytes\n", checked.version.semver().major,
+          checked.version.semver().minor, checked.version.semver().patch,
+          (int)checked.version.filename().size(), checked.version.filename().data(), checked.version.length());
+
+  auto downloaded = co_await h.download();
+  if(downloaded)
+    fprintf(stderr, "Downloaded to %.*s\n", (int)downloaded.path.size(), downloaded.path.data());
+  auto verified = downloaded ? co_await h.verify() : downloaded;
+  if(!verified || verified.path.empty())
+    fprintf(stderr, "Update: %s\n", h.error_message().c_str());
+  else if(keep) {
+    printf("Kept: %.*s\n", (int)verified.path.size(), verified.path.data());
+    h.cancel();
+    result = 0;
+  } else if(co_await h.install() == sxupdate_status_ok)
+    result = 0;
+  loop.done = true;
+}
+
+int main() {
+  const char *url = getenv("SXUPDATE_URL"), *pem = getenv("SXUPDATE_PEMFILE");
+  if(!url) {
+    fprintf(stderr, "Set SXUPDATE_URL\n");
+    return 1;
+  }
+  sxupdate::handle h;
+  h.set_url(url);
+  h.set_current_version(get_version);
+  if((pem && *pem && sxupdate_set_public_key_from_file(h.native(), pem) != sxupdate_status_ok)
+     || sxupdate_set_event_callbacks(h.native(), socket_cb, timer_cb, nullptr) != sxupdate_status_ok)
+    return 1;
+
+  // moved before it is awaited, which is allowed
+  sxupdate::handle moved = std::move(h);
+  update(moved, getenv("SXUPDATE_KEEP") != nullptr);
+  run_loop(moved.native());
+  return result;
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h> // getenv
+#include "test_options.h"
+
+/* SXUPDATE_PEER: fetch from, and share with, LAN peers */
+static enum sxupdate_status option_peer(sxupdate_t sxu, const char *value) {
+  struct sxupdate_peer_options opts = { 0 };
+  opts.share_dir = getenv("SXUPDATE_PEER_DIR");
+  opts.iface = getenv("SXUPDATE_PEER_IFACE");
+  if((value = getenv("SXUPDATE_PEER_PORT")))
+    opts.port = (unsigned short)atoi(value);
+  return sxupdate_set_peer_cache(sxu, &opts);
+}
+
+/* SXUPDATE_STATE_FILE=path: skip checks made within SXUPDATE_STATE_TTL seconds */
+static enum sxupdate_status option_state(sxupdate_t sxu, const char *value) {
+  const char *ttl = getenv("SXUPDATE_STATE_TTL");
+  return sxupdate_set_state_file(sxu, value, ttl ? atol(ttl) : 3600);
+}
+
+/* SXUPDATE_BACKGROUND_DIR=dir: check in a helper process */
+static enum sxupdate_status option_background(sxupdate_t sxu, const char *value) {
+  struct sxupdate_background_options opts = { 0 };
+  opts.dir = value;
+  opts.prefetch = !!getenv("SXUPDATE_BACKGROUND_PREFETCH");
+  return sxupdate_set_background(sxu, &opts);
+}
+
+/* SXUPDATE_SHARD_CHANNEL=name: if the url serves an index */
+static enum sxupdate_status option_shard(sxupdate_t sxu, const char *value) {
+  struct sxupdate_shard_options opts = { 0 };
+  opts.channel = value;
+  return sxupdate_set_shard(sxu, &opts);
+}
+
+/* SXUPDATE_SPECULATIVE: download while the user answers */
+static enum sxupdate_status option_speculative(sxupdate_t sxu, const char *value) {
+  (void)value;
+  return sxupdate_set_speculative_download(sxu, 1);
+}
+
+/* SXUPDATE_INSTALL_DIR=dir: update this tree from manifests */
+static enum sxupdate_status option_install_dir(sxupdate_t sxu, const char *value) {
+  return sxupdate_set_install_dir(sxu, value);
+}
+
+/* SXUPDATE_DELTA_SEED=file, SXUPDATE_DELTA_CACHE=dir: fetch only missing blocks */
+static enum sxupdate_status option_delta(sxupdate_t sxu, const char *value) {
+  const char *seeds[] = { getenv("SXUPDATE_DELTA_SEED"), NULL };
+  struct sxupdate_delta_options opts = { 0 };
+  (void)value;
+  opts.seeds = seeds;
+  opts.cache_dir = getenv("SXUPDATE_DELTA_CACHE");
+  return sxupdate_set_delta(sxu, &opts);
+}
+
+/* SXUPDATE_DEADLINE_MS, SXUPDATE_HEDGE_MS, SXUPDATE_MIRROR: bound the fetch */
+static enum sxupdate_status option_fetch(sxupdate_t sxu, const char *value) {
+  const char *mirrors[] = { getenv("SXUPDATE_MIRROR"), NULL };
+  struct sxupdate_fetch_options opts = { 0 };
+  if((value = getenv("SXUPDATE_DEADLINE_MS")))
+    opts.deadline_ms = atol(value);
+  if((value = getenv("SXUPDATE_HEDGE_MS"))) { // race a second request after this long
+    opts.hedge = 1;
+    opts.hedge_delay_ms = atol(value);
+  }
+  opts.mirrors = mirrors;
+  return sxupdate_set_fetch_options(sxu, &opts);
+}
+
+/* SXUPDATE_ASYNC_WRITES, SXUPDATE_DIRECT_MIN_BYTES: write the download from another thread or io_uring */
+static enum sxupdate_status option_async_writes(sxupdate_t sxu, const char *value) {
+  struct sxupdate_write_options opts = { 0 };
+  opts.async = 1;
+  if((value = getenv("SXUPDATE_DIRECT_MIN_BYTES")))
+    opts.direct_min_bytes = atoll(value);
+  return sxupdate_set_write_options(sxu, &opts);
+}
+
+/* SXUPDATE_QOS_MAX_RATE, SXUPDATE_QOS_NICE, SXUPDATE_QOS_IDLE_IO: stay in the background */
+static enum sxupdate_status option_qos(sxupdate_t sxu, const char *value) {
+  struct sxupdate_qos_options opts = { 0 };
+  if((value = getenv("SXUPDATE_QOS_MAX_RATE")))
+    opts.max_recv_bytes_per_second = atoll(value);
+  if((value = getenv("SXUPDATE_QOS_NICE")))
+    opts.nice = atoi(value);
+  opts.idle_io = !!getenv("SXUPDATE_QOS_IDLE_IO");
+  return sxupdate_set_qos(sxu, &opts);
+}
+
+/* SXUPDATE_MACHINE_ID, SXUPDATE_MACHINE_ID_FILE: place this client in staged rollouts */
+static enum sxupdate_status option_rollout(sxupdate_t sxu, const char *value) {
+  struct sxupdate_rollout_options opts = { 0 };
+  (void)value;
+  opts.machine_id = getenv("SXUPDATE_MACHINE_ID");
+  opts.id_file = getenv("SXUPDATE_MACHINE_ID_FILE");
+  return sxupdate_set_rollout(sxu, &opts);
+}
+
+/* SXUPDATE_FLIGHT_DIR=dir: one fetch and download for all processes */
+static enum sxupdate_status option_single_flight(sxupdate_t sxu, const char *value) {
+  struct sxupdate_single_flight_options opts = { 0 };
+  opts.dir = value;
+  opts.no_wait = !!getenv("SXUPDATE_FLIGHT_NO_WAIT");
+  return sxupdate_set_single_flight(sxu, &opts);
+}
+
+/* SXUPDATE_EVENT_RING=capacity: report phases and progress to be polled */
+static enum sxupdate_status option_event_ring(sxupdate_t sxu, const char *value) {
+  struct sxupdate_event_ring_options opts = { 0 };
+  opts.capacity = strtoul(value, NULL, 10);
+  return sxupdate_set_event_ring(sxu, &opts);
+}
+
+#define TEST_OPTION_MAX_ENV 3
+
+static const struct test_option {
+  const char *env[TEST_OPTION_MAX_ENV]; // set if any of these is; passed the first one's value
+  enum sxupdate_status (*set)(sxupdate_t sxu, const char *value);
+} test_options[] = {
+  { { "SXUPDATE_PEER" }, option_peer },
+  { { "SXUPDATE_STATE_FILE" }, option_state },
+  { { "SXUPDATE_BACKGROUND_DIR" }, option_background },
+  { { "SXUPDATE_SHARD_CHANNEL" }, option_shard },
+  { { "SXUPDATE_SPECULATIVE" }, option_speculative },
+  { { "SXUPDATE_INSTALL_DIR" }, option_install_dir },
+  { { "SXUPDATE_DELTA_SEED", "SXUPDATE_DELTA_CACHE" }, option_delta },
+  { { "SXUPDATE_DEADLINE_MS", "SXUPDATE_HEDGE_MS" }, option_fetch },
+  { { "SXUPDATE_ASYNC_WRITES" }, option_async_writes },
+  { { "SXUPDATE_QOS_MAX_RATE", "SXUPDATE_QOS_NICE", "SXUPDATE_QOS_IDLE_IO" }, option_qos },
+  { { "SXUPDATE_MACHINE_ID", "SXUPDATE_MACHINE_ID_FILE" }, option_rollout },
+  { { "SXUPDATE_FLIGHT_DIR" }, option_single_flight },
+  { { "SXUPDATE_EVENT_RING" }, option_event_ring },
+};
+
+int test_options_apply(sxupdate_t sxu) {
+  int err = 0;
+  for(size_t i = 0; i < sizeof(test_options) / sizeof(*test_options); i++) {
+    const char *value = NULL;
+    for(int j = 0; j < TEST_OPTION_MAX_ENV && test_options[i].env[j] && !value; j++)
+      value = getenv(test_options[i].env[j]);
+    if(value && test_options[i].set(sxu, value) != sxupdate_status_ok)
+      err = 1;
+  }
+  return err;
+}
@@ -0,0 +1,14 @@
+#ifndef SXUPDATE_TEST_OPTIONS_H
+#define SXUPDATE_TEST_OPTIONS_H
+
+#include <sxupdate/api.h>
+
+/**
+ * Set the optional features that the environment asks for (see test_options.c, which
+ * has one entry per feature, so that a feature's test adds an entry there, not a branch
+ * to test.c)
+ * @return 0 on success, else 1 if a feature could not be set
+ */
+int test_options_apply(sxupdate_t sxu);
+
+#endif
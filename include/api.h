@@ -4,9 +4,46 @@
 #define SXUPDATE_API
 
 #include <ctype.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET sxupdate_socket_t;
+#else
+typedef int sxupdate_socket_t;
+#endif
+
+/* pass as the `fd` argument of sxupdate_socket_action() when a timer has expired */
+#define SXUPDATE_SOCKET_TIMEOUT ((sxupdate_socket_t)-1)
 
 typedef struct sxupdate_data *sxupdate_t;
 
+enum sxupdate_log_level {
+  sxupdate_log_level_error = 1,
+  sxupdate_log_level_warning,
+  sxupdate_log_level_info,
+  sxupdate_log_level_debug,
+  sxupdate_log_level_trace
+};
+
+struct sxupdate_log_field {
+  const char *key;
+  const char *value;
+};
+
+/***
+ * Caller-defined log sink. Receives one record per call, consisting of its level, a stable
+ * dotted event id (e.g. "download.start"), a human-readable message and zero or more
+ * key/value fields. All pointers are only valid for the duration of the call
+ */
+typedef void (*sxupdate_log_sink)(void *ctx, enum sxupdate_log_level level, const char *event,
+                                  const char *message,
+                                  const struct sxupdate_log_field *fields, size_t field_count);
+
 enum sxupdate_status {
   sxupdate_status_ok = 0,
   sxupdate_status_error,
@@ -38,6 +75,58 @@ typedef void (*sxupdate_interaction_handler)(sxupdate_t handle, enum sxupdate_st
                                       void (*resume)(sxupdate_t, enum sxupdate_action)
                                       );
 
+enum sxupdate_stage {
+  sxupdate_stage_none = 0,
+  sxupdate_stage_downloaded, /* the installer has been downloaded, not yet verified */
+  sxupdate_stage_verified    /* the installer has been verified, and is about to be run */
+};
+
+/***
+ * Caller-defined handler for the stages of the download (see sxupdate_set_stage_handler()).
+ * `path` is the installer, and is valid until `resume()` is called. As with the interaction
+ * handler, `resume()` must be called exactly once, possibly after the handler has returned:
+ * with sxupdate_action_proceed to go on to the next stage, or else to stop there
+ */
+typedef void (*sxupdate_stage_handler)(sxupdate_t handle, enum sxupdate_stage stage, const char *path,
+                                       void (*resume)(sxupdate_t, enum sxupdate_action));
+
+/***
+ * Caller-defined handler invoked once the whole update flow has finished, i.e. after
+ * the metadata fetch failed, or after the action passed to `resume()` has completed
+ */
+typedef void (*sxupdate_completion_handler)(sxupdate_t handle, enum sxupdate_status);
+
+/***
+ * Event loop integration. Values match libcurl's CURL_POLL_* and CURL_CSELECT_*
+ */
+enum sxupdate_poll {
+  sxupdate_poll_none = 0,
+  sxupdate_poll_in = 1,    /* wait for the socket to become readable */
+  sxupdate_poll_out = 2,   /* wait for the socket to become writable */
+  sxupdate_poll_inout = 3, /* wait for either */
+  sxupdate_poll_remove = 4 /* stop watching the socket */
+};
+
+enum sxupdate_socket_event {
+  sxupdate_socket_event_in = 1,
+  sxupdate_socket_event_out = 2,
+  sxupdate_socket_event_err = 4
+};
+
+/***
+ * Called when sxupdate needs the caller's event loop to start, change or stop
+ * watching a socket
+ */
+typedef void (*sxupdate_socket_callback)(sxupdate_t handle, sxupdate_socket_t fd,
+                                         enum sxupdate_poll what, void *ctx);
+
+/***
+ * Called when sxupdate needs the caller's event loop to (re)arm its single timer.
+ * A `timeout_ms` of -1 means the timer should be disarmed; 0 means it should fire
+ * as soon as possible
+ */
+typedef void (*sxupdate_timer_callback)(sxupdate_t handle, long timeout_ms, void *ctx);
+
 struct sxupdate_semantic_version { /* see https://semver.org */
   int major;
   int minor;
@@ -60,9 +149,83 @@ struct sxupdate_version { // structure for an appcast item
     char *type;
     char *signature;
     char *filename; /* name of downloaded file e.g. 'myapp_installer.exe' */
+    char *encoding; /* compression of the file at url, e.g. "xz", or NULL if stored as is */
+    char *blocks;   /* block checksums of the file at url, for sxupdate_set_delta(), or NULL */
   } enclosure;
+
+  struct {
+    char *url;       /* signed list of the files of this version (see sxupdate_set_install_dir()) */
+    char *signature;
+  } manifest;
+};
+
+/***
+ * Timings of the phases of a transfer, in seconds, as reported by curl_easy_getinfo()
+ */
+struct sxupdate_transfer_stats {
+  double dns;        /* name lookup */
+  double connect;    /* TCP connect, after name lookup */
+  double tls;        /* TLS handshake, after connect */
+  double ttfb;       /* time to first byte, from start of transfer */
+  double total;      /* whole transfer, from start */
+  double bytes;      /* bytes received */
+  double throughput; /* average bytes per second */
+};
+
+/***
+ * Per-phase timings, in seconds, of the most recent sxupdate_execute(). Phases that
+ * did not (yet) run are zero
+ */
+struct sxupdate_stats {
+  double state;           /* reading and writing the state file */
+  struct sxupdate_transfer_stats index;   /* the index, if the url serves one (see sxupdate_set_shard()) */
+  struct sxupdate_transfer_stats appcast;
+  struct sxupdate_transfer_stats download;
+  double download_wait;   /* waiting for a speculative download after the user proceeded */
+  double parse;           /* parsing the appcast, including while it streams in */
+  double version_compare; /* comparing the fetched and current versions */
+  double peer_discovery;  /* asking LAN peers for a copy of the installer */
+  double hash;            /* SHA-256 of the downloaded installer, while or after downloading it */
+  double verify;          /* RSA signature verification */
+  double spawn;           /* launching the installer */
+};
+
+/***
+ * Custom memory allocator. `realloc` must accept a NULL `ptr`. Each function is
+ * passed `ctx`
+ */
+struct sxupdate_allocator {
+  void *(*malloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
 };
 
+/***
+ * Memory counters for a handle, or for the whole process
+ */
+struct sxupdate_memory_stats {
+  size_t bytes;              /* currently allocated */
+  size_t peak_bytes;         /* high-water mark of `bytes` */
+  size_t allocations;        /* blocks currently allocated */
+  size_t total_allocations;  /* blocks allocated, including those since freed */
+  size_t failed_allocations; /* refused by the allocator or by the memory limit */
+};
+
+/***
+ * Route the memory allocated by sxupdate, and by libcurl, OpenSSL and the bundled yajl,
+ * through a custom allocator, and count it towards the handle on whose behalf it was
+ * allocated (see sxupdate_get_memory_stats()). Memory sxupdate allocates itself is always
+ * counted; memory allocated by the other libraries is counted only after this is called
+ *
+ * This is process-wide, and must be called once, before any other sxupdate function and
+ * before the application initializes libcurl or OpenSSL, otherwise it fails
+ *
+ * @param allocator: the allocator to use, which can be transient, or NULL to count with
+ *                   the system allocator
+ */
+enum sxupdate_status sxupdate_set_allocator(const struct sxupdate_allocator *allocator);
+
 /***
  * Get a new sxupdate handle
  **/
@@ -74,6 +237,27 @@ sxupdate_t sxupdate_new();
 void sxupdate_set_interaction_handler(sxupdate_t handle,
                                       sxupdate_interaction_handler handler);
 
+/***
+ * Pause the update once the installer has been downloaded, and again once it has been
+ * verified, calling `handler` each time. Stopping at sxupdate_stage_verified keeps the
+ * installer, at `path`, for the caller to run; stopping at sxupdate_stage_downloaded
+ * deletes it. If a copy from a peer, a prefetch or a delta fails to verify, the installer
+ * is downloaded again, and `handler` called again with sxupdate_stage_downloaded
+ *
+ * @param handler: the handler, or NULL to verify and run the installer without pausing
+ */
+void sxupdate_set_stage_handler(sxupdate_t handle, sxupdate_stage_handler handler);
+
+/***
+ * Attach a pointer of the caller's to the handle, e.g. for its handlers to find their state
+ */
+void sxupdate_set_user_data(sxupdate_t handle, void *user_data);
+
+/***
+ * Get the pointer set with sxupdate_set_user_data(), or NULL
+ */
+void *sxupdate_get_user_data(sxupdate_t handle);
+
 /***
  * Get a pointer to the latest version, as defined by the fetched metadata
  * For use within your interaction handler, for example to display a message
@@ -93,6 +277,30 @@ void sxupdate_delete(sxupdate_t handle);
  */
 void sxupdate_set_verbosity(sxupdate_t handle, unsigned char verbosity);
 
+/***
+ * Send log records to a custom sink instead of stderr. Records less severe than
+ * `max_level` are discarded before any formatting takes place. Pass a NULL sink to revert
+ * to the default, which writes to stderr and derives its level from the verbosity
+ *
+ * Records can also be removed at compile time by building with
+ * -DSXUPDATE_LOG_MIN_LEVEL=n, where n is the least severe sxupdate_log_level to keep
+ */
+void sxupdate_set_log_sink(sxupdate_t handle, sxupdate_log_sink sink, void *ctx,
+                           enum sxupdate_log_level max_level);
+
+/***
+ * Cap the memory that can be allocated on behalf of a handle. Allocations that would
+ * exceed the cap fail, which surfaces as sxupdate_status_memory or a transfer error
+ *
+ * @param max_bytes: the cap, or 0 for no limit
+ */
+void sxupdate_set_memory_limit(sxupdate_t handle, size_t max_bytes);
+
+/***
+ * Get the memory counters for a handle, or for the whole process if handle is NULL
+ */
+void sxupdate_get_memory_stats(sxupdate_t handle, struct sxupdate_memory_stats *stats);
+
 /***
  * Add an argument that will be passed to the installer when it is invoked
  * In windows environment, the argument will be appended to the command string,
@@ -123,15 +331,480 @@ enum sxupdate_status sxupdate_add_header(sxupdate_t handle, const char *header_n
 /***
  * Execute the update
  *
+ * If event callbacks have been set with sxupdate_set_event_callbacks(), this function
+ * only starts the metadata fetch and returns immediately; progress is then driven by
+ * calling sxupdate_socket_action() and the result is reported to the completion handler
+ *
  * @return 0 on success, else non-zero.
  **/
 enum sxupdate_status sxupdate_execute(sxupdate_t handle);
 
+/***
+ * A product to check with sxupdate_execute_batch()
+ */
+struct sxupdate_product {
+  const char *id;                                   /* its key in the catalog's "products" */
+  struct sxupdate_semantic_version current_version; /* the version installed */
+  sxupdate_interaction_handler interaction_handler; /* called as for sxupdate_execute() */
+};
+
+/***
+ * Check many products with a single fetch and parse of a catalog (see
+ * schema/catalog.schema.json), which the url must serve instead of an appcast. Only the
+ * entries of the products listed are kept. The products are then taken in turn: the
+ * interaction handler of each is called as in sxupdate_execute(), with
+ * sxupdate_get_version() and sxupdate_get_product_id() describing that product, and once
+ * it has finished, the completion handler is called for it before the next product is
+ * taken. A product that is missing from the catalog, or whose entry is invalid, completes
+ * with sxupdate_status_error, as does every product if the catalog cannot be fetched
+ *
+ * The get_current_version callback and interaction handler set on the handle are not
+ * used, nor are the state file and background checks. Installer arguments are passed to
+ * the installer of every product
+ *
+ * @param products: the products to check, which can be transient
+ * @return 0 on success, else non-zero: sxupdate_status_invalid if count is 0, or a product
+ *         has no id or interaction handler
+ */
+enum sxupdate_status sxupdate_execute_batch(sxupdate_t handle, const struct sxupdate_product *products,
+                                            size_t count);
+
+/***
+ * During sxupdate_execute_batch(), the id of the product that the interaction and
+ * completion handlers are called for. NULL otherwise
+ */
+const char *sxupdate_get_product_id(sxupdate_t handle);
+
+/***
+ * Release the results of the previous check (the fetched version, its signature and the
+ * parser state), keeping the configuration: url, headers, public key, installer arguments
+ * and callbacks. sxupdate_execute() does this itself before each check, so this is only
+ * needed to release that memory between checks
+ */
+enum sxupdate_status sxupdate_reset(sxupdate_t handle);
+
+/***
+ * Options for sxupdate_run_periodic()
+ */
+struct sxupdate_periodic_options {
+  unsigned long interval_ms; /* time from the start of one check to the start of the next */
+  unsigned long max_checks;  /* stop after this many checks, or 0 to run until sxupdate_stop() */
+};
+
+/***
+ * Check for updates every `interval_ms`, for long-lived processes. Each check is a full
+ * sxupdate_execute(), calling the interaction and completion handlers as usual; the
+ * interaction handler must call `resume()` before it returns. The public key, headers and
+ * fetch connection are reused from one check to the next, so memory use stays flat
+ *
+ * Blocks until `max_checks` checks have been made or sxupdate_stop() is called. A failed
+ * check is logged and retried at the next interval. Cannot be used with event callbacks
+ *
+ * @return the status of the last check
+ */
+enum sxupdate_status sxupdate_run_periodic(sxupdate_t handle,
+                                           const struct sxupdate_periodic_options *opts);
+
+/***
+ * Make sxupdate_run_periodic() return once any check in progress has finished. Can be
+ * called from any thread, or from a signal handler
+ */
+void sxupdate_stop(sxupdate_t handle);
+
+/***
+ * Remember the result of each check in a small state file, so that processes that check
+ * at every launch (e.g. command-line tools) do not all make a network round trip. If the
+ * last check, by any process using the same file and url, was less than `ttl_seconds`
+ * ago and found no version newer than the current one, sxupdate_execute() reports
+ * sxupdate_step_already_up_to_date straight away, without fetching anything or
+ * initializing curl or OpenSSL. Otherwise the check is made as usual, sending the
+ * appcast's ETag and Last-Modified from the last check, so that an unchanged appcast
+ * costs only a 304 response
+ *
+ * The file is replaced atomically, so concurrent processes can share it
+ *
+ * @param path       : the state file, or NULL to stop using one
+ * @param ttl_seconds: how long a check stays fresh, or 0 to always check (still using
+ *                     the validators)
+ */
+enum sxupdate_status sxupdate_set_state_file(sxupdate_t handle, const char *path, long ttl_seconds);
+
+/***
+ * Options for sxupdate_set_background()
+ */
+struct sxupdate_background_options {
+  const char *dir; /* where the helper leaves its result; must exist and be private to the user */
+  int prefetch;    /* also download and verify a newer installer */
+};
+
+/***
+ * Make checks in the background, so that a due check never blocks the caller. Instead of
+ * checking, sxupdate_execute() starts a detached, low-priority helper process and finishes
+ * at once, without calling the interaction handler. The helper fetches and parses the
+ * appcast, optionally downloads and verifies a newer installer, leaves the result in
+ * `dir`, and exits. The next sxupdate_execute() calls the interaction handler straight
+ * away with that result; if the user proceeds, the prefetched installer is verified again
+ * and run without downloading it
+ *
+ * Combine with sxupdate_set_state_file() to only start a helper when a check is due.
+ * The helper is forked from the calling process, without exec(), so the process must be
+ * single-threaded when sxupdate_execute() starts it: if other threads are running (on
+ * Linux and macOS, where that can be told), sxupdate_execute() logs "background.threads"
+ * and fails with sxupdate_status_error instead of forking. Not supported on Windows
+ *
+ * @param opts: the options, which can be transient, or NULL to check in the foreground
+ */
+enum sxupdate_status sxupdate_set_background(sxupdate_t handle,
+                                             const struct sxupdate_background_options *opts);
+
+/***
+ * Options for sxupdate_set_shard(). Any field left NULL or 0 takes its default
+ */
+struct sxupdate_shard_options {
+  const char *platform; /* e.g. "linux", "macos", "windows". Default: the platform built for */
+  const char *arch;     /* e.g. "x86_64", "arm64". Default: the architecture built for */
+  const char *channel;  /* e.g. "beta". Default: "stable" */
+  long index_ttl;       /* seconds to keep using a shard before fetching the index again. Default: 86400 */
+};
+
+/***
+ * Choose the shard to use when the url serves an index instead of an appcast. An index
+ * maps platform, architecture and channel to per-shard appcast urls (see
+ * schema/index.schema.json), so that each client only fetches the small appcast that
+ * applies to it. Relative shard urls are resolved against the index url, and relative
+ * enclosure urls against the shard url
+ *
+ * The index is fetched once, and the shard it names is then fetched directly for
+ * `index_ttl` seconds (remembered across processes with sxupdate_set_state_file()).
+ * Indexes work without calling this; it is only needed to override the defaults
+ *
+ * @param opts: the options, which can be transient, or NULL for the defaults
+ */
+enum sxupdate_status sxupdate_set_shard(sxupdate_t handle, const struct sxupdate_shard_options *opts);
+
+/***
+ * Options for sxupdate_set_rollout(). Any field left NULL or 0 takes its default
+ */
+struct sxupdate_rollout_options {
+  const char *machine_id; /* any string that identifies this host or installation. Default: read
+                             from id_file */
+  const char *id_file;    /* file holding the machine id, created with a random one if missing.
+                             Default: the id of the operating system installation
+                             (/etc/machine-id, the host UUID on macOS, MachineGuid on Windows) */
+  int ignore;             /* take the first item regardless of its rollout, e.g. when the user
+                             explicitly asks to check for updates */
+};
+
+/***
+ * Choose how this client is placed in staged rollouts. An appcast item with a `rollout`
+ * (see schema/appcast.schema.json) is only offered to a share of clients, which grows from
+ * its start time to its percentage over its ramp. Each client hashes its machine id and the
+ * item's version into a stable bucket, and skips the item until the share reaches it,
+ * taking the next item that is available to it instead
+ *
+ * Rollouts are honoured without calling this; it is only needed to override the defaults
+ *
+ * @param opts: the options, which can be transient, or NULL for the defaults
+ */
+enum sxupdate_status sxupdate_set_rollout(sxupdate_t handle, const struct sxupdate_rollout_options *opts);
+
+/***
+ * Start downloading a newer installer as soon as it is found, instead of once the user
+ * proceeds, so that large installers are mostly downloaded (and hashed) while the
+ * interaction handler waits for an answer. If the user proceeds, `resume()` only waits for
+ * the rest of the download; if not, the download is cancelled and its file discarded
+ *
+ * Without event callbacks, the download runs on a separate thread, so the log sink may be
+ * called from that thread; this is not supported on Windows, where the installer is then
+ * downloaded once the user proceeds. With event callbacks, the download is driven by the
+ * caller's event loop as usual
+ *
+ * @param enabled: non-zero to download speculatively
+ */
+enum sxupdate_status sxupdate_set_speculative_download(sxupdate_t handle, int enabled);
+
+/***
+ * Update a directory tree file by file instead of running an installer. If the newer
+ * version has a "manifest" (see schema/appcast.schema.json), proceeding downloads its
+ * signed manifest, compares it with the files under `dir`, and only downloads the files
+ * that changed, several at a time, checking each against the manifest. The new tree is
+ * staged next to `dir` and then swapped with it, atomically where the platform allows,
+ * so that `dir` never holds a mix of versions. The caller is then responsible for
+ * restarting into the new tree; no installer is run
+ *
+ * Versions without a manifest are installed from their enclosure as usual. Manifests are
+ * not used for batch checks. Blocks until the update is done, even when driven by an
+ * event loop. Not supported on Windows
+ *
+ * @param dir: the install directory, which must be writable along with its parent, or
+ *             NULL to always use the enclosure
+ */
+enum sxupdate_status sxupdate_set_install_dir(sxupdate_t handle, const char *dir);
+
+/***
+ * Options for sxupdate_set_delta()
+ */
+struct sxupdate_delta_options {
+  const char *const *seeds; /* NULL-terminated list of local files likely to share content with
+                               newer installers, e.g. the installed executable. May be NULL */
+  const char *cache_dir;    /* keep the last verified installer here, to take blocks from at the
+                               next update. NULL for none */
+};
+
+/***
+ * Download only the parts of a newer installer that are not already on this host. If its
+ * enclosure has "blocks" (see schema/appcast.schema.json), a list of checksums of each
+ * fixed-size block of the installer, the seed files and the last installer kept in
+ * `cache_dir` are searched for those blocks at any offset, and only the blocks not found
+ * are fetched, with a few HTTP Range requests. The rebuilt installer is checked against
+ * the checksums, then its signature verified as usual; if anything goes wrong, or too
+ * few blocks are found to be worth it, the installer is downloaded in full
+ *
+ * Only uncompressed enclosures can be rebuilt. Searching and fetching block until done,
+ * even when driven by an event loop
+ *
+ * @param opts: the options, which can be transient, or NULL to always download in full
+ */
+enum sxupdate_status sxupdate_set_delta(sxupdate_t handle, const struct sxupdate_delta_options *opts);
+
+/***
+ * Options for sxupdate_set_write_options()
+ */
+struct sxupdate_write_options {
+  int async;                  /* non-zero to write installers from io_uring, where available, or a
+                                 writer thread, so that receiving and writing overlap */
+  long long direct_min_bytes; /* with async, bypass the page cache (O_DIRECT) for installers at
+                                 least this large, where the file system allows. 0: never */
+};
+
+/***
+ * Choose how downloaded installers are written. By default they go through stdio on the
+ * transfer thread, which suits most installers; on fast local mirrors, large installers
+ * download faster with `async`, which queues large aligned buffers to the disk while the
+ * next bytes are received. Not supported on Windows
+ *
+ * @param opts: the options, which can be transient, or NULL for the defaults
+ */
+enum sxupdate_status sxupdate_set_write_options(sxupdate_t handle,
+                                                const struct sxupdate_write_options *opts);
+
+/***
+ * Options for sxupdate_set_qos(). Any field left 0 leaves that resource alone
+ */
+struct sxupdate_qos_options {
+  long long max_recv_bytes_per_second; /* cap on the rate at which installers, blocks and
+                                          files are received, shared by parallel transfers */
+  int nice;                /* lower the CPU priority of hashing and writing by this much (1-19) */
+  int idle_io;             /* non-zero to give the disk I/O of hashing and writing the idle class */
+  long hash_chunk_bytes;   /* hash files this much at a time, yielding the CPU in between.
+                              Default: 262144 if nice or idle_io is set, else no yielding */
+  long hash_pause_us;      /* pause this long between chunks instead of only yielding */
+};
+
+/***
+ * Keep updates from competing with the application, or other services on the host, for
+ * the network, disk and CPU. Downloads are capped to `max_recv_bytes_per_second`, and
+ * files are hashed a chunk at a time, yielding the CPU in between
+ *
+ * With `nice` or `idle_io`, hashing runs on a short-lived thread at that priority, and
+ * asynchronous writes (see sxupdate_set_write_options()), the speculative download thread
+ * and the background helper process (see sxupdate_set_background()) run at it too. The
+ * priority of the caller's own threads is never changed, since on most platforms an
+ * unprivileged thread cannot raise it back. The idle I/O class is Linux only; macOS and
+ * Windows use their nearest equivalents (throttled I/O, background mode)
+ *
+ * @param opts: the options, which can be transient, or NULL to run at full speed
+ */
+enum sxupdate_status sxupdate_set_qos(sxupdate_t handle, const struct sxupdate_qos_options *opts);
+
+/***
+ * Options for sxupdate_set_fetch_options()
+ */
+struct sxupdate_fetch_options {
+  long deadline_ms;            /* give up fetching the version info this long after the check
+                                  starts, including any index and retries. Default: no deadline */
+  long stall_seconds;          /* abort a connection attempt, fetch or download that receives less
+                                  than stall_bytes_per_second for this long. Default: 30; -1: never */
+  long stall_bytes_per_second; /* Default: 1 */
+  int hedge;                   /* non-zero to send a second appcast request if the first has not
+                                  responded after hedge_delay_ms */
+  long hedge_delay_ms;         /* Default: the 95th percentile of recent response times, or
+                                  1000 until a few are known */
+  const char *const *mirrors;  /* NULL-terminated list of other urls serving the same appcast,
+                                  taken in turn by hedged requests. May be NULL, to send the
+                                  second request to the url again, on a new connection */
+};
+
+/***
+ * Bound how long a check can take. Without a deadline or stall detection, a server that
+ * accepts the connection but never answers holds sxupdate_execute() indefinitely.
+ * Stall detection is on, with the defaults above, unless this is called to change it
+ *
+ * With `hedge` set, an appcast request that has not responded within the hedge delay
+ * is raced against a second one, to a mirror or on a new connection; the first to respond
+ * is kept, and the other aborted. Since the appcast is parsed as it arrives, the race is
+ * decided by the first response rather than the first complete one. Hedging applies to
+ * synchronous checks over http(s), not to file:// urls or checks driven by an event loop
+ *
+ * @param opts: the options, which can be transient, or NULL for the defaults
+ */
+enum sxupdate_status sxupdate_set_fetch_options(sxupdate_t handle,
+                                                const struct sxupdate_fetch_options *opts);
+
+/***
+ * Options for sxupdate_set_single_flight()
+ */
+struct sxupdate_single_flight_options {
+  const char *dir;      /* shared by the processes that coordinate; must exist and be private to the user */
+  long wait_ms;         /* how long to wait for the process fetching the appcast or downloading the
+                           installer before doing it too. Default: 30000 */
+  int no_wait;          /* if another process is checking, return at once instead, without
+                           calling the interaction handler */
+  long max_age_seconds; /* use an appcast another process fetched this recently. Default: 10 */
+};
+
+/***
+ * Coordinate the processes of a host that check for updates at the same time, e.g. many
+ * instances of a tool started together. One process takes a lock in `dir` and fetches the
+ * appcast; the others wait for it, then parse the copy it leaves in `dir` instead of
+ * fetching their own. Likewise, the first to download the installer leaves a copy of it
+ * once verified, which the others verify again and use instead of downloading it. A
+ * process that gives up waiting, or finds no usable result, fetches as usual
+ *
+ * An appcast that is unchanged since the last check (see sxupdate_set_state_file()) is not
+ * shared. Applies to synchronous checks; ignored when driven by an event loop, in the
+ * background (see sxupdate_set_background()), and by sxupdate_execute_batch(). Not
+ * supported on Windows
+ *
+ * @param opts: the options, which can be transient, or NULL to stop coordinating
+ */
+enum sxupdate_status sxupdate_set_single_flight(sxupdate_t handle,
+                                                const struct sxupdate_single_flight_options *opts);
+
+/***
+ * Set a callback that will be called once the update flow has finished. Optional for
+ * synchronous use; required to learn the outcome when driven by an event loop
+ */
+void sxupdate_set_completion_handler(sxupdate_t handle,
+                                     sxupdate_completion_handler handler);
+
+/***
+ * Drive sxupdate from the caller's event loop (e.g. epoll or libuv) instead of blocking.
+ * All network and file transfers (appcast fetch and installer download) are then
+ * performed with curl_multi_socket_action(): `socket_cb` tells the caller which fds to
+ * watch, `timer_cb` tells it when to call back on timeout, and the caller reports
+ * readiness with sxupdate_socket_action(). Must be called before sxupdate_execute()
+ */
+enum sxupdate_status sxupdate_set_event_callbacks(sxupdate_t handle,
+                                                  sxupdate_socket_callback socket_cb,
+                                                  sxupdate_timer_callback timer_cb,
+                                                  void *ctx);
+
+/***
+ * Tell sxupdate that a watched socket is ready, or that the timer has expired
+ *
+ * @param fd    : the ready socket, or SXUPDATE_SOCKET_TIMEOUT if the timer expired
+ * @param events: bitwise-or of sxupdate_socket_event values, or 0 if unknown
+ */
+enum sxupdate_status sxupdate_socket_action(sxupdate_t handle, sxupdate_socket_t fd, int events);
+
+/***
+ * Return non-zero while a transfer started by an event-loop driven handle is in progress
+ */
+int sxupdate_is_running(sxupdate_t handle);
+
+enum sxupdate_event_type {
+  sxupdate_event_phase = 1, /* the update moved on to another phase */
+  sxupdate_event_progress,  /* more of the installer was received */
+  sxupdate_event_error      /* an error was logged */
+};
+
+enum sxupdate_phase {
+  sxupdate_phase_none = 0,
+  sxupdate_phase_checking,    /* fetching the appcast */
+  sxupdate_phase_checked,     /* the appcast was parsed, and the interaction handler is called */
+  sxupdate_phase_downloading,
+  sxupdate_phase_downloaded,
+  sxupdate_phase_verifying,
+  sxupdate_phase_verified,
+  sxupdate_phase_installing,
+  sxupdate_phase_done         /* the update has finished, with `status` */
+};
+
+/***
+ * An event read with sxupdate_poll_events()
+ */
+struct sxupdate_event {
+  enum sxupdate_event_type type;
+  enum sxupdate_phase phase;   /* the phase, or for progress and errors, the phase they happened in */
+  enum sxupdate_status status; /* for sxupdate_phase_done: the outcome */
+  double time;                 /* seconds since the update started */
+  long long bytes;             /* progress: bytes received so far */
+  long long total;             /* progress: bytes expected, or 0 if not known */
+  double bytes_per_second;     /* progress: receive rate since the download started */
+  const char *error;           /* errors: the event id of the log record, e.g. "download.open" */
+};
+
+/***
+ * Options for sxupdate_set_event_ring()
+ */
+struct sxupdate_event_ring_options {
+  size_t capacity; /* events held until read, rounded up to a power of two. Default: 256 */
+};
+
+/***
+ * Counters of an event ring, for sxupdate_get_event_ring_stats()
+ */
+struct sxupdate_event_ring_stats {
+  unsigned long long published; /* events written to the ring */
+  unsigned long long coalesced; /* progress updates folded into a later one, as the ring was full */
+  unsigned long long dropped;   /* phase and error events lost, as the ring was full */
+};
+
+/***
+ * Have sxupdate write phase changes, download progress and errors to a ring, for another
+ * thread, e.g. a UI thread, to read with sxupdate_poll_events() at its own pace. Writing
+ * never blocks nor calls into the caller. When the ring is full, progress is held back
+ * and the next update reports the latest value; room is kept for phase and error events,
+ * which are only dropped if the reader has not drained the ring for many phases.
+ * The ring has one writer, the thread running the update, and one reader. Must not be
+ * called while an update is in progress
+ *
+ * @param opts: the options, which can be transient, or NULL to remove the ring
+ */
+enum sxupdate_status sxupdate_set_event_ring(sxupdate_t handle,
+                                             const struct sxupdate_event_ring_options *opts);
+
+/***
+ * Read up to `max` events from the ring set with sxupdate_set_event_ring(), without blocking.
+ * Safe to call from any one thread, while the update runs on another
+ *
+ * @return the number of events read into `events`
+ */
+size_t sxupdate_poll_events(sxupdate_t handle, struct sxupdate_event *events, size_t max);
+
+/***
+ * Get the counters of the ring set with sxupdate_set_event_ring(). Safe to call from the
+ * reader's thread
+ */
+void sxupdate_get_event_ring_stats(sxupdate_t handle, struct sxupdate_event_ring_stats *stats);
+
 /***
  * Retrieve the last error message. Caller must free the returned string, if any
  */
 char *sxupdate_err_msg(sxupdate_t handle);
 
+/***
+ * Get the per-phase timings of the most recent (or current) sxupdate_execute().
+ * Can be called at any time, including from within the interaction handler
+ */
+const struct sxupdate_stats *sxupdate_get_stats(sxupdate_t handle);
+
+/***
+ * Get the per-phase timings as a JSON object. Caller must free the returned string
+ */
+char *sxupdate_stats_to_json(sxupdate_t handle);
+
 #ifndef NO_SIGNATURE
 #include <openssl/rsa.h>
 
@@ -141,9 +814,48 @@ char *sxupdate_err_msg(sxupdate_t handle);
  */
 void sxupdate_set_public_key(sxupdate_t handle, RSA *key);
 
+/**
+ * Set the public key from a PEM file. The file is read now, and sxupdate_status_error is
+ * returned if it cannot be, or does not hold a PEM public key ("-----BEGIN PUBLIC KEY-----"
+ * and a base64 body). The key is only parsed once a check needs it, so that a check
+ * answered from the state file (see sxupdate_set_state_file()) does not initialize
+ * OpenSSL: a key that has that form but does not parse makes that sxupdate_execute() fail
+ * with sxupdate_status_error
+ */
 enum sxupdate_status sxupdate_set_public_key_from_file(sxupdate_t handle, const char *filepath);
 
+/***
+ * Options for sxupdate_set_peer_cache(). Zero / NULL members take their default values
+ */
+struct sxupdate_peer_options {
+  const char *share_dir; /* directory that verified installers are copied to, for `sxupdate-peer`
+                            to serve to other hosts. NULL to fetch from peers without sharing */
+  const char *group;     /* multicast group. Default: 239.255.77.77 */
+  unsigned short port;   /* discovery port. Default: 7645 */
+  const char *iface;     /* IPv4 address of the interface to query on. Default: any */
+  long timeout_ms;       /* how long to wait for a peer to answer. Default: 250 */
+};
+
+/***
+ * Opt in to sharing installers with peers on the local network. Before downloading an
+ * installer from its origin, sxupdate asks peers via UDP multicast whether one already
+ * holds a verified copy, and if so, downloads it from that peer over HTTP instead. The
+ * signature is always verified locally, and if no peer answers or the peer copy cannot be
+ * downloaded or verified, the installer is downloaded from the origin
+ *
+ * Requires a public key, since peer copies cannot be trusted without verification.
+ * Discovery blocks for up to `timeout_ms`, even when driven by an event loop. A peer that
+ * sends more than the enclosure's length (or 4 GiB, if the appcast does not give the
+ * length of the installer as it is installed) is given up on
+ *
+ * @param opts: options, which can be transient, or NULL to disable
+ */
+enum sxupdate_status sxupdate_set_peer_cache(sxupdate_t handle, const struct sxupdate_peer_options *opts);
+
 #endif
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif // SXUPDATE_API_H
@@ -0,0 +1,382 @@
+#ifndef SXUPDATE_API_HPP
+#define SXUPDATE_API_HPP
+
+/***
+ * C++20 layer over the C API (api.h), header-only:
+ *
+ * - sxupdate::handle owns an sxupdate_t, and is move-only
+ * - sxupdate::version_view gives std::string_view access to an appcast item, without copies
+ * - handle::check(), download(), verify() and install() are awaitables, one for each stage
+ *   of an update, which are resumed from the handlers of the C API
+ *
+ * For the awaitables not to block, drive the handle from the event loop of the executor
+ * (see sxupdate_set_event_callbacks(), on native()): each coroutine is then resumed from
+ * within sxupdate_socket_action(), on the executor's thread, and no thread is needed for
+ * the fetch and download. Otherwise each stage runs to completion before it is resumed.
+ * A handle is used by one coroutine at a time, and must not be moved while it is awaited
+ *
+ *   sxupdate::handle h;
+ *   h.set_url("https://example.com/appcast.json");
+ *   auto checked = co_await h.check();
+ *   if(checked.newer()) {
+ *     auto downloaded = co_await h.download();  // downloaded.path: not verified yet
+ *     auto verified = co_await h.verify();      // verified.path: ready to run
+ *     if(verified)
+ *       co_await h.install();                   // or h.cancel() to keep it, and run it later
+ *   }
+ */
+
+#include <coroutine>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "api.h"
+
+namespace sxupdate {
+
+/***
+ * An appcast item, as parsed. Valid until the next check, or until the handle is deleted
+ */
+class version_view {
+public:
+  explicit version_view(const struct sxupdate_version *v = nullptr) noexcept : v_(v) {}
+
+  explicit operator bool() const noexcept { return v_ != nullptr; }
+  const struct sxupdate_version *get() const noexcept { return v_; }
+
+  std::string_view title() const noexcept { return view(v_ ? v_->title : nullptr); }
+  std::string_view link() const noexcept { return view(v_ ? v_->link : nullptr); }
+  std::string_view description() const noexcept { return view(v_ ? v_->description : nullptr); }
+  std::string_view pub_date() const noexcept { return view(v_ ? v_->pubDate : nullptr); }
+
+  /* the semantic version: major, minor and patch numbers, and the two strings below */
+  const struct sxupdate_semantic_version &semver() const noexcept { return v_ ? v_->version : none(); }
+  std::string_view prerelease() const noexcept { return view(semver().prerelease); }
+  std::string_view meta() const noexcept { return view(semver().meta); }
+
+  std::string_view url() const noexcept { return view(v_ ? v_->enclosure.url : nullptr); }
+  size_t length() const noexcept { return v_ ? v_->enclosure.length : 0; }
+  std::string_view type() const noexcept { return view(v_ ? v_->enclosure.type : nullptr); }
+  std::string_view signature() const noexcept { return view(v_ ? v_->enclosure.signature : nullptr); }
+  std::string_view filename() const noexcept { return view(v_ ? v_->enclosure.filename : nullptr); }
+  std::string_view encoding() const noexcept { return view(v_ ? v_->enclosure.encoding : nullptr); }
+  std::string_view blocks() const noexcept { return view(v_ ? v_->enclosure.blocks : nullptr); }
+
+  std::string_view manifest_url() const noexcept { return view(v_ ? v_->manifest.url : nullptr); }
+  std::string_view manifest_signature() const noexcept { return view(v_ ? v_->manifest.signature : nullptr); }
+
+private:
+  static std::string_view view(const char *s) noexcept { return s ? std::string_view(s) : std::string_view(); }
+  static const struct sxupdate_semantic_version &none() noexcept {
+    static const struct sxupdate_semantic_version v = {};
+    return v;
+  }
+
+  const struct sxupdate_version *v_;
+};
+
+/***
+ * Result of handle::check()
+ */
+struct check_result {
+  enum sxupdate_status status;
+  enum sxupdate_step step;
+  version_view version; // the newest item, if any
+
+  explicit operator bool() const noexcept { return status == sxupdate_status_ok; }
+  bool newer() const noexcept { return status == sxupdate_status_ok && step == sxupdate_step_have_newer_version; }
+};
+
+/***
+ * Result of handle::download() and handle::verify()
+ */
+struct stage_result {
+  enum sxupdate_status status;
+  std::string_view path; // the installer, valid until the next stage is started. Empty if
+                         // there was none, e.g. the update was applied from a manifest
+
+  explicit operator bool() const noexcept { return status == sxupdate_status_ok; }
+};
+
+class handle;
+
+namespace detail {
+
+enum class stage { check, download, verify, install };
+
+/* the stage a coroutine is waiting for, held in its awaitable */
+struct operation {
+  stage what;
+  enum sxupdate_status status = sxupdate_status_ok;
+  std::string_view path;
+  std::coroutine_handle<> coro;
+  bool suspended = false;
+  bool done = false;
+};
+
+template <typename Result>
+class awaitable;
+
+} // namespace detail
+
+/***
+ * Owner of an sxupdate_t. The C API can be used on native() for anything not wrapped here,
+ * except the handlers and user data, which this class takes
+ */
+class handle {
+public:
+  handle() : h_(sxupdate_new()) {
+    if(!h_)
+      throw std::bad_alloc();
+    attach();
+  }
+
+  handle(handle &&other) noexcept
+    : h_(std::exchange(other.h_, nullptr)), resume_(std::exchange(other.resume_, nullptr)),
+      paused_(std::exchange(other.paused_, paused::none)), step_(other.step_) {
+    if(h_)
+      sxupdate_set_user_data(h_, this);
+  }
+
+  handle &operator=(handle &&other) noexcept {
+    if(this != &other) {
+      release();
+      h_ = std::exchange(other.h_, nullptr);
+      resume_ = std::exchange(other.resume_, nullptr);
+      paused_ = std::exchange(other.paused_, paused::none);
+      step_ = other.step_;
+      if(h_)
+        sxupdate_set_user_data(h_, this);
+    }
+    return *this;
+  }
+
+  handle(const handle &) = delete;
+  handle &operator=(const handle &) = delete;
+
+  ~handle() { release(); }
+
+  sxupdate_t native() const noexcept { return h_; }
+
+  enum sxupdate_status set_url(const std::string &url) { return sxupdate_set_url(h_, url.c_str()); }
+  void set_current_version(struct sxupdate_semantic_version (*get_version)()) {
+    sxupdate_set_current_version(h_, get_version);
+  }
+
+  /* the newest item of the last check */
+  version_view version() const noexcept { return version_view(sxupdate_get_version(h_)); }
+
+  /* the last error message, if any */
+  std::string error_message() const {
+    char *s = sxupdate_err_msg(h_);
+    std::string msg = s ? s : "";
+    std::free(s);
+    return msg;
+  }
+
+  /***
+   * Fetch the appcast, and compare its newest item with the current version. Stops an
+   * update that was not taken any further
+   */
+  [[nodiscard]] detail::awaitable<check_result> check() noexcept;
+
+  /***
+   * Once check() found a newer version, download its installer. The result's path is not
+   * verified yet, and is deleted unless verify() follows
+   */
+  [[nodiscard]] detail::awaitable<stage_result> download() noexcept;
+
+  /***
+   * Once download() has completed, verify the installer. If a copy that was not downloaded
+   * from the origin does not verify, it is downloaded from there and verified in turn
+   */
+  [[nodiscard]] detail::awaitable<stage_result> verify() noexcept;
+
+  /***
+   * Once verify() has completed, run the installer
+   */
+  [[nodiscard]] detail::awaitable<enum sxupdate_status> install() noexcept;
+
+  /***
+   * Stop the update where it is: an installer that was verified is kept, for the caller to
+   * run; one that was not is deleted
+   */
+  void cancel() noexcept {
+    if(auto resume = std::exchange(resume_, nullptr)) {
+      paused_ = paused::none;
+      resume(h_, sxupdate_action_abort);
+    }
+  }
+
+private:
+  template <typename Result>
+  friend class detail::awaitable;
+
+  enum class paused { none, checked, downloaded, verified };
+
+  void attach() noexcept {
+    sxupdate_set_user_data(h_, this);
+    sxupdate_set_interaction_handler(h_, on_interaction);
+    sxupdate_set_stage_handler(h_, on_stage);
+    sxupdate_set_completion_handler(h_, on_completion);
+  }
+
+  void release() noexcept {
+    if(h_) {
+      op_ = nullptr;
+      cancel();
+      sxupdate_delete(std::exchange(h_, nullptr));
+    }
+  }
+
+  static handle &self(sxupdate_t h) noexcept { return *static_cast<handle *>(sxupdate_get_user_data(h)); }
+
+  void proceed() {
+    auto resume = std::exchange(resume_, nullptr);
+    paused_ = paused::none;
+    resume(h_, sxupdate_action_proceed);
+  }
+
+  /* end the awaited stage, and resume its coroutine if it has been suspended */
+  void complete(enum sxupdate_status status, std::string_view path) {
+    detail::operation *op = std::exchange(op_, nullptr);
+    if(!op)
+      return;
+    op->status = status;
+    op->path = path;
+    op->done = true;
+    if(op->suspended)
+      op->coro.resume();
+  }
+
+  void start(detail::operation &op) {
+    if(op.what == detail::stage::check) {
+      cancel(); // before op_ is set, so as not to end it
+      step_ = sxupdate_step_none;
+    }
+    op_ = &op;
+    enum sxupdate_status status = sxupdate_status_ok;
+    switch(op.what) {
+    case detail::stage::check:
+      status = sxupdate_execute(h_);
+      break;
+    case detail::stage::download:
+      if(paused_ != paused::checked)
+        status = sxupdate_status_invalid;
+      else
+        proceed();
+      break;
+    case detail::stage::verify:
+      if(paused_ != paused::downloaded)
+        status = sxupdate_status_invalid;
+      else
+        proceed();
+      break;
+    case detail::stage::install:
+      if(paused_ != paused::verified)
+        status = sxupdate_status_invalid;
+      else
+        proceed();
+      break;
+    }
+    if(status != sxupdate_status_ok && op_ == &op) // did not start, so no handler will be called
+      complete(status, {});
+  }
+
+  static void on_interaction(sxupdate_t h, enum sxupdate_step step,
+                             void (*resume)(sxupdate_t, enum sxupdate_action)) {
+    handle &s = self(h);
+    s.step_ = step;
+    if(step != sxupdate_step_have_newer_version) {
+      resume(h, sxupdate_action_none); // nothing to wait for: on_completion() ends check()
+      return;
+    }
+    s.resume_ = resume;
+    s.paused_ = paused::checked;
+    s.complete(sxupdate_status_ok, {});
+  }
+
+  static void on_stage(sxupdate_t h, enum sxupdate_stage stage, const char *path,
+                       void (*resume)(sxupdate_t, enum sxupdate_action)) {
+    handle &s = self(h);
+    s.resume_ = resume;
+    s.paused_ = stage == sxupdate_stage_verified ? paused::verified : paused::downloaded;
+    if(stage == sxupdate_stage_downloaded && s.op_ && s.op_->what == detail::stage::verify)
+      s.proceed(); // downloaded again, after a copy failed to verify: verify() goes on
+    else
+      s.complete(sxupdate_status_ok, path);
+  }
+
+  static void on_completion(sxupdate_t h, enum sxupdate_status status) {
+    handle &s = self(h);
+    s.resume_ = nullptr;
+    s.paused_ = paused::none;
+    s.complete(status, {});
+  }
+
+  sxupdate_t h_;
+  void (*resume_)(sxupdate_t, enum sxupdate_action) = nullptr; // continues from paused_
+  paused paused_ = paused::none;
+  enum sxupdate_step step_ = sxupdate_step_none;
+  detail::operation *op_ = nullptr; // the stage being awaited, if any
+};
+
+namespace detail {
+
+template <typename Result>
+class awaitable {
+public:
+  awaitable(handle &h, stage what) noexcept : h_(h) { op_.what = what; }
+
+  bool await_ready() const noexcept { return false; }
+
+  /* start the stage; if its handler was called straight away, do not suspend at all */
+  bool await_suspend(std::coroutine_handle<> coro) {
+    op_.coro = coro;
+    h_.start(op_);
+    if(op_.done)
+      return false;
+    op_.suspended = true;
+    return true;
+  }
+
+  Result await_resume() const noexcept {
+    if constexpr(std::is_same_v<Result, check_result>)
+      return check_result{ op_.status, op_.status == sxupdate_status_ok ? h_.step_ : sxupdate_step_none,
+                           h_.version() };
+    else if constexpr(std::is_same_v<Result, stage_result>)
+      return stage_result{ op_.status, op_.path };
+    else
+      return op_.status;
+  }
+
+private:
+  handle &h_;
+  operation op_;
+};
+
+} // namespace detail
+
+inline detail::awaitable<check_result> handle::check() noexcept {
+  return { *this, detail::stage::check };
+}
+
+inline detail::awaitable<stage_result> handle::download() noexcept {
+  return { *this, detail::stage::download };
+}
+
+inline detail::awaitable<stage_result> handle::verify() noexcept {
+  return { *this, detail::stage::verify };
+}
+
+inline detail::awaitable<enum sxupdate_status> handle::install() noexcept {
+  return { *this, detail::stage::install };
+}
+
+} // namespace sxupdate
+
+#endif // SXUPDATE_API_HPP
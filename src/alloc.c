@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+#ifndef NO_SIGNATURE
+#include <openssl/crypto.h>
+#endif
+
+#include "alloc.h"
+
+#ifdef SXUPDATE_USE_BUNDLED_YAJL
+void yajl_set_global_alloc_funcs(const yajl_alloc_funcs *yaf);
+#endif
+
+/* header size is a multiple of the alignment malloc() guarantees, so blocks stay aligned */
+#define SXUPDATE_MEM_HEADER_SIZE 16
+
+struct sxupdate_mem_header {
+  struct sxupdate_mem_account *account;
+  size_t size;
+};
+
+struct sxupdate_mem_account {
+  size_t bytes;
+  size_t peak_bytes;
+  size_t allocations;
+  size_t total_allocations;
+  size_t failed_allocations;
+  size_t limit;
+  size_t refs; // one for the owning handle, plus one per live block
+};
+
+/* blocks may be freed on a different thread from the one that allocated them */
+#define sxupdate_mem_add(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+#define sxupdate_mem_sub(p, n) __atomic_sub_fetch((p), (n), __ATOMIC_ACQ_REL)
+#define sxupdate_mem_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static struct sxupdate_mem_account sxupdate_mem_process; // every block, whatever its account
+static __thread struct sxupdate_mem_account *sxupdate_mem_current;
+
+static void *sxupdate_mem_system_malloc(void *ctx, size_t size) {
+  (void)(ctx);
+  return malloc(size);
+}
+
+static void *sxupdate_mem_system_realloc(void *ctx, void *ptr, size_t size) {
+  (void)(ctx);
+  return realloc(ptr, size);
+}
+
+static void sxupdate_mem_system_free(void *ctx, void *ptr) {
+  (void)(ctx);
+  free(ptr);
+}
+
+static struct sxupdate_allocator sxupdate_mem_allocator = {
+  sxupdate_mem_system_malloc,
+  sxupdate_mem_system_realloc,
+  sxupdate_mem_system_free,
+  NULL
+};
+
+struct sxupdate_mem_account *sxupdate_mem_account_new(void) {
+  struct sxupdate_mem_account *account =
+    sxupdate_mem_allocator.malloc(sxupdate_mem_allocator.ctx, sizeof(*account));
+  if(account) {
+    memset(account, 0, sizeof(*account));
+    account->refs = 1;
+  }
+  return account;
+}
+
+static void sxupdate_mem_account_unref(struct sxupdate_mem_account *account) {
+  if(sxupdate_mem_sub(&account->refs, 1) == 0)
+    sxupdate_mem_allocator.free(sxupdate_mem_allocator.ctx, account);
+}
+
+void sxupdate_mem_account_release(struct sxupdate_mem_account *account) {
+  if(account)
+    sxupdate_mem_account_unref(account);
+}
+
+void sxupdate_mem_account_set_limit(struct sxupdate_mem_account *account, size_t max_bytes) {
+  account->limit = max_bytes;
+}
+
+void sxupdate_mem_account_stats(const struct sxupdate_mem_account *account,
+                                struct sxupdate_memory_stats *stats) {
+  if(!account)
+    account = &sxupdate_mem_process;
+  stats->bytes = sxupdate_mem_load(&account->bytes);
+  stats->peak_bytes = sxupdate_mem_load(&account->peak_bytes);
+  stats->allocations = sxupdate_mem_load(&account->allocations);
+  stats->total_allocations = sxupdate_mem_load(&account->total_allocations);
+  stats->failed_allocations = sxupdate_mem_load(&account->failed_allocations);
+}
+
+struct sxupdate_mem_account *sxupdate_mem_enter(struct sxupdate_mem_account *account) {
+  struct sxupdate_mem_account *previous = sxupdate_mem_current;
+  sxupdate_mem_current = account;
+  return previous;
+}
+
+void sxupdate_mem_leave(struct sxupdate_mem_account *previous) {
+  sxupdate_mem_current = previous;
+}
+
+static void sxupdate_mem_update_peak(struct sxupdate_mem_account *account, size_t bytes) {
+  size_t peak = sxupdate_mem_load(&account->peak_bytes);
+  while(bytes > peak
+        && !__atomic_compare_exchange_n(&account->peak_bytes, &peak, bytes, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static int sxupdate_mem_over_limit(struct sxupdate_mem_account *account, size_t more) {
+  if(account && account->limit && sxupdate_mem_load(&account->bytes) + more > account->limit) {
+    sxupdate_mem_add(&account->failed_allocations, 1);
+    sxupdate_mem_add(&sxupdate_mem_process.failed_allocations, 1);
+    return 1;
+  }
+  return 0;
+}
+
+static void sxupdate_mem_charge(struct sxupdate_mem_account *account, size_t size) {
+  struct sxupdate_mem_account *accounts[2] = { &sxupdate_mem_process, account };
+  for(int i = 0; i < 2 && accounts[i]; i++) {
+    if(i)
+      sxupdate_mem_add(&account->refs, 1);
+    sxupdate_mem_update_peak(accounts[i], sxupdate_mem_add(&accounts[i]->bytes, size));
+    sxupdate_mem_add(&accounts[i]->allocations, 1);
+    sxupdate_mem_add(&accounts[i]->total_allocations, 1);
+  }
+}
+
+static void sxupdate_mem_credit(struct sxupdate_mem_account *account, size_t size) {
+  struct sxupdate_mem_account *accounts[2] = { &sxupdate_mem_process, account };
+  for(int i = 0; i < 2 && accounts[i]; i++) {
+    sxupdate_mem_sub(&accounts[i]->bytes, size);
+    sxupdate_mem_sub(&accounts[i]->allocations, 1);
+  }
+  if(account)
+    sxupdate_mem_account_unref(account);
+}
+
+static void sxupdate_mem_failed(void) {
+  sxupdate_mem_add(&sxupdate_mem_process.failed_allocations, 1);
+  if(sxupdate_mem_current)
+    sxupdate_mem_add(&sxupdate_mem_current->failed_allocations, 1);
+}
+
+void *sxupdate_mem_alloc(size_t size) {
+  struct sxupdate_mem_account *account = sxupdate_mem_current;
+  if(size > SIZE_MAX - SXUPDATE_MEM_HEADER_SIZE) {
+    sxupdate_mem_failed();
+    return NULL;
+  }
+  if(sxupdate_mem_over_limit(account, size))
+    return NULL;
+
+  unsigned char *block = sxupdate_mem_allocator.malloc(sxupdate_mem_allocator.ctx,
+                                                       size + SXUPDATE_MEM_HEADER_SIZE);
+  if(!block) {
+    sxupdate_mem_failed();
+    return NULL;
+  }
+  struct sxupdate_mem_header *header = (struct sxupdate_mem_header *)block;
+  header->account = account;
+  header->size = size;
+  sxupdate_mem_charge(account, size);
+  return block + SXUPDATE_MEM_HEADER_SIZE;
+}
+
+void *sxupdate_mem_calloc(size_t count, size_t size) {
+  if(size && count > SIZE_MAX / size) {
+    sxupdate_mem_failed();
+    return NULL;
+  }
+  void *p = sxupdate_mem_alloc(count * size);
+  if(p)
+    memset(p, 0, count * size);
+  return p;
+}
+
+void *sxupdate_mem_realloc(void *ptr, size_t size) {
+  if(!ptr)
+    return sxupdate_mem_alloc(size);
+  if(size > SIZE_MAX - SXUPDATE_MEM_HEADER_SIZE) {
+    sxupdate_mem_failed();
+    return NULL;
+  }
+
+  unsigned char *block = (unsigned char *)ptr - SXUPDATE_MEM_HEADER_SIZE;
+  struct sxupdate_mem_header *header = (struct sxupdate_mem_header *)block;
+  struct sxupdate_mem_account *account = header->account; // stays with the original account
+  size_t old_size = header->size;
+  if(size > old_size && sxupdate_mem_over_limit(account, size - old_size))
+    return NULL;
+
+  block = sxupdate_mem_allocator.realloc(sxupdate_mem_allocator.ctx, block,
+                                         size + SXUPDATE_MEM_HEADER_SIZE);
+  if(!block) {
+    sxupdate_mem_failed();
+    return NULL;
+  }
+  header = (struct sxupdate_mem_header *)block;
+  header->size = size;
+
+  struct sxupdate_mem_account *accounts[2] = { &sxupdate_mem_process, account };
+  for(int i = 0; i < 2 && accounts[i]; i++) {
+    if(size >= old_size)
+      sxupdate_mem_update_peak(accounts[i], sxupdate_mem_add(&accounts[i]->bytes, size - old_size));
+    else
+      sxupdate_mem_sub(&accounts[i]->bytes, old_size - size);
+  }
+  return block + SXUPDATE_MEM_HEADER_SIZE;
+}
+
+char *sxupdate_mem_strndup(const char *s, size_t n) {
+  size_t len = strnlen(s, n);
+  char *dupe = sxupdate_mem_alloc(len + 1);
+  if(dupe) {
+    memcpy(dupe, s, len);
+    dupe[len] = '\0';
+  }
+  return dupe;
+}
+
+char *sxupdate_mem_strdup(const char *s) {
+  size_t len = strlen(s);
+  char *dupe = sxupdate_mem_alloc(len + 1);
+  if(dupe)
+    memcpy(dupe, s, len + 1);
+  return dupe;
+}
+
+void sxupdate_mem_free(void *ptr) {
+  if(!ptr)
+    return;
+  unsigned char *block = (unsigned char *)ptr - SXUPDATE_MEM_HEADER_SIZE;
+  struct sxupdate_mem_header *header = (struct sxupdate_mem_header *)block;
+  sxupdate_mem_credit(header->account, header->size);
+  sxupdate_mem_allocator.free(sxupdate_mem_allocator.ctx, block);
+}
+
+/* adapters for yajl, libcurl and OpenSSL */
+
+static void *sxupdate_mem_yajl_malloc(void *ctx, size_t size) {
+  (void)(ctx);
+  return sxupdate_mem_alloc(size);
+}
+
+static void *sxupdate_mem_yajl_realloc(void *ctx, void *ptr, size_t size) {
+  (void)(ctx);
+  return sxupdate_mem_realloc(ptr, size);
+}
+
+static void sxupdate_mem_yajl_free(void *ctx, void *ptr) {
+  (void)(ctx);
+  sxupdate_mem_free(ptr);
+}
+
+static const yajl_alloc_funcs sxupdate_mem_yajl = {
+  sxupdate_mem_yajl_malloc,
+  sxupdate_mem_yajl_realloc,
+  sxupdate_mem_yajl_free,
+  NULL
+};
+
+const yajl_alloc_funcs *sxupdate_mem_yajl_funcs(void) {
+  return &sxupdate_mem_yajl;
+}
+
+#ifndef NO_SIGNATURE
+static void *sxupdate_mem_crypto_malloc(size_t size, const char *file, int line) {
+  (void)(file);
+  (void)(line);
+  return sxupdate_mem_alloc(size);
+}
+
+static void *sxupdate_mem_crypto_realloc(void *ptr, size_t size, const char *file, int line) {
+  (void)(file);
+  (void)(line);
+  return sxupdate_mem_realloc(ptr, size);
+}
+
+static void sxupdate_mem_crypto_free(void *ptr, const char *file, int line) {
+  (void)(file);
+  (void)(line);
+  sxupdate_mem_free(ptr);
+}
+#endif
+
+static void sxupdate_mem_allocator_reset(void) {
+  sxupdate_mem_allocator.malloc = sxupdate_mem_system_malloc;
+  sxupdate_mem_allocator.realloc = sxupdate_mem_system_realloc;
+  sxupdate_mem_allocator.free = sxupdate_mem_system_free;
+  sxupdate_mem_allocator.ctx = NULL;
+}
+
+enum sxupdate_status sxupdate_mem_set_allocator(const struct sxupdate_allocator *allocator) {
+  static int installed = 0;
+
+  // blocks already allocated must be freed by the allocator that allocated them
+  if(installed || sxupdate_mem_load(&sxupdate_mem_process.total_allocations))
+    return sxupdate_status_error;
+  if(allocator) {
+    if(!(allocator->malloc && allocator->realloc && allocator->free))
+      return sxupdate_status_invalid;
+    sxupdate_mem_allocator = *allocator;
+  }
+
+#ifndef NO_SIGNATURE
+  void *(*crypto_malloc)(size_t, const char *, int);
+  void *(*crypto_realloc)(void *, size_t, const char *, int);
+  void (*crypto_free)(void *, const char *, int);
+  CRYPTO_get_mem_functions(&crypto_malloc, &crypto_realloc, &crypto_free);
+
+  // fails if OpenSSL has already allocated anything
+  if(!CRYPTO_set_mem_functions(sxupdate_mem_crypto_malloc, sxupdate_mem_crypto_realloc,
+                               sxupdate_mem_crypto_free)) {
+    sxupdate_mem_allocator_reset();
+    return sxupdate_status_error;
+  }
+#endif
+
+  // has no effect if libcurl has already been initialized
+  if(curl_global_init_mem(CURL_GLOBAL_DEFAULT, sxupdate_mem_alloc, sxupdate_mem_free,
+                          sxupdate_mem_realloc, sxupdate_mem_strdup,
+                          sxupdate_mem_calloc) != CURLE_OK) {
+#ifndef NO_SIGNATURE
+    // put OpenSSL back as it was, unless it has allocated through ours in the meantime:
+    // those blocks must then go on being freed by it, so it stays installed
+    if(!CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free)) {
+      installed = 1;
+      return sxupdate_status_error;
+    }
+#endif
+    sxupdate_mem_allocator_reset();
+    return sxupdate_status_error;
+  }
+
+#ifdef SXUPDATE_USE_BUNDLED_YAJL
+  yajl_set_global_alloc_funcs(&sxupdate_mem_yajl);
+#endif
+
+  installed = 1;
+  return sxupdate_status_ok;
+}
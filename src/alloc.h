@@ -0,0 +1,65 @@
+#ifndef SXUPDATE_ALLOC_H
+#define SXUPDATE_ALLOC_H
+
+#include <stddef.h>
+#include <yajl/yajl_common.h>
+#include "../include/api.h"
+
+/**
+ * Memory accounting. Every block allocated through the functions below carries a small
+ * header recording its size and the account it is charged to, which is the account of
+ * the handle whose API call was in progress on the allocating thread (or none). Blocks
+ * are always credited back to the account they were charged to, on whatever thread
+ * they are freed
+ */
+struct sxupdate_mem_account;
+
+/**
+ * Create an account for a new handle. The account itself is not counted
+ */
+struct sxupdate_mem_account *sxupdate_mem_account_new(void);
+
+/**
+ * Release the handle's reference to its account. The account is destroyed once the
+ * last block charged to it has been freed
+ */
+void sxupdate_mem_account_release(struct sxupdate_mem_account *account);
+
+/**
+ * @param max_bytes: 0 for no limit
+ */
+void sxupdate_mem_account_set_limit(struct sxupdate_mem_account *account, size_t max_bytes);
+
+/**
+ * Get an account's counters, or process-wide counters if account is NULL
+ */
+void sxupdate_mem_account_stats(const struct sxupdate_mem_account *account,
+                                struct sxupdate_memory_stats *stats);
+
+/**
+ * Charge allocations made by this thread to account until sxupdate_mem_leave().
+ * Calls may be nested
+ *
+ * @return the previous account, to pass to sxupdate_mem_leave()
+ */
+struct sxupdate_mem_account *sxupdate_mem_enter(struct sxupdate_mem_account *account);
+void sxupdate_mem_leave(struct sxupdate_mem_account *previous);
+
+void *sxupdate_mem_alloc(size_t size);
+void *sxupdate_mem_calloc(size_t count, size_t size);
+void *sxupdate_mem_realloc(void *ptr, size_t size);
+char *sxupdate_mem_strdup(const char *s);
+char *sxupdate_mem_strndup(const char *s, size_t n);
+void sxupdate_mem_free(void *ptr);
+
+/**
+ * yajl allocation functions that allocate through the functions above
+ */
+const yajl_alloc_funcs *sxupdate_mem_yajl_funcs(void);
+
+/**
+ * See sxupdate_set_allocator()
+ */
+enum sxupdate_status sxupdate_mem_set_allocator(const struct sxupdate_allocator *allocator);
+
+#endif
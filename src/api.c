@@ -1,7 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <curl/curl.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 #ifndef NO_SIGNATURE
 #include <openssl/rsa.h>
 #endif
@@ -13,18 +19,66 @@
 #include "parse.h"
 #include "version.h"
 #include "verify.h"
+#include "transfer.h"
+#include "stats.h"
+#include "peer.h"
+#include "state.h"
+#include "background.h"
+#include "encoding.h"
+#include "shard.h"
+#include "batch.h"
+#include "manifest.h"
+#include "delta.h"
+#include "flight.h"
+#include "qos.h"
+#include "sink.h"
+#include "ring.h"
+#include "alloc.h"
 #include "log.h"
 
+/***
+ * Route memory allocated by sxupdate and the libraries it uses through a custom allocator
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_allocator(const struct sxupdate_allocator *allocator) {
+  return sxupdate_mem_set_allocator(allocator);
+}
+
 /***
  * Get a new sxupdate handle
  **/
 SXUPDATE_API sxupdate_t sxupdate_new() {
-  sxupdate_t h = calloc(1, sizeof(struct sxupdate_data));
-  if(h)
+  struct sxupdate_mem_account *mem = sxupdate_mem_account_new();
+  if(!mem)
+    return NULL;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(mem);
+  sxupdate_t h = sxupdate_mem_calloc(1, sizeof(struct sxupdate_data));
+  sxupdate_mem_leave(previous);
+  if(h) {
     h->parser.stat = yajl_status_ok;
+    h->mem = mem;
+    h->fetch.stall_seconds = SXUPDATE_STALL_SECONDS;
+    h->fetch.stall_bytes_per_second = 1;
+    h->flight.appcast_lock = h->flight.installer_lock = -1;
+  } else
+    sxupdate_mem_account_release(mem);
   return h;
 }
 
+/***
+ * Cap the memory that can be allocated on behalf of a handle
+ */
+SXUPDATE_API void sxupdate_set_memory_limit(sxupdate_t handle, size_t max_bytes) {
+  sxupdate_mem_account_set_limit(handle->mem, max_bytes);
+}
+
+/***
+ * Get the memory counters for a handle, or for the whole process if handle is NULL
+ */
+SXUPDATE_API void sxupdate_get_memory_stats(sxupdate_t handle, struct sxupdate_memory_stats *stats) {
+  sxupdate_mem_account_stats(handle ? handle->mem : NULL, stats);
+}
+
 /***
  * Set the callback that will inform sxupdate what this build's version is, so that
  * it can compare to the version metadata it fetches
@@ -43,6 +97,16 @@ SXUPDATE_API void sxupdate_set_verbosity(sxupdate_t handle, unsigned char verbos
   handle->verbosity = (verbosity > 5 ? 5 : verbosity);
 }
 
+/***
+ * Send log records to a custom sink instead of stderr
+ */
+SXUPDATE_API void sxupdate_set_log_sink(sxupdate_t handle, sxupdate_log_sink sink, void *ctx,
+                                        enum sxupdate_log_level max_level) {
+  handle->log.sink = sink;
+  handle->log.ctx = ctx;
+  handle->log.max_level = max_level;
+}
+
 /***
  * Add an argument that will be passed to the installer when it is invoked
  * In windows environment, the argument will be appended to the command string,
@@ -51,11 +115,13 @@ SXUPDATE_API void sxupdate_set_verbosity(sxupdate_t handle, unsigned char verbos
  * @param dir: the argument to add e.g. /D=C:\Program Files\NSIS
  */
 enum sxupdate_status sxupdate_add_installer_arg(sxupdate_t handle, const char *val) {
-  struct sxupdate_string_list *arg = calloc(1, sizeof(*arg));
-  char *value = strdup(val);
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  struct sxupdate_string_list *arg = sxupdate_mem_calloc(1, sizeof(*arg));
+  char *value = sxupdate_mem_strdup(val);
+  sxupdate_mem_leave(previous);
   if(!(arg && value)) {
-    free(arg);
-    free(value);
+    sxupdate_mem_free(arg);
+    sxupdate_mem_free(value);
     return sxupdate_status_memory;
   }
   arg->value = value;
@@ -67,23 +133,160 @@ enum sxupdate_status sxupdate_add_installer_arg(sxupdate_t handle, const char *v
   return sxupdate_status_ok;
 }
 
+#ifndef NO_SIGNATURE
+static void sxupdate_peer_options_free(sxupdate_t handle) {
+  sxupdate_mem_free(handle->peer.share_dir);
+  sxupdate_mem_free(handle->peer.group);
+  sxupdate_mem_free(handle->peer.iface);
+  memset(&handle->peer, 0, sizeof(handle->peer));
+}
+#endif
+
+static void sxupdate_shard_options_free(sxupdate_t handle) {
+  sxupdate_mem_free(handle->shard.platform);
+  sxupdate_mem_free(handle->shard.arch);
+  sxupdate_mem_free(handle->shard.channel);
+  handle->shard.platform = handle->shard.arch = handle->shard.channel = NULL;
+  handle->shard.index_ttl = 0;
+}
+
+static void sxupdate_delta_options_free(sxupdate_t handle) {
+  for(struct sxupdate_string_list *next, *seed = handle->delta.seeds; seed; seed = next) {
+    next = seed->next;
+    sxupdate_mem_free(seed->value);
+    sxupdate_mem_free(seed);
+  }
+  sxupdate_mem_free(handle->delta.cache_dir);
+  memset(&handle->delta, 0, sizeof(handle->delta));
+}
+
+static void sxupdate_fetch_mirrors_free(sxupdate_t handle) {
+  for(struct sxupdate_string_list *next, *mirror = handle->fetch.mirrors; mirror; mirror = next) {
+    next = mirror->next;
+    sxupdate_mem_free(mirror->value);
+    sxupdate_mem_free(mirror);
+  }
+  handle->fetch.mirrors = handle->fetch.next_mirror = NULL;
+}
+
+/* forget the shard resolved from the index, e.g. once the url or the options change */
+static void sxupdate_shard_forget(sxupdate_t handle) {
+  sxupdate_mem_free(handle->shard.url);
+  handle->shard.url = NULL;
+  handle->shard.resolved_at = 0;
+}
+
+/* close the file being downloaded to, waiting for any writes still in flight
+   @return 0 on success, else errno */
+static int sxupdate_download_close(sxupdate_t handle) {
+  int err = 0;
+  if(handle->download.sink)
+    err = sxupdate_sink_close(handle->download.sink);
+  else if(handle->download.f && fclose(handle->download.f))
+    err = errno ? errno : EIO;
+  handle->download.sink = NULL;
+  handle->download.f = NULL;
+  return err;
+}
+
+/* release an unfinished download, discarding its partial file */
+static void sxupdate_download_release(sxupdate_t handle) {
+  sxupdate_download_close(handle);
+  if(handle->download.save_path)
+    remove(handle->download.save_path);
+  sxupdate_mem_free(handle->download.save_path);
+  handle->download.save_path = NULL;
+  if(handle->download.resolved_url != handle->latest_version.enclosure.url)
+    sxupdate_mem_free(handle->download.resolved_url);
+  handle->download.resolved_url = NULL;
+  sxupdate_codec_free(handle->download.decoder);
+  handle->download.decoder = NULL;
+}
+
+/***
+ * Stop the speculative download, if any, and discard its file
+ */
+static void sxupdate_speculative_cancel(sxupdate_t handle) {
+  if(!handle->speculative.started)
+    return;
+  __atomic_store_n(&handle->speculative.cancel, 1, __ATOMIC_RELAXED);
+  if(!handle->event.multi) {
+#ifndef _WIN32
+    pthread_join(handle->speculative.thread, NULL);
+#endif
+  } else if(!handle->speculative.done) {
+    sxupdate_transfer_cancel(handle);
+    sxupdate_download_release(handle);
+  }
+  if(handle->speculative.path)
+    remove(handle->speculative.path);
+  sxupdate_mem_free(handle->speculative.path);
+  handle->speculative.path = NULL;
+  handle->speculative.started = 0;
+  handle->speculative.done = 0;
+  handle->speculative.proceed = 0;
+  handle->speculative.cancel = 0;
+  sxupdate_log_info(handle, "speculative.cancel", "Discarded the installer downloaded while waiting");
+}
+
+/* forget the stage the update was paused at, deleting an installer that was not verified */
+static void sxupdate_stage_release(sxupdate_t handle) {
+  if(handle->stage.path && handle->stage.current == sxupdate_stage_downloaded)
+    remove(handle->stage.path);
+  sxupdate_mem_free(handle->stage.path);
+  handle->stage.path = NULL;
+  handle->stage.current = sxupdate_stage_none;
+}
+
 static void sxupdate_free(sxupdate_t handle) {
+  sxupdate_speculative_cancel(handle);
+  sxupdate_stage_release(handle);
+  sxupdate_transfer_cleanup(handle);
+  if(handle->fetch_curl)
+    curl_easy_cleanup(handle->fetch_curl);
+  sxupdate_download_release(handle);
+  if(handle->background.appcast)
+    fclose(handle->background.appcast);
+  sxupdate_mem_free(handle->background.installer);
+  sxupdate_mem_free(handle->background.dir);
+  sxupdate_flight_unlock(&handle->flight.appcast_lock);
+  sxupdate_flight_unlock(&handle->flight.installer_lock);
+  sxupdate_mem_free(handle->flight.dir);
+  sxupdate_mem_free(handle->rollout.machine_id);
+  sxupdate_mem_free(handle->rollout.id_file);
+  sxupdate_mem_free(handle->install_dir);
+  sxupdate_delta_options_free(handle);
+  sxupdate_fetch_mirrors_free(handle);
+  sxupdate_ring_free(handle->events.ring);
+
   if(handle->http_headers)
     curl_slist_free_all(handle->http_headers);
+  if(handle->state.headers)
+    curl_slist_free_all(handle->state.headers);
+  sxupdate_mem_free(handle->state.path);
 
   if(handle->public_key)
     RSA_free(handle->public_key);
+#ifndef NO_SIGNATURE
+  sxupdate_mem_free(handle->public_key_pem);
+#endif
 
-  sxupdate_version_free(&handle->latest_version);
+  sxupdate_version_free(handle, &handle->latest_version);
 
   for(struct sxupdate_string_list *next, *arg = handle->installer_args; arg; arg = next) {
     next = arg->next;
-    free(arg->value);
-    free(arg);
+    sxupdate_mem_free(arg->value);
+    sxupdate_mem_free(arg);
   }
-  free(handle->latest_version_internal.signature);
-  free(handle->url);
-  yajl_helper_delete(handle->parser.yh);
+  sxupdate_mem_free(handle->latest_version_internal.signature);
+#ifndef NO_SIGNATURE
+  sxupdate_peer_options_free(handle);
+#endif
+  sxupdate_shard_options_free(handle);
+  sxupdate_shard_forget(handle);
+  sxupdate_batch_free(handle);
+  sxupdate_mem_free(handle->url);
+  sxupdate_parse_reset(handle);
 }
 
 
@@ -96,8 +299,10 @@ SXUPDATE_API void sxupdate_set_public_key(sxupdate_t handle, RSA *key) {
   handle->no_public_key = 0;
   if(handle->public_key)
     RSA_free(handle->public_key);
+  sxupdate_mem_free(handle->public_key_pem);
+  handle->public_key_pem = NULL;
   if(!key) {
-    sxupdate_printerr("Warning! signature verification disabled. Not secure!!!!!");
+    sxupdate_log_warning(handle, "key.disabled", "Warning! signature verification disabled. Not secure!!!!!");
     handle->no_public_key = 1;
     handle->public_key = NULL;
   } else
@@ -107,23 +312,106 @@ SXUPDATE_API void sxupdate_set_public_key(sxupdate_t handle, RSA *key) {
 SXUPDATE_API enum sxupdate_status sxupdate_set_public_key_from_file(sxupdate_t handle, const char *filepath) {
   if(handle->public_key)
     RSA_free(handle->public_key);
+  handle->public_key = NULL;
   handle->no_public_key = 0;
-  if(handle->verbosity)
-    sxupdate_verbose("loading public key from file %s", filepath);
-  handle->public_key = sxupdate_public_key_from_pem_file(filepath);
-  if(!handle->public_key)
+  sxupdate_mem_free(handle->public_key_pem);
+  handle->public_key_pem = NULL;
+
+  // parsing the key initializes OpenSSL, which a check answered from the state file
+  // does not need, so only read it, and check that it holds a public key, for now
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->public_key_pem = sxupdate_public_key_pem_read(handle, filepath, &handle->public_key_pem_len);
+  sxupdate_mem_leave(previous);
+  return handle->public_key_pem ? sxupdate_status_ok : sxupdate_status_error;
+}
+
+/***
+ * Parse the key set with sxupdate_set_public_key_from_file(), if not done yet
+ */
+static enum sxupdate_status sxupdate_load_public_key(sxupdate_t handle) {
+  if(!handle->public_key_pem)
+    return sxupdate_status_ok;
+
+  sxupdate_log_info(handle, "key.load", "loading public key");
+  if(!(handle->public_key = sxupdate_public_key_from_pem(handle, handle->public_key_pem,
+                                                         handle->public_key_pem_len)))
     return sxupdate_status_error;
+  sxupdate_mem_free(handle->public_key_pem);
+  handle->public_key_pem = NULL;
+  return sxupdate_status_ok;
+}
+
+/***
+ * Opt in to sharing installers with peers on the local network
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_peer_cache(sxupdate_t handle,
+                                                          const struct sxupdate_peer_options *opts) {
+  sxupdate_peer_options_free(handle);
+  if(!opts)
+    return sxupdate_status_ok;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  int err = (opts->share_dir && !(handle->peer.share_dir = sxupdate_mem_strdup(opts->share_dir)))
+    || (opts->group && !(handle->peer.group = sxupdate_mem_strdup(opts->group)))
+    || (opts->iface && !(handle->peer.iface = sxupdate_mem_strdup(opts->iface)));
+  sxupdate_mem_leave(previous);
+  if(err) {
+    sxupdate_peer_options_free(handle);
+    return sxupdate_status_memory;
+  }
+  handle->peer.port = opts->port;
+  handle->peer.timeout_ms = opts->timeout_ms;
+  handle->peer.enabled = 1;
+  sxupdate_log_info(handle, "peer.enable", "Peer cache enabled%s%s",
+                    opts->share_dir ? ", sharing from " : "", opts->share_dir ? opts->share_dir : "");
   return sxupdate_status_ok;
 }
 
+/***
+ * Ask LAN peers for a copy of the installer. Return its url, or NULL if
+ * the peer cache is disabled or no peer has it
+ */
+static char *sxupdate_peer_url(sxupdate_t handle) {
+  if(!handle->peer.enabled || handle->download.no_peer
+     || !handle->public_key || !handle->latest_version_internal.signature)
+    return NULL;
+
+  char key[SXUPDATE_PEER_KEY_LENGTH + 1];
+  sxupdate_peer_key(handle->latest_version_internal.signature,
+                    handle->latest_version_internal.signature_length, key);
+  double start = sxupdate_clock_now();
+  char *url = sxupdate_peer_discover(handle, handle->peer.group, handle->peer.port,
+                                     handle->peer.iface, handle->peer.timeout_ms, key);
+  handle->stats.peer_discovery = sxupdate_clock_now() - start;
+  return url;
+}
+
+/***
+ * Make a verified installer available to other peers
+ */
+static void sxupdate_peer_publish(sxupdate_t handle, const char *filepath) {
+  if(!(handle->peer.enabled && handle->peer.share_dir && handle->public_key
+       && handle->latest_version_internal.signature))
+    return;
+
+  char key[SXUPDATE_PEER_KEY_LENGTH + 1];
+  sxupdate_peer_key(handle->latest_version_internal.signature,
+                    handle->latest_version_internal.signature_length, key);
+  sxupdate_peer_share(handle, handle->peer.share_dir, key, filepath);
+}
+
 #endif
 
 /***
  * Delete a handle that was created with sxupdate_new()
  */
 SXUPDATE_API void sxupdate_delete(sxupdate_t handle) {
+  struct sxupdate_mem_account *mem = handle->mem;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(mem);
   sxupdate_free(handle);
-  free(handle);
+  sxupdate_mem_free(handle);
+  sxupdate_mem_leave(previous);
+  sxupdate_mem_account_release(mem);
 }
 
 /***
@@ -135,13 +423,75 @@ SXUPDATE_API void sxupdate_set_interaction_handler(sxupdate_t handle,
 }
 
 
+/***
+ * Set the callback that pauses the update once the installer is downloaded and verified
+ */
+SXUPDATE_API void sxupdate_set_stage_handler(sxupdate_t handle, sxupdate_stage_handler handler) {
+  handle->stage_handler = handler;
+}
+
+SXUPDATE_API void sxupdate_set_user_data(sxupdate_t handle, void *user_data) {
+  handle->user_data = user_data;
+}
+
+SXUPDATE_API void *sxupdate_get_user_data(sxupdate_t handle) {
+  return handle->user_data;
+}
+
+/***
+ * Set a callback that will be called once the update flow has finished
+ */
+SXUPDATE_API void sxupdate_set_completion_handler(sxupdate_t handle,
+                                                  sxupdate_completion_handler handler) {
+  handle->completion_handler = handler;
+}
+
+/***
+ * Drive sxupdate from the caller's event loop instead of blocking
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_event_callbacks(sxupdate_t handle,
+                                                               sxupdate_socket_callback socket_cb,
+                                                               sxupdate_timer_callback timer_cb,
+                                                               void *ctx) {
+  if(!(socket_cb && timer_cb))
+    return sxupdate_status_invalid;
+  if(handle->event.curl) {
+    sxupdate_log_error(handle, "event.busy", "Cannot change event callbacks while a transfer is in progress");
+    return sxupdate_status_error;
+  }
+  handle->event.socket_cb = socket_cb;
+  handle->event.timer_cb = timer_cb;
+  handle->event.ctx = ctx;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  enum sxupdate_status stat = sxupdate_transfer_init_multi(handle);
+  sxupdate_mem_leave(previous);
+  return stat;
+}
+
+/***
+ * Tell sxupdate that a watched socket is ready, or that the timer has expired
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_socket_action(sxupdate_t handle, sxupdate_socket_t fd, int events) {
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  enum sxupdate_status stat =
+    sxupdate_transfer_socket_action(handle,
+                                    fd == SXUPDATE_SOCKET_TIMEOUT ? CURL_SOCKET_TIMEOUT : (curl_socket_t)fd,
+                                    events);
+  sxupdate_mem_leave(previous);
+  return stat;
+}
+
+SXUPDATE_API int sxupdate_is_running(sxupdate_t handle) {
+  return handle->event.curl != NULL;
+}
+
 /***
  * Set the url used to fetch the version info. The url value can be transient, and must
  * start with http:// or file://
  */
 SXUPDATE_API enum sxupdate_status sxupdate_set_url(sxupdate_t handle, const char *url) {
   if(!url) {
-    free(handle->url);
+    sxupdate_mem_free(handle->url);
     handle->url = NULL;
     return sxupdate_status_bad_url;
   }
@@ -153,9 +503,12 @@ SXUPDATE_API enum sxupdate_status sxupdate_set_url(sxupdate_t handle, const char
   else
     return sxupdate_status_bad_url;
 
-  free(handle->url);
-  handle->url = strdup(url);
-  return sxupdate_status_ok;
+  sxupdate_mem_free(handle->url);
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_shard_forget(handle);
+  handle->url = sxupdate_mem_strdup(url);
+  sxupdate_mem_leave(previous);
+  return handle->url ? sxupdate_status_ok : sxupdate_status_memory;
 }
 
 /***
@@ -166,237 +519,1233 @@ SXUPDATE_API enum sxupdate_status sxupdate_add_header(sxupdate_t handle, const c
     return sxupdate_status_invalid;
 
   size_t len = strlen(header_name) + strlen(header_value) + 10;
-  char *s = calloc(1, len);
-  if(!s)
-    return sxupdate_status_memory;
-  snprintf(s, len, "%s: %s", header_name, header_value);
-  if(handle->verbosity)
-    sxupdate_verbose("Adding header %s", s);
-  handle->http_headers = curl_slist_append(handle->http_headers, s);
-  free(s);
-  return sxupdate_status_ok;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  enum sxupdate_status stat = sxupdate_status_memory;
+  char *s = sxupdate_mem_calloc(1, len);
+  if(s) {
+    snprintf(s, len, "%s: %s", header_name, header_value);
+    sxupdate_log_info(handle, "header.add", "Adding header %s", s);
+    struct curl_slist *headers = curl_slist_append(handle->http_headers, s);
+    if(headers) {
+      handle->http_headers = headers;
+      stat = sxupdate_status_ok;
+    }
+    sxupdate_mem_free(s);
+  }
+  sxupdate_mem_leave(previous);
+  return stat;
 }
 
 static enum sxupdate_status sxupdate_ready(sxupdate_t handle) {
-  if(!handle->get_current_version) {
-    sxupdate_printerr("get_current_version callback not set");
+  // each product of a batch check has its own current version and interaction handler
+  int batch = handle->batch.products != NULL;
+  if(!handle->get_current_version && !batch) {
+    sxupdate_log_error(handle, "config.invalid", "get_current_version callback not set");
     return sxupdate_status_error;
   }
-  if(!handle->url || !handle->interaction_handler) {
-    sxupdate_printerr("url or on_update_available callback not set");
+  if(!handle->url || (!handle->interaction_handler && !batch)) {
+    sxupdate_log_error(handle, "config.invalid", "url or on_update_available callback not set");
     return sxupdate_status_error;
   }
   if(handle->url_is_file && handle->http_headers) {
-    sxupdate_printerr("custom headers cannot be used with file:// url");
+    sxupdate_log_error(handle, "config.invalid", "custom headers cannot be used with file:// url");
     return sxupdate_status_error;
   }
 
-  if(!handle->public_key && !handle->no_public_key) {
-    sxupdate_printerr("no public key set-- call sxupdate_set_public_key() before sxupdate_execute()");
+  if(!handle->public_key && !handle->public_key_pem && !handle->no_public_key) {
+    sxupdate_log_error(handle, "config.invalid", "no public key set-- call sxupdate_set_public_key() before sxupdate_execute()");
     return sxupdate_status_error;
   }
 
   return sxupdate_status_ok;
 }
 
-static size_t sxupdate_curl_progress_callback(void *h,
-                                              double dltotal,
-                                              double dlnow,
-                                              double ultotal,
-                                              double ulnow) {
-  (void)(dltotal);
-  (void)(dlnow);
-  (void)(ultotal);
-  (void)(ulnow);
-  sxupdate_t handle = h;
-  if(handle->parser.stat != yajl_status_ok)
-    return 1; // abort
-   return 0; /* all is good */
+/***
+ * Remember the result of each check in a state file, and skip checks made within
+ * ttl_seconds of the last one
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_state_file(sxupdate_t handle, const char *path,
+                                                          long ttl_seconds) {
+  sxupdate_mem_free(handle->state.path);
+  handle->state.path = NULL;
+  handle->state.ttl = ttl_seconds > 0 ? ttl_seconds : 0;
+  if(!path)
+    return sxupdate_status_ok;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->state.path = sxupdate_mem_strdup(path);
+  sxupdate_mem_leave(previous);
+  return handle->state.path ? sxupdate_status_ok : sxupdate_status_memory;
 }
 
-static size_t sxupdate_parse_chunk(char *ptr, size_t size, size_t nmemb, void *h) {
-  sxupdate_t handle = h;
-  size_t len = size * nmemb;
-  if(handle->parser.stat == yajl_status_ok)
-    sxupdate_parse(handle, ptr, len);
-  return len;
+/***
+ * Choose the shard to fetch when the url serves an index
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_shard(sxupdate_t handle,
+                                                     const struct sxupdate_shard_options *opts) {
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_shard_options_free(handle);
+  sxupdate_shard_forget(handle);
+  enum sxupdate_status stat = sxupdate_status_ok;
+  if(opts) {
+    if((opts->platform && !(handle->shard.platform = sxupdate_mem_strdup(opts->platform)))
+       || (opts->arch && !(handle->shard.arch = sxupdate_mem_strdup(opts->arch)))
+       || (opts->channel && !(handle->shard.channel = sxupdate_mem_strdup(opts->channel)))) {
+      sxupdate_shard_options_free(handle);
+      stat = sxupdate_status_memory;
+    } else
+      handle->shard.index_ttl = opts->index_ttl > 0 ? opts->index_ttl : 0;
+  }
+  sxupdate_mem_leave(previous);
+  return stat;
 }
 
-static enum sxupdate_status sxupdate_after_parse(sxupdate_t handle, enum sxupdate_status stat,
-                                                 void (*next)(sxupdate_t, enum sxupdate_status)
-                                                 ) {
-  // finish parsing
-  if(stat == sxupdate_status_ok) {
-    if(handle->parser.scanned_bytes == 0) {
-      handle->err_msg = "Unable to connect. Please check your credentials and try again";
-      stat = sxupdate_status_error;
+/***
+ * Set how this client is placed in staged rollouts
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_rollout(sxupdate_t handle,
+                                                       const struct sxupdate_rollout_options *opts) {
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_mem_free(handle->rollout.machine_id);
+  sxupdate_mem_free(handle->rollout.id_file);
+  handle->rollout.machine_id = handle->rollout.id_file = NULL;
+  handle->rollout.ignore = 0;
+  enum sxupdate_status stat = sxupdate_status_ok;
+  if(opts) {
+    if(opts->machine_id && !*opts->machine_id) {
+      sxupdate_log_error(handle, "config.invalid", "Empty machine id");
+      stat = sxupdate_status_invalid;
+    } else if((opts->machine_id && !(handle->rollout.machine_id = sxupdate_mem_strdup(opts->machine_id)))
+              || (opts->id_file && !(handle->rollout.id_file = sxupdate_mem_strdup(opts->id_file)))) {
+      sxupdate_mem_free(handle->rollout.machine_id);
+      handle->rollout.machine_id = NULL;
+      stat = sxupdate_status_memory;
     } else
-      stat = sxupdate_parse_finish(handle);
+      handle->rollout.ignore = !!opts->ignore;
   }
-  next(handle, stat);
+  sxupdate_mem_leave(previous);
   return stat;
 }
 
 /***
- * Fetch and parse the metadata from file or network using curl
+ * Start downloading a newer installer while the interaction handler waits for the user
  */
-static enum sxupdate_status sxupdate_fetch_from_curl(sxupdate_t handle,
-                                                     struct curl_slist *http_headers,
-                                                     void (*next)(sxupdate_t, enum sxupdate_status)
-                                                     ) {
-  enum sxupdate_status stat = sxupdate_status_ok;
-  CURL *curl = curl_easy_init();
-  if(!curl)
-    stat = sxupdate_status_memory;
-  else {
-    curl_easy_setopt(curl, CURLOPT_URL, handle->url);
+SXUPDATE_API enum sxupdate_status sxupdate_set_speculative_download(sxupdate_t handle, int enabled) {
+  handle->speculative.enabled = !!enabled;
+  return sxupdate_status_ok;
+}
 
-    // set custom headers
-    if(http_headers && !sxupdate_url_is_file(handle->url))
-      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, http_headers);
+/***
+ * Update the files under dir from the manifest of the newer version, when it has one
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_install_dir(sxupdate_t handle, const char *dir) {
+  sxupdate_mem_free(handle->install_dir);
+  handle->install_dir = NULL;
+  if(!dir)
+    return sxupdate_status_ok;
+#ifdef _WIN32
+  sxupdate_log_error(handle, "manifest.unsupported", "Manifest updates are not supported on this platform");
+  return sxupdate_status_invalid;
+#else
+  size_t len = strlen(dir);
+  while(len > 1 && dir[len - 1] == '/')
+    len--; // the stage dir is named after it
+  if(!len || (len == 1 && *dir == '/'))
+    return sxupdate_status_invalid;
 
-    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, handle);
-    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, sxupdate_curl_progress_callback);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->install_dir = sxupdate_mem_strndup(dir, len);
+  sxupdate_mem_leave(previous);
+  return handle->install_dir ? sxupdate_status_ok : sxupdate_status_memory;
+#endif
+}
 
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, handle);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sxupdate_parse_chunk);
+/***
+ * Download only the blocks of a newer installer that cannot be found locally
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_delta(sxupdate_t handle, const struct sxupdate_delta_options *opts) {
+  sxupdate_delta_options_free(handle);
+  if(!opts)
+    return sxupdate_status_ok;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  int err = opts->cache_dir && !(handle->delta.cache_dir = sxupdate_mem_strdup(opts->cache_dir));
+  struct sxupdate_string_list **next = &handle->delta.seeds;
+  for(const char *const *seed = opts->seeds; !err && seed && *seed; seed++) {
+    struct sxupdate_string_list *s = sxupdate_mem_calloc(1, sizeof(*s));
+    if(!s || !(s->value = sxupdate_mem_strdup(*seed))) {
+      sxupdate_mem_free(s);
+      err = 1;
+    } else {
+      *next = s;
+      next = &s->next;
+    }
+  }
+  sxupdate_mem_leave(previous);
+  if(err) {
+    sxupdate_delta_options_free(handle);
+    return sxupdate_status_memory;
+  }
+  handle->delta.enabled = 1;
+  return sxupdate_status_ok;
+}
 
+/***
+ * Choose how downloaded installers are written to disk
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_write_options(sxupdate_t handle,
+                                                             const struct sxupdate_write_options *opts) {
 #ifdef _WIN32
-    // if(no_verify)
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+  if(opts && opts->async)
+    return sxupdate_status_invalid;
 #endif
+  handle->write.async = opts && opts->async;
+  handle->write.direct_min_bytes = opts && opts->direct_min_bytes > 0 ? opts->direct_min_bytes : 0;
+  return sxupdate_status_ok;
+}
 
-    // execute
-    if(handle->verbosity)
-      sxupdate_verbose("Fetching version info from %s", handle->url);
-
-    CURLcode res = curl_easy_perform(curl);
-
-    if((sxupdate_url_is_file(handle->url)))
-      handle->http_code = 200;
-    else
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &handle->http_code);
-
-    if(res != CURLE_OK) {
-      sxupdate_printerr("Error connecting to %s:\n  %s", handle->url, curl_easy_strerror(res));
-      stat = sxupdate_status_error;
-    } else if(!(handle->http_code >= 200 && handle->http_code < 300))
-      stat = sxupdate_status_error;
-
-    curl_easy_cleanup(curl);
-
-    stat = sxupdate_after_parse(handle, stat, next);
+/***
+ * Set the rate cap and priorities of downloads, hashing and writing
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_qos(sxupdate_t handle, const struct sxupdate_qos_options *opts) {
+  memset(&handle->qos, 0, sizeof(handle->qos));
+  if(!opts)
+    return sxupdate_status_ok;
+  if(opts->nice < 0 || opts->nice > SXUPDATE_QOS_MAX_NICE || opts->max_recv_bytes_per_second < 0
+     || opts->hash_chunk_bytes < 0 || opts->hash_pause_us < 0) {
+    sxupdate_log_error(handle, "config.invalid", "Invalid QoS options");
+    return sxupdate_status_invalid;
   }
+  handle->qos.max_recv_speed = opts->max_recv_bytes_per_second;
+  handle->qos.nice = opts->nice;
+  handle->qos.idle_io = !!opts->idle_io;
+  handle->qos.hash_chunk = opts->hash_chunk_bytes ? (size_t)opts->hash_chunk_bytes
+    : opts->nice || opts->idle_io || opts->hash_pause_us ? SXUPDATE_QOS_HASH_CHUNK : 0;
+  handle->qos.hash_pause_us = opts->hash_pause_us;
+  return sxupdate_status_ok;
+}
 
-  return stat;
+/***
+ * Have phase changes, download progress and errors written to a ring, for another thread to poll
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_event_ring(sxupdate_t handle,
+                                                          const struct sxupdate_event_ring_options *opts) {
+  sxupdate_ring_free(handle->events.ring);
+  handle->events.ring = NULL;
+  if(!opts)
+    return sxupdate_status_ok;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->events.ring = sxupdate_ring_new(opts->capacity ? opts->capacity : SXUPDATE_RING_DEFAULT_CAPACITY);
+  sxupdate_mem_leave(previous);
+  return handle->events.ring ? sxupdate_status_ok : sxupdate_status_memory;
 }
 
 /***
- * Fetch and parse the metadata from network or file
- *
- * This implementation is synchronous, but, we use a callback because future
- * implementations in other contexts (e.g. web assembly) might be async.
+ * Read events from the ring, without blocking
  */
-static
-enum sxupdate_status sxupdate_fetch_and_parse(sxupdate_t handle,
-                                              struct curl_slist *http_headers,
-                                              void (*next)(sxupdate_t, enum sxupdate_status)
-                                              ) {
-  enum sxupdate_status stat = sxupdate_status_error;
-  if(handle->url
-     && (stat = sxupdate_parse_init(handle)) == sxupdate_status_ok)
-    stat = sxupdate_fetch_from_curl(handle, http_headers, next);
-  return stat;
+SXUPDATE_API size_t sxupdate_poll_events(sxupdate_t handle, struct sxupdate_event *events, size_t max) {
+  return handle->events.ring ? sxupdate_ring_pop(handle->events.ring, events, max) : 0;
 }
 
+/***
+ * Get the counters of the ring
+ */
+SXUPDATE_API void sxupdate_get_event_ring_stats(sxupdate_t handle, struct sxupdate_event_ring_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if(handle->events.ring)
+    sxupdate_ring_stats(handle->events.ring, stats);
+}
 
-static char *url_merge(const char *parent_url, const char *relative_url) {
-  size_t parent_bytes_to_keep;
-  if(strncmp(parent_url, SXUPDATE_HTTPS_PREFIX, strlen(SXUPDATE_HTTPS_PREFIX))) {
-    char *first_slash = strchr(parent_url + strlen(SXUPDATE_HTTPS_PREFIX), '/');
-    if(!first_slash) {
-      sxupdate_printerr("url_merge: unexpected error 1");
-      return NULL;
+/***
+ * Set the deadline, stall detection and hedging of fetches
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_fetch_options(sxupdate_t handle,
+                                                             const struct sxupdate_fetch_options *opts) {
+  sxupdate_fetch_mirrors_free(handle);
+  handle->fetch.deadline_ms = opts && opts->deadline_ms > 0 ? opts->deadline_ms : 0;
+  handle->fetch.stall_seconds = !opts || !opts->stall_seconds ? SXUPDATE_STALL_SECONDS
+    : opts->stall_seconds > 0 ? opts->stall_seconds : 0;
+  handle->fetch.stall_bytes_per_second = opts && opts->stall_bytes_per_second > 0 ? opts->stall_bytes_per_second : 1;
+  handle->fetch.hedge = opts && opts->hedge;
+  handle->fetch.hedge_delay_ms = opts && opts->hedge_delay_ms > 0 ? opts->hedge_delay_ms : 0;
+  if(!opts)
+    return sxupdate_status_ok;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  int err = 0;
+  struct sxupdate_string_list **next = &handle->fetch.mirrors;
+  for(const char *const *mirror = opts->mirrors; !err && mirror && *mirror; mirror++) {
+    struct sxupdate_string_list *s = NULL;
+    if(!sxupdate_url_is_https(*mirror)) {
+      sxupdate_log_error(handle, "config.invalid", "Mirror url must begin with %s: %s",
+                         SXUPDATE_HTTPS_PREFIX, *mirror);
+      err = 1;
+    } else if(!(s = sxupdate_mem_calloc(1, sizeof(*s))) || !(s->value = sxupdate_mem_strdup(*mirror))) {
+      sxupdate_mem_free(s);
+      err = 2;
+    } else {
+      *next = s;
+      next = &s->next;
     }
-    parent_bytes_to_keep = first_slash - parent_url + 1;
-  } else if(strncmp(parent_url, SXUPDATE_FILE_PREFIX, strlen(SXUPDATE_FILE_PREFIX)))
-    parent_bytes_to_keep = strlen(SXUPDATE_FILE_PREFIX);
-  else {
-    sxupdate_printerr("url_merge: unexpected error 2");
-    return NULL;
   }
+  sxupdate_mem_leave(previous);
+  if(err) {
+    sxupdate_fetch_mirrors_free(handle);
+    return err == 1 ? sxupdate_status_invalid : sxupdate_status_memory;
+  }
+  handle->fetch.next_mirror = handle->fetch.mirrors;
+  return sxupdate_status_ok;
+}
 
-  if(!strncmp(relative_url, "./", 2))
-    relative_url += 2;
+/***
+ * Coordinate concurrent checks of the processes on this host, so that only one fetches
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_set_single_flight(sxupdate_t handle,
+                                                             const struct sxupdate_single_flight_options *opts) {
+  sxupdate_mem_free(handle->flight.dir);
+  handle->flight.dir = NULL;
+  if(!opts)
+    return sxupdate_status_ok;
+#ifdef _WIN32
+  sxupdate_log_error(handle, "flight.unsupported", "Single flight is not supported on this platform");
+  return sxupdate_status_invalid;
+#else
+  if(!opts->dir)
+    return sxupdate_status_invalid;
 
-  if(*relative_url != '/') {
-    // relative path. extend parent_bytes_to_keep to the last slash
-    char *last_slash = strrchr(parent_url + parent_bytes_to_keep, '/');
-    if(last_slash && last_slash > parent_url + parent_bytes_to_keep)
-      parent_bytes_to_keep = last_slash - parent_url + 1;
-  } else
-    relative_url++;
-  size_t len = parent_bytes_to_keep + strlen(relative_url) + 3;
-  char *merged_url = malloc(len);
-  snprintf(merged_url, len, "%.*s%s", (int)parent_bytes_to_keep, parent_url, relative_url);
-  return merged_url;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->flight.dir = sxupdate_mem_strdup(opts->dir);
+  sxupdate_mem_leave(previous);
+  if(!handle->flight.dir)
+    return sxupdate_status_memory;
+  handle->flight.wait_ms = opts->wait_ms > 0 ? opts->wait_ms : SXUPDATE_FLIGHT_WAIT_MS;
+  handle->flight.max_age = opts->max_age_seconds > 0 ? opts->max_age_seconds : SXUPDATE_FLIGHT_MAX_AGE;
+  handle->flight.no_wait = !!opts->no_wait;
+  return sxupdate_status_ok;
+#endif
 }
 
 /***
- * Download the installer file and save the file path to save_path_p
- *
- * @return sxupdate_status_ok on success
+ * Check for updates in a detached helper process, and use its result on the next launch
  */
-static enum sxupdate_status sxupdate_download(sxupdate_t handle,
-                                              char **save_path_p) {
-  const char *parent_url = handle->url;
-  struct sxupdate_version *version = &handle->latest_version;
-  struct curl_slist *http_headers = handle->http_headers;
-  unsigned char verbosity = handle->verbosity;
+SXUPDATE_API enum sxupdate_status sxupdate_set_background(sxupdate_t handle,
+                                                          const struct sxupdate_background_options *opts) {
+  sxupdate_mem_free(handle->background.dir);
+  handle->background.dir = NULL;
+  handle->background.prefetch = 0;
+  if(!opts)
+    return sxupdate_status_ok;
+#ifdef _WIN32
+  sxupdate_log_error(handle, "background.unsupported", "Background checks are not supported on this platform");
+  return sxupdate_status_invalid;
+#else
+  if(!opts->dir)
+    return sxupdate_status_invalid;
 
-  *save_path_p = NULL;
-  char *resolved_url = NULL;
-  if(sxupdate_is_relative_filename(version->enclosure.url)) {
-    if(verbosity > 1)
-      sxupdate_verbose("Merging urls: %s + %s", parent_url, version->enclosure.url);
-    resolved_url = url_merge(parent_url, version->enclosure.url);
-    if(!resolved_url) {
-      sxupdate_printerr("Unable to merge urls: %s + %s", parent_url, version->enclosure.url);
-      return sxupdate_status_error;
-    }
-  } else
-    resolved_url = version->enclosure.url;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  handle->background.dir = sxupdate_mem_strdup(opts->dir);
+  sxupdate_mem_leave(previous);
+  if(!handle->background.dir)
+    return sxupdate_status_memory;
+  handle->background.prefetch = !!opts->prefetch;
+  return sxupdate_status_ok;
+#endif
+}
 
-  enum sxupdate_status stat = sxupdate_status_error;
-  char *save_path = sxupdate_get_installer_download_path(version->enclosure.filename);
+/* identify the shard options, so that a shard recorded for other options is not used */
+static uint64_t sxupdate_shard_key(sxupdate_t handle) {
+  const char *fields[] = {
+    sxupdate_shard_platform(handle), sxupdate_shard_arch(handle), sxupdate_shard_channel(handle)
+  };
+  uint64_t key = 0;
+  for(size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++)
+    key = key * 31 + sxupdate_state_hash(fields[i], strlen(fields[i]));
+  return key;
+}
 
-  // download to temp file
-  if(!save_path)
-    stat = sxupdate_status_memory;
+/* non-zero if the shard was read from the index less than the index ttl ago */
+static int sxupdate_shard_fresh(sxupdate_t handle) {
+  long ttl = handle->shard.index_ttl > 0 ? handle->shard.index_ttl : SXUPDATE_SHARD_DEFAULT_INDEX_TTL;
+  time_t elapsed = time(NULL) - handle->shard.resolved_at;
+  return handle->shard.url && handle->shard.resolved_at && elapsed >= 0 && elapsed < ttl;
+}
+
+/***
+ * Take the latest version from the state file record
+ */
+static enum sxupdate_status sxupdate_state_use(sxupdate_t handle) {
+  const struct sxupdate_state_record *record = &handle->state.record;
+  struct sxupdate_semantic_version *v = &handle->latest_version.version;
+  sxupdate_parse_string_free(handle, v->prerelease);
+  v->prerelease = NULL;
+  if(*record->prerelease && !(v->prerelease = sxupdate_mem_strdup(record->prerelease)))
+    return sxupdate_status_memory;
+  v->major = record->major;
+  v->minor = record->minor;
+  v->patch = record->patch;
+  return sxupdate_status_ok;
+}
+
+/***
+ * Read the state file, and decide whether the check can be skipped: it can if the last
+ * check was made less than the ttl ago and found no version newer than this one. If it
+ * cannot, but the appcast is unchanged since, the fetch can still be skipped with a 304
+ *
+ * @return non-zero if the check can be skipped
+ */
+static int sxupdate_state_fresh(sxupdate_t handle) {
+  struct sxupdate_state_record *record = &handle->state.record;
+  double start = sxupdate_clock_now();
+  handle->state.have_record = !sxupdate_state_read(handle->state.path, record)
+    && record->url_hash == sxupdate_state_hash(handle->url, strlen(handle->url));
+  if(handle->state.have_record && *record->shard_url && record->shard_key != sxupdate_shard_key(handle))
+    handle->state.have_record = 0; // the check was of a shard for another platform or channel
+  if(handle->state.have_record && *record->shard_url && !handle->shard.url) {
+    // another process has read the index: fetch the shard it found directly
+    handle->shard.url = sxupdate_mem_strdup(record->shard_url);
+    handle->shard.resolved_at = handle->shard.url ? (time_t)record->shard_resolved_at : 0;
+  }
+  if(handle->state.have_record) {
+    struct sxupdate_semantic_version seen = { 0 };
+    seen.major = record->major;
+    seen.minor = record->minor;
+    seen.patch = record->patch;
+    seen.prerelease = *record->prerelease ? record->prerelease : NULL;
+    if(sxupdate_version_cmp(handle, seen, handle->get_current_version()) > 0)
+      handle->state.have_record = 0; // fetch the details needed to install the newer version
+    else {
+      int64_t elapsed = (int64_t)time(NULL) - record->checked_at;
+      handle->state.fresh = elapsed >= 0 && elapsed < handle->state.ttl
+        && sxupdate_state_use(handle) == sxupdate_status_ok;
+      handle->state.conditional = !handle->state.fresh
+        && (*record->etag || *record->last_modified);
+    }
+  }
+  handle->stats.state += sxupdate_clock_now() - start;
+  if(handle->state.fresh)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "state.fresh",
+                    ((const struct sxupdate_log_field[]){ { "path", handle->state.path }, { NULL, NULL } }),
+                    "Skipping check: last checked %lli seconds ago",
+                    (long long)((int64_t)time(NULL) - record->checked_at));
+  return handle->state.fresh;
+}
+
+/***
+ * Record the result of a successful check in the state file
+ */
+static void sxupdate_state_save(sxupdate_t handle) {
+  const struct sxupdate_semantic_version *v = &handle->latest_version.version;
+  if(v->prerelease && strlen(v->prerelease) >= SXUPDATE_STATE_PRERELEASE_MAX)
+    return; // too long to record; check every time
+
+  double start = sxupdate_clock_now();
+  struct sxupdate_state_record record;
+  memset(&record, 0, sizeof(record));
+  record.url_hash = sxupdate_state_hash(handle->url, strlen(handle->url));
+  record.checked_at = (int64_t)time(NULL);
+  record.major = v->major;
+  record.minor = v->minor;
+  record.patch = v->patch;
+  if(v->prerelease)
+    strcpy(record.prerelease, v->prerelease);
+  if(handle->shard.url && strlen(handle->shard.url) < sizeof(record.shard_url)) {
+    strcpy(record.shard_url, handle->shard.url);
+    record.shard_key = sxupdate_shard_key(handle);
+    record.shard_resolved_at = (int64_t)handle->shard.resolved_at;
+  }
+  if(handle->rollout.held)
+    ; // the same appcast may offer this client a newer version later: do not let it be skipped with a 304
+  else if(handle->state.not_modified) { // the validators we sent still apply
+    memcpy(record.etag, handle->state.record.etag, sizeof(record.etag));
+    memcpy(record.last_modified, handle->state.record.last_modified, sizeof(record.last_modified));
+  } else {
+    memcpy(record.etag, handle->state.etag, sizeof(record.etag));
+    memcpy(record.last_modified, handle->state.last_modified, sizeof(record.last_modified));
+  }
+
+  int err = sxupdate_state_write(handle, handle->state.path, &record);
+  if(err)
+    sxupdate_log_warning(handle, "state.write", "Unable to write %s: %s", handle->state.path, strerror(err));
+  handle->stats.state += sxupdate_clock_now() - start;
+}
+
+static int sxupdate_slist_add(struct curl_slist **list, const char *s) {
+  struct curl_slist *l = curl_slist_append(*list, s);
+  if(!l)
+    return 1;
+  *list = l;
+  return 0;
+}
+
+/***
+ * Whether the validators from the state file are for the document being fetched: the
+ * appcast, or the shard recorded if the url serves an index
+ */
+static int sxupdate_state_validates(sxupdate_t handle) {
+  const struct sxupdate_state_record *record = &handle->state.record;
+  return handle->state.conditional && !sxupdate_url_is_file(handle->fetch_url)
+    && !strcmp(handle->fetch_url, *record->shard_url ? record->shard_url : handle->url);
+}
+
+/***
+ * Add the validators from the state file to the custom headers, so that an unchanged
+ * appcast is answered with a 304
+ */
+static struct curl_slist *sxupdate_state_headers(sxupdate_t handle, struct curl_slist *http_headers) {
+  if(!sxupdate_state_validates(handle))
+    return http_headers;
+
+  const struct sxupdate_state_record *record = &handle->state.record;
+  struct curl_slist *headers = NULL;
+  char header[SXUPDATE_STATE_ETAG_MAX + 32];
+  int err = 0;
+  for(struct curl_slist *h = http_headers; h && !err; h = h->next)
+    err = sxupdate_slist_add(&headers, h->data);
+  if(!err && *record->etag) {
+    snprintf(header, sizeof(header), "If-None-Match: %s", record->etag);
+    err = sxupdate_slist_add(&headers, header);
+  }
+  if(!err && *record->last_modified) {
+    snprintf(header, sizeof(header), "If-Modified-Since: %s", record->last_modified);
+    err = sxupdate_slist_add(&headers, header);
+  }
+  if(err) {
+    curl_slist_free_all(headers);
+    handle->state.conditional = 0;
+    return http_headers;
+  }
+  handle->state.headers = headers;
+  return headers;
+}
+
+/* copy the value of the header in line to target if it is called name and fits */
+static void sxupdate_header_value(const char *line, size_t len, const char *name,
+                                  char *target, size_t target_size) {
+  size_t name_len = strlen(name);
+  if(len <= name_len || line[name_len] != ':' || !curl_strnequal(line, name, name_len))
+    return;
+  line += name_len + 1;
+  len -= name_len + 1;
+  while(len && (*line == ' ' || *line == '\t'))
+    line++, len--;
+  while(len && strchr(" \t\r\n", line[len - 1]))
+    len--;
+  if(len < target_size) {
+    memcpy(target, line, len);
+    target[len] = '\0';
+  }
+}
+
+/* capture the validators of the appcast response, to send with the next check */
+static size_t sxupdate_fetch_header(char *buffer, size_t size, size_t nitems, void *h) {
+  sxupdate_t handle = h;
+  size_t len = size * nitems;
+  if(len > 5 && !memcmp(buffer, "HTTP/", 5)) { // a new response, e.g. after a redirect
+    *handle->state.etag = '\0';
+    *handle->state.last_modified = '\0';
+  } else {
+    sxupdate_header_value(buffer, len, "ETag", handle->state.etag, sizeof(handle->state.etag));
+    sxupdate_header_value(buffer, len, "Last-Modified", handle->state.last_modified,
+                          sizeof(handle->state.last_modified));
+  }
+  return len;
+}
+
+static size_t sxupdate_curl_progress_callback(void *h,
+                                              double dltotal,
+                                              double dlnow,
+                                              double ultotal,
+                                              double ulnow) {
+  (void)(dltotal);
+  (void)(dlnow);
+  (void)(ultotal);
+  (void)(ulnow);
+  sxupdate_t handle = h;
+  if(handle->parser.stat != yajl_status_ok)
+    return 1; // abort
+   return 0; /* all is good */
+}
+
+static size_t sxupdate_parse_chunk(char *ptr, size_t size, size_t nmemb, void *h) {
+  sxupdate_t handle = h;
+  size_t len = size * nmemb;
+  // copied first: parsing a mapped appcast terminates its strings in place
+  if(handle->background.appcast && fwrite(ptr, 1, len, handle->background.appcast) != len)
+    return 0; // abort
+  if(handle->parser.stat == yajl_status_ok) {
+    double start = sxupdate_clock_now();
+    sxupdate_parse(handle, ptr, len);
+    handle->stats.parse += sxupdate_clock_now() - start;
+  }
+  return len;
+}
+
+/* defined below; an index is followed by a second fetch, of the shard */
+static enum sxupdate_status sxupdate_fetch_and_parse(sxupdate_t handle,
+                                                     struct curl_slist *http_headers,
+                                                     void (*next)(sxupdate_t, enum sxupdate_status));
+static enum sxupdate_status sxupdate_shard_fetch(sxupdate_t handle,
+                                                 void (*next)(sxupdate_t, enum sxupdate_status));
+
+static enum sxupdate_status sxupdate_after_parse(sxupdate_t handle, enum sxupdate_status stat,
+                                                 void (*next)(sxupdate_t, enum sxupdate_status)
+                                                 ) {
+  // finish parsing
+  if(stat == sxupdate_status_ok) {
+    if(handle->state.not_modified)
+      stat = sxupdate_state_use(handle);
+    else if(handle->parser.scanned_bytes == 0) {
+      handle->err_msg = "Unable to connect. Please check your credentials and try again";
+      stat = sxupdate_status_error;
+    } else {
+      double start = sxupdate_clock_now();
+      stat = sxupdate_parse_finish(handle);
+      handle->stats.parse += sxupdate_clock_now() - start;
+      if(stat == sxupdate_status_ok && handle->shard.is_index)
+        return sxupdate_shard_fetch(handle, next);
+      if(stat == sxupdate_status_ok && handle->fetch_url == handle->url)
+        sxupdate_shard_forget(handle); // the url serves the appcast itself
+    }
+  }
+  next(handle, stat);
+  return stat;
+}
+
+static void sxupdate_fetch_done(sxupdate_t handle, CURL *curl, CURLcode res) {
+  enum sxupdate_status stat = sxupdate_status_ok;
+  const char *url = handle->fetch_url;
+  if((sxupdate_url_is_file(url)))
+    handle->http_code = 200;
+  else
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &handle->http_code);
+
+  if(res != CURLE_OK) {
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "fetch.error",
+                    ((const struct sxupdate_log_field[]){ { "url", url }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error connecting to %s:\n  %s", url, curl_easy_strerror(res));
+    stat = sxupdate_status_error;
+  } else if(handle->http_code == 304 && sxupdate_state_validates(handle)) {
+    sxupdate_log_info(handle, "state.not_modified", "Version info unchanged since the last check");
+    handle->state.not_modified = 1;
+  } else if(!(handle->http_code >= 200 && handle->http_code < 300))
+    stat = sxupdate_status_error;
+
+  // the shard may have moved: read the index again next time
+  if(stat != sxupdate_status_ok && url == handle->shard.url)
+    handle->shard.resolved_at = 0;
+
+  sxupdate_stats_from_curl(&handle->stats.appcast, curl);
+  handle->fetch_curl = curl; // keep for the next check
+  if(res == CURLE_OK && !sxupdate_url_is_file(url) && handle->stats.appcast.ttfb > 0)
+    handle->fetch.latency[handle->fetch.latency_count++ % SXUPDATE_FETCH_LATENCY_SAMPLES] =
+      handle->stats.appcast.ttfb;
+
+  handle->fetch_status = sxupdate_after_parse(handle, stat, handle->after_fetch);
+}
+
+/* give up at the deadline, if any, and on a connection or transfer that stalls */
+static void sxupdate_set_limits(sxupdate_t handle, CURL *curl, double deadline) {
+  if(handle->fetch.stall_seconds) {
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, handle->fetch.stall_seconds);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, handle->fetch.stall_bytes_per_second);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, handle->fetch.stall_seconds);
+  }
+  if(deadline) {
+    // once past it, fail straight away, so that the usual completion path runs
+    double remaining = deadline - sxupdate_clock_now();
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, remaining > 0 ? (long)(remaining * 1000) + 1 : 1L);
+  }
+}
+
+/* one of the requests of a hedged fetch */
+struct sxupdate_fetch_attempt {
+  sxupdate_t handle;
+  CURL *curl;
+  const char *url;
+  unsigned char validators:1; // capture the validators of its response for the state file
+  unsigned char _:7;
+};
+
+/* the first request to respond wins the race, and only its response is parsed */
+static int sxupdate_fetch_claim(struct sxupdate_fetch_attempt *attempt) {
+  sxupdate_t handle = attempt->handle;
+  if(!handle->fetch.winner) {
+    handle->fetch.winner = attempt->curl;
+    sxupdate_log_debug(handle, "fetch.hedge", "First response from %s", attempt->url);
+  }
+  return handle->fetch.winner == attempt->curl;
+}
+
+static size_t sxupdate_fetch_attempt_header(char *buffer, size_t size, size_t nitems, void *a) {
+  struct sxupdate_fetch_attempt *attempt = a;
+  if(!sxupdate_fetch_claim(attempt))
+    return 0; // abort
+  if(attempt->validators)
+    return sxupdate_fetch_header(buffer, size, nitems, attempt->handle);
+  return size * nitems;
+}
+
+static size_t sxupdate_fetch_attempt_chunk(char *ptr, size_t size, size_t nmemb, void *a) {
+  struct sxupdate_fetch_attempt *attempt = a;
+  if(!sxupdate_fetch_claim(attempt))
+    return 0; // abort
+  return sxupdate_parse_chunk(ptr, size, nmemb, attempt->handle);
+}
+
+static int sxupdate_latency_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* seconds to wait for a response before hedging: by default, the 95th percentile of the
+   last response times, so that about one fetch in 20 sends a second request */
+static double sxupdate_fetch_hedge_delay(sxupdate_t handle) {
+  if(handle->fetch.hedge_delay_ms)
+    return handle->fetch.hedge_delay_ms / 1000.0;
+  size_t n = handle->fetch.latency_count;
+  if(n > SXUPDATE_FETCH_LATENCY_SAMPLES)
+    n = SXUPDATE_FETCH_LATENCY_SAMPLES;
+  if(n < SXUPDATE_HEDGE_MIN_SAMPLES)
+    return SXUPDATE_HEDGE_DELAY_MS / 1000.0;
+  double sorted[SXUPDATE_FETCH_LATENCY_SAMPLES];
+  memcpy(sorted, handle->fetch.latency, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), sxupdate_latency_cmp);
+  return sorted[(n * 95 + 99) / 100 - 1];
+}
+
+/* set up curl to fetch url into the parser, through the callbacks of attempt if hedged */
+static void sxupdate_fetch_setup(sxupdate_t handle, CURL *curl, const char *url,
+                                 struct curl_slist *http_headers,
+                                 struct sxupdate_fetch_attempt *attempt) {
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  if(http_headers && !sxupdate_url_is_file(url))
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, http_headers);
+  if(attempt) {
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, attempt);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, sxupdate_fetch_attempt_header);
+  } else if(handle->state.path) {
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, handle);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, sxupdate_fetch_header);
+  }
+
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, handle);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, sxupdate_curl_progress_callback);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, attempt ? (void *)attempt : (void *)handle);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+                   attempt ? sxupdate_fetch_attempt_chunk : sxupdate_parse_chunk);
+
+#ifdef _WIN32
+  // if(no_verify)
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+#endif
+
+  sxupdate_set_limits(handle, curl, handle->fetch.deadline);
+}
+
+/***
+ * Fetch and parse the metadata from file or network using curl
+ */
+static enum sxupdate_status sxupdate_fetch_from_curl(sxupdate_t handle,
+                                                     struct curl_slist *http_headers,
+                                                     void (*next)(sxupdate_t, enum sxupdate_status)
+                                                     ) {
+  enum sxupdate_status stat = sxupdate_status_ok;
+  CURL *curl = handle->fetch_curl;
+  handle->fetch_curl = NULL; // sxupdate_fetch_done() hands it back
+  if(curl)
+    curl_easy_reset(curl); // clears options, but keeps open connections and caches
+  else
+    curl = curl_easy_init();
+
+  // hedge requests over http(s), unless driven by an event loop
+  CURL *hedge = NULL;
+  if(curl && handle->fetch.hedge && !handle->event.multi && !sxupdate_url_is_file(handle->fetch_url)
+     && !(hedge = curl_easy_init())) {
+    curl_easy_cleanup(curl);
+    curl = NULL;
+  }
+
+  if(!curl)
+    stat = sxupdate_status_memory;
   else {
-    if(verbosity)
-      sxupdate_verbose("Downloading to %s from %s", save_path, resolved_url);
-    FILE *f = fopen(save_path, "wb");
-    if(!f)
-      perror(save_path);
+    // set custom headers, plus the validators from the state file if any
+    struct curl_slist *custom_headers = http_headers;
+    http_headers = sxupdate_state_headers(handle, http_headers);
+
+    struct sxupdate_fetch_attempt attempts[2];
+    memset(attempts, 0, sizeof(attempts));
+    if(!hedge)
+      sxupdate_fetch_setup(handle, curl, handle->fetch_url, http_headers, NULL);
+    else {
+      attempts[0].handle = attempts[1].handle = handle;
+      attempts[0].curl = curl;
+      attempts[0].url = handle->fetch_url;
+      attempts[0].validators = !!handle->state.path;
+      sxupdate_fetch_setup(handle, curl, attempts[0].url, http_headers, &attempts[0]);
+
+      // a mirror serves the same appcast as the url, but not the same validators
+      attempts[1].curl = hedge;
+      if(handle->fetch.next_mirror && handle->fetch_url == handle->url) {
+        attempts[1].url = handle->fetch.next_mirror->value;
+        handle->fetch.next_mirror = handle->fetch.next_mirror->next ? handle->fetch.next_mirror->next
+          : handle->fetch.mirrors;
+        sxupdate_fetch_setup(handle, hedge, attempts[1].url, custom_headers, &attempts[1]);
+      } else {
+        attempts[1].url = handle->fetch_url;
+        attempts[1].validators = attempts[0].validators;
+        sxupdate_fetch_setup(handle, hedge, attempts[1].url, http_headers, &attempts[1]);
+        curl_easy_setopt(hedge, CURLOPT_FRESH_CONNECT, 1L);
+      }
+    }
+
+    // execute
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "fetch.start",
+                    ((const struct sxupdate_log_field[]){ { "url", handle->fetch_url }, { NULL, NULL } }),
+                    "Fetching version info from %s", handle->fetch_url);
+
+    handle->after_fetch = next;
+    handle->fetch_status = sxupdate_status_ok;
+    if(hedge)
+      stat = sxupdate_transfer_hedged(handle, curl, hedge, sxupdate_fetch_hedge_delay(handle),
+                                      handle->fetch.deadline, sxupdate_fetch_done);
+    else
+      stat = sxupdate_transfer_start(handle, curl, sxupdate_fetch_done);
+    if(stat != sxupdate_status_ok) {
+      curl_easy_cleanup(curl);
+      if(hedge)
+        curl_easy_cleanup(hedge);
+    } else if(!handle->event.multi)
+      stat = handle->fetch_status;
+  }
+
+  return stat;
+}
+
+/***
+ * Parse a file:// appcast straight from a mapping of the file, in one go, without
+ * initializing curl
+ *
+ * @return non-zero if it was, in which case `next` has been called; else the fetch is
+ *         left to curl, e.g. for a url that names another host
+ */
+static int sxupdate_fetch_from_file(sxupdate_t handle, void (*next)(sxupdate_t, enum sxupdate_status),
+                                    enum sxupdate_status *stat) {
+  const char *url = handle->fetch_url;
+  char *path = sxupdate_url_is_file(url) ? sxupdate_file_url_path(url) : NULL;
+  if(!path)
+    return 0;
+
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "fetch.start",
+                  ((const struct sxupdate_log_field[]){ { "url", url }, { NULL, NULL } }),
+                  "Fetching version info from %s", url);
+  double start = sxupdate_clock_now();
+  int err = sxupdate_parse_map(handle, path);
+  if(!err) {
+    size_t len = handle->parser.document_len;
+    if(sxupdate_parse_chunk(handle->parser.document, 1, len, handle) != len)
+      err = EIO;
+    struct sxupdate_transfer_stats *ts = &handle->stats.appcast;
+    ts->ttfb = ts->total = sxupdate_clock_now() - start;
+    ts->bytes = len;
+    ts->throughput = ts->total > 0 ? len / ts->total : 0;
+  }
+  if(err) {
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "fetch.error",
+                    ((const struct sxupdate_log_field[]){ { "url", url }, { "error", strerror(err) }, { NULL, NULL } }),
+                    "Error reading %s:\n  %s", path, strerror(err));
+    if(url == handle->shard.url)
+      handle->shard.resolved_at = 0;
+  }
+  handle->http_code = err ? 0 : 200;
+  sxupdate_mem_free(path);
+  *stat = sxupdate_after_parse(handle, err ? sxupdate_status_error : sxupdate_status_ok, next);
+  return 1;
+}
+
+/***
+ * Fetch and parse the metadata from network or file: the shard read from the index
+ * recently, if the url serves an index, else the url
+ *
+ * This is synchronous unless the handle is driven by an event loop, in which case
+ * `next` is called from sxupdate_socket_action() once the fetch completes
+ */
+static
+enum sxupdate_status sxupdate_fetch_and_parse(sxupdate_t handle,
+                                              struct curl_slist *http_headers,
+                                              void (*next)(sxupdate_t, enum sxupdate_status)
+                                              ) {
+  enum sxupdate_status stat = sxupdate_status_error;
+  if(handle->url
+     && (stat = sxupdate_parse_init(handle)) == sxupdate_status_ok) {
+    handle->fetch_url = sxupdate_shard_fresh(handle) ? handle->shard.url : handle->url;
+    if(!sxupdate_fetch_from_file(handle, next, &stat))
+      stat = sxupdate_fetch_from_curl(handle, http_headers, next);
+  }
+  return stat;
+}
+
+
+static char *url_merge(sxupdate_t handle, const char *parent_url, const char *relative_url) {
+  size_t parent_bytes_to_keep;
+  if(!strncmp(parent_url, SXUPDATE_HTTPS_PREFIX, strlen(SXUPDATE_HTTPS_PREFIX))) {
+    // keep the scheme and host
+    char *first_slash = strchr(parent_url + strlen(SXUPDATE_HTTPS_PREFIX), '/');
+    if(!first_slash) {
+      sxupdate_log_error(handle, "url.merge", "url_merge: unexpected error 1");
+      return NULL;
+    }
+    parent_bytes_to_keep = first_slash - parent_url + 1;
+  } else if(!strncmp(parent_url, SXUPDATE_FILE_PREFIX, strlen(SXUPDATE_FILE_PREFIX))) {
+    // keep the scheme, and the root of an absolute path
+    parent_bytes_to_keep = strlen(SXUPDATE_FILE_PREFIX);
+    if(parent_url[parent_bytes_to_keep] == '/')
+      parent_bytes_to_keep++;
+  } else {
+    sxupdate_log_error(handle, "url.merge", "url_merge: unexpected error 2");
+    return NULL;
+  }
+
+  if(!strncmp(relative_url, "./", 2))
+    relative_url += 2;
+
+  if(*relative_url != '/') {
+    // relative path. extend parent_bytes_to_keep to the last slash
+    char *last_slash = strrchr(parent_url + parent_bytes_to_keep, '/');
+    if(last_slash && last_slash > parent_url + parent_bytes_to_keep)
+      parent_bytes_to_keep = last_slash - parent_url + 1;
+  } else
+    relative_url++;
+  size_t len = parent_bytes_to_keep + strlen(relative_url) + 3;
+  char *merged_url = sxupdate_mem_alloc(len);
+  if(merged_url)
+    snprintf(merged_url, len, "%.*s%s", (int)parent_bytes_to_keep, parent_url, relative_url);
+  return merged_url;
+}
+
+/* where the appcast is copied to as it is fetched: in the background helper, or for the
+   other processes if this one is fetching it for them */
+static char *sxupdate_appcast_copy_path(sxupdate_t handle) {
+  if(handle->flight.appcast_lock >= 0)
+    return sxupdate_background_path(handle->flight.dir, SXUPDATE_FLIGHT_APPCAST ".tmp");
+  return sxupdate_background_path(handle->background.dir, SXUPDATE_BACKGROUND_APPCAST ".tmp");
+}
+
+/* restart the copy of the appcast, to keep only the shard */
+static int sxupdate_background_restart_appcast(sxupdate_t handle) {
+  char *tmp = sxupdate_appcast_copy_path(handle);
+  int err = fclose(handle->background.appcast);
+  handle->background.appcast = tmp && !err ? fopen(tmp, "wb") : NULL;
+  sxupdate_mem_free(tmp);
+  return handle->background.appcast == NULL;
+}
+
+/***
+ * The url served an index: fetch and parse the shard it names for this client instead
+ */
+static enum sxupdate_status sxupdate_shard_fetch(sxupdate_t handle,
+                                                 void (*next)(sxupdate_t, enum sxupdate_status)) {
+  enum sxupdate_status stat = sxupdate_status_error;
+  const char *match = handle->shard.match;
+  handle->stats.index = handle->stats.appcast;
+  memset(&handle->stats.appcast, 0, sizeof(handle->stats.appcast));
+
+  char *shard_url = NULL;
+  if(handle->fetch_url != handle->url) {
+    sxupdate_log_error(handle, "shard.invalid", "Shard %s is an index, not an appcast", handle->fetch_url);
+    handle->shard.resolved_at = 0; // read the index again next time
+  } else if(!match)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "shard.missing",
+                    ((const struct sxupdate_log_field[]){
+                      { "platform", sxupdate_shard_platform(handle) },
+                      { "arch", sxupdate_shard_arch(handle) },
+                      { "channel", sxupdate_shard_channel(handle) },
+                      { NULL, NULL } }),
+                    "No shard for %s/%s/%s in the index at %s", sxupdate_shard_platform(handle),
+                    sxupdate_shard_arch(handle), sxupdate_shard_channel(handle), handle->url);
+  else if(!sxupdate_url_is_https(match) && !sxupdate_url_is_file(match)
+          && !sxupdate_is_relative_filename(match))
+    sxupdate_log_error(handle, "shard.invalid", "Index: bad shard url (%s)", match);
+  else if(!(shard_url = sxupdate_is_relative_filename(match) ? url_merge(handle, handle->url, match)
+            : sxupdate_mem_strdup(match)))
+    stat = sxupdate_status_memory;
+  else {
+    sxupdate_shard_forget(handle);
+    handle->shard.url = shard_url;
+    handle->shard.resolved_at = time(NULL);
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "shard.resolve",
+                    ((const struct sxupdate_log_field[]){ { "url", shard_url }, { NULL, NULL } }),
+                    "Using shard %s", shard_url);
+    if(!handle->background.appcast || !sxupdate_background_restart_appcast(handle))
+      return sxupdate_fetch_and_parse(handle, handle->http_headers, next);
+  }
+  next(handle, stat);
+  return stat;
+}
+
+/* write installer bytes, decompressed if need be, to the file, hashing them as they go */
+static int sxupdate_download_sink(void *h, const void *data, size_t len) {
+  sxupdate_t handle = h;
+  int err;
+  if(handle->download.sink) {
+    if((err = sxupdate_sink_write(handle->download.sink, data, len)))
+      return err;
+  } else if(fwrite(data, 1, len, handle->download.f) != len)
+    return errno ? errno : EIO;
+#ifndef NO_SIGNATURE
+  // hash as the installer streams in, so that verifying it does not read it back
+  double start = sxupdate_clock_now();
+  SHA256_Update(&handle->download.sha256, data, len);
+  handle->stats.hash += sxupdate_clock_now() - start;
+#endif
+  return 0;
+}
+
+static size_t sxupdate_download_chunk(char *ptr, size_t size, size_t nmemb, void *h) {
+  sxupdate_t handle = h;
+  size_t len = size * nmemb;
+  int err;
+  handle->download.received += len;
+  if(handle->download.max_bytes && handle->download.received > handle->download.max_bytes) {
+    sxupdate_log_error(handle, "download.size", "%s: more than %lld bytes", handle->download.resolved_url,
+                       handle->download.max_bytes);
+    return 0; // aborts
+  }
+  if(!handle->download.decoder)
+    err = sxupdate_download_sink(handle, ptr, len);
+  else if((err = sxupdate_codec_write(handle->download.decoder, ptr, len, sxupdate_download_sink, handle)) == EINVAL)
+    sxupdate_log_error(handle, "download.decode", "Unable to decompress %s: corrupt data",
+                       handle->download.resolved_url);
+  return err ? 0 : len; // 0 aborts
+}
+
+static int sxupdate_download_progress(void *h, curl_off_t dltotal, curl_off_t dlnow,
+                                      curl_off_t ultotal, curl_off_t ulnow) {
+  (void)(ultotal);
+  (void)(ulnow);
+  sxupdate_t handle = h;
+  sxupdate_ring_progress(handle, dlnow, dltotal);
+  return __atomic_load_n(&handle->speculative.cancel, __ATOMIC_RELAXED); // non-zero aborts
+}
+
+static void sxupdate_download_done(sxupdate_t handle, CURL *curl, CURLcode res) {
+  enum sxupdate_status stat = sxupdate_status_error;
+  char *resolved_url = handle->download.resolved_url;
+  if((sxupdate_url_is_file(resolved_url)))
+    handle->http_code = 200;
+  else
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &handle->http_code);
+  if(res == CURLE_ABORTED_BY_CALLBACK && __atomic_load_n(&handle->speculative.cancel, __ATOMIC_RELAXED))
+    sxupdate_log_debug(handle, "download.cancel", "Download from %s cancelled", resolved_url);
+  else if(res != CURLE_OK)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "download.error",
+                    ((const struct sxupdate_log_field[]){ { "url", resolved_url }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error connecting to %s:\n  %s", resolved_url, curl_easy_strerror(res));
+  else if(handle->http_code >= 200 && handle->http_code < 300)
+    stat = sxupdate_status_ok;
+  sxupdate_log_trace(handle, "download.cleanup", "cleaning up curl call");
+  sxupdate_stats_from_curl(&handle->stats.download, curl);
+  curl_easy_cleanup(curl);
+
+  // flush the decompressor, making sure the installer was not truncated
+  int err;
+  if(handle->download.decoder && stat == sxupdate_status_ok
+     && (err = sxupdate_codec_finish(handle->download.decoder, sxupdate_download_sink, handle))) {
+    sxupdate_log_error(handle, "download.decode", "Unable to decompress %s: %s", resolved_url,
+                       err == EINVAL ? "truncated or corrupt data" : strerror(err));
+    stat = sxupdate_status_error;
+  }
+  sxupdate_codec_free(handle->download.decoder);
+  handle->download.decoder = NULL;
+  if((err = sxupdate_download_close(handle)) && stat == sxupdate_status_ok) {
+    sxupdate_log_error(handle, "download.write", "%s: %s", handle->download.save_path, strerror(err));
+    stat = sxupdate_status_error;
+  }
+
+  char *save_path = handle->download.save_path;
+  handle->download.save_path = NULL;
+  if(stat != sxupdate_status_ok) {
+    remove(save_path);
+    sxupdate_mem_free(save_path);
+    save_path = NULL;
+  }
+#ifndef NO_SIGNATURE
+  else {
+    SHA256_Final(handle->download.hash, &handle->download.sha256);
+    handle->download.hashed = 1;
+  }
+#endif
+
+  if(resolved_url != handle->latest_version.enclosure.url)
+    sxupdate_mem_free(resolved_url);
+  handle->download.resolved_url = NULL;
+
+  handle->download.next(handle, stat, save_path);
+}
+
+/***
+ * Download the installer file and pass the saved file path to next(), which
+ * takes ownership of it. On failure, next() receives a NULL path
+ */
+static void sxupdate_after_download(sxupdate_t handle, enum sxupdate_status stat,
+                                    char *downloaded_file_path);
+
+/* what a shared installer was verified against: its enclosure url and signature */
+static char *sxupdate_flight_installer_key(sxupdate_t handle) {
+  const struct sxupdate_version *version = &handle->latest_version;
+  const char *signature = version->enclosure.signature ? version->enclosure.signature : "";
+  size_t len = strlen(version->enclosure.url) + strlen(signature) + 2;
+  char *key = sxupdate_mem_alloc(len);
+  if(key)
+    snprintf(key, len, "%s\n%s", version->enclosure.url, signature);
+  return key;
+}
+
+/***
+ * Single flight: wait for any other process downloading the installer, and use its copy if
+ * it verified against the same enclosure; else keep the lock, to share this one once verified
+ *
+ * @return non-zero if the copy was taken, to save_path
+ */
+static int sxupdate_flight_download(sxupdate_t handle, const char *save_path) {
+  if(handle->event.multi || handle->download.next != sxupdate_after_download) // not while the user decides
+    return 0;
+  handle->flight.installer_lock = sxupdate_flight_lock(handle->flight.dir, SXUPDATE_FLIGHT_INSTALLER_LOCK,
+                                                       handle->flight.no_wait ? 0 : handle->flight.wait_ms);
+  if(handle->download.no_flight) // the shared copy did not verify: replace it
+    return 0;
+  char *key = sxupdate_flight_installer_key(handle);
+  handle->download.from_flight = key && !sxupdate_flight_take_installer(handle, handle->flight.dir, key, save_path);
+  sxupdate_mem_free(key);
+  if(handle->download.from_flight) {
+    handle->download.hashed = 0;
+    sxupdate_flight_unlock(&handle->flight.installer_lock);
+  }
+  return handle->download.from_flight;
+}
+
+static void sxupdate_download(sxupdate_t handle,
+                              void (*next)(sxupdate_t, enum sxupdate_status, char *)) {
+  const char *parent_url = handle->shard.url ? handle->shard.url : handle->url;
+  struct sxupdate_version *version = &handle->latest_version;
+  struct curl_slist *http_headers = handle->http_headers;
+
+  handle->download.next = next;
+  sxupdate_ring_phase(handle, sxupdate_phase_downloading, sxupdate_status_ok);
+  char *resolved_url = NULL;
+  if(handle->flight.dir) {
+    char *save_path = sxupdate_get_installer_download_path(handle, version->enclosure.filename);
+    if(save_path && sxupdate_flight_download(handle, save_path)) {
+      next(handle, sxupdate_status_ok, save_path);
+      return;
+    }
+    if(save_path) // created empty, and downloaded to under another name below
+      remove(save_path);
+    sxupdate_mem_free(save_path);
+  }
+#ifndef NO_SIGNATURE
+  resolved_url = sxupdate_peer_url(handle);
+#endif
+  handle->download.from_peer = resolved_url != NULL;
+
+  // peers hold the installer as it was verified, i.e. decompressed
+  enum sxupdate_encoding encoding = sxupdate_encoding_identity;
+  if(!handle->download.from_peer)
+    sxupdate_encoding_from_name(version->enclosure.encoding, &encoding); // validated when parsed
+  if(resolved_url)
+    ; // fetch from the peer; sxupdate_after_download() falls back to the origin if need be
+  else if(sxupdate_is_relative_filename(version->enclosure.url)) {
+    sxupdate_log_debug(handle, "url.merge", "Merging urls: %s + %s", parent_url, version->enclosure.url);
+    resolved_url = url_merge(handle, parent_url, version->enclosure.url);
+    if(!resolved_url) {
+      sxupdate_log_error(handle, "url.merge", "Unable to merge urls: %s + %s", parent_url, version->enclosure.url);
+      next(handle, sxupdate_status_error, NULL);
+      return;
+    }
+  } else
+    resolved_url = version->enclosure.url;
+
+  enum sxupdate_status stat = sxupdate_status_error;
+  char *save_path = sxupdate_get_installer_download_path(handle, version->enclosure.filename);
+
+  // rebuild it from local blocks if it has block checksums; if that fails, download it in full
+  if(save_path && !handle->download.from_peer && sxupdate_delta_wanted(handle)) {
+    char *blocks_url = sxupdate_is_relative_filename(version->enclosure.blocks)
+      ? url_merge(handle, parent_url, version->enclosure.blocks) : sxupdate_mem_strdup(version->enclosure.blocks);
+    handle->download.hashed = 0;
+    handle->download.from_delta = blocks_url
+      && sxupdate_delta_download(handle, blocks_url, resolved_url, save_path) == sxupdate_status_ok;
+    sxupdate_mem_free(blocks_url);
+    if(handle->download.from_delta) {
+      if(resolved_url != version->enclosure.url)
+        sxupdate_mem_free(resolved_url);
+      next(handle, sxupdate_status_ok, save_path);
+      return;
+    }
+  }
+
+  // download to temp file
+  if(!save_path)
+    stat = sxupdate_status_memory;
+  else {
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "download.start",
+                    ((const struct sxupdate_log_field[]){ { "url", resolved_url }, { "path", save_path }, { NULL, NULL } }),
+                    "Downloading to %s from %s", save_path, resolved_url);
+    // write from io_uring or a thread if asked to, so that receiving and writing overlap
+    int err = 0;
+    if(handle->write.async) {
+      int flags = handle->write.direct_min_bytes && (long long)version->enclosure.length >= handle->write.direct_min_bytes
+        ? SXUPDATE_SINK_DIRECT : 0;
+      if(handle->qos.idle_io)
+        flags |= SXUPDATE_SINK_IDLE_IO;
+      if((err = sxupdate_sink_open(save_path, flags, &handle->download.sink)))
+        sxupdate_log_debug(handle, "download.sink", "Writing %s with stdio: %s", save_path, strerror(err));
+    }
+    if(!handle->download.sink && !(handle->download.f = fopen(save_path, "wb")))
+      sxupdate_log_error(handle, "download.open", "%s: %s", save_path, strerror(errno));
     else {
       // initialize curl
       CURL *curl = curl_easy_init();
-      if(!curl)
+      struct sxupdate_codec *decoder = NULL;
+      if(!curl || (encoding != sxupdate_encoding_identity && !(decoder = sxupdate_decoder_new(encoding)))) {
         stat = sxupdate_status_memory;
-      else {
+        if(curl)
+          curl_easy_cleanup(curl);
+        sxupdate_download_close(handle);
+      } else {
         curl_easy_setopt(curl, CURLOPT_URL, resolved_url);
 
-        // set custom headers
-        if(http_headers)
-          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, http_headers);
+        handle->download.max_bytes = 0;
+        if(handle->download.from_peer) {
+          // custom headers may hold origin credentials, so never send them to a peer.
+          // Give up quickly on a dead or stalled peer, so the origin fallback is not delayed
+          curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2000L);
+          curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+          curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
+          // bound what a peer sends, whether it gives a length or not (if encoded, the
+          // enclosure length is that of the compressed file, which the peer does not hold)
+          handle->download.max_bytes = version->enclosure.length && !version->enclosure.encoding
+            ? (long long)version->enclosure.length : SXUPDATE_PEER_MAX_BYTES;
+          curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)handle->download.max_bytes);
+        } else {
+          if(http_headers) // set custom headers
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, http_headers);
+          sxupdate_set_limits(handle, curl, 0);
+        }
+
+        sxupdate_qos_curl(handle, curl, 1);
 
         // to do: add option for custom progress reporting
 
         // set write to temp file
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, handle);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sxupdate_download_chunk);
+
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, handle);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, sxupdate_download_progress);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 
 #ifdef _WIN32
         // if(no_verify)
@@ -405,71 +1754,337 @@ static enum sxupdate_status sxupdate_download(sxupdate_t handle,
 #endif
 
         // connect and download
-        CURLcode res = curl_easy_perform(curl);
-        if((sxupdate_url_is_file(resolved_url)))
-          handle->http_code = 200;
-        else
-          curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &handle->http_code);
-        stat = sxupdate_status_error;
-        if(res != CURLE_OK)
-          sxupdate_printerr("Error connecting to %s:\n  %s", resolved_url, curl_easy_strerror(res));
-        else if(handle->http_code >= 200 && handle->http_code < 300)
-          stat = sxupdate_status_ok;
-        if(verbosity > 2)
-          sxupdate_verbose("cleaning up curl call");
+        handle->download.save_path = save_path;
+        handle->download.resolved_url = resolved_url;
+        handle->download.decoder = decoder;
+        handle->download.hashed = 0;
+        handle->download.received = 0;
+#ifndef NO_SIGNATURE
+        SHA256_Init(&handle->download.sha256);
+#endif
+        if((stat = sxupdate_transfer_start(handle, curl, sxupdate_download_done)) == sxupdate_status_ok)
+          return; // sxupdate_download_done() takes it from here
+
         curl_easy_cleanup(curl);
+        sxupdate_codec_free(decoder);
+        sxupdate_download_close(handle);
+        handle->download.save_path = NULL;
+        handle->download.resolved_url = NULL;
+        handle->download.decoder = NULL;
       }
-      fclose(f);
     }
   }
 
-  if(stat != sxupdate_status_ok)
-    free(save_path);
+  if(save_path) // created empty by sxupdate_get_installer_download_path()
+    remove(save_path);
+  sxupdate_mem_free(save_path);
+  if(resolved_url != version->enclosure.url)
+    sxupdate_mem_free(resolved_url);
+
+  next(handle, stat, NULL);
+}
+
+static void sxupdate_batch_next(sxupdate_t handle);
+
+static void sxupdate_finish(sxupdate_t handle, enum sxupdate_status stat) {
+  sxupdate_flight_unlock(&handle->flight.installer_lock);
+  sxupdate_ring_phase(handle, sxupdate_phase_done, stat);
+  if(handle->completion_handler)
+    handle->completion_handler(handle, stat);
+  if(handle->batch.current)
+    sxupdate_batch_next(handle);
+}
+
+static void sxupdate_after_download(sxupdate_t handle, enum sxupdate_status stat,
+                                    char *downloaded_file_path);
+static void sxupdate_stage_resume(sxupdate_t handle, enum sxupdate_action action);
+
+/***
+ * Pause at stage, if the caller has a stage handler: it then owns path, until it resumes
+ * @return non-zero if paused
+ */
+static int sxupdate_stage_pause(sxupdate_t handle, enum sxupdate_stage stage, char *path) {
+  if(!handle->stage_handler)
+    return 0;
+  handle->stage.current = stage;
+  handle->stage.path = path;
+  handle->stage_handler(handle, stage, path, sxupdate_stage_resume);
+  return 1;
+}
+
+/* run the verified installer, then finish */
+static void sxupdate_install(sxupdate_t handle, char *installer) {
+  enum sxupdate_status stat = sxupdate_status_ok;
+  sxupdate_ring_phase(handle, sxupdate_phase_installing, stat);
+  double start = sxupdate_clock_now();
+  if(fork_and_exit(handle, installer, handle->installer_args))
+    stat = sxupdate_status_error;
+  handle->stats.spawn = sxupdate_clock_now() - start;
+  sxupdate_mem_free(installer);
+  sxupdate_finish(handle, stat);
+}
+
+static void sxupdate_verify_download(sxupdate_t handle, enum sxupdate_status stat,
+                                     char *downloaded_file_path) {
+  if(stat == sxupdate_status_ok) {
+    // TO DO: check download file size
+
+    // check signature
+    sxupdate_ring_phase(handle, sxupdate_phase_verifying, stat);
+    stat = sxupdate_verify_signature(handle, downloaded_file_path);
+    if(stat == sxupdate_status_ok)
+      sxupdate_ring_phase(handle, sxupdate_phase_verified, stat);
+  }
+
+  if(stat != sxupdate_status_ok
+     && (handle->download.from_peer || handle->download.from_cache || handle->download.from_delta
+         || handle->download.from_flight)) {
+    // the peer, prefetched, rebuilt or shared copy could not be obtained or did not verify: download it in full
+    if(handle->download.from_cache)
+      sxupdate_log_warning(handle, "background.fallback", "Unable to use prefetched installer; downloading from origin");
+    else if(handle->download.from_flight)
+      sxupdate_log_warning(handle, "flight.fallback", "Unable to use the installer another process downloaded; downloading it");
+    else if(handle->download.from_delta)
+      sxupdate_log_warning(handle, "delta.fallback", "Unable to use the rebuilt installer; downloading it in full");
+    else
+      sxupdate_log_warning(handle, "peer.fallback", "Unable to use peer copy; downloading from origin");
+    if(downloaded_file_path)
+      remove(downloaded_file_path);
+    sxupdate_mem_free(downloaded_file_path);
+    handle->download.no_peer = 1;
+    handle->download.from_cache = 0;
+    if(handle->download.from_delta)
+      handle->download.no_delta = 1;
+    handle->download.from_delta = 0;
+    if(handle->download.from_flight)
+      handle->download.no_flight = 1;
+    handle->download.from_flight = 0;
+    sxupdate_download(handle, sxupdate_after_download);
+    return;
+  }
+
+  if(stat == sxupdate_status_ok) {
+    // only a verified installer gets a name it could be run by
+    if(!handle->download.from_cache)
+      sxupdate_publish_download(handle, &downloaded_file_path, handle->latest_version.enclosure.filename);
+    if(handle->flight.installer_lock >= 0) { // downloaded for the other processes too
+      char *key = sxupdate_flight_installer_key(handle);
+      if(key)
+        sxupdate_flight_share_installer(handle, handle->flight.dir, downloaded_file_path, key);
+      sxupdate_mem_free(key);
+      sxupdate_flight_unlock(&handle->flight.installer_lock);
+    }
+#ifndef NO_SIGNATURE
+    sxupdate_peer_publish(handle, downloaded_file_path);
+#endif
+    sxupdate_delta_keep(handle, downloaded_file_path);
+    if(!sxupdate_stage_pause(handle, sxupdate_stage_verified, downloaded_file_path))
+      sxupdate_install(handle, downloaded_file_path);
+    return;
+  }
+  if(downloaded_file_path) // not verified, so never to be run
+    remove(downloaded_file_path);
+  sxupdate_mem_free(downloaded_file_path);
+  sxupdate_finish(handle, stat);
+}
+
+static void sxupdate_stage_resume(sxupdate_t handle, enum sxupdate_action action) {
+  // may be called after the stage handler has returned
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  enum sxupdate_stage stage = handle->stage.current;
+  char *path = handle->stage.path;
+  handle->stage.current = sxupdate_stage_none;
+  handle->stage.path = NULL;
+  if(!path)
+    ; // not paused, or already resumed
+  else if(action != sxupdate_action_proceed) {
+    if(stage == sxupdate_stage_downloaded) // never to be run, as it was not verified
+      remove(path);
+    sxupdate_mem_free(path);
+    sxupdate_finish(handle, sxupdate_status_ok);
+  } else if(stage == sxupdate_stage_downloaded)
+    sxupdate_verify_download(handle, sxupdate_status_ok, path);
   else
-    *save_path_p = save_path;
+    sxupdate_install(handle, path);
+  sxupdate_mem_leave(previous);
+}
 
-  if(resolved_url != version->enclosure.url)
-    free(resolved_url);
+static void sxupdate_after_download(sxupdate_t handle, enum sxupdate_status stat,
+                                    char *downloaded_file_path) {
+  if(stat == sxupdate_status_ok &&
+     // ensure saved_path has executable permissions
+     sxupdate_set_execute_permission(handle, downloaded_file_path))
+    stat = sxupdate_status_error;
+  if(stat == sxupdate_status_ok)
+    sxupdate_ring_phase(handle, sxupdate_phase_downloaded, stat);
+  if(stat != sxupdate_status_ok || !sxupdate_stage_pause(handle, sxupdate_stage_downloaded, downloaded_file_path))
+    sxupdate_verify_download(handle, stat, downloaded_file_path);
+}
 
-  return stat;
+/***
+ * Install the result of the speculative download, once the user has proceeded
+ */
+static void sxupdate_speculative_install(sxupdate_t handle) {
+  handle->stats.download_wait = sxupdate_clock_now() - handle->speculative.answered_at;
+  char *path = handle->speculative.path;
+  handle->speculative.path = NULL;
+  handle->speculative.started = 0;
+  handle->speculative.done = 0;
+  handle->speculative.proceed = 0;
+  sxupdate_log_info(handle, "speculative.use", "Using the installer downloaded while waiting (waited %.3fs)",
+                    handle->stats.download_wait);
+  sxupdate_after_download(handle, handle->speculative.stat, path);
+}
+
+static void sxupdate_speculative_done(sxupdate_t handle, enum sxupdate_status stat, char *path) {
+  handle->speculative.stat = stat;
+  handle->speculative.path = path;
+  handle->speculative.done = 1;
+  if(handle->speculative.proceed) // the user is already waiting for it
+    sxupdate_speculative_install(handle);
+}
+
+#ifndef _WIN32
+static void *sxupdate_speculative_run(void *h) {
+  sxupdate_t handle = h;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_qos_lower(handle); // this thread is only used for the download
+  sxupdate_download(handle, sxupdate_speculative_done);
+  sxupdate_mem_leave(previous);
+  return NULL;
+}
+#endif
+
+/***
+ * Start downloading the newer installer before the user has answered
+ */
+static void sxupdate_speculative_start(sxupdate_t handle) {
+  handle->speculative.cancel = 0;
+  handle->speculative.done = 0;
+  handle->speculative.proceed = 0;
+  handle->speculative.started = 1;
+  sxupdate_log_info(handle, "speculative.start", "Downloading the installer while waiting for an answer");
+  if(handle->event.multi)
+    sxupdate_download(handle, sxupdate_speculative_done);
+#ifndef _WIN32
+  else if(pthread_create(&handle->speculative.thread, NULL, sxupdate_speculative_run, handle)) {
+    sxupdate_log_warning(handle, "speculative.thread", "Unable to start download thread; downloading once the user proceeds");
+    handle->speculative.started = 0;
+  }
+#else
+  else
+    handle->speculative.started = 0; // no download thread: download once the user proceeds
+#endif
+}
+
+/***
+ * The user has proceeded: wait for the rest of the speculative download, then install it
+ */
+static void sxupdate_speculative_proceed(sxupdate_t handle) {
+  handle->speculative.answered_at = sxupdate_clock_now();
+  if(handle->event.multi) {
+    if(!handle->speculative.done) {
+      handle->speculative.proceed = 1; // sxupdate_speculative_done() takes it from here
+      return;
+    }
+  }
+#ifndef _WIN32
+  else
+    pthread_join(handle->speculative.thread, NULL);
+#endif
+  sxupdate_speculative_install(handle);
+}
+
+/***
+ * Update the install dir from the manifest of the newer version, instead of running an
+ * installer
+ */
+static void sxupdate_manifest_update(sxupdate_t handle) {
+  const char *parent_url = handle->shard.url ? handle->shard.url : handle->url;
+  const char *url = handle->latest_version.manifest.url;
+  char *manifest_url = sxupdate_is_relative_filename(url) ? url_merge(handle, parent_url, url)
+    : sxupdate_mem_strdup(url);
+  char *objects_url = manifest_url ? url_merge(handle, manifest_url, SXUPDATE_MANIFEST_OBJECTS) : NULL;
+  char *path = sxupdate_get_installer_download_path(handle, SXUPDATE_MANIFEST_FILENAME);
+  struct sxupdate_manifest manifest = { 0 };
+  enum sxupdate_status stat = sxupdate_status_memory;
+  int err;
+  if(manifest_url && objects_url && path) {
+    handle->download.hashed = 0;
+    if((stat = sxupdate_manifest_fetch(handle, manifest_url, path)) == sxupdate_status_ok
+       && (stat = sxupdate_verify_signature(handle, path)) == sxupdate_status_ok) {
+      if((err = sxupdate_manifest_read(path, &manifest))) {
+        sxupdate_log_error(handle, "manifest.invalid", "%s: %s", manifest_url,
+                           err == EINVAL ? "not a valid manifest" : strerror(err));
+        stat = sxupdate_status_error;
+      } else
+        stat = sxupdate_manifest_apply(handle, &manifest, handle->install_dir, objects_url);
+    }
+  }
+  if(path)
+    remove(path);
+  sxupdate_manifest_free(&manifest);
+  sxupdate_mem_free(path);
+  sxupdate_mem_free(objects_url);
+  sxupdate_mem_free(manifest_url);
+  sxupdate_finish(handle, stat);
 }
 
 static void sxupdate_resume(sxupdate_t handle, enum sxupdate_action action) {
-  enum sxupdate_status stat = sxupdate_status_ok;
+  // may be called after the interaction handler has returned
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
   if(action == sxupdate_action_proceed && handle->step == sxupdate_step_have_newer_version) {
-    char *downloaded_file_path;
-    stat = sxupdate_download(handle, &downloaded_file_path);
-    if(stat == sxupdate_status_ok &&
-       // ensure saved_path has executable permissions
-       sxupdate_set_execute_permission(downloaded_file_path))
-      stat = sxupdate_status_error;
-    if(stat == sxupdate_status_ok) {
-      // TO DO: check download file size
-
-      // check signature
-      stat = sxupdate_verify_signature(handle, downloaded_file_path);
-      if(stat == sxupdate_status_ok) {
-        if(fork_and_exit(downloaded_file_path, handle->installer_args, handle->verbosity))
-          stat = sxupdate_status_error;
-      }
+    if(sxupdate_manifest_wanted(handle))
+      sxupdate_manifest_update(handle);
+    else if(handle->speculative.started)
+      sxupdate_speculative_proceed(handle);
+    else if(handle->background.installer) { // prefetched by the background check
+      char *installer = handle->background.installer;
+      handle->background.installer = NULL;
+      handle->download.no_peer = 0;
+      handle->download.from_cache = 1;
+      sxupdate_after_download(handle, sxupdate_status_ok, installer);
+    } else {
+      handle->download.no_peer = 0;
+      sxupdate_download(handle, sxupdate_after_download);
     }
-    free(downloaded_file_path);
+  } else {
+    sxupdate_speculative_cancel(handle);
+    sxupdate_finish(handle, sxupdate_status_ok);
   }
+  sxupdate_mem_leave(previous);
 }
 
 static void sxupdate_after_fetch_and_parse(sxupdate_t handle, enum sxupdate_status stat) {
+  struct sxupdate_batch_product *product = handle->batch.current;
   if(stat == sxupdate_status_ok) {
     handle->http_code = 0;
+    if(handle->state.path && !handle->state.fresh && !handle->background.from_result
+       && !handle->flight.from_result && !product)
+      sxupdate_state_save(handle);
 
     // check if this version is newer
-    if(sxupdate_version_cmp(handle->latest_version.version, handle->get_current_version(), handle->verbosity) > 0)
+    double start = sxupdate_clock_now();
+    struct sxupdate_semantic_version current =
+      product ? product->current_version : handle->get_current_version();
+    if(sxupdate_version_cmp(handle, handle->latest_version.version, current) > 0)
       handle->step = sxupdate_step_have_newer_version;
     else
       handle->step = sxupdate_step_already_up_to_date;
+    handle->stats.version_compare = sxupdate_clock_now() - start;
+    sxupdate_ring_phase(handle, sxupdate_phase_checked, stat);
+
+    if(handle->step == sxupdate_step_have_newer_version && handle->speculative.enabled
+       && !handle->background.installer && !sxupdate_manifest_wanted(handle))
+      sxupdate_speculative_start(handle);
 
     // execute callback and proceed if it returns sxupdate_action_do_update
-    handle->interaction_handler(handle, handle->step, sxupdate_resume);
-  }
+    if(product)
+      product->interaction_handler(handle, handle->step, sxupdate_resume);
+    else
+      handle->interaction_handler(handle, handle->step, sxupdate_resume);
+  } else
+    sxupdate_finish(handle, stat);
 }
 
 /***
@@ -481,6 +2096,333 @@ const struct sxupdate_version *sxupdate_get_version(sxupdate_t handle) {
   return &handle->latest_version;
 }
 
+/* release the latest version, and what was derived from it */
+static void sxupdate_clear_version(sxupdate_t handle) {
+  sxupdate_version_free(handle, &handle->latest_version);
+  memset(&handle->latest_version, 0, sizeof(handle->latest_version));
+#ifndef NO_SIGNATURE
+  sxupdate_mem_free(handle->latest_version_internal.signature);
+  memset(&handle->latest_version_internal, 0, sizeof(handle->latest_version_internal));
+#endif
+  handle->step = sxupdate_step_none;
+  handle->err_msg = NULL;
+  handle->download.from_peer = 0;
+  handle->download.no_peer = 0;
+  handle->download.from_cache = 0;
+  handle->download.from_delta = 0;
+  handle->download.no_delta = 0;
+  handle->download.from_flight = 0;
+  handle->download.no_flight = 0;
+  handle->download.hashed = 0;
+}
+
+/***
+ * Release the results of the previous check, keeping the configuration
+ */
+static void sxupdate_clear_check(sxupdate_t handle) {
+  sxupdate_stage_release(handle);
+  sxupdate_batch_free(handle);
+  sxupdate_clear_version(handle);
+  sxupdate_parse_reset(handle); // after the versions, which may point into a mapped appcast
+  handle->http_code = 0;
+  handle->fetch_url = NULL;
+  sxupdate_mem_free(handle->background.installer);
+  handle->background.installer = NULL;
+  handle->background.from_result = 0;
+  handle->flight.from_result = 0;
+  if(handle->state.headers)
+    curl_slist_free_all(handle->state.headers);
+  handle->state.headers = NULL;
+  *handle->state.etag = '\0';
+  *handle->state.last_modified = '\0';
+  handle->state.have_record = 0;
+  handle->state.conditional = 0;
+  handle->state.not_modified = 0;
+  handle->state.fresh = 0;
+  memset(&handle->stats, 0, sizeof(handle->stats));
+  handle->fetch.deadline = handle->fetch.deadline_ms
+    ? sxupdate_clock_now() + handle->fetch.deadline_ms / 1000.0 : 0;
+}
+
+/***
+ * Batch check: take the next product, with its item from the catalog, through the same
+ * steps as a single check. Ends the batch once every product has completed
+ */
+static void sxupdate_batch_next(sxupdate_t handle) {
+  // a product that completes before the handler of the next one has been called, e.g.
+  // because its handler resumed straight away, only flags it: products are taken in a
+  // loop, so that the stack does not grow with their number
+  if(handle->batch.running) {
+    handle->batch.advance = 1;
+    return;
+  }
+  handle->batch.running = 1;
+  do {
+    handle->batch.advance = 0;
+    if(handle->batch.next == handle->batch.count) {
+      sxupdate_batch_free(handle);
+      return;
+    }
+    struct sxupdate_batch_product *product = &handle->batch.products[handle->batch.next++];
+    handle->batch.current = product;
+    sxupdate_clear_version(handle);
+    handle->latest_version = product->version;
+    memset(&product->version, 0, sizeof(product->version));
+
+    enum sxupdate_status stat = handle->batch.stat;
+    handle->rollout.held = product->held;
+    if(stat == sxupdate_status_ok && !product->got_version && !product->held) {
+      sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "batch.missing",
+                      ((const struct sxupdate_log_field[]){ { "product", product->id }, { NULL, NULL } }),
+                      "Product %s is not in the catalog", product->id);
+      stat = sxupdate_status_error;
+    } else if(stat == sxupdate_status_ok && !sxupdate_parse_ok(handle))
+      stat = sxupdate_status_error;
+    sxupdate_after_fetch_and_parse(handle, stat);
+  } while(handle->batch.advance);
+  handle->batch.running = 0;
+}
+
+static void sxupdate_batch_after_fetch(sxupdate_t handle, enum sxupdate_status stat) {
+  handle->batch.stat = stat;
+  handle->batch.next = 0;
+  sxupdate_batch_next(handle);
+}
+
+/***
+ * Release the results of the previous check, keeping the configuration
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_reset(sxupdate_t handle) {
+  // the user never answered: the speculative download is no longer wanted
+  sxupdate_speculative_cancel(handle);
+  if(handle->event.curl) {
+    sxupdate_log_error(handle, "reset.busy", "Cannot reset while a transfer is in progress");
+    return sxupdate_status_error;
+  }
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_clear_check(handle);
+  sxupdate_mem_leave(previous);
+  return sxupdate_status_ok;
+}
+
+/***
+ * Background check, in the helper process: keep the installer if it verifies, then
+ * record the result
+ */
+static void sxupdate_background_after_download(sxupdate_t handle, enum sxupdate_status stat,
+                                               char *downloaded_file_path) {
+  char *installer = sxupdate_background_path(handle->background.dir, SXUPDATE_BACKGROUND_INSTALLER);
+  if(stat == sxupdate_status_ok
+     && (!installer
+         || sxupdate_set_execute_permission(handle, downloaded_file_path)
+         || sxupdate_verify_signature(handle, downloaded_file_path) != sxupdate_status_ok
+         || rename(downloaded_file_path, installer)))
+    stat = sxupdate_status_error;
+  if(downloaded_file_path && stat != sxupdate_status_ok)
+    remove(downloaded_file_path);
+  sxupdate_background_write_result(handle, handle->background.dir, handle->url,
+                                   handle->shard.url ? handle->shard.url : handle->url,
+                                   stat == sxupdate_status_ok);
+  sxupdate_mem_free(downloaded_file_path);
+  sxupdate_mem_free(installer);
+}
+
+/***
+ * Background check, in the helper process: keep the appcast, then prefetch the installer
+ * if it is newer and prefetching is enabled
+ */
+static void sxupdate_background_after_fetch(sxupdate_t handle, enum sxupdate_status stat) {
+  char *appcast = sxupdate_background_path(handle->background.dir, SXUPDATE_BACKGROUND_APPCAST);
+  char *tmp = sxupdate_background_path(handle->background.dir, SXUPDATE_BACKGROUND_APPCAST ".tmp");
+  if(!handle->background.appcast || fclose(handle->background.appcast))
+    stat = sxupdate_status_error;
+  handle->background.appcast = NULL;
+  if(stat == sxupdate_status_ok && (!appcast || !tmp || rename(tmp, appcast)))
+    stat = sxupdate_status_error;
+
+  if(stat != sxupdate_status_ok) {
+    if(tmp)
+      remove(tmp);
+  } else {
+    if(handle->state.path)
+      sxupdate_state_save(handle);
+    if(handle->background.prefetch && !sxupdate_manifest_wanted(handle)
+       && sxupdate_version_cmp(handle, handle->latest_version.version, handle->get_current_version()) > 0)
+      sxupdate_download(handle, sxupdate_background_after_download);
+    else
+      sxupdate_background_write_result(handle, handle->background.dir, handle->url,
+                                       handle->shard.url ? handle->shard.url : handle->url, 0);
+  }
+  sxupdate_mem_free(appcast);
+  sxupdate_mem_free(tmp);
+}
+
+/***
+ * Body of the background helper process
+ */
+static void sxupdate_background_check(sxupdate_t handle) {
+  // the caller's event loop and its sockets stay with the caller, and its callbacks may
+  // not be safe to call from here, so only get_current_version is used
+  handle->event.multi = NULL;
+  handle->event.curl = NULL;
+  handle->log.sink = NULL;
+  sxupdate_qos_lower(handle); // the whole helper process is in the background
+  sxupdate_clear_check(handle);
+  handle->download.no_peer = 1;
+  handle->download.dir = handle->background.dir;
+
+  char *tmp = sxupdate_background_path(handle->background.dir, SXUPDATE_BACKGROUND_APPCAST ".tmp");
+  if(tmp
+#ifndef NO_SIGNATURE
+     && sxupdate_load_public_key(handle) == sxupdate_status_ok
+#endif
+     && (handle->background.appcast = fopen(tmp, "wb")))
+    sxupdate_fetch_and_parse(handle, handle->http_headers, sxupdate_background_after_fetch);
+  sxupdate_mem_free(tmp);
+}
+
+/* take the url an appcast kept by another process was fetched from: the url, or its
+   shard if the url serves an index */
+static void sxupdate_use_base_url(sxupdate_t handle, char *base_url) {
+  if(!strcmp(base_url, handle->url)) {
+    sxupdate_mem_free(base_url);
+    handle->fetch_url = handle->url;
+  } else {
+    if(handle->shard.url && !strcmp(base_url, handle->shard.url))
+      sxupdate_mem_free(base_url);
+    else {
+      sxupdate_shard_forget(handle);
+      handle->shard.url = base_url; // not read from the index by this process, so not fresh
+    }
+    handle->fetch_url = handle->shard.url;
+  }
+}
+
+/* parse <dir>/<name>, an appcast kept by another process */
+static enum sxupdate_status sxupdate_parse_kept(sxupdate_t handle, const char *dir, const char *name) {
+  char *appcast = sxupdate_background_path(dir, name);
+  enum sxupdate_status stat = sxupdate_status_error;
+  if(appcast && (stat = sxupdate_parse_init(handle)) == sxupdate_status_ok) {
+    if(sxupdate_parse_map(handle, appcast))
+      stat = sxupdate_status_error;
+    else
+      sxupdate_parse_chunk(handle->parser.document, 1, handle->parser.document_len, handle);
+  }
+  sxupdate_mem_free(appcast);
+  return stat;
+}
+
+/***
+ * If a background check has left a result, run the interaction handler with it, using
+ * the installer it prefetched, if any, instead of downloading it
+ *
+ * @return non-zero if there was a result
+ */
+static int sxupdate_background_use(sxupdate_t handle, enum sxupdate_status *stat) {
+  int prefetched = 0;
+  char *base_url = NULL;
+  if(sxupdate_background_take_result(handle, handle->background.dir, handle->url, &prefetched,
+                                     &base_url))
+    return 0;
+
+  // the appcast the helper kept is its shard, if the url serves an index
+  sxupdate_use_base_url(handle, base_url);
+  handle->background.from_result = 1;
+#ifndef NO_SIGNATURE
+  if((*stat = sxupdate_load_public_key(handle)) == sxupdate_status_ok)
+#endif
+    *stat = sxupdate_parse_kept(handle, handle->background.dir, SXUPDATE_BACKGROUND_APPCAST);
+
+  if(*stat == sxupdate_status_ok && prefetched
+     && !(handle->background.installer = sxupdate_background_path(handle->background.dir,
+                                                                  SXUPDATE_BACKGROUND_INSTALLER)))
+    *stat = sxupdate_status_memory;
+  *stat = sxupdate_after_parse(handle, *stat, sxupdate_after_fetch_and_parse);
+  return 1;
+}
+
+/***
+ * Single flight: if another process is fetching the appcast, wait for it and parse the copy
+ * it leaves; else take the lock and fetch it for the others too (see
+ * sxupdate_flight_after_fetch())
+ *
+ * @return non-zero if the check was completed from another process's result
+ */
+static int sxupdate_flight_use(sxupdate_t handle, enum sxupdate_status *stat) {
+  if(handle->event.multi || handle->batch.current)
+    return 0;
+
+  time_t since = time(NULL) - handle->flight.max_age;
+  int lock = sxupdate_flight_lock(handle->flight.dir, SXUPDATE_FLIGHT_APPCAST_LOCK, 0);
+  if(lock < 0) {
+    if(handle->flight.no_wait) {
+      sxupdate_log_info(handle, "flight.busy", "Another process is checking for updates");
+      *stat = sxupdate_status_ok;
+      sxupdate_finish(handle, *stat);
+      return 1;
+    }
+    sxupdate_log_debug(handle, "flight.wait", "Waiting for another process to fetch the version info");
+    lock = sxupdate_flight_lock(handle->flight.dir, SXUPDATE_FLIGHT_APPCAST_LOCK, handle->flight.wait_ms);
+  }
+
+  char *base_url = NULL;
+  if(!sxupdate_flight_read_result(handle, handle->flight.dir, handle->url, since, &base_url)) {
+    sxupdate_flight_unlock(&lock);
+    sxupdate_use_base_url(handle, base_url);
+    handle->flight.from_result = 1;
+    *stat = sxupdate_parse_kept(handle, handle->flight.dir, SXUPDATE_FLIGHT_APPCAST);
+    *stat = sxupdate_after_parse(handle, *stat, sxupdate_after_fetch_and_parse);
+    return 1;
+  }
+
+  if(lock < 0)
+    sxupdate_log_warning(handle, "flight.timeout", "Gave up waiting for another process; fetching the version info");
+  else { // fetch it for the others
+    handle->flight.appcast_lock = lock;
+    char *tmp = sxupdate_appcast_copy_path(handle);
+    if(!tmp || !(handle->background.appcast = fopen(tmp, "wb")))
+      sxupdate_flight_unlock(&handle->flight.appcast_lock);
+    sxupdate_mem_free(tmp);
+  }
+  return 0;
+}
+
+/***
+ * Single flight, in the process that fetched the appcast: leave it for the others, then
+ * carry on as usual
+ */
+static void sxupdate_flight_after_fetch(sxupdate_t handle, enum sxupdate_status stat) {
+  char *appcast = sxupdate_background_path(handle->flight.dir, SXUPDATE_FLIGHT_APPCAST);
+  char *tmp = sxupdate_appcast_copy_path(handle);
+  int err = handle->background.appcast ? fclose(handle->background.appcast) : -1;
+  handle->background.appcast = NULL;
+  if(appcast && tmp) {
+    // an unchanged appcast was not received, so there is nothing to share
+    if(stat == sxupdate_status_ok && !err && !handle->state.not_modified && !rename(tmp, appcast))
+      sxupdate_flight_write_result(handle, handle->flight.dir, handle->url,
+                                   handle->shard.url ? handle->shard.url : handle->url);
+    else
+      remove(tmp);
+  }
+  sxupdate_mem_free(appcast);
+  sxupdate_mem_free(tmp);
+  sxupdate_flight_unlock(&handle->flight.appcast_lock);
+  sxupdate_after_fetch_and_parse(handle, stat);
+}
+
+/***
+ * Start a background check, and finish at once
+ */
+static enum sxupdate_status sxupdate_background_start(sxupdate_t handle) {
+  int err = sxupdate_background_spawn(handle, handle->background.dir, sxupdate_background_check);
+  if(err) {
+    sxupdate_log_error(handle, "background.spawn", "Unable to start background check: %s", strerror(err));
+    return sxupdate_status_error;
+  }
+  sxupdate_finish(handle, sxupdate_status_ok);
+  return sxupdate_status_ok;
+}
+
 /***
  * Execute the update
  *
@@ -489,15 +2431,162 @@ const struct sxupdate_version *sxupdate_get_version(sxupdate_t handle) {
 SXUPDATE_API enum sxupdate_status sxupdate_execute(sxupdate_t handle) {
   enum sxupdate_status stat;
 
+  // release the results of any previous check
+  if((stat = sxupdate_reset(handle)) != sxupdate_status_ok)
+    return stat;
+
   // make sure our handle is prepared
   if((stat = sxupdate_ready(handle)) == sxupdate_status_ok) {
 
-    // fetch the update metadata
-    stat = sxupdate_fetch_and_parse(handle, handle->http_headers, sxupdate_after_fetch_and_parse);
+    struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+    sxupdate_ring_phase(handle, sxupdate_phase_checking, stat);
+    if(handle->background.dir && sxupdate_background_use(handle, &stat))
+      ; // the handlers have run with the result of the last background check
+    else if(handle->state.path && sxupdate_state_fresh(handle))
+      // checked recently: skip the fetch, and curl and OpenSSL altogether
+      sxupdate_after_fetch_and_parse(handle, sxupdate_status_ok);
+    else if(handle->background.dir)
+      stat = sxupdate_background_start(handle);
+#ifndef NO_SIGNATURE
+    else if((stat = sxupdate_load_public_key(handle)) != sxupdate_status_ok)
+      ;
+#endif
+    else if(handle->flight.dir && sxupdate_flight_use(handle, &stat))
+      ; // another process fetched the appcast for this one
+    else if(handle->flight.appcast_lock >= 0) { // fetch it for the other processes too
+      stat = sxupdate_fetch_and_parse(handle, handle->http_headers, sxupdate_flight_after_fetch);
+      if(handle->flight.appcast_lock >= 0) { // failed before it was fetched
+        if(handle->background.appcast)
+          fclose(handle->background.appcast);
+        handle->background.appcast = NULL;
+        char *tmp = sxupdate_appcast_copy_path(handle);
+        if(tmp)
+          remove(tmp);
+        sxupdate_mem_free(tmp);
+        sxupdate_flight_unlock(&handle->flight.appcast_lock);
+      }
+    } else // fetch the update metadata
+      stat = sxupdate_fetch_and_parse(handle, handle->http_headers, sxupdate_after_fetch_and_parse);
+    sxupdate_mem_leave(previous);
+  }
+  return stat;
+}
+
+/***
+ * Check many products with one fetch and parse of a catalog
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_execute_batch(sxupdate_t handle,
+                                                         const struct sxupdate_product *products,
+                                                         size_t count) {
+  enum sxupdate_status stat;
+
+  // release the results of any previous check
+  if((stat = sxupdate_reset(handle)) != sxupdate_status_ok)
+    return stat;
+  if(!products || !count)
+    return sxupdate_status_invalid;
+  for(size_t i = 0; i < count; i++)
+    if(!products[i].id || !products[i].interaction_handler)
+      return sxupdate_status_invalid;
+
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(handle->mem);
+  sxupdate_ring_phase(handle, sxupdate_phase_checking, stat);
+  if((stat = sxupdate_batch_init(handle, products, count)) == sxupdate_status_ok
+     && (stat = sxupdate_ready(handle)) == sxupdate_status_ok
+#ifndef NO_SIGNATURE
+     && (stat = sxupdate_load_public_key(handle)) == sxupdate_status_ok
+#endif
+     )
+    stat = sxupdate_fetch_and_parse(handle, handle->http_headers, sxupdate_batch_after_fetch);
+  if(stat != sxupdate_status_ok && !handle->batch.current)
+    sxupdate_batch_free(handle); // the catalog was never fetched
+  sxupdate_mem_leave(previous);
+  return stat;
+}
+
+/***
+ * During a batch check, the product the handlers are called for
+ */
+SXUPDATE_API const char *sxupdate_get_product_id(sxupdate_t handle) {
+  return handle->batch.current ? handle->batch.current->id : NULL;
+}
+
+#define SXUPDATE_STOP_POLL_MS 100
+
+static int sxupdate_stopped(sxupdate_t handle) {
+  return __atomic_load_n(&handle->stop, __ATOMIC_RELAXED);
+}
+
+/* sleep until the given sxupdate_clock_now() time, waking early if sxupdate_stop() is called */
+static void sxupdate_wait_until(sxupdate_t handle, double until) {
+  double now;
+  while(!sxupdate_stopped(handle) && (now = sxupdate_clock_now()) < until) {
+    long ms = (long)((until - now) * 1000) + 1;
+    if(ms > SXUPDATE_STOP_POLL_MS)
+      ms = SXUPDATE_STOP_POLL_MS;
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+#endif
+  }
+}
+
+/***
+ * Check for updates repeatedly, reusing the handle's configuration, key and connections
+ */
+SXUPDATE_API enum sxupdate_status sxupdate_run_periodic(sxupdate_t handle,
+                                                        const struct sxupdate_periodic_options *opts) {
+  if(!opts)
+    return sxupdate_status_invalid;
+  if(handle->event.multi) {
+    sxupdate_log_error(handle, "periodic.event_loop",
+                       "Cannot run periodic checks on a handle driven by an event loop; call sxupdate_execute() from a timer instead");
+    return sxupdate_status_invalid;
+  }
+
+  enum sxupdate_status stat;
+  if((stat = sxupdate_ready(handle)) != sxupdate_status_ok)
+    return stat;
+
+  __atomic_store_n(&handle->stop, 0, __ATOMIC_RELAXED);
+  double next = sxupdate_clock_now();
+  for(unsigned long checks = 0; !opts->max_checks || checks < opts->max_checks; checks++) {
+    sxupdate_wait_until(handle, next);
+    if(sxupdate_stopped(handle))
+      break;
+    next = sxupdate_clock_now() + opts->interval_ms / 1000.0;
+
+    sxupdate_log_debug(handle, "periodic.check", "Periodic check %lu", checks + 1);
+    if((stat = sxupdate_execute(handle)) != sxupdate_status_ok)
+      sxupdate_log_warning(handle, "periodic.error", "Periodic check %lu failed; next in %lu ms",
+                           checks + 1, opts->interval_ms);
   }
   return stat;
 }
 
+/***
+ * Stop sxupdate_run_periodic()
+ */
+SXUPDATE_API void sxupdate_stop(sxupdate_t handle) {
+  __atomic_store_n(&handle->stop, 1, __ATOMIC_RELAXED);
+}
+
+/***
+ * Get the per-phase timings of the most recent (or current) sxupdate_execute()
+ */
+SXUPDATE_API const struct sxupdate_stats *sxupdate_get_stats(sxupdate_t handle) {
+  return &handle->stats;
+}
+
+/***
+ * Get the per-phase timings as a JSON object. Caller must free
+ */
+SXUPDATE_API char *sxupdate_stats_to_json(sxupdate_t handle) {
+  return sxupdate_stats_json(&handle->stats);
+}
+
 /***
  * Retrieve the last error message. Caller must free
  */
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+#include "internal.h"
+#include "background.h"
+#include "alloc.h"
+#include "log.h"
+
+#define SXUPDATE_BACKGROUND_MAGIC "sxupdate-result 2"
+#define SXUPDATE_BACKGROUND_BASE_URL_MAX 4096
+
+char *sxupdate_background_path(const char *dir, const char *name) {
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char *path = sxupdate_mem_alloc(len);
+  if(path)
+    snprintf(path, len, "%s/%s", dir, name);
+  return path;
+}
+
+#ifndef _WIN32
+/* threads running in this process, or 0 if that cannot be told */
+static long sxupdate_background_threads(void) {
+  long count = 0;
+#ifdef __linux__
+  DIR *dir = opendir("/proc/self/task");
+  if(!dir)
+    return 0;
+  for(struct dirent *e; (e = readdir(dir));)
+    if(*e->d_name != '.')
+      count++;
+  closedir(dir);
+#elif defined(__APPLE__)
+  thread_act_array_t threads;
+  mach_msg_type_number_t n;
+  if(task_threads(mach_task_self(), &threads, &n) != KERN_SUCCESS)
+    return 0;
+  for(mach_msg_type_number_t i = 0; i < n; i++)
+    mach_port_deallocate(mach_task_self(), threads[i]);
+  vm_deallocate(mach_task_self(), (vm_address_t)threads, n * sizeof(*threads));
+  count = n;
+#endif
+  return count;
+}
+
+/* body of the helper process. Never returns */
+static void sxupdate_background_run(sxupdate_t handle, const char *dir, void (*check)(sxupdate_t)) {
+  if(nice(19) == -1)
+    errno = 0; // not allowed: run at normal priority then
+
+  // the caller's terminal is not ours to write to
+  int null = open("/dev/null", O_RDWR);
+  if(null >= 0) {
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    if(null > 2)
+      close(null);
+  }
+
+  // held until exit
+  char *lock_path = sxupdate_background_path(dir, SXUPDATE_BACKGROUND_LOCK);
+  int lock = lock_path ? open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+  sxupdate_mem_free(lock_path);
+  if(lock < 0 || flock(lock, LOCK_EX | LOCK_NB))
+    _exit(0); // another helper is already checking
+
+  check(handle);
+  _exit(0);
+}
+#endif
+
+int sxupdate_background_spawn(sxupdate_t handle, const char *dir, void (*check)(sxupdate_t)) {
+#ifdef _WIN32
+  (void)(handle);
+  (void)(dir);
+  (void)(check);
+  return ENOSYS;
+#else
+  // the helper goes on to run curl and OpenSSL without exec(), which is only safe if no
+  // other thread could be holding a lock (e.g. malloc's) at the time of the fork
+  long threads = sxupdate_background_threads();
+  if(threads > 1) {
+    sxupdate_log_error(handle, "background.threads",
+                       "Not checking in the background: %ld threads are running, and the helper could deadlock",
+                       threads);
+    return EBUSY;
+  }
+
+  pid_t pid = fork();
+  if(pid < 0)
+    return errno;
+  if(pid == 0) {
+    // leave the caller's session, and exit at once so that the helper is not our child
+    if(setsid() < 0 || fork() != 0)
+      _exit(0);
+    sxupdate_background_run(handle, dir, check);
+  }
+
+  int status;
+  while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  sxupdate_log_info(handle, "background.spawn", "Checking for updates in the background");
+  return 0;
+#endif
+}
+
+int sxupdate_background_write_result(sxupdate_t handle, const char *dir, const char *url,
+                                     const char *base_url, int prefetched) {
+  char *path = sxupdate_background_path(dir, SXUPDATE_BACKGROUND_RESULT);
+  char *tmp = sxupdate_background_path(dir, SXUPDATE_BACKGROUND_RESULT ".tmp");
+  int err = 0;
+  FILE *f = NULL;
+  if(!(path && tmp))
+    err = ENOMEM;
+  else if(strlen(base_url) >= SXUPDATE_BACKGROUND_BASE_URL_MAX)
+    err = ENAMETOOLONG;
+  else if(!(f = fopen(tmp, "wb")))
+    err = errno;
+  else {
+    if(fprintf(f, "%s\n%i\n%s\n%s\n", SXUPDATE_BACKGROUND_MAGIC, prefetched ? 1 : 0, url, base_url) < 0)
+      err = errno ? errno : EIO;
+    if(fclose(f) && !err)
+      err = errno ? errno : EIO;
+#ifdef _WIN32
+    remove(path); // rename() does not replace an existing file
+#endif
+    if(!err && rename(tmp, path))
+      err = errno;
+    if(err)
+      remove(tmp);
+  }
+  if(err)
+    sxupdate_log_warning(handle, "background.result", "Unable to write result in %s: %s", dir, strerror(err));
+  sxupdate_mem_free(path);
+  sxupdate_mem_free(tmp);
+  return err;
+}
+
+int sxupdate_background_take_result(sxupdate_t handle, const char *dir, const char *url,
+                                    int *prefetched, char **base_url) {
+  char *path = sxupdate_background_path(dir, SXUPDATE_BACKGROUND_RESULT);
+  if(!path)
+    return ENOMEM;
+  FILE *f = fopen(path, "rb");
+  if(!f) {
+    int err = errno;
+    sxupdate_mem_free(path);
+    return err;
+  }
+
+  int err = EINVAL;
+  size_t url_len = strlen(url);
+  size_t len = (url_len > SXUPDATE_BACKGROUND_BASE_URL_MAX ? url_len : SXUPDATE_BACKGROUND_BASE_URL_MAX) + 32;
+  char *line = sxupdate_mem_alloc(len);
+  *base_url = NULL;
+  if(!line)
+    err = ENOMEM;
+  else if(fgets(line, (int)len, f) && !strcmp(line, SXUPDATE_BACKGROUND_MAGIC "\n")
+          && fgets(line, (int)len, f) && (*line == '0' || *line == '1') && line[1] == '\n') {
+    *prefetched = *line == '1';
+    size_t base_len;
+    if(fgets(line, (int)len, f) && !strncmp(line, url, url_len) && !strcmp(line + url_len, "\n")
+       && fgets(line, (int)len, f) && (base_len = strlen(line)) > 1 && line[base_len - 1] == '\n') {
+      line[base_len - 1] = '\0';
+      err = (*base_url = sxupdate_mem_strdup(line)) ? 0 : ENOMEM;
+    }
+  }
+  fclose(f);
+  sxupdate_mem_free(line);
+
+  // used once, or not at all if it was for another url
+  remove(path);
+  sxupdate_mem_free(path);
+  if(!err)
+    sxupdate_log_info(handle, "background.result", "Using the result of the last background check");
+  return err;
+}
@@ -0,0 +1,56 @@
+#ifndef SXUPDATE_BACKGROUND_H
+#define SXUPDATE_BACKGROUND_H
+
+#include "../include/api.h"
+
+/**
+ * Background checks (see sxupdate_set_background()). A detached helper process makes the
+ * check and leaves its result in a directory for the next sxupdate_execute():
+ *
+ *   <dir>/appcast.json : the appcast it fetched
+ *   <dir>/installer    : the installer it downloaded and verified, if any
+ *   <dir>/result       : written last, naming the appcast url, the url relative enclosure
+ *                        urls resolve against (the shard, if the url serves an index), and
+ *                        whether the installer was prefetched. A result is complete only
+ *                        once this exists
+ *   <dir>/lock         : held by the running helper, so that only one runs at a time
+ */
+#define SXUPDATE_BACKGROUND_APPCAST "appcast.json"
+#define SXUPDATE_BACKGROUND_INSTALLER "installer"
+#define SXUPDATE_BACKGROUND_RESULT "result"
+#define SXUPDATE_BACKGROUND_LOCK "lock"
+
+/**
+ * Return <dir>/<name>. Caller must free
+ */
+char *sxupdate_background_path(const char *dir, const char *name);
+
+/**
+ * Run check(handle) in a detached, low-priority process that exits once check() returns,
+ * unless a helper is already running for dir. Returns as soon as the process has started.
+ * The process is forked without exec(), so this refuses to when other threads are running
+ *
+ * @return 0 on success, EBUSY if other threads are running, else errno
+ */
+int sxupdate_background_spawn(sxupdate_t handle, const char *dir, void (*check)(sxupdate_t));
+
+/**
+ * Record that the helper's result for url is complete
+ * @param base_url: the url the appcast was fetched from: url, or its shard
+ * @return 0 on success, else errno
+ */
+int sxupdate_background_write_result(sxupdate_t handle, const char *dir, const char *url,
+                                     const char *base_url, int prefetched);
+
+/**
+ * Take the result left by a helper for url, if any. The result is removed, so that it is
+ * only used once
+ *
+ * @param prefetched: set to non-zero if the helper also prefetched the installer
+ * @param base_url  : set to the url the appcast was fetched from. Caller must free
+ * @return 0 if there was a result for url, else errno
+ */
+int sxupdate_background_take_result(sxupdate_t handle, const char *dir, const char *url,
+                                    int *prefetched, char **base_url);
+
+#endif
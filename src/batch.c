@@ -0,0 +1,56 @@
+#include <string.h>
+
+#include "internal.h"
+#include "batch.h"
+#include "version.h"
+#include "alloc.h"
+
+enum sxupdate_status sxupdate_batch_init(sxupdate_t handle, const struct sxupdate_product *products,
+                                         size_t count) {
+  sxupdate_batch_free(handle);
+  if(!count) // else a zero-byte allocation, reported as out of memory
+    return sxupdate_status_invalid;
+  handle->batch.products = sxupdate_mem_calloc(count, sizeof(*handle->batch.products));
+  if(!handle->batch.products)
+    return sxupdate_status_memory;
+  handle->batch.count = count;
+
+  for(size_t i = 0; i < count; i++) {
+    struct sxupdate_batch_product *p = &handle->batch.products[i];
+    const struct sxupdate_semantic_version *current = &products[i].current_version;
+    p->interaction_handler = products[i].interaction_handler;
+    p->current_version.major = current->major;
+    p->current_version.minor = current->minor;
+    p->current_version.patch = current->patch;
+    // so that we know after parsing whether it was explicitly set to zero
+    p->version.version.major = p->version.version.minor = p->version.version.patch = -1;
+    if(!(p->id = sxupdate_mem_strdup(products[i].id))
+       || (current->prerelease && !(p->current_version.prerelease = sxupdate_mem_strdup(current->prerelease)))
+       || (current->meta && !(p->current_version.meta = sxupdate_mem_strdup(current->meta)))) {
+      sxupdate_batch_free(handle);
+      return sxupdate_status_memory;
+    }
+  }
+  return sxupdate_status_ok;
+}
+
+struct sxupdate_batch_product *sxupdate_batch_find(sxupdate_t handle, const char *id) {
+  if(!id)
+    return NULL;
+  for(size_t i = 0; i < handle->batch.count; i++)
+    if(!strcmp(handle->batch.products[i].id, id))
+      return &handle->batch.products[i];
+  return NULL;
+}
+
+void sxupdate_batch_free(sxupdate_t handle) {
+  for(size_t i = 0; i < handle->batch.count; i++) {
+    struct sxupdate_batch_product *p = &handle->batch.products[i];
+    sxupdate_mem_free(p->id);
+    sxupdate_mem_free(p->current_version.prerelease);
+    sxupdate_mem_free(p->current_version.meta);
+    sxupdate_version_free(handle, &p->version);
+  }
+  sxupdate_mem_free(handle->batch.products);
+  memset(&handle->batch, 0, sizeof(handle->batch));
+}
@@ -0,0 +1,35 @@
+#ifndef SXUPDATE_BATCH_H
+#define SXUPDATE_BATCH_H
+
+#include <stddef.h>
+#include "../include/api.h"
+
+/**
+ * Batch checks (see sxupdate_execute_batch()). The url serves a catalog (see
+ * schema/catalog.schema.json), which holds an appcast per product:
+ *
+ *   {"products":{"<product id>":{"items":[...]}, ...}}
+ *
+ * It is fetched and parsed once, keeping the first item of each product checked. The
+ * interaction handler of each product then runs in turn, as in a single check
+ */
+
+/**
+ * Copy the products to check into the handle
+ * @return sxupdate_status_ok, sxupdate_status_invalid if there are none, or sxupdate_status_memory
+ */
+enum sxupdate_status sxupdate_batch_init(sxupdate_t handle, const struct sxupdate_product *products,
+                                         size_t count);
+
+/**
+ * Find a product being checked by its id
+ * @return the product, or NULL if it is not being checked
+ */
+struct sxupdate_batch_product *sxupdate_batch_find(sxupdate_t handle, const char *id);
+
+/**
+ * Release the products, ending the batch
+ */
+void sxupdate_batch_free(sxupdate_t handle);
+
+#endif
@@ -0,0 +1,166 @@
+/***
+ * Stress test of the event ring (see sxupdate_set_event_ring()): a producer thread writes
+ * progress events flat out, with a numbered phase event every few milliseconds, while a
+ * consumer thread reads them, first as fast as it can, then once per 16 ms frame as a UI
+ * thread would, i.e. far slower than they are written
+ *
+ * Fails if a phase event is lost or out of order, if progress goes backwards, or if the
+ * final progress is not read. Also reports how long the producer spent per event, which a
+ * slow consumer must not change, since the producer never waits for it (the max includes
+ * any time the producer thread was descheduled)
+ *
+ * Usage: event_ring_stress [progress events] [ring capacity]
+ */
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../ring.h"
+
+#define STRESS_PHASE_MS 4 // between phase events
+#define STRESS_BATCH 64   // events read per poll
+
+struct stress {
+  struct sxupdate_ring *ring;
+  long long count;     // progress events to write
+  long frame_ms;       // consumer: poll once per frame, or flat out if 0
+  int done;            // set by the producer once all is written
+  long long phases;    // written
+  double push_mean_ns; // producer time per event
+  double push_max_ns;  // longest single write
+};
+
+static double stress_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stress_push(struct stress *s, struct sxupdate_event *e, double *max) {
+  double start = stress_now();
+  sxupdate_ring_push(s->ring, e);
+  double elapsed = stress_now() - start;
+  if(elapsed > *max)
+    *max = elapsed;
+}
+
+static void *stress_produce(void *arg) {
+  struct stress *s = arg;
+  struct sxupdate_event progress, phase;
+  memset(&progress, 0, sizeof(progress));
+  memset(&phase, 0, sizeof(phase));
+  progress.type = sxupdate_event_progress;
+  progress.phase = sxupdate_phase_downloading;
+  progress.total = s->count;
+  phase.type = sxupdate_event_phase;
+  phase.phase = sxupdate_phase_downloading;
+
+  double max = 0, start = stress_now(), next_phase = start;
+  for(long long i = 1; i <= s->count; i++) {
+    progress.bytes = i;
+    stress_push(s, &progress, &max);
+    if((i & 255) == 0 && stress_now() >= next_phase) {
+      phase.bytes = s->phases++; // numbered, to check none is lost
+      stress_push(s, &phase, &max);
+      next_phase += STRESS_PHASE_MS / 1e3;
+    }
+  }
+  phase.phase = sxupdate_phase_done;
+  phase.bytes = s->phases++;
+  stress_push(s, &phase, &max);
+  s->push_mean_ns = (stress_now() - start) * 1e9 / (s->count + s->phases);
+  s->push_max_ns = max * 1e9;
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int stress_run(const char *label, long long count, size_t capacity, long frame_ms) {
+  struct stress s;
+  memset(&s, 0, sizeof(s));
+  s.count = count;
+  s.frame_ms = frame_ms;
+  if(!(s.ring = sxupdate_ring_new(capacity)))
+    return 1;
+
+  pthread_t producer;
+  if(pthread_create(&producer, NULL, stress_produce, &s)) {
+    sxupdate_ring_free(s.ring);
+    return 1;
+  }
+
+  struct sxupdate_event events[STRESS_BATCH];
+  long long read = 0, polls = 0, next_phase = 0, last_bytes = 0;
+  const char *error = NULL;
+  double start = stress_now();
+  for(;;) {
+    int done = __atomic_load_n(&s.done, __ATOMIC_ACQUIRE);
+    size_t n;
+    do { // drain what is there, as a frame would
+      n = sxupdate_ring_pop(s.ring, events, STRESS_BATCH);
+      polls++;
+      for(size_t i = 0; i < n && !error; i++) {
+        if(events[i].type == sxupdate_event_phase && events[i].bytes != next_phase++)
+          error = "phase event lost or out of order";
+        else if(events[i].type == sxupdate_event_progress && events[i].bytes <= last_bytes)
+          error = "progress went backwards";
+        else if(events[i].type == sxupdate_event_progress)
+          last_bytes = events[i].bytes;
+      }
+      read += n;
+    } while(n == STRESS_BATCH);
+    if(done)
+      break; // all was written before this last drain
+    if(frame_ms) {
+      struct timespec ts = { 0, frame_ms * 1000000L };
+      nanosleep(&ts, NULL);
+    }
+  }
+  double elapsed = stress_now() - start;
+  pthread_join(producer, NULL);
+
+  struct sxupdate_event_ring_stats stats;
+  sxupdate_ring_stats(s.ring, &stats);
+  sxupdate_ring_free(s.ring);
+  if(!error && stats.dropped)
+    error = "phase events dropped";
+  else if(!error && next_phase != s.phases)
+    error = "phase events missing";
+  else if(!error && last_bytes != count)
+    error = "final progress not read";
+  else if(!error && (unsigned long long)read != stats.published)
+    error = "events published but not read";
+
+  printf("%-12s %8.1f M events/s  push mean %6.1f ns  max %9.1f us  read %10lld  polls %9lld"
+         "  coalesced %10llu  dropped %llu  %s\n",
+         label, (count + s.phases) / elapsed / 1e6, s.push_mean_ns, s.push_max_ns / 1e3, read, polls,
+         stats.coalesced, stats.dropped, error ? error : "");
+  return error != NULL;
+}
+
+int main(int argc, char *argv[]) {
+  long long count = argc > 1 ? strtoll(argv[1], NULL, 10) : 20000000;
+  size_t capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : SXUPDATE_RING_DEFAULT_CAPACITY;
+  if(count <= 0)
+    return 1;
+  printf("Writing %lld progress events, and a phase event every %d ms, to a ring of %zu\n",
+         count, STRESS_PHASE_MS, capacity);
+  int err = stress_run("flat out", count, capacity, 0);
+  err |= stress_run("16 ms frames", count, capacity, 16);
+  printf(err ? "Fail!\n" : "Success\n");
+  return err;
+}
+
+#else
+
+#include <stdio.h>
+
+int main() {
+  fprintf(stderr, "event_ring_stress is not supported on this platform\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/***
+ * Benchmark of the ways downloads can be written to disk: stdio on the transfer thread,
+ * as by default, against the asynchronous sink (see sxupdate_set_write_options()), from a
+ * writer thread, with io_uring if built with it, and with O_DIRECT
+ *
+ * Each run writes the same random data in curl-sized chunks, hashing each chunk as a
+ * download does, then syncs the file. "transfer" is the time the transfer thread was
+ * busy, i.e. could not receive; "total" includes the final fsync()
+ *
+ * Usage: sink_bench <directory> [megabytes] [chunk bytes]
+ */
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "../sink.h"
+
+#define SINK_BENCH_STDIO -1
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_run(const char *label, const char *path, int flags, const unsigned char *data,
+                     size_t size, size_t chunk) {
+  FILE *f = NULL;
+  struct sxupdate_sink *sink = NULL;
+  SHA256_CTX sha256;
+  SHA256_Init(&sha256);
+  int err = 0;
+
+  double start = bench_now();
+  if(flags == SINK_BENCH_STDIO) {
+    if(!(f = fopen(path, "wb")))
+      err = errno;
+  } else
+    err = sxupdate_sink_open(path, flags, &sink);
+  if(err) {
+    fprintf(stderr, "%s: %s\n", path, strerror(err));
+    return 1;
+  }
+  if(sink && !(flags & SXUPDATE_SINK_NO_URING) && !sxupdate_sink_uses_uring(sink))
+    label = "io_uring (unavailable: thread)";
+
+  for(size_t off = 0; off < size && !err; off += chunk) {
+    size_t len = size - off < chunk ? size - off : chunk;
+    SHA256_Update(&sha256, data + off, len);
+    if(f)
+      err = fwrite(data + off, 1, len, f) == len ? 0 : errno;
+    else
+      err = sxupdate_sink_write(sink, data + off, len);
+  }
+  if(f && fclose(f) && !err)
+    err = errno;
+  if(sink) {
+    int close_err = sxupdate_sink_close(sink);
+    if(!err)
+      err = close_err;
+  }
+  double transfer = bench_now() - start;
+
+  int fd = open(path, O_RDONLY);
+  if(fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  double total = bench_now() - start;
+  remove(path);
+  if(err) {
+    fprintf(stderr, "%s: %s\n", label, strerror(err));
+    return 1;
+  }
+  printf("  %-32s transfer %8.1f MB/s   total %8.1f MB/s\n", label,
+         size / transfer / 1e6, size / total / 1e6);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s <directory> [megabytes] [chunk bytes]\n", argv[0]);
+    return 1;
+  }
+  size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 256) * 1024 * 1024;
+  size_t chunk = argc > 3 ? strtoul(argv[3], NULL, 10) : 16384; // CURL_MAX_WRITE_SIZE
+  unsigned char *data = malloc(size);
+  char path[4096];
+  if(!data || !chunk)
+    return 1;
+  srand(1);
+  for(size_t i = 0; i < size; i++)
+    data[i] = (unsigned char)rand();
+  snprintf(path, sizeof(path), "%s/sink_bench.tmp", argv[1]);
+
+  printf("Writing %zu MB in %zu-byte chunks to %s\n", size >> 20, chunk, argv[1]);
+  int err = bench_run("stdio", path, SINK_BENCH_STDIO, data, size, chunk)
+    || bench_run("thread", path, SXUPDATE_SINK_NO_URING, data, size, chunk)
+    || bench_run("io_uring", path, 0, data, size, chunk)
+    || bench_run("io_uring + O_DIRECT", path, SXUPDATE_SINK_DIRECT, data, size, chunk);
+  free(data);
+  return err;
+}
+
+#else
+
+#include <stdio.h>
+
+int main() {
+  fprintf(stderr, "sink_bench is not supported on this platform\n");
+  return 1;
+}
+
+#endif
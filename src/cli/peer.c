@@ -0,0 +1,352 @@
+/***
+ * sxupdate-peer: share verified installers with other hosts on the local network
+ *
+ * Serves the installers that sxupdate has copied into a share directory (see
+ * sxupdate_set_peer_cache()). Answers multicast discovery queries for installers it holds,
+ * and serves them over HTTP. Clients verify every installer they fetch from a peer against
+ * its signature, so peers do not need to be trusted
+ *
+ * With --query, instead asks peers for an installer and prints the url of the first to answer
+ */
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "../peer.h"
+#include "../alloc.h"
+
+#define PEER_REQUEST_MAX 4096
+#define PEER_COPY_BUFFER_SIZE (64 * 1024)
+#define PEER_IO_TIMEOUT_SECONDS 30
+#define PEER_DEFAULT_MAX_CONNECTIONS 32
+
+static struct {
+  const char *dir;
+  unsigned short http_port;
+  int verbose;
+  int max_connections;
+  int connections; // being served
+  volatile sig_atomic_t stop;
+} peer;
+
+static void peer_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s -d share_dir [options]\n"
+          "       %s --query <key> [options]\n"
+          "Share verified installers with sxupdate clients on the local network\n"
+          "\n"
+          "Options:\n"
+          "  -d, --dir <dir>           directory holding the installers to share, as written by\n"
+          "                            sxupdate_set_peer_cache()\n"
+          "  -H, --http-port <port>    port to serve installers on. Default: any free port\n"
+          "  -g, --group <address>     multicast group. Default: " SXUPDATE_PEER_DEFAULT_GROUP "\n"
+          "  -p, --port <port>         discovery port. Default: %i\n"
+          "  -i, --iface <address>     IPv4 address of the interface to use. Default: any\n"
+          "  -q, --query <key>         ask peers for <key>, print the url of the first to answer,\n"
+          "                            and exit\n"
+          "  -t, --timeout <ms>        how long --query waits for an answer. Default: %i\n"
+          "  -c, --max-connections <n> connections served at once; more are closed. Default: %i\n"
+          "  -v, --verbose\n",
+          argv0, argv0, SXUPDATE_PEER_DEFAULT_PORT, SXUPDATE_PEER_DEFAULT_TIMEOUT_MS,
+          PEER_DEFAULT_MAX_CONNECTIONS);
+}
+
+static void peer_on_signal(int sig) {
+  (void)(sig);
+  peer.stop = 1;
+}
+
+/* return non-zero if the share directory holds the installer for key */
+static int peer_have(const char *key) {
+  char path[FILENAME_MAX];
+  struct stat st;
+  snprintf(path, sizeof(path), "%s/%s", peer.dir, key);
+  return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+static void peer_on_query(int udp) {
+  char msg[SXUPDATE_PEER_MESSAGE_MAX];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t len = recvfrom(udp, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+  char key[SXUPDATE_PEER_KEY_LENGTH + 1];
+  if(len <= 0 || sxupdate_peer_parse(msg, (size_t)len, key, NULL) != sxupdate_peer_verb_want)
+    return;
+
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host));
+  if(!peer_have(key)) {
+    if(peer.verbose)
+      fprintf(stderr, "%s asked for %s: not here\n", host, key);
+    return;
+  }
+
+  char reply[SXUPDATE_PEER_MESSAGE_MAX];
+  int reply_len = snprintf(reply, sizeof(reply), "%s HAVE %s %u", SXUPDATE_PEER_MAGIC, key,
+                           (unsigned)peer.http_port);
+  sendto(udp, reply, reply_len, 0, (struct sockaddr *)&from, from_len);
+  if(peer.verbose)
+    fprintf(stderr, "%s asked for %s: answered\n", host, key);
+}
+
+static int peer_send_all(int fd, const char *buff, size_t len) {
+  while(len) {
+    ssize_t n = send(fd, buff, len, MSG_NOSIGNAL);
+    if(n <= 0)
+      return -1;
+    buff += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static void peer_send_status(int fd, const char *status) {
+  char header[256];
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+  peer_send_all(fd, header, (size_t)len);
+}
+
+static int peer_send_file(int fd, int file, off_t size) {
+#ifdef __linux__
+  off_t offset = 0;
+  while(offset < size) {
+    ssize_t n = sendfile(fd, file, &offset, (size_t)(size - offset));
+    if(n <= 0)
+      return -1;
+  }
+  return 0;
+#else
+  char *buff = malloc(PEER_COPY_BUFFER_SIZE);
+  int err = !buff;
+  ssize_t n;
+  while(!err && size > 0 && (n = read(file, buff, PEER_COPY_BUFFER_SIZE)) > 0) {
+    err = peer_send_all(fd, buff, (size_t)n);
+    size -= n;
+  }
+  free(buff);
+  return err || size ? -1 : 0;
+#endif
+}
+
+/* serve one request, then close the connection */
+static void *peer_serve_conn(void *p) {
+  int fd = (int)(intptr_t)p;
+  struct timeval tv = { PEER_IO_TIMEOUT_SECONDS, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  char request[PEER_REQUEST_MAX];
+  size_t len = 0;
+  while(len < sizeof(request) - 1) {
+    ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+    if(n <= 0)
+      break;
+    len += (size_t)n;
+    request[len] = '\0';
+    if(strstr(request, "\r\n\r\n"))
+      break;
+  }
+  request[len] = '\0';
+
+  int head = !strncmp(request, "HEAD /", 6);
+  const char *path = head ? request + 6 : !strncmp(request, "GET /", 5) ? request + 5 : NULL;
+  char key[SXUPDATE_PEER_KEY_LENGTH + 1];
+  if(!strstr(request, "\r\n\r\n"))
+    peer_send_status(fd, "400 Bad Request");
+  else if(!path)
+    peer_send_status(fd, "405 Method Not Allowed");
+  else {
+    snprintf(key, sizeof(key), "%s", path);
+    char filepath[FILENAME_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", peer.dir, key);
+    int file = -1;
+    struct stat st;
+    if(!sxupdate_peer_key_valid(key) || path[SXUPDATE_PEER_KEY_LENGTH] != ' '
+       || (file = open(filepath, O_RDONLY)) < 0 || fstat(file, &st) || !S_ISREG(st.st_mode))
+      peer_send_status(fd, "404 Not Found");
+    else {
+      char header[256];
+      int header_len = snprintf(header, sizeof(header),
+                                "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                "Content-Length: %lld\r\nConnection: close\r\n\r\n",
+                                (long long)st.st_size);
+      int err = peer_send_all(fd, header, (size_t)header_len)
+        || (!head && peer_send_file(fd, file, st.st_size));
+      if(peer.verbose) {
+        if(err)
+          fprintf(stderr, "Error sending %s: %s\n", key, strerror(errno));
+        else
+          fprintf(stderr, "Served %s (%lld bytes)\n", key, head ? 0LL : (long long)st.st_size);
+      }
+    }
+    if(file >= 0)
+      close(file);
+  }
+  close(fd);
+  __atomic_sub_fetch(&peer.connections, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int peer_http_listen(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(peer.http_port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t addr_len = sizeof(addr);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 64)
+     || getsockname(fd, (struct sockaddr *)&addr, &addr_len)) {
+    close(fd);
+    return -1;
+  }
+  peer.http_port = ntohs(addr.sin_port);
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  const char *group = NULL;
+  const char *iface = NULL;
+  const char *query = NULL;
+  unsigned short port = 0;
+  long timeout_ms = 0;
+
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+#define peer_opt(short_name, long_name) (!strcmp(arg, short_name) || !strcmp(arg, long_name))
+#define peer_optarg() (i + 1 < argc ? argv[++i] : (peer_usage(argv[0]), exit(1), NULL))
+    if(peer_opt("-h", "--help")) {
+      peer_usage(argv[0]);
+      return 0;
+    } else if(peer_opt("-d", "--dir"))
+      peer.dir = peer_optarg();
+    else if(peer_opt("-H", "--http-port"))
+      peer.http_port = (unsigned short)atoi(peer_optarg());
+    else if(peer_opt("-g", "--group"))
+      group = peer_optarg();
+    else if(peer_opt("-p", "--port"))
+      port = (unsigned short)atoi(peer_optarg());
+    else if(peer_opt("-i", "--iface"))
+      iface = peer_optarg();
+    else if(peer_opt("-q", "--query"))
+      query = peer_optarg();
+    else if(peer_opt("-t", "--timeout"))
+      timeout_ms = atol(peer_optarg());
+    else if(peer_opt("-c", "--max-connections"))
+      peer.max_connections = atoi(peer_optarg());
+    else if(peer_opt("-v", "--verbose"))
+      peer.verbose = 1;
+    else {
+      fprintf(stderr, "Unrecognized option: %s\n", arg);
+      peer_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(query) {
+    if(!sxupdate_peer_key_valid(query)) {
+      fprintf(stderr, "Invalid key: %s\n", query);
+      return 1;
+    }
+    char *url = sxupdate_peer_discover(NULL, group, port, iface, timeout_ms, query);
+    if(!url)
+      return 1;
+    printf("%s\n", url);
+    sxupdate_mem_free(url);
+    return 0;
+  }
+
+  if(peer.max_connections <= 0)
+    peer.max_connections = PEER_DEFAULT_MAX_CONNECTIONS;
+
+  struct stat st;
+  if(!peer.dir || stat(peer.dir, &st) || !S_ISDIR(st.st_mode)) {
+    if(peer.dir)
+      fprintf(stderr, "Invalid share directory: %s\n", peer.dir);
+    peer_usage(argv[0]);
+    return 1;
+  }
+
+  int udp = sxupdate_peer_listen(NULL, group, port, iface);
+  if(udp < 0)
+    return 1;
+  int http = peer_http_listen();
+  if(http < 0) {
+    perror("Unable to listen for http connections");
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, peer_on_signal);
+  signal(SIGTERM, peer_on_signal);
+
+  fprintf(stderr, "Sharing %s on http port %u\n", peer.dir, (unsigned)peer.http_port);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while(!peer.stop) {
+    struct pollfd fds[2] = { { udp, POLLIN, 0 }, { http, POLLIN, 0 } };
+    if(poll(fds, 2, -1) < 0)
+      continue; // EINTR
+
+    if(fds[0].revents & POLLIN)
+      peer_on_query(udp);
+    if(fds[1].revents & POLLIN) {
+      int fd = accept(http, NULL, NULL);
+      pthread_t thread;
+      if(fd < 0)
+        ;
+      else if(__atomic_load_n(&peer.connections, __ATOMIC_ACQUIRE) >= peer.max_connections) {
+        // each connection holds a thread and a file: do not let any host use them all up
+        if(peer.verbose)
+          fprintf(stderr, "Serving %i connections already; closing another\n", peer.max_connections);
+        close(fd);
+      } else {
+        __atomic_add_fetch(&peer.connections, 1, __ATOMIC_RELEASE);
+        if(pthread_create(&thread, &attr, peer_serve_conn, (void *)(intptr_t)fd)) {
+          __atomic_sub_fetch(&peer.connections, 1, __ATOMIC_RELEASE);
+          close(fd);
+        }
+      }
+    }
+  }
+  pthread_attr_destroy(&attr);
+  close(http);
+  close(udp);
+  return 0;
+}
+
+#else // _WIN32
+
+#include <stdio.h>
+
+int main() {
+  fprintf(stderr, "sxupdate-peer is not supported on this platform\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,593 @@
+/***
+ * sxupdate-publish: hash and sign installers in parallel, and emit appcast.json
+ *
+ * Replaces the `openssl dgst -sha256 -sign | openssl base64 | sed` pipeline, using
+ * the same hashing and signature code that sxupdate uses to verify downloads
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <yajl/yajl_gen.h>
+
+#include "../internal.h"
+#include "../parse.h"
+#include "../verify.h"
+#include "../encoding.h"
+#include "../manifest.h"
+#include "../delta.h"
+#include "../alloc.h"
+#include "../log.h"
+
+struct publish_artifact {
+  const char *path;
+  const char *filename; // basename of path
+  size_t length;
+  char *signature; // base64
+  char *encoded_path; // compressed copy, if --encoding was given
+  size_t encoded_length;
+  char *blocks_path; // block checksums, if --blocks was given
+  const char *shard; // "platform/arch/channel", if --shard was given
+  int err;
+};
+
+struct publish_opts {
+  RSA *private_key;
+  struct sxupdate_semantic_version version;
+  const char *base_url;
+  const char *title;
+  const char *description;
+  const char *link;
+  const char *pub_date;
+  const char *type;
+  const char *encoding_name; // NULL unless --encoding was given
+  enum sxupdate_encoding encoding;
+  int blocks;             // write block checksums for client-side deltas
+  size_t block_size;      // 0 for the default
+  const char *output;     // single appcast listing every artifact
+  const char *output_dir; // one appcast per artifact
+  int index;              // also write an index of those appcasts (see sxupdate_set_shard())
+  const char *manifest_tree; // NULL unless --manifest was given
+  const char *manifest_dir;  // where its manifest and objects are written
+  char *manifest_signature;  // base64
+  const char *rollout_percentage; // NULL unless --rollout was given
+  long long rollout_start;
+  long long rollout_ramp;
+
+  struct publish_artifact *artifacts;
+  size_t artifact_count;
+
+  pthread_mutex_t lock;
+  size_t next; // next artifact to process
+};
+
+static void publish_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s -k private_key.pem -V version [options] installer [installer ...]\n"
+          "       %s -k private_key.pem -V version -m dir [options] [installer ...]\n"
+          "Hash and sign installers in parallel and generate an appcast.json file\n"
+          "\n"
+          "Options:\n"
+          "  -k, --key <file>          PEM file holding the RSA private key used to sign\n"
+          "  -V, --version <x.y.z>     semantic version, optionally with -prerelease and/or +meta\n"
+          "  -o, --output <file>       write a single appcast listing every installer, in the order\n"
+          "                            given (the first is treated as the latest). Default: stdout\n"
+          "  -d, --output-dir <dir>    instead, write one appcast per installer to <dir>/<filename>.json\n"
+          "  -I, --index               with --output-dir, also write <dir>/index.json, which maps the\n"
+          "                            shard of each installer to its appcast (see sxupdate_set_shard()).\n"
+          "                            Clients take the first shard that matches, in the order given\n"
+          "  -s, --shard <p/a/c>       platform/arch/channel of the next installer, for --index, e.g.\n"
+          "                            linux/x86_64/stable or //beta. Empty or missing fields match any\n"
+          "  -u, --base-url <url>      prefix for enclosure urls. Default: relative to the appcast\n"
+          "  -j, --jobs <n>            number of parallel signing jobs. Default: number of CPUs\n"
+          "  -e, --encoding <name>     also compress each installer to <installer>.<name> (xz or zstd),\n"
+          "                            and point the enclosure at the compressed copy. The signature\n"
+          "                            is still of the installer itself\n"
+          "  -m, --manifest <dir>      also publish the tree at <dir> for file-level updates (see\n"
+          "                            sxupdate_set_install_dir()): write a signed manifest of its\n"
+          "                            files and a copy of each, named by its SHA-256, to the\n"
+          "                            manifest dir, and add the manifest to each item\n"
+          "  -M, --manifest-dir <dir>  where to write the manifest and objects/. Default: .\n"
+          "  -b, --blocks              also write the block checksums of each installer to\n"
+          "                            <installer>.blocks, so that clients can fetch only the blocks\n"
+          "                            they do not have (see sxupdate_set_delta()). Not compatible\n"
+          "                            with --encoding\n"
+          "      --block-size <bytes>  block size for --blocks. Default: about the square root of\n"
+          "                            the installer size, from 2048 to 65536\n"
+          "  -r, --rollout <percent>   offer the items to this share of clients only (see\n"
+          "                            sxupdate_set_rollout()). Clients that are not yet offered\n"
+          "                            them take the next item, e.g. from a previous appcast\n"
+          "      --rollout-start <t>   Unix time from which clients are offered the items. Default: now\n"
+          "      --rollout-ramp <s>    seconds over which the share grows to --rollout. Default: 0\n"
+          "      --title <text>\n"
+          "      --description <text>\n"
+          "      --link <url>\n"
+          "      --pub-date <date>\n"
+          "      --type <mime type>\n"
+          "  -v, --verbose\n",
+          argv0, argv0);
+}
+
+static int publish_parse_version(const char *s, struct sxupdate_semantic_version *v) {
+  char *end;
+  long parts[3];
+  for(int i = 0; i < 3; i++) {
+    parts[i] = strtol(s, &end, 10);
+    if(end == s || parts[i] < 0 || (i < 2 && *end != '.'))
+      return 1;
+    s = end + (i < 2);
+  }
+  v->major = (int)parts[0];
+  v->minor = (int)parts[1];
+  v->patch = (int)parts[2];
+  if(*end == '-') {
+    const char *plus = strchr(end + 1, '+');
+    v->prerelease = plus ? strndup(end + 1, plus - end - 1) : strdup(end + 1);
+    end = plus ? (char *)plus : end + strlen(end);
+  }
+  if(*end == '+')
+    v->meta = strdup(end + 1);
+  else if(*end)
+    return 1;
+  return 0;
+}
+
+static void *publish_worker(void *p) {
+  struct publish_opts *opts = p;
+  while(1) {
+    pthread_mutex_lock(&opts->lock);
+    size_t i = opts->next++;
+    pthread_mutex_unlock(&opts->lock);
+    if(i >= opts->artifact_count)
+      break;
+
+    struct publish_artifact *a = &opts->artifacts[i];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    if((a->err = sxupdate_sha256_file(a->path, hash, &a->length)))
+      sxupdate_log_error(NULL, "publish.hash", "%s: %s", a->path, strerror(a->err));
+    else if(!(a->signature = sxupdate_sign_sha256_b64(NULL, opts->private_key, hash)))
+      a->err = 1;
+    else if(opts->encoding_name) {
+      size_t len = strlen(a->path) + strlen(opts->encoding_name) + 2;
+      if(!(a->encoded_path = malloc(len)))
+        a->err = ENOMEM;
+      else {
+        snprintf(a->encoded_path, len, "%s.%s", a->path, opts->encoding_name);
+        if((a->err = sxupdate_encode_file(opts->encoding, a->path, a->encoded_path, &a->encoded_length)))
+          sxupdate_log_error(NULL, "publish.encode", "%s: %s", a->encoded_path, strerror(a->err));
+      }
+    } else if(opts->blocks) {
+      size_t len = strlen(a->path) + sizeof(".blocks");
+      if(!(a->blocks_path = malloc(len)))
+        a->err = ENOMEM;
+      else {
+        snprintf(a->blocks_path, len, "%s.blocks", a->path);
+        if((a->err = sxupdate_blocks_write(a->path, a->blocks_path, opts->block_size)))
+          sxupdate_log_error(NULL, "publish.blocks", "%s: %s", a->blocks_path, strerror(a->err));
+      }
+    }
+  }
+  return NULL;
+}
+
+#define publish_gen_str(g, s) yajl_gen_string(g, (const unsigned char *)(s), strlen(s))
+
+static void publish_gen_kv(yajl_gen g, const char *key, const char *value) {
+  if(value) {
+    publish_gen_str(g, key);
+    publish_gen_str(g, value);
+  }
+}
+
+/* url of a published file: relative to the appcast, unless --base-url was given */
+static void publish_gen_url(yajl_gen g, struct publish_opts *opts, const char *filename, const char *ext) {
+  size_t len = opts->base_url ? strlen(opts->base_url) : 0;
+  char *url = malloc(len + strlen(filename) + strlen(ext) + 3);
+  if(url) {
+    sprintf(url, "%s%s%s%s%s", opts->base_url ? opts->base_url : "",
+            !opts->base_url || (len && opts->base_url[len-1] == '/') ? "" : "/", filename,
+            *ext ? "." : "", ext);
+    publish_gen_str(g, url);
+    free(url);
+  }
+}
+
+static void publish_gen_item(yajl_gen g, struct publish_opts *opts, struct publish_artifact *a) {
+  yajl_gen_map_open(g);
+  publish_gen_kv(g, "title", opts->title);
+  publish_gen_kv(g, "description", opts->description);
+  publish_gen_kv(g, "link", opts->link);
+  publish_gen_kv(g, "pubDate", opts->pub_date);
+
+  publish_gen_str(g, "version");
+  yajl_gen_map_open(g);
+  publish_gen_str(g, "major");
+  yajl_gen_integer(g, opts->version.major);
+  publish_gen_str(g, "minor");
+  yajl_gen_integer(g, opts->version.minor);
+  publish_gen_str(g, "patch");
+  yajl_gen_integer(g, opts->version.patch);
+  publish_gen_kv(g, "prerelease", opts->version.prerelease);
+  publish_gen_kv(g, "meta", opts->version.meta);
+  yajl_gen_map_close(g);
+
+  if(opts->manifest_signature) {
+    publish_gen_str(g, "manifest");
+    yajl_gen_map_open(g);
+    publish_gen_str(g, "url");
+    publish_gen_url(g, opts, SXUPDATE_MANIFEST_FILENAME, "");
+    publish_gen_kv(g, "signature", opts->manifest_signature);
+    yajl_gen_map_close(g);
+  }
+
+  if(opts->rollout_percentage) {
+    publish_gen_str(g, "rollout");
+    yajl_gen_map_open(g);
+    publish_gen_str(g, "percentage");
+    yajl_gen_number(g, opts->rollout_percentage, strlen(opts->rollout_percentage));
+    publish_gen_str(g, "start");
+    yajl_gen_integer(g, opts->rollout_start);
+    if(opts->rollout_ramp) {
+      publish_gen_str(g, "ramp");
+      yajl_gen_integer(g, opts->rollout_ramp);
+    }
+    yajl_gen_map_close(g);
+  }
+
+  if(!a) { // manifest only
+    yajl_gen_map_close(g);
+    return;
+  }
+  publish_gen_str(g, "enclosure");
+  yajl_gen_map_open(g);
+  publish_gen_str(g, "url");
+  publish_gen_url(g, opts, a->filename, opts->encoding_name ? opts->encoding_name : "");
+  publish_gen_str(g, "length");
+  yajl_gen_integer(g, (long long)(a->encoded_path ? a->encoded_length : a->length));
+  publish_gen_kv(g, "encoding", opts->encoding_name);
+  if(a->blocks_path) {
+    publish_gen_str(g, "blocks");
+    publish_gen_url(g, opts, a->filename, "blocks");
+  }
+  publish_gen_kv(g, "type", opts->type);
+  publish_gen_kv(g, "filename", a->filename);
+  publish_gen_kv(g, "signature", a->signature);
+  yajl_gen_map_close(g);
+
+  yajl_gen_map_close(g);
+}
+
+/* write out, and free, the generated JSON */
+static int publish_write_gen(yajl_gen g, const char *output) {
+  const unsigned char *buf;
+  size_t len;
+  yajl_gen_get_buf(g, &buf, &len);
+
+  int err = 0;
+  FILE *f = output ? fopen(output, "wb") : stdout;
+  if(!f)
+    err = errno;
+  else {
+    if(fwrite(buf, 1, len, f) != len)
+      err = EIO;
+    if(f != stdout)
+      fclose(f);
+  }
+  if(err)
+    sxupdate_log_error(NULL, "publish.write", "%s: %s", output ? output : "stdout", strerror(err));
+  yajl_gen_free(g);
+  return err;
+}
+
+/* split "platform/arch/channel" in place; missing or empty fields are NULL */
+static int publish_parse_shard(char *s, char *fields[3]) {
+  for(int i = 0; i < 3; i++) {
+    char *slash = s ? strchr(s, '/') : NULL;
+    if(slash)
+      *slash = '\0';
+    fields[i] = s && *s ? s : NULL;
+    s = slash ? slash + 1 : NULL;
+  }
+  return s != NULL; // more than 3 fields
+}
+
+/* map the shard of each artifact to its appcast, written beside the index by --output-dir */
+static int publish_write_index(struct publish_opts *opts, const char *output) {
+  yajl_gen g = yajl_gen_alloc(sxupdate_mem_yajl_funcs());
+  if(!g)
+    return ENOMEM;
+  yajl_gen_config(g, yajl_gen_beautify, 1);
+
+  static const char *names[3] = { "platform", "arch", "channel" };
+  yajl_gen_map_open(g);
+  publish_gen_str(g, "shards");
+  yajl_gen_array_open(g);
+  for(size_t i = 0; i < opts->artifact_count; i++) {
+    struct publish_artifact *a = &opts->artifacts[i];
+    char *fields[3] = { NULL, NULL, NULL };
+    char *shard = a->shard ? strdup(a->shard) : NULL;
+    char *url = malloc(strlen(a->filename) + sizeof(".json"));
+    if(!url || (a->shard && !shard)) {
+      free(shard);
+      free(url);
+      yajl_gen_free(g);
+      return ENOMEM;
+    }
+    publish_parse_shard(shard, fields);
+    sprintf(url, "%s.json", a->filename);
+    yajl_gen_map_open(g);
+    for(int j = 0; j < 3; j++)
+      publish_gen_kv(g, names[j], fields[j]);
+    publish_gen_kv(g, "url", url);
+    yajl_gen_map_close(g);
+    free(shard);
+    free(url);
+  }
+  yajl_gen_array_close(g);
+  yajl_gen_map_close(g);
+  return publish_write_gen(g, output);
+}
+
+static int publish_write_appcast(struct publish_opts *opts, struct publish_artifact *artifacts,
+                                 size_t count, const char *output) {
+  yajl_gen g = yajl_gen_alloc(sxupdate_mem_yajl_funcs());
+  if(!g)
+    return ENOMEM;
+  yajl_gen_config(g, yajl_gen_beautify, 1);
+
+  yajl_gen_map_open(g);
+  publish_gen_str(g, "items");
+  yajl_gen_array_open(g);
+  for(size_t i = 0; i < count; i++)
+    publish_gen_item(g, opts, &artifacts[i]);
+  if(!count)
+    publish_gen_item(g, opts, NULL);
+  yajl_gen_array_close(g);
+  yajl_gen_map_close(g);
+  return publish_write_gen(g, output);
+}
+
+int main(int argc, char *argv[]) {
+  struct publish_opts opts = { 0 };
+  const char *key_path = NULL;
+  const char *version = NULL;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int verbose = 0;
+  const char *shard = NULL; // for the next installer
+
+  opts.artifacts = calloc(argc, sizeof(*opts.artifacts));
+  if(!opts.artifacts) {
+    fprintf(stderr, "Out of memory!\n");
+    return 1;
+  }
+
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+#define publish_opt(short_name, long_name) \
+    ((*short_name && !strcmp(arg, short_name)) || !strcmp(arg, long_name))
+#define publish_optarg() (i + 1 < argc ? argv[++i] : (publish_usage(argv[0]), exit(1), NULL))
+    if(publish_opt("-h", "--help")) {
+      publish_usage(argv[0]);
+      return 0;
+    } else if(publish_opt("-k", "--key"))
+      key_path = publish_optarg();
+    else if(publish_opt("-V", "--version"))
+      version = publish_optarg();
+    else if(publish_opt("-o", "--output"))
+      opts.output = publish_optarg();
+    else if(publish_opt("-d", "--output-dir"))
+      opts.output_dir = publish_optarg();
+    else if(publish_opt("-I", "--index"))
+      opts.index = 1;
+    else if(publish_opt("-s", "--shard")) {
+      char *fields[3], *copy = strdup(shard = publish_optarg());
+      int bad = !copy || publish_parse_shard(copy, fields);
+      free(copy);
+      if(bad) {
+        fprintf(stderr, "Invalid shard: %s (expected platform/arch/channel)\n", shard);
+        return 1;
+      }
+    } else if(publish_opt("-u", "--base-url"))
+      opts.base_url = publish_optarg();
+    else if(publish_opt("-j", "--jobs"))
+      jobs = atol(publish_optarg());
+    else if(publish_opt("-e", "--encoding"))
+      opts.encoding_name = publish_optarg();
+    else if(publish_opt("-b", "--blocks"))
+      opts.blocks = 1;
+    else if(publish_opt("", "--block-size"))
+      opts.block_size = (size_t)atol(publish_optarg());
+    else if(publish_opt("-m", "--manifest"))
+      opts.manifest_tree = publish_optarg();
+    else if(publish_opt("-M", "--manifest-dir"))
+      opts.manifest_dir = publish_optarg();
+    else if(publish_opt("-r", "--rollout"))
+      opts.rollout_percentage = publish_optarg();
+    else if(publish_opt("", "--rollout-start"))
+      opts.rollout_start = atoll(publish_optarg());
+    else if(publish_opt("", "--rollout-ramp"))
+      opts.rollout_ramp = atoll(publish_optarg());
+    else if(publish_opt("", "--title"))
+      opts.title = publish_optarg();
+    else if(publish_opt("", "--description"))
+      opts.description = publish_optarg();
+    else if(publish_opt("", "--link"))
+      opts.link = publish_optarg();
+    else if(publish_opt("", "--pub-date"))
+      opts.pub_date = publish_optarg();
+    else if(publish_opt("", "--type"))
+      opts.type = publish_optarg();
+    else if(publish_opt("-v", "--verbose"))
+      verbose = 1;
+    else if(*arg == '-') {
+      fprintf(stderr, "Unrecognized option: %s\n", arg);
+      publish_usage(argv[0]);
+      return 1;
+    } else {
+      struct publish_artifact *a = &opts.artifacts[opts.artifact_count++];
+      const char *slash = strrchr(arg, '/');
+#ifdef _WIN32
+      const char *backslash = strrchr(arg, '\\');
+      if(backslash > slash)
+        slash = backslash;
+#endif
+      a->path = arg;
+      a->filename = slash ? slash + 1 : arg;
+      if(!sxupdate_is_valid_filename(a->filename)) {
+        fprintf(stderr, "Invalid filename: %s (may only contain alphanumeric characters, dash, underscore and period)\n", a->filename);
+        return 1;
+      }
+      a->shard = shard;
+      shard = NULL;
+    }
+  }
+
+  if(!key_path || !version || !(opts.artifact_count || opts.manifest_tree)
+     || (opts.output_dir && !opts.artifact_count)) {
+    publish_usage(argv[0]);
+    return 1;
+  }
+  if(opts.index && !opts.output_dir) {
+    fprintf(stderr, "--index requires --output-dir\n");
+    return 1;
+  }
+  if(shard) {
+    fprintf(stderr, "--shard %s must come before the installer it applies to\n", shard);
+    return 1;
+  }
+  if(publish_parse_version(version, &opts.version)) {
+    fprintf(stderr, "Invalid version: %s\n", version);
+    return 1;
+  }
+  if(opts.encoding_name) {
+    int err = sxupdate_encoding_from_name(opts.encoding_name, &opts.encoding);
+    if(err || opts.encoding == sxupdate_encoding_identity) {
+      fprintf(stderr, "%s encoding: %s\n", err == ENOTSUP ? "Unsupported" : "Invalid", opts.encoding_name);
+      return 1;
+    }
+  }
+  if(opts.blocks && opts.encoding_name) {
+    fprintf(stderr, "--blocks cannot be combined with --encoding\n");
+    return 1;
+  }
+  if(opts.block_size && (opts.block_size < SXUPDATE_BLOCKS_MIN_SIZE || opts.block_size > SXUPDATE_BLOCKS_MAX_SIZE)) {
+    fprintf(stderr, "Invalid block size: %zu\n", opts.block_size);
+    return 1;
+  }
+  if(opts.rollout_percentage) {
+    char *end;
+    double pct = strtod(opts.rollout_percentage, &end);
+    if(end == opts.rollout_percentage || *end || !(pct >= 0 && pct <= 100) || opts.rollout_ramp < 0) {
+      fprintf(stderr, "Invalid rollout: %s%%, over %llis\n", opts.rollout_percentage, opts.rollout_ramp);
+      return 1;
+    }
+    if(!opts.rollout_start)
+      opts.rollout_start = (long long)time(NULL);
+  }
+  if(!(opts.private_key = sxupdate_private_key_from_pem_file(NULL, key_path)))
+    return 1;
+
+  if(jobs < 1)
+    jobs = 1;
+  if((size_t)jobs > opts.artifact_count)
+    jobs = (long)opts.artifact_count;
+
+  int err = 0;
+  if(opts.manifest_tree) {
+    // the manifest is signed like an installer
+    const char *dir = opts.manifest_dir ? opts.manifest_dir : ".";
+    size_t len = strlen(dir) + strlen(SXUPDATE_MANIFEST_FILENAME) + 2;
+    char *path = malloc(len);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    size_t count = 0;
+    if(!path)
+      err = ENOMEM;
+    else {
+      snprintf(path, len, "%s/%s", dir, SXUPDATE_MANIFEST_FILENAME);
+      if((err = sxupdate_manifest_publish(NULL, opts.manifest_tree, dir, &count)))
+        sxupdate_log_error(NULL, "publish.manifest", "%s: %s", opts.manifest_tree, strerror(err));
+      else if((err = sxupdate_sha256_file(path, hash, NULL)))
+        sxupdate_log_error(NULL, "publish.hash", "%s: %s", path, strerror(err));
+      else if(!(opts.manifest_signature = sxupdate_sign_sha256_b64(NULL, opts.private_key, hash)))
+        err = 1;
+      else if(verbose)
+        fprintf(stderr, "Wrote %s (%zu files)\n", path, count);
+    }
+    free(path);
+  }
+
+  // hash and sign
+  pthread_mutex_init(&opts.lock, NULL);
+  pthread_t *threads = calloc(jobs, sizeof(*threads));
+  long started = 0;
+  for(; threads && started < jobs; started++)
+    if(pthread_create(&threads[started], NULL, publish_worker, &opts))
+      break;
+  if(!started && opts.artifact_count)
+    publish_worker(&opts); // no threads available; do it ourselves
+  for(long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&opts.lock);
+
+  for(size_t i = 0; i < opts.artifact_count; i++) {
+    if(opts.artifacts[i].err)
+      err = 1;
+    else if(verbose) {
+      fprintf(stderr, "Signed %s (%zu bytes)\n", opts.artifacts[i].path, opts.artifacts[i].length);
+      if(opts.artifacts[i].encoded_path)
+        fprintf(stderr, "Wrote %s (%zu bytes)\n", opts.artifacts[i].encoded_path, opts.artifacts[i].encoded_length);
+      if(opts.artifacts[i].blocks_path)
+        fprintf(stderr, "Wrote %s\n", opts.artifacts[i].blocks_path);
+    }
+  }
+
+  // generate appcast(s)
+  if(!err) {
+    if(!opts.output_dir)
+      err = publish_write_appcast(&opts, opts.artifacts, opts.artifact_count, opts.output);
+    else {
+      for(size_t i = 0; i < opts.artifact_count && !err; i++) {
+        size_t len = strlen(opts.output_dir) + strlen(opts.artifacts[i].filename) + 7;
+        char *path = malloc(len);
+        if(!path)
+          err = ENOMEM;
+        else {
+          snprintf(path, len, "%s/%s.json", opts.output_dir, opts.artifacts[i].filename);
+          err = publish_write_appcast(&opts, &opts.artifacts[i], 1, path);
+          if(!err && verbose)
+            fprintf(stderr, "Wrote %s\n", path);
+          free(path);
+        }
+      }
+      if(!err && opts.index) {
+        size_t len = strlen(opts.output_dir) + sizeof("/index.json");
+        char *path = malloc(len);
+        if(!path)
+          err = ENOMEM;
+        else {
+          snprintf(path, len, "%s/index.json", opts.output_dir);
+          err = publish_write_index(&opts, path);
+          if(!err && verbose)
+            fprintf(stderr, "Wrote %s\n", path);
+          free(path);
+        }
+      }
+    }
+  }
+
+  for(size_t i = 0; i < opts.artifact_count; i++) {
+    sxupdate_mem_free(opts.artifacts[i].signature);
+    free(opts.artifacts[i].encoded_path);
+    free(opts.artifacts[i].blocks_path);
+  }
+  free(opts.artifacts);
+  sxupdate_mem_free(opts.manifest_signature);
+  free(opts.version.prerelease);
+  free(opts.version.meta);
+  RSA_free(opts.private_key);
+  return err ? 1 : 0;
+}
@@ -0,0 +1,1019 @@
+/***
+ * sxupdate-serve: local caching mirror for appcasts and installers
+ *
+ * Proxies GET/HEAD requests to an upstream base URL and caches the responses on disk.
+ * Concurrent requests for the same uncached path are coalesced into a single upstream
+ * fetch. Cached files are served with ETag / If-None-Match and single-range Range
+ * support. Everything runs on one thread: client sockets and libcurl's upstream sockets
+ * share a single epoll (or poll) loop
+ */
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <curl/curl.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <poll.h>
+#endif
+
+#define SERVE_REQUEST_MAX 8192
+#define SERVE_HEADER_MAX 1024
+#define SERVE_ETAG_MAX 128
+#define SERVE_HASH_BUCKETS 1024
+#define SERVE_MAX_EVENTS 256
+#define SERVE_COPY_BUFFER_SIZE (64 * 1024)
+
+enum serve_watch_kind {
+  serve_watch_listener = 1,
+  serve_watch_conn,
+  serve_watch_curl
+};
+
+/* anything registered with the event loop starts with this */
+struct serve_watch {
+  enum serve_watch_kind kind;
+  int fd;
+  unsigned int events; // SERVE_IN | SERVE_OUT
+};
+
+#define SERVE_IN 1
+#define SERVE_OUT 2
+
+enum serve_entry_state {
+  serve_entry_empty = 0,
+  serve_entry_fetching,
+  serve_entry_ready
+};
+
+struct serve_conn;
+
+struct serve_entry { // cache entry for one request path
+  struct serve_entry *next; // hash chain
+  char *path;               // request path e.g. /appcast.json
+  char *file;               // cache file
+  char etag[SERVE_ETAG_MAX];
+  time_t fetched_at;
+  enum serve_entry_state state;
+  unsigned char have_file:1;
+  unsigned char _:7;
+
+  struct serve_conn *waiters; // clients waiting on the upstream fetch
+
+  // in-flight upstream fetch
+  CURL *curl;
+  struct curl_slist *headers;
+  FILE *part;
+  char *part_path;
+  char new_etag[SERVE_ETAG_MAX];
+  long last_status; // status of the last failed upstream fetch, if any
+};
+
+struct serve_conn {
+  struct serve_watch watch;
+  struct serve_conn *next_waiter;
+
+  char req[SERVE_REQUEST_MAX];
+  size_t req_len;
+
+  // parsed request
+  char path[SERVE_REQUEST_MAX];
+  char if_none_match[SERVE_ETAG_MAX];
+  int have_range;
+  long long range_start, range_end; // range_start < 0 means suffix range of -range_start bytes
+  unsigned char head_only:1;
+  unsigned char keep_alive:1;
+  unsigned char waiting:1;
+  unsigned char writing:1;
+  unsigned char _:4;
+
+  // response
+  char hdr[SERVE_HEADER_MAX];
+  size_t hdr_len, hdr_sent;
+  int file_fd;
+  off_t offset, end; // body bytes remaining to send: [offset, end)
+};
+
+struct serve_curl_socket {
+  struct serve_watch watch;
+};
+
+static struct {
+  const char *upstream; // base url, without trailing slash
+  const char *cache_dir;
+  long ttl; // seconds before a cached .json is revalidated upstream
+  int verbose;
+
+  int loop_fd; // epoll
+#ifndef __linux__
+  struct serve_watch **watches; // poll() fallback
+  size_t watch_count, watch_max;
+#endif
+
+  struct serve_watch listener;
+  CURLM *multi;
+  long curl_timeout_ms;
+  double curl_deadline; // serve_now() time curl's timer expires, if curl_timeout_ms >= 0
+
+  struct serve_entry *entries[SERVE_HASH_BUCKETS];
+
+  volatile sig_atomic_t stop;
+} serve;
+
+/*** event loop ***/
+
+static int serve_watch_set(struct serve_watch *w, unsigned int events) {
+  unsigned int old = w->events;
+  w->events = events;
+#ifdef __linux__
+  struct epoll_event ev = { 0 };
+  ev.events = (events & SERVE_IN ? EPOLLIN : 0) | (events & SERVE_OUT ? EPOLLOUT : 0);
+  ev.data.ptr = w;
+  if(!old && !events)
+    return 0;
+  if(!events)
+    return epoll_ctl(serve.loop_fd, EPOLL_CTL_DEL, w->fd, &ev);
+  return epoll_ctl(serve.loop_fd, old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w->fd, &ev);
+#else
+  if(!old && events) {
+    if(serve.watch_count == serve.watch_max) {
+      size_t n = serve.watch_max ? serve.watch_max * 2 : 64;
+      struct serve_watch **tmp = realloc(serve.watches, n * sizeof(*tmp));
+      if(!tmp)
+        return -1;
+      serve.watches = tmp;
+      serve.watch_max = n;
+    }
+    serve.watches[serve.watch_count++] = w;
+  } else if(old && !events) {
+    for(size_t i = 0; i < serve.watch_count; i++)
+      if(serve.watches[i] == w) {
+        serve.watches[i] = serve.watches[--serve.watch_count];
+        break;
+      }
+  }
+  return 0;
+#endif
+}
+
+static void serve_handle_event(struct serve_watch *w, unsigned int events, int err);
+
+static double serve_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void serve_loop_wait(void) {
+  int timeout = 1000;
+  if(serve.curl_timeout_ms >= 0) {
+    double left = serve.curl_deadline - serve_now();
+    timeout = left <= 0 ? 0 : left < 1 ? (int)(left * 1000) + 1 : 1000;
+  }
+#ifdef __linux__
+  struct epoll_event events[SERVE_MAX_EVENTS];
+  int n = epoll_wait(serve.loop_fd, events, SERVE_MAX_EVENTS, timeout);
+  for(int i = 0; i < n; i++)
+    serve_handle_event(events[i].data.ptr,
+                       (events[i].events & EPOLLIN ? SERVE_IN : 0) | (events[i].events & EPOLLOUT ? SERVE_OUT : 0),
+                       !!(events[i].events & (EPOLLERR | EPOLLHUP)));
+#else
+  size_t count = serve.watch_count;
+  struct pollfd *fds = calloc(count ? count : 1, sizeof(*fds));
+  struct serve_watch **watches = malloc((count ? count : 1) * sizeof(*watches));
+  int n = -1;
+  if(fds && watches) {
+    for(size_t i = 0; i < count; i++) {
+      watches[i] = serve.watches[i];
+      fds[i].fd = watches[i]->fd;
+      fds[i].events = (watches[i]->events & SERVE_IN ? POLLIN : 0) | (watches[i]->events & SERVE_OUT ? POLLOUT : 0);
+    }
+    n = poll(fds, count, timeout);
+    // handlers may unregister watches, so dispatch from the snapshot
+    for(size_t i = 0; n > 0 && i < count; i++)
+      if(fds[i].revents)
+        serve_handle_event(watches[i],
+                           (fds[i].revents & POLLIN ? SERVE_IN : 0) | (fds[i].revents & POLLOUT ? SERVE_OUT : 0),
+                           !!(fds[i].revents & (POLLERR | POLLHUP)));
+  }
+  free(fds);
+  free(watches);
+#endif
+  // however busy the sockets, curl's timeouts and retries must still run once due
+  if(serve.curl_timeout_ms >= 0 && serve_now() >= serve.curl_deadline) {
+    int running;
+    curl_multi_socket_action(serve.multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  }
+}
+
+/*** cache entries ***/
+
+static unsigned long long serve_hash(const char *s) {
+  unsigned long long h = 14695981039346656037ULL; // FNV-1a
+  for(; *s; s++)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return h;
+}
+
+static int serve_is_metadata(const char *path) {
+  size_t len = strlen(path);
+  return len > 5 && !strcasecmp(path + len - 5, ".json");
+}
+
+static void serve_entry_load_meta(struct serve_entry *e) {
+  struct stat st;
+  if(stat(e->file, &st) || !S_ISREG(st.st_mode))
+    return;
+
+  size_t len = strlen(e->file) + 6;
+  char *meta = malloc(len);
+  if(!meta)
+    return;
+  snprintf(meta, len, "%s.meta", e->file);
+  FILE *f = fopen(meta, "rb");
+  if(f) {
+    if(fgets(e->etag, sizeof(e->etag), f))
+      e->etag[strcspn(e->etag, "\r\n")] = '\0';
+    struct stat mst;
+    e->fetched_at = fstat(fileno(f), &mst) ? st.st_mtime : mst.st_mtime;
+    fclose(f);
+  } else
+    e->fetched_at = st.st_mtime;
+  free(meta);
+
+  if(!*e->etag)
+    snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx\"",
+             (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+  e->have_file = 1;
+  e->state = serve_entry_ready;
+}
+
+static struct serve_entry *serve_entry_get(const char *path) {
+  unsigned long long h = serve_hash(path);
+  struct serve_entry **bucket = &serve.entries[h % SERVE_HASH_BUCKETS];
+  for(struct serve_entry *e = *bucket; e; e = e->next)
+    if(!strcmp(e->path, path))
+      return e;
+
+  struct serve_entry *e = calloc(1, sizeof(*e));
+  if(!e)
+    return NULL;
+  const char *base = strrchr(path, '/');
+  base = base && base[1] ? base + 1 : "index";
+  size_t len = strlen(serve.cache_dir) + strlen(base) + 20;
+  e->path = strdup(path);
+  e->file = malloc(len);
+  if(!(e->path && e->file)) {
+    free(e->path);
+    free(e->file);
+    free(e);
+    return NULL;
+  }
+  snprintf(e->file, len, "%s/%016llx-%s", serve.cache_dir, h, base);
+  serve_entry_load_meta(e);
+  e->next = *bucket;
+  *bucket = e;
+  return e;
+}
+
+static int serve_entry_fresh(struct serve_entry *e) {
+  if(e->state != serve_entry_ready || !e->have_file)
+    return 0;
+  if(!serve_is_metadata(e->path))
+    return 1; // installers are immutable
+  return time(NULL) - e->fetched_at < serve.ttl;
+}
+
+/*** responses ***/
+
+static void serve_conn_close(struct serve_conn *c) {
+  serve_watch_set(&c->watch, 0);
+  close(c->watch.fd);
+  if(c->file_fd >= 0)
+    close(c->file_fd);
+  free(c);
+}
+
+static void serve_conn_reset(struct serve_conn *c) {
+  if(c->file_fd >= 0)
+    close(c->file_fd);
+  c->file_fd = -1;
+  c->hdr_len = c->hdr_sent = 0;
+  c->offset = c->end = 0;
+  c->waiting = c->writing = 0;
+  c->have_range = 0;
+  *c->if_none_match = '\0';
+}
+
+static void serve_conn_flush(struct serve_conn *c);
+static void serve_conn_read(struct serve_conn *c);
+
+static void serve_conn_respond_status(struct serve_conn *c, int status, const char *reason,
+                                      const char *extra_headers) {
+  c->hdr_len = snprintf(c->hdr, sizeof(c->hdr),
+                        "HTTP/1.1 %i %s\r\n"
+                        "Content-Length: 0\r\n"
+                        "%s"
+                        "Connection: %s\r\n\r\n",
+                        status, reason, extra_headers ? extra_headers : "",
+                        c->keep_alive ? "keep-alive" : "close");
+  c->writing = 1;
+  serve_conn_flush(c);
+}
+
+static void serve_conn_respond(struct serve_conn *c, struct serve_entry *e) {
+  c->waiting = 0;
+  if(!e->have_file) {
+    if(e->last_status == 404)
+      serve_conn_respond_status(c, 404, "Not Found", NULL);
+    else
+      serve_conn_respond_status(c, 502, "Bad Gateway", NULL);
+    return;
+  }
+
+  char etag_header[SERVE_ETAG_MAX + 16];
+  snprintf(etag_header, sizeof(etag_header), "ETag: %s\r\n", e->etag);
+  if(*c->if_none_match && (!strcmp(c->if_none_match, e->etag) || !strcmp(c->if_none_match, "*"))) {
+    serve_conn_respond_status(c, 304, "Not Modified", etag_header);
+    return;
+  }
+
+  int fd = open(e->file, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)) {
+    if(fd >= 0)
+      close(fd);
+    serve_conn_respond_status(c, 500, "Internal Server Error", NULL);
+    return;
+  }
+
+  long long size = (long long)st.st_size;
+  long long start = 0, end = size; // [start, end)
+  int status = 200;
+  if(c->have_range) {
+    if(c->range_start < 0) { // suffix range
+      start = size + c->range_start > 0 ? size + c->range_start : 0;
+    } else {
+      start = c->range_start;
+      if(c->range_end >= 0 && c->range_end + 1 < size)
+        end = c->range_end + 1;
+    }
+    if(start >= size || start >= end) {
+      close(fd);
+      char range_header[64];
+      snprintf(range_header, sizeof(range_header), "Content-Range: bytes */%lli\r\n", size);
+      serve_conn_respond_status(c, 416, "Range Not Satisfiable", range_header);
+      return;
+    }
+    status = 206;
+  }
+
+  char range_header[96] = "";
+  if(status == 206)
+    snprintf(range_header, sizeof(range_header), "Content-Range: bytes %lli-%lli/%lli\r\n",
+             start, end - 1, size);
+
+  c->hdr_len = snprintf(c->hdr, sizeof(c->hdr),
+                        "HTTP/1.1 %i %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %lli\r\n"
+                        "Accept-Ranges: bytes\r\n"
+                        "%s%s"
+                        "Connection: %s\r\n\r\n",
+                        status, status == 206 ? "Partial Content" : "OK",
+                        serve_is_metadata(e->path) ? "application/json" : "application/octet-stream",
+                        end - start, etag_header, range_header,
+                        c->keep_alive ? "keep-alive" : "close");
+  if(c->head_only)
+    close(fd);
+  else {
+    c->file_fd = fd;
+    c->offset = (off_t)start;
+    c->end = (off_t)end;
+  }
+  c->writing = 1;
+  serve_conn_flush(c);
+}
+
+/* send as much of the pending response as the socket will take */
+static void serve_conn_flush(struct serve_conn *c) {
+  while(c->hdr_sent < c->hdr_len) {
+    ssize_t n = send(c->watch.fd, c->hdr + c->hdr_sent, c->hdr_len - c->hdr_sent, MSG_NOSIGNAL);
+    if(n < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        serve_watch_set(&c->watch, SERVE_OUT);
+        return;
+      }
+      serve_conn_close(c);
+      return;
+    }
+    c->hdr_sent += n;
+  }
+
+  while(c->file_fd >= 0 && c->offset < c->end) {
+    size_t want = (size_t)(c->end - c->offset);
+    ssize_t n;
+#ifdef __linux__
+    n = sendfile(c->watch.fd, c->file_fd, &c->offset, want);
+#else
+    char buff[SERVE_COPY_BUFFER_SIZE];
+    if(want > sizeof(buff))
+      want = sizeof(buff);
+    n = pread(c->file_fd, buff, want, c->offset);
+    if(n > 0 && (n = send(c->watch.fd, buff, n, MSG_NOSIGNAL)) > 0)
+      c->offset += n;
+#endif
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      serve_watch_set(&c->watch, SERVE_OUT);
+      return;
+    }
+    if(n <= 0) {
+      serve_conn_close(c);
+      return;
+    }
+  }
+
+  // response complete
+  if(!c->keep_alive) {
+    serve_conn_close(c);
+    return;
+  }
+  serve_conn_reset(c);
+  serve_watch_set(&c->watch, SERVE_IN);
+  if(c->req_len) // pipelined request already received
+    serve_conn_read(c);
+}
+
+/*** upstream ***/
+
+static size_t serve_upstream_write(char *ptr, size_t size, size_t nmemb, void *p) {
+  struct serve_entry *e = p;
+  return fwrite(ptr, size, nmemb, e->part) * size;
+}
+
+static size_t serve_upstream_header(char *ptr, size_t size, size_t nmemb, void *p) {
+  struct serve_entry *e = p;
+  size_t len = size * nmemb;
+  if(len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+    const char *v = ptr + 5;
+    while(*v == ' ' || *v == '\t')
+      v++;
+    size_t vlen = len - (v - ptr);
+    while(vlen && strchr("\r\n \t", v[vlen-1]))
+      vlen--;
+    if(vlen < sizeof(e->new_etag)) {
+      memcpy(e->new_etag, v, vlen);
+      e->new_etag[vlen] = '\0';
+    }
+  }
+  return len;
+}
+
+static void serve_upstream_start(struct serve_entry *e) {
+  size_t len = strlen(serve.upstream) + strlen(e->path) + 1;
+  char *url = malloc(len);
+  size_t plen = strlen(e->file) + 6;
+  e->part_path = malloc(plen);
+  if(!(url && e->part_path))
+    goto fail;
+  snprintf(url, len, "%s%s", serve.upstream, e->path);
+  snprintf(e->part_path, plen, "%s.part", e->file);
+
+  if(!(e->part = fopen(e->part_path, "wb")) || !(e->curl = curl_easy_init()))
+    goto fail;
+
+  *e->new_etag = '\0';
+  curl_easy_setopt(e->curl, CURLOPT_URL, url);
+  curl_easy_setopt(e->curl, CURLOPT_PRIVATE, e);
+  curl_easy_setopt(e->curl, CURLOPT_WRITEFUNCTION, serve_upstream_write);
+  curl_easy_setopt(e->curl, CURLOPT_WRITEDATA, e);
+  curl_easy_setopt(e->curl, CURLOPT_HEADERFUNCTION, serve_upstream_header);
+  curl_easy_setopt(e->curl, CURLOPT_HEADERDATA, e);
+  curl_easy_setopt(e->curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+  if(e->have_file && *e->etag) { // revalidate
+    char h[SERVE_ETAG_MAX + 20];
+    snprintf(h, sizeof(h), "If-None-Match: %s", e->etag);
+    // curl copies the url, but not the header list, which must live until the fetch is done
+    e->headers = curl_slist_append(NULL, h);
+    curl_easy_setopt(e->curl, CURLOPT_HTTPHEADER, e->headers);
+  }
+
+  if(serve.verbose)
+    fprintf(stderr, "upstream: fetching %s\n", url);
+  if(curl_multi_add_handle(serve.multi, e->curl) == CURLM_OK) {
+    e->state = serve_entry_fetching;
+    free(url);
+    return;
+  }
+
+ fail:
+  free(url);
+  curl_slist_free_all(e->headers);
+  e->headers = NULL;
+  if(e->curl)
+    curl_easy_cleanup(e->curl);
+  e->curl = NULL;
+  if(e->part) {
+    fclose(e->part);
+    unlink(e->part_path);
+  }
+  e->part = NULL;
+  free(e->part_path);
+  e->part_path = NULL;
+  e->state = e->have_file ? serve_entry_ready : serve_entry_empty;
+  e->last_status = 0;
+}
+
+static void serve_upstream_done(struct serve_entry *e, CURLcode res) {
+  long status = 0;
+  curl_easy_getinfo(e->curl, CURLINFO_RESPONSE_CODE, &status);
+  if(res == CURLE_OK && status == 0)
+    status = 200; // e.g. file://
+  else if(res == CURLE_FILE_COULDNT_READ_FILE)
+    status = 404;
+  else if(res != CURLE_OK)
+    status = 0;
+
+  curl_multi_remove_handle(serve.multi, e->curl);
+  curl_easy_cleanup(e->curl);
+  curl_slist_free_all(e->headers);
+  e->headers = NULL;
+  e->curl = NULL;
+  fclose(e->part);
+  e->part = NULL;
+
+  if(status == 200) {
+    if(rename(e->part_path, e->file) == 0) {
+      struct stat st;
+      if(*e->new_etag)
+        strcpy(e->etag, e->new_etag);
+      else if(!stat(e->file, &st))
+        snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx\"",
+                 (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+      size_t len = strlen(e->file) + 6;
+      char *meta = malloc(len);
+      if(meta) {
+        snprintf(meta, len, "%s.meta", e->file);
+        FILE *f = fopen(meta, "wb");
+        if(f) {
+          fprintf(f, "%s\n", e->etag);
+          fclose(f);
+        }
+        free(meta);
+      }
+      e->have_file = 1;
+    }
+  } else
+    unlink(e->part_path);
+  free(e->part_path);
+  e->part_path = NULL;
+
+  if(status == 200 || status == 304)
+    e->fetched_at = time(NULL);
+  e->last_status = status;
+  e->state = e->have_file ? serve_entry_ready : serve_entry_empty;
+  if(serve.verbose)
+    fprintf(stderr, "upstream: %s -> %li\n", e->path, status);
+
+  // fan out to everyone who was waiting on this fetch
+  struct serve_conn *waiters = e->waiters;
+  e->waiters = NULL;
+  for(struct serve_conn *next, *c = waiters; c; c = next) {
+    next = c->next_waiter;
+    serve_conn_respond(c, e);
+  }
+}
+
+static void serve_upstream_check_done(void) {
+  CURLMsg *msg;
+  int left;
+  while((msg = curl_multi_info_read(serve.multi, &left))) {
+    if(msg->msg == CURLMSG_DONE) {
+      struct serve_entry *e = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&e);
+      if(e)
+        serve_upstream_done(e, msg->data.result);
+    }
+  }
+}
+
+static int serve_curl_socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+  (void)(easy);
+  (void)(userp);
+  struct serve_curl_socket *cs = socketp;
+  if(what == CURL_POLL_REMOVE) {
+    if(cs) {
+      serve_watch_set(&cs->watch, 0);
+      free(cs);
+      curl_multi_assign(serve.multi, s, NULL);
+    }
+    return 0;
+  }
+  if(!cs) {
+    if(!(cs = calloc(1, sizeof(*cs))))
+      return -1;
+    cs->watch.kind = serve_watch_curl;
+    cs->watch.fd = s;
+    curl_multi_assign(serve.multi, s, cs);
+  }
+  serve_watch_set(&cs->watch, (what & CURL_POLL_IN ? SERVE_IN : 0) | (what & CURL_POLL_OUT ? SERVE_OUT : 0));
+  return 0;
+}
+
+static int serve_curl_timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+  (void)(multi);
+  (void)(userp);
+  serve.curl_timeout_ms = timeout_ms;
+  serve.curl_deadline = serve_now() + (timeout_ms > 0 ? timeout_ms / 1e3 : 0);
+  return 0;
+}
+
+/*** requests ***/
+
+static const char *serve_header_value(const char *headers, const char *name, size_t *len) {
+  size_t name_len = strlen(name);
+  for(const char *line = headers; line && *line; ) {
+    const char *eol = strstr(line, "\r\n");
+    if(!eol || eol == line)
+      break;
+    if((size_t)(eol - line) > name_len && !strncasecmp(line, name, name_len) && line[name_len] == ':') {
+      const char *v = line + name_len + 1;
+      while(*v == ' ' || *v == '\t')
+        v++;
+      *len = eol - v;
+      while(*len && (v[*len-1] == ' ' || v[*len-1] == '\t'))
+        (*len)--;
+      return v;
+    }
+    line = eol + 2;
+  }
+  return NULL;
+}
+
+/* parse "bytes=a-b", "bytes=a-" or "bytes=-n". Multiple ranges are not supported */
+static int serve_parse_range(struct serve_conn *c, const char *v, size_t len) {
+  if(len < 7 || strncmp(v, "bytes=", 6) || memchr(v, ',', len))
+    return 0;
+  char spec[64];
+  if(len - 6 >= sizeof(spec))
+    return 0;
+  memcpy(spec, v + 6, len - 6);
+  spec[len - 6] = '\0';
+  char *dash = strchr(spec, '-');
+  if(!dash)
+    return 0;
+  char *end;
+  if(dash == spec) {
+    long long n = strtoll(dash + 1, &end, 10);
+    if(*end || n <= 0)
+      return 0;
+    c->range_start = -n;
+    c->range_end = -1;
+  } else {
+    *dash = '\0';
+    c->range_start = strtoll(spec, &end, 10);
+    if(*end || c->range_start < 0)
+      return 0;
+    c->range_end = -1;
+    if(dash[1]) {
+      c->range_end = strtoll(dash + 1, &end, 10);
+      if(*end || c->range_end < c->range_start)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/* the blank line ending the request headers, or NULL (memmem() is not portable) */
+static char *serve_headers_end(char *req, size_t len) {
+  for(size_t i = 0; i + 4 <= len; i++)
+    if(!memcmp(req + i, "\r\n\r\n", 4))
+      return req + i;
+  return NULL;
+}
+
+/* return 1 if a full request was parsed, 0 if more data is needed, -1 on error */
+static int serve_conn_parse(struct serve_conn *c) {
+  char *end = serve_headers_end(c->req, c->req_len);
+  if(!end)
+    return c->req_len == sizeof(c->req) ? -1 : 0;
+  end[2] = '\0'; // keep the last header's line ending
+  size_t consumed = end - c->req + 4;
+
+  char method[8], version[16];
+  char *sp1 = strchr(c->req, ' ');
+  char *sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+  char *eol = strstr(c->req, "\r\n");
+  if(!eol)
+    eol = end;
+  if(!sp1 || !sp2 || sp2 > eol || sp1 - c->req >= (int)sizeof(method)
+     || eol - sp2 - 1 >= (int)sizeof(version))
+    return -1;
+  memcpy(method, c->req, sp1 - c->req);
+  method[sp1 - c->req] = '\0';
+  memcpy(c->path, sp1 + 1, sp2 - sp1 - 1);
+  c->path[sp2 - sp1 - 1] = '\0';
+  memcpy(version, sp2 + 1, eol - sp2 - 1);
+  version[eol - sp2 - 1] = '\0';
+
+  char *query = strchr(c->path, '?');
+  if(query)
+    *query = '\0';
+
+  c->head_only = !strcmp(method, "HEAD");
+  c->keep_alive = !strcmp(version, "HTTP/1.1");
+
+  const char *headers = eol + 2;
+  size_t len;
+  const char *v;
+  if((v = serve_header_value(headers, "Connection", &len))) {
+    if(len == 5 && !strncasecmp(v, "close", 5))
+      c->keep_alive = 0;
+    else if(len == 10 && !strncasecmp(v, "keep-alive", 10))
+      c->keep_alive = 1;
+  }
+  if((v = serve_header_value(headers, "If-None-Match", &len)) && len < sizeof(c->if_none_match)) {
+    memcpy(c->if_none_match, v, len);
+    c->if_none_match[len] = '\0';
+  }
+  if((v = serve_header_value(headers, "Range", &len)))
+    c->have_range = serve_parse_range(c, v, len);
+
+  // keep any pipelined bytes for the next request
+  memmove(c->req, c->req + consumed, c->req_len - consumed);
+  c->req_len -= consumed;
+
+  if(strcmp(method, "GET") && !c->head_only)
+    return 2;
+  if(*c->path != '/' || strstr(c->path, "..") || strstr(c->path, "//"))
+    return 3;
+  return 1;
+}
+
+static void serve_conn_read(struct serve_conn *c) {
+  while(!c->writing && !c->waiting) {
+    int rc = serve_conn_parse(c);
+    if(rc < 0) {
+      serve_conn_close(c);
+      return;
+    }
+    if(rc == 2) {
+      c->keep_alive = 0;
+      serve_conn_respond_status(c, 405, "Method Not Allowed", NULL);
+      return;
+    }
+    if(rc == 3) {
+      serve_conn_respond_status(c, 400, "Bad Request", NULL);
+      return;
+    }
+    if(rc == 1) {
+      struct serve_entry *e = serve_entry_get(c->path);
+      if(!e) {
+        serve_conn_respond_status(c, 500, "Internal Server Error", NULL);
+        return;
+      }
+      if(serve_entry_fresh(e)) {
+        serve_conn_respond(c, e);
+        return;
+      }
+      // wait for the (possibly already in-flight) upstream fetch
+      c->waiting = 1;
+      c->next_waiter = e->waiters;
+      e->waiters = c;
+      serve_watch_set(&c->watch, 0);
+      if(e->state != serve_entry_fetching)
+        serve_upstream_start(e);
+      if(e->state != serve_entry_fetching) { // could not start
+        e->waiters = c->next_waiter;
+        serve_conn_respond(c, e);
+      }
+      return;
+    }
+
+    ssize_t n = recv(c->watch.fd, c->req + c->req_len, sizeof(c->req) - c->req_len, 0);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if(n <= 0) {
+      serve_conn_close(c);
+      return;
+    }
+    c->req_len += n;
+  }
+}
+
+static void serve_accept(void) {
+  while(1) {
+    int fd = accept(serve.listener.fd, NULL, NULL);
+    if(fd < 0)
+      return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct serve_conn *c = calloc(1, sizeof(*c));
+    if(!c) {
+      close(fd);
+      continue;
+    }
+    c->watch.kind = serve_watch_conn;
+    c->watch.fd = fd;
+    c->file_fd = -1;
+    if(serve_watch_set(&c->watch, SERVE_IN)) {
+      close(fd);
+      free(c);
+    }
+  }
+}
+
+static void serve_handle_event(struct serve_watch *w, unsigned int events, int err) {
+  switch(w->kind) {
+  case serve_watch_listener:
+    serve_accept();
+    break;
+  case serve_watch_conn:
+    {
+      struct serve_conn *c = (struct serve_conn *)w;
+      if(err && !(events & SERVE_IN))
+        serve_conn_close(c);
+      else if(c->writing)
+        serve_conn_flush(c);
+      else
+        serve_conn_read(c);
+    }
+    break;
+  case serve_watch_curl:
+    {
+      int running;
+      int flags = (events & SERVE_IN ? CURL_CSELECT_IN : 0) | (events & SERVE_OUT ? CURL_CSELECT_OUT : 0)
+        | (err ? CURL_CSELECT_ERR : 0);
+      curl_multi_socket_action(serve.multi, w->fd, flags, &running);
+    }
+    break;
+  }
+}
+
+/*** main ***/
+
+static void serve_on_signal(int sig) {
+  (void)(sig);
+  serve.stop = 1;
+}
+
+static int serve_listen(const char *host, const char *port) {
+  struct addrinfo hints = { 0 }, *res = NULL;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int rc = getaddrinfo(host, port, &hints, &res);
+  if(rc) {
+    fprintf(stderr, "%s:%s: %s\n", host ? host : "*", port, gai_strerror(rc));
+    return -1;
+  }
+  int fd = -1;
+  for(struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd < 0)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 1024)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if(fd < 0)
+    perror("listen");
+  else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void serve_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s -u upstream_base_url -c cache_dir [options]\n"
+          "Serve and cache appcasts and installers from an upstream URL\n"
+          "\n"
+          "Options:\n"
+          "  -u, --upstream <url>   base url to fetch from, e.g. https://example.com/updates\n"
+          "  -c, --cache <dir>      directory in which to cache fetched files\n"
+          "  -p, --port <port>      port to listen on. Default: 8080\n"
+          "  -b, --bind <address>   address to listen on. Default: all\n"
+          "  -t, --ttl <seconds>    revalidate cached .json files after this long. Default: 300\n"
+          "  -v, --verbose\n",
+          argv0);
+}
+
+int main(int argc, char *argv[]) {
+  const char *port = "8080";
+  const char *host = NULL;
+  serve.ttl = 300;
+  serve.curl_timeout_ms = -1;
+
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+#define serve_opt(short_name, long_name) (!strcmp(arg, short_name) || !strcmp(arg, long_name))
+#define serve_optarg() (i + 1 < argc ? argv[++i] : (serve_usage(argv[0]), exit(1), NULL))
+    if(serve_opt("-h", "--help")) {
+      serve_usage(argv[0]);
+      return 0;
+    } else if(serve_opt("-u", "--upstream"))
+      serve.upstream = serve_optarg();
+    else if(serve_opt("-c", "--cache"))
+      serve.cache_dir = serve_optarg();
+    else if(serve_opt("-p", "--port"))
+      port = serve_optarg();
+    else if(serve_opt("-b", "--bind"))
+      host = serve_optarg();
+    else if(serve_opt("-t", "--ttl"))
+      serve.ttl = atol(serve_optarg());
+    else if(serve_opt("-v", "--verbose"))
+      serve.verbose = 1;
+    else {
+      fprintf(stderr, "Unrecognized option: %s\n", arg);
+      serve_usage(argv[0]);
+      return 1;
+    }
+  }
+  if(!serve.upstream || !serve.cache_dir) {
+    serve_usage(argv[0]);
+    return 1;
+  }
+
+  char *upstream = strdup(serve.upstream);
+  if(!upstream)
+    return 1;
+  for(size_t len = strlen(upstream); len && upstream[len-1] == '/'; len--)
+    upstream[len-1] = '\0';
+  serve.upstream = upstream;
+
+  mkdir(serve.cache_dir, 0755);
+  struct stat st;
+  if(stat(serve.cache_dir, &st) || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "Invalid cache directory: %s\n", serve.cache_dir);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, serve_on_signal);
+  signal(SIGTERM, serve_on_signal);
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  serve.multi = curl_multi_init();
+#ifdef __linux__
+  serve.loop_fd = epoll_create1(0);
+  if(serve.loop_fd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+#endif
+  if(!serve.multi || (serve.listener.fd = serve_listen(host, port)) < 0)
+    return 1;
+  serve.listener.kind = serve_watch_listener;
+  serve_watch_set(&serve.listener, SERVE_IN);
+  curl_multi_setopt(serve.multi, CURLMOPT_SOCKETFUNCTION, serve_curl_socket_callback);
+  curl_multi_setopt(serve.multi, CURLMOPT_TIMERFUNCTION, serve_curl_timer_callback);
+
+  if(serve.verbose)
+    fprintf(stderr, "Serving %s on port %s, caching to %s\n", serve.upstream, port, serve.cache_dir);
+
+  while(!serve.stop) {
+    serve_loop_wait();
+    serve_upstream_check_done();
+  }
+
+  close(serve.listener.fd);
+  curl_multi_cleanup(serve.multi);
+  curl_global_cleanup();
+  free(upstream);
+  return 0;
+}
+
+#else // _WIN32
+
+#include <stdio.h>
+
+int main() {
+  fprintf(stderr, "sxupdate-serve is not supported on this platform\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "internal.h"
+#include "delta.h"
+#include "encoding.h"
+#include "parse.h"
+#include "verify.h"
+#include "qos.h"
+#include "stats.h"
+#include "file.h"
+#include "alloc.h"
+#include "log.h"
+
+#ifdef _WIN32
+#define sxupdate_delta_seek(f, offset) _fseeki64(f, (__int64)(offset), SEEK_SET)
+#else
+#define sxupdate_delta_seek(f, offset) fseeko(f, (off_t)(offset), SEEK_SET)
+#endif
+
+#define SXUPDATE_BLOCKS_LINE_LENGTH (8 + 1 + 2 * SXUPDATE_BLOCKS_STRONG_LENGTH + 1)
+#define SXUPDATE_BLOCKS_FILE_MAX (64 * 1024 * 1024)
+#define SXUPDATE_DELTA_READ_SIZE (1024 * 1024) // seed bytes read at a time
+#define SXUPDATE_DELTA_FILTER_BITS 16 // of the weak checksum, to rule out offsets without a lookup
+
+struct sxupdate_blocks {
+  size_t block_size;
+  uint64_t length;
+  unsigned char digest[SHA256_DIGEST_LENGTH]; // of the whole installer
+  size_t count;
+  uint32_t *weak;
+  unsigned char (*strong)[SXUPDATE_BLOCKS_STRONG_LENGTH];
+};
+
+struct sxupdate_delta_match {
+  uint32_t weak;
+  uint32_t block;
+};
+
+struct sxupdate_delta_range {
+  struct sxupdate_delta *delta;
+  uint64_t start, end; // [start, end) of the installer
+  uint64_t received;
+  CURL *curl;
+};
+
+struct sxupdate_delta {
+  sxupdate_t handle;
+  struct sxupdate_blocks blocks;
+  size_t full;                         // blocks of block_size bytes; the last one may be shorter
+  struct sxupdate_delta_match *index;  // full blocks, by weak checksum
+  unsigned char filter[(1 << SXUPDATE_DELTA_FILTER_BITS) / 8];
+  unsigned char *have;                 // per block: found locally
+  size_t found;
+  FILE *out;
+  const char *url;
+  struct sxupdate_delta_range *ranges;
+  size_t range_count;
+};
+
+/* rsync's rolling checksum: two 16-bit sums, updated in constant time as the window slides */
+struct sxupdate_rolling {
+  uint32_t a, b;
+  size_t len;
+};
+
+static void sxupdate_rolling_init(struct sxupdate_rolling *r, const unsigned char *data, size_t len) {
+  r->a = r->b = 0;
+  r->len = len;
+  for(size_t i = 0; i < len; i++) {
+    r->a += data[i];
+    r->b += (uint32_t)(len - i) * data[i];
+  }
+}
+
+static void sxupdate_rolling_roll(struct sxupdate_rolling *r, unsigned char out, unsigned char in) {
+  r->a += (uint32_t)in - out;
+  r->b += r->a - (uint32_t)r->len * out;
+}
+
+static uint32_t sxupdate_rolling_value(const struct sxupdate_rolling *r) {
+  return (r->b & 0xffff) << 16 | (r->a & 0xffff);
+}
+
+static unsigned sxupdate_delta_filter_key(uint32_t weak) {
+  return (weak ^ weak >> 16) & ((1 << SXUPDATE_DELTA_FILTER_BITS) - 1);
+}
+
+static void sxupdate_blocks_free(struct sxupdate_blocks *blocks) {
+  sxupdate_mem_free(blocks->weak);
+  sxupdate_mem_free(blocks->strong);
+  memset(blocks, 0, sizeof(*blocks));
+}
+
+/* parse a NUL-terminated block-checksum file */
+static int sxupdate_blocks_parse(const char *data, size_t len, struct sxupdate_blocks *blocks) {
+  memset(blocks, 0, sizeof(*blocks));
+  size_t magic_len = strlen(SXUPDATE_BLOCKS_MAGIC);
+  if(len <= magic_len || strncmp(data, SXUPDATE_BLOCKS_MAGIC " ", magic_len + 1))
+    return EINVAL;
+  const char *p = data + magic_len + 1;
+  char *end;
+  if(*p < '0' || *p > '9')
+    return EINVAL;
+  errno = 0;
+  unsigned long long block_size = strtoull(p, &end, 10);
+  if(errno || *end != ' ' || block_size < SXUPDATE_BLOCKS_MIN_SIZE || block_size > SXUPDATE_BLOCKS_MAX_SIZE)
+    return EINVAL;
+  p = end + 1;
+  if(*p < '0' || *p > '9')
+    return EINVAL;
+  unsigned long long length = strtoull(p, &end, 10);
+  if(errno || *end != ' ' || !length)
+    return EINVAL;
+  p = end + 1;
+  if(strlen(p) < 2 * SHA256_DIGEST_LENGTH + 1 || sxupdate_unhex(p, blocks->digest, SHA256_DIGEST_LENGTH)
+     || p[2 * SHA256_DIGEST_LENGTH] != '\n')
+    return EINVAL;
+  p += 2 * SHA256_DIGEST_LENGTH + 1;
+
+  unsigned long long count = (length + block_size - 1) / block_size;
+  if(count > UINT32_MAX || (size_t)(data + len - p) != count * SXUPDATE_BLOCKS_LINE_LENGTH)
+    return EINVAL;
+  blocks->block_size = (size_t)block_size;
+  blocks->length = length;
+  blocks->count = (size_t)count;
+  blocks->weak = sxupdate_mem_alloc(blocks->count * sizeof(*blocks->weak));
+  blocks->strong = sxupdate_mem_alloc(blocks->count * sizeof(*blocks->strong));
+  if(!blocks->weak || !blocks->strong) {
+    sxupdate_blocks_free(blocks);
+    return ENOMEM;
+  }
+  for(size_t i = 0; i < blocks->count; i++, p += SXUPDATE_BLOCKS_LINE_LENGTH) {
+    unsigned char weak[4];
+    if(sxupdate_unhex(p, weak, sizeof(weak)) || p[8] != ' '
+       || sxupdate_unhex(p + 9, blocks->strong[i], SXUPDATE_BLOCKS_STRONG_LENGTH)
+       || p[SXUPDATE_BLOCKS_LINE_LENGTH - 1] != '\n') {
+      sxupdate_blocks_free(blocks);
+      return EINVAL;
+    }
+    blocks->weak[i] = (uint32_t)weak[0] << 24 | (uint32_t)weak[1] << 16 | (uint32_t)weak[2] << 8 | weak[3];
+  }
+  return 0;
+}
+
+struct sxupdate_delta_buffer {
+  char *data;
+  size_t len, capacity;
+};
+
+static size_t sxupdate_delta_fetch_chunk(char *ptr, size_t size, size_t nmemb, void *b) {
+  struct sxupdate_delta_buffer *buffer = b;
+  size_t len = size * nmemb;
+  if(buffer->len + len >= SXUPDATE_BLOCKS_FILE_MAX)
+    return 0; // aborts
+  if(buffer->len + len >= buffer->capacity) {
+    size_t n = buffer->capacity ? buffer->capacity : 64 * 1024;
+    while(n <= buffer->len + len)
+      n *= 2;
+    char *data = sxupdate_mem_realloc(buffer->data, n);
+    if(!data)
+      return 0;
+    buffer->data = data;
+    buffer->capacity = n;
+  }
+  memcpy(buffer->data + buffer->len, ptr, len);
+  buffer->len += len;
+  buffer->data[buffer->len] = '\0';
+  return len;
+}
+
+/* download and parse the block-checksum file */
+static enum sxupdate_status sxupdate_blocks_fetch(sxupdate_t handle, const char *url, struct sxupdate_blocks *blocks) {
+  struct sxupdate_delta_buffer buffer = { 0 };
+  CURL *curl = curl_easy_init();
+  if(!curl)
+    return sxupdate_status_memory;
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "delta.fetch",
+                  ((const struct sxupdate_log_field[]){ { "url", url }, { NULL, NULL } }),
+                  "Fetching block checksums %s", url);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  if(handle->http_headers && !sxupdate_url_is_file(url))
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->http_headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sxupdate_delta_fetch_chunk);
+  sxupdate_qos_curl(handle, curl, 1);
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+
+  enum sxupdate_status stat = sxupdate_status_error;
+  int err;
+  if(res != CURLE_OK)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_WARNING, "delta.error",
+                    ((const struct sxupdate_log_field[]){ { "url", url }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error fetching %s:\n  %s", url, curl_easy_strerror(res));
+  else if((err = buffer.data ? sxupdate_blocks_parse(buffer.data, buffer.len, blocks) : EINVAL))
+    sxupdate_log_warning(handle, "delta.invalid", "%s: %s", url,
+                         err == EINVAL ? "not a valid block-checksum file" : strerror(err));
+  else
+    stat = sxupdate_status_ok;
+  sxupdate_mem_free(buffer.data);
+  return stat;
+}
+
+static int sxupdate_delta_match_cmp(const void *a, const void *b) {
+  const struct sxupdate_delta_match *x = a, *y = b;
+  if(x->weak != y->weak)
+    return x->weak < y->weak ? -1 : 1;
+  return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* index the full blocks by weak checksum */
+static int sxupdate_delta_index(struct sxupdate_delta *delta) {
+  struct sxupdate_blocks *blocks = &delta->blocks;
+  delta->full = blocks->length / blocks->block_size;
+  delta->index = sxupdate_mem_alloc((delta->full ? delta->full : 1) * sizeof(*delta->index));
+  delta->have = sxupdate_mem_calloc(blocks->count, 1);
+  if(!delta->index || !delta->have)
+    return ENOMEM;
+  for(size_t i = 0; i < delta->full; i++) {
+    delta->index[i].weak = blocks->weak[i];
+    delta->index[i].block = (uint32_t)i;
+    unsigned key = sxupdate_delta_filter_key(blocks->weak[i]);
+    delta->filter[key / 8] |= (unsigned char)(1 << key % 8);
+  }
+  qsort(delta->index, delta->full, sizeof(*delta->index), sxupdate_delta_match_cmp);
+  return 0;
+}
+
+/**
+ * Look up the window in the index, and write it as every missing block it matches
+ * @return 1 if it matched, 0 if not, or -errno
+ */
+static int sxupdate_delta_try(struct sxupdate_delta *delta, uint32_t weak, const unsigned char *window) {
+  unsigned key = sxupdate_delta_filter_key(weak);
+  if(!(delta->filter[key / 8] & 1 << key % 8))
+    return 0;
+  // first entry with this weak checksum
+  size_t lo = 0, hi = delta->full;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(delta->index[mid].weak < weak)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  size_t bs = delta->blocks.block_size;
+  unsigned char strong[SHA256_DIGEST_LENGTH];
+  int hashed = 0, matched = 0;
+  for(size_t i = lo; i < delta->full && delta->index[i].weak == weak; i++) {
+    uint32_t block = delta->index[i].block;
+    if(delta->have[block])
+      continue;
+    if(!hashed) {
+      SHA256(window, bs, strong);
+      hashed = 1;
+    }
+    if(memcmp(strong, delta->blocks.strong[block], SXUPDATE_BLOCKS_STRONG_LENGTH))
+      continue;
+    if(sxupdate_delta_seek(delta->out, (uint64_t)block * bs) || fwrite(window, 1, bs, delta->out) != bs)
+      return -(errno ? errno : EIO);
+    delta->have[block] = 1;
+    delta->found++;
+    matched = 1;
+  }
+  return matched;
+}
+
+/* find the blocks held by a local file, at any offset */
+static int sxupdate_delta_scan(struct sxupdate_delta *delta, const char *seed) {
+  FILE *f = fopen(seed, "rb");
+  if(!f)
+    return errno;
+  size_t bs = delta->blocks.block_size;
+  size_t capacity = SXUPDATE_DELTA_READ_SIZE > 4 * bs ? SXUPDATE_DELTA_READ_SIZE : 4 * bs;
+  unsigned char *buff = sxupdate_mem_alloc(capacity);
+  if(!buff) {
+    fclose(f);
+    return ENOMEM;
+  }
+
+  struct sxupdate_rolling rolling;
+  size_t pos = 0, end = 0; // window at pos; data read up to end
+  int err = 0, eof = 0, rolled = 0;
+  while(!err && delta->found < delta->full) {
+    if(end - pos <= bs && !eof) {
+      // keep the window, and the byte after it, contiguous
+      memmove(buff, buff + pos, end - pos);
+      end -= pos;
+      pos = 0;
+      size_t want = capacity - end, n = fread(buff + end, 1, want, f);
+      end += n;
+      eof = n < want; // end of file, or error
+    }
+    if(end - pos < bs)
+      break;
+    if(!rolled) {
+      sxupdate_rolling_init(&rolling, buff + pos, bs);
+      rolled = 1;
+    }
+
+    int matched = sxupdate_delta_try(delta, sxupdate_rolling_value(&rolling), buff + pos);
+    if(matched < 0)
+      err = -matched;
+    else if(matched) {
+      pos += bs; // blocks rarely overlap: look for the next one right after
+      rolled = 0;
+    } else if(end - pos > bs) {
+      sxupdate_rolling_roll(&rolling, buff[pos], buff[pos + bs]);
+      pos++;
+    } else
+      break;
+  }
+  if(!err && ferror(f))
+    err = EIO;
+  fclose(f);
+  sxupdate_mem_free(buff);
+  return err;
+}
+
+static int sxupdate_delta_gap_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* the byte ranges to fetch: missing blocks, with the small gaps between them */
+static int sxupdate_delta_plan(struct sxupdate_delta *delta, uint64_t *bytes) {
+  struct sxupdate_blocks *blocks = &delta->blocks;
+  delta->ranges = sxupdate_mem_calloc(blocks->count, sizeof(*delta->ranges));
+  if(!delta->ranges)
+    return ENOMEM;
+  size_t n = 0;
+  for(size_t i = 0; i < blocks->count; i++) {
+    if(delta->have[i])
+      continue;
+    uint64_t start = (uint64_t)i * blocks->block_size;
+    uint64_t end = start + blocks->block_size < blocks->length ? start + blocks->block_size : blocks->length;
+    if(n && start - delta->ranges[n - 1].end < SXUPDATE_DELTA_GAP)
+      delta->ranges[n - 1].end = end;
+    else {
+      delta->ranges[n].start = start;
+      delta->ranges[n++].end = end;
+    }
+  }
+
+  // too many requests: also fetch the smallest gaps, until few enough remain
+  if(n > SXUPDATE_DELTA_MAX_RANGES) {
+    uint64_t *gaps = sxupdate_mem_alloc((n - 1) * sizeof(*gaps));
+    if(!gaps)
+      return ENOMEM;
+    for(size_t i = 0; i + 1 < n; i++)
+      gaps[i] = delta->ranges[i + 1].start - delta->ranges[i].end;
+    qsort(gaps, n - 1, sizeof(*gaps), sxupdate_delta_gap_cmp);
+    uint64_t threshold = gaps[n - SXUPDATE_DELTA_MAX_RANGES - 1];
+    sxupdate_mem_free(gaps);
+    size_t merged = 0;
+    for(size_t i = 1; i < n; i++)
+      if(delta->ranges[i].start - delta->ranges[merged].end <= threshold)
+        delta->ranges[merged].end = delta->ranges[i].end;
+      else
+        delta->ranges[++merged] = delta->ranges[i];
+    n = merged + 1;
+  }
+
+  delta->range_count = n;
+  *bytes = 0;
+  for(size_t i = 0; i < n; i++) {
+    delta->ranges[i].delta = delta;
+    *bytes += delta->ranges[i].end - delta->ranges[i].start;
+  }
+  return 0;
+}
+
+static size_t sxupdate_delta_range_chunk(char *ptr, size_t size, size_t nmemb, void *r) {
+  struct sxupdate_delta_range *range = r;
+  struct sxupdate_delta *delta = range->delta;
+  size_t len = size * nmemb;
+  if(!range->received && !sxupdate_url_is_file(delta->url)) {
+    long code = 0;
+    curl_easy_getinfo(range->curl, CURLINFO_RESPONSE_CODE, &code);
+    if(code != 206)
+      return 0; // the whole file instead of the range: aborts
+  }
+  if(range->received + len > range->end - range->start
+     || sxupdate_delta_seek(delta->out, range->start + range->received)
+     || fwrite(ptr, 1, len, delta->out) != len)
+    return 0;
+  range->received += len;
+  return len;
+}
+
+static enum sxupdate_status sxupdate_delta_range_start(sxupdate_t handle, CURLM *multi,
+                                                       struct sxupdate_delta_range *range) {
+  char spec[64];
+  snprintf(spec, sizeof(spec), "%llu-%llu", (unsigned long long)range->start, (unsigned long long)range->end - 1);
+  if(!(range->curl = curl_easy_init()))
+    return sxupdate_status_memory;
+  sxupdate_log_debug(handle, "delta.range", "Fetching bytes %s of %s", spec, range->delta->url);
+  curl_easy_setopt(range->curl, CURLOPT_URL, range->delta->url);
+  curl_easy_setopt(range->curl, CURLOPT_RANGE, spec);
+  curl_easy_setopt(range->curl, CURLOPT_FAILONERROR, 1L);
+  if(handle->http_headers && !sxupdate_url_is_file(range->delta->url))
+    curl_easy_setopt(range->curl, CURLOPT_HTTPHEADER, handle->http_headers);
+  curl_easy_setopt(range->curl, CURLOPT_WRITEDATA, range);
+  curl_easy_setopt(range->curl, CURLOPT_WRITEFUNCTION, sxupdate_delta_range_chunk);
+  curl_easy_setopt(range->curl, CURLOPT_PRIVATE, range);
+  sxupdate_qos_curl(handle, range->curl, SXUPDATE_DELTA_PARALLEL);
+  range->received = 0;
+  return curl_multi_add_handle(multi, range->curl) == CURLM_OK ? sxupdate_status_ok : sxupdate_status_error;
+}
+
+static enum sxupdate_status sxupdate_delta_range_done(sxupdate_t handle, CURLM *multi,
+                                                      struct sxupdate_delta_range *range, CURLcode res) {
+  enum sxupdate_status stat = sxupdate_status_error;
+  if(res != CURLE_OK)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_WARNING, "delta.error",
+                    ((const struct sxupdate_log_field[]){ { "url", range->delta->url }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error fetching a range of %s:\n  %s", range->delta->url, curl_easy_strerror(res));
+  else if(range->received != range->end - range->start)
+    sxupdate_log_warning(handle, "delta.error", "Incomplete range of %s", range->delta->url);
+  else
+    stat = sxupdate_status_ok;
+  handle->stats.download.bytes += (double)range->received;
+  curl_multi_remove_handle(multi, range->curl);
+  curl_easy_cleanup(range->curl);
+  range->curl = NULL;
+  return stat;
+}
+
+/* fetch the ranges, SXUPDATE_DELTA_PARALLEL at a time, over reused connections */
+static enum sxupdate_status sxupdate_delta_fetch_ranges(struct sxupdate_delta *delta) {
+  sxupdate_t handle = delta->handle;
+  CURLM *multi = curl_multi_init();
+  if(!multi)
+    return sxupdate_status_memory;
+  double start = sxupdate_clock_now();
+  enum sxupdate_status stat = sxupdate_status_ok;
+  size_t next = 0, running = 0;
+  while(stat == sxupdate_status_ok && (next < delta->range_count || running)) {
+    if(__atomic_load_n(&handle->speculative.cancel, __ATOMIC_RELAXED)) {
+      sxupdate_log_debug(handle, "download.cancel", "Download from %s cancelled", delta->url);
+      stat = sxupdate_status_error;
+      break;
+    }
+    while(stat == sxupdate_status_ok && next < delta->range_count && running < SXUPDATE_DELTA_PARALLEL)
+      if((stat = sxupdate_delta_range_start(handle, multi, &delta->ranges[next++])) == sxupdate_status_ok)
+        running++;
+
+    int still_running, left;
+    if(stat == sxupdate_status_ok && curl_multi_perform(multi, &still_running) != CURLM_OK)
+      stat = sxupdate_status_error;
+    CURLMsg *msg;
+    while(stat == sxupdate_status_ok && (msg = curl_multi_info_read(multi, &left))) {
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+      char *range = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &range);
+      stat = sxupdate_delta_range_done(handle, multi, (struct sxupdate_delta_range *)range, msg->data.result);
+      running--;
+    }
+    if(stat == sxupdate_status_ok && running && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+      stat = sxupdate_status_error;
+  }
+
+  // on failure, abort the requests still running
+  for(size_t i = 0; i < next; i++)
+    if(delta->ranges[i].curl) {
+      curl_multi_remove_handle(multi, delta->ranges[i].curl);
+      curl_easy_cleanup(delta->ranges[i].curl);
+      delta->ranges[i].curl = NULL;
+    }
+  curl_multi_cleanup(multi);
+
+  struct sxupdate_transfer_stats *ts = &handle->stats.download;
+  ts->total = sxupdate_clock_now() - start;
+  ts->throughput = ts->total > 0 ? ts->bytes / ts->total : 0;
+  return stat;
+}
+
+static int sxupdate_delta_readable(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if(f)
+    fclose(f);
+  return f != NULL;
+}
+
+int sxupdate_delta_wanted(sxupdate_t handle) {
+  const struct sxupdate_version *v = &handle->latest_version;
+  enum sxupdate_encoding encoding;
+  // ranges of a compressed enclosure do not line up with blocks of the installer
+  return handle->delta.enabled && !handle->download.no_delta && v->enclosure.blocks
+    && !sxupdate_encoding_from_name(v->enclosure.encoding, &encoding) && encoding == sxupdate_encoding_identity;
+}
+
+enum sxupdate_status sxupdate_delta_download(sxupdate_t handle, const char *blocks_url,
+                                             const char *url, const char *save_path) {
+  // the files to take blocks from, most likely to match first
+  const char *seeds[64];
+  size_t seed_count = 0;
+  char *cached = handle->delta.cache_dir
+    ? sxupdate_join_path(handle->delta.cache_dir, "/", handle->latest_version.enclosure.filename) : NULL;
+  if(cached && sxupdate_delta_readable(cached))
+    seeds[seed_count++] = cached;
+  for(struct sxupdate_string_list *s = handle->delta.seeds; s && seed_count < sizeof(seeds) / sizeof(*seeds); s = s->next)
+    if(sxupdate_delta_readable(s->value))
+      seeds[seed_count++] = s->value;
+  if(!seed_count) {
+    sxupdate_log_debug(handle, "delta.skip", "No local file to take blocks from");
+    sxupdate_mem_free(cached);
+    return sxupdate_status_error;
+  }
+
+  struct sxupdate_delta delta;
+  memset(&delta, 0, sizeof(delta));
+  delta.handle = handle;
+  delta.url = url;
+  enum sxupdate_status stat = sxupdate_blocks_fetch(handle, blocks_url, &delta.blocks);
+  int err = 0;
+  uint64_t bytes = 0;
+  if(stat == sxupdate_status_ok && (err = sxupdate_delta_index(&delta)))
+    stat = sxupdate_status_memory;
+  if(stat == sxupdate_status_ok && !(delta.out = fopen(save_path, "wb+"))) {
+    sxupdate_log_error(handle, "download.open", "%s: %s", save_path, strerror(errno));
+    stat = sxupdate_status_error;
+  }
+
+  double start = sxupdate_clock_now();
+  for(size_t i = 0; i < seed_count && stat == sxupdate_status_ok && delta.found < delta.full; i++)
+    if((err = sxupdate_delta_scan(&delta, seeds[i]))) {
+      sxupdate_log_warning(handle, "delta.seed", "%s: %s", seeds[i], strerror(err));
+      stat = err == ENOMEM ? sxupdate_status_memory : sxupdate_status_error;
+    }
+  handle->stats.hash += sxupdate_clock_now() - start;
+
+  if(stat == sxupdate_status_ok && (err = sxupdate_delta_plan(&delta, &bytes)))
+    stat = sxupdate_status_memory;
+  if(stat == sxupdate_status_ok) {
+    sxupdate_log_info(handle, "delta.plan", "%zu of %zu blocks found locally; fetching %llu of %llu bytes in %zu ranges",
+                      delta.found, delta.blocks.count, (unsigned long long)bytes,
+                      (unsigned long long)delta.blocks.length, delta.range_count);
+    if(bytes * 10 >= delta.blocks.length * 9) {
+      sxupdate_log_info(handle, "delta.skip", "Too few blocks found locally; downloading the whole installer");
+      stat = sxupdate_status_error;
+    } else
+      stat = sxupdate_delta_fetch_ranges(&delta);
+  }
+
+  if(delta.out && fclose(delta.out) && stat == sxupdate_status_ok) {
+    sxupdate_log_error(handle, "download.write", "%s: %s", save_path, strerror(errno));
+    stat = sxupdate_status_error;
+  }
+
+  // the blocks file is not signed: check the result as a whole before trusting it
+  if(stat == sxupdate_status_ok) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    size_t length = 0;
+    start = sxupdate_clock_now();
+    err = sxupdate_sha256_file_qos(handle, save_path, digest, &length);
+    handle->stats.hash += sxupdate_clock_now() - start;
+    if(err || length != delta.blocks.length || memcmp(digest, delta.blocks.digest, sizeof(digest))) {
+      sxupdate_log_warning(handle, "delta.verify", "Rebuilt installer does not match the block checksums");
+      stat = sxupdate_status_error;
+    } else {
+#ifndef NO_SIGNATURE
+      memcpy(handle->download.hash, digest, sizeof(digest));
+      handle->download.hashed = 1;
+#endif
+      sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "delta.done",
+                      ((const struct sxupdate_log_field[]){ { "path", save_path }, { NULL, NULL } }),
+                      "Rebuilt %s from %zu local blocks", save_path, delta.found);
+    }
+  }
+  if(stat != sxupdate_status_ok)
+    remove(save_path);
+
+  sxupdate_blocks_free(&delta.blocks);
+  sxupdate_mem_free(delta.index);
+  sxupdate_mem_free(delta.have);
+  sxupdate_mem_free(delta.ranges);
+  sxupdate_mem_free(cached);
+  return stat;
+}
+
+void sxupdate_delta_keep(sxupdate_t handle, const char *path) {
+  const char *filename = handle->latest_version.enclosure.filename;
+  if(!handle->delta.enabled || !handle->delta.cache_dir || !filename)
+    return;
+  char *cached = sxupdate_join_path(handle->delta.cache_dir, "/", filename);
+  char *tmp = cached ? sxupdate_join_path(cached, "", ".tmp") : NULL;
+  int err = cached && tmp ? 0 : ENOMEM;
+  if(!err) {
+    err = sxupdate_copy_file(path, tmp, 1);
+#ifdef _WIN32
+    remove(cached); // rename() does not replace an existing file
+#endif
+    if(!err && rename(tmp, cached))
+      err = errno;
+    if(err)
+      remove(tmp);
+  }
+  if(err)
+    sxupdate_log_warning(handle, "delta.keep", "Unable to keep the installer in %s: %s",
+                         handle->delta.cache_dir, strerror(err));
+  else
+    sxupdate_log_debug(handle, "delta.keep", "Kept the installer as %s", cached);
+  sxupdate_mem_free(cached);
+  sxupdate_mem_free(tmp);
+}
+
+/* about sqrt(length), so that neither the block list nor the blocks themselves get large */
+static size_t sxupdate_blocks_default_size(size_t length) {
+  size_t block_size = 2048;
+  while(block_size < 64 * 1024 && block_size * block_size < length)
+    block_size *= 2;
+  return block_size;
+}
+
+int sxupdate_blocks_write(const char *in_path, const char *out_path, size_t block_size) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  char hex[2 * SHA256_DIGEST_LENGTH + 1];
+  size_t length;
+  int err = sxupdate_sha256_file(in_path, digest, &length);
+  if(err)
+    return err;
+  if(!block_size)
+    block_size = sxupdate_blocks_default_size(length);
+  if(!length || block_size < SXUPDATE_BLOCKS_MIN_SIZE || block_size > SXUPDATE_BLOCKS_MAX_SIZE)
+    return EINVAL;
+
+  unsigned char *buff = sxupdate_mem_alloc(block_size);
+  FILE *in = buff ? fopen(in_path, "rb") : NULL;
+  FILE *out = in ? fopen(out_path, "wb") : NULL;
+  if(!buff)
+    err = ENOMEM;
+  else if(!out)
+    err = errno ? errno : EIO;
+  else {
+    sxupdate_hex(digest, SHA256_DIGEST_LENGTH, hex);
+    if(fprintf(out, "%s %zu %zu %s\n", SXUPDATE_BLOCKS_MAGIC, block_size, length, hex) < 0)
+      err = errno ? errno : EIO;
+    size_t n;
+    while(!err && (n = fread(buff, 1, block_size, in)) > 0) {
+      struct sxupdate_rolling rolling;
+      sxupdate_rolling_init(&rolling, buff, n);
+      SHA256(buff, n, digest);
+      sxupdate_hex(digest, SXUPDATE_BLOCKS_STRONG_LENGTH, hex);
+      if(fprintf(out, "%08x %s\n", (unsigned)sxupdate_rolling_value(&rolling), hex) < 0)
+        err = errno ? errno : EIO;
+    }
+    if(!err && ferror(in))
+      err = EIO;
+  }
+  if(in)
+    fclose(in);
+  if(out && fclose(out) && !err)
+    err = errno ? errno : EIO;
+  if(err && out)
+    remove(out_path);
+  sxupdate_mem_free(buff);
+  return err;
+}
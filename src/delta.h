@@ -0,0 +1,61 @@
+#ifndef SXUPDATE_DELTA_H
+#define SXUPDATE_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/api.h"
+
+/**
+ * Client-side block deltas (see the enclosure "blocks" in schema/appcast.schema.json, and
+ * sxupdate_set_delta()). The publisher splits the installer into fixed-size blocks and
+ * lists a weak, rolling checksum and a strong hash of each:
+ *
+ *   sxupdate-blocks 1 <block size> <length> <hex SHA-256 of the installer>
+ *   <8 hex digits: weak checksum> <32 hex digits: first 16 bytes of the block's SHA-256>
+ *   ...
+ *
+ * The client slides a window over local files likely to share content with the new
+ * installer (the installed executable, the last installer), finds the blocks they hold
+ * at any offset, and fetches only the others, with Range requests. As with rsync and
+ * zsync, the weak checksum rules out most offsets cheaply; the strong hash confirms a match
+ */
+#define SXUPDATE_BLOCKS_MAGIC "sxupdate-blocks 1"
+#define SXUPDATE_BLOCKS_STRONG_LENGTH 16
+#define SXUPDATE_BLOCKS_MIN_SIZE 512
+#define SXUPDATE_BLOCKS_MAX_SIZE (1024 * 1024)
+#define SXUPDATE_DELTA_GAP (4 * 1024)  // fetch blocks closer than this in a single range
+#define SXUPDATE_DELTA_MAX_RANGES 256  // merge the closest ranges until there are no more
+#define SXUPDATE_DELTA_PARALLEL 4      // concurrent Range requests
+
+/**
+ * Whether to rebuild the installer of the latest version from local blocks: it has a
+ * block-checksum file, is not compressed, and deltas are enabled and not ruled out
+ */
+int sxupdate_delta_wanted(sxupdate_t handle);
+
+/**
+ * Rebuild the installer served at url into save_path, from the blocks of the seed files
+ * and Range requests for the rest, then check it against the length and SHA-256 listed
+ * in the block-checksum file
+ *
+ * Blocks until done, even when the handle is driven by an event loop
+ *
+ * @return sxupdate_status_ok if the installer was rebuilt. Otherwise, save_path is
+ *         removed, and the installer should be downloaded in full
+ */
+enum sxupdate_status sxupdate_delta_download(sxupdate_t handle, const char *blocks_url,
+                                             const char *url, const char *save_path);
+
+/**
+ * Keep a copy of a verified installer in the cache dir, as a seed for the next update
+ */
+void sxupdate_delta_keep(sxupdate_t handle, const char *path);
+
+/**
+ * Write the block-checksum file of the installer at in_path, for sxupdate-publish
+ * @param block_size: 0 to choose one from the size of the installer
+ * @return 0 on success, else errno
+ */
+int sxupdate_blocks_write(const char *in_path, const char *out_path, size_t block_size);
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef SXUPDATE_USE_XZ
+#include <lzma.h>
+#endif
+#ifdef SXUPDATE_USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "encoding.h"
+#include "alloc.h"
+
+#define SXUPDATE_CODEC_BUFFER_SIZE (64 * 1024)
+#define SXUPDATE_XZ_PRESET 6
+#define SXUPDATE_ZSTD_LEVEL 19
+
+struct sxupdate_codec {
+  enum sxupdate_encoding encoding;
+  int encode;
+  unsigned char *buff; // output, SXUPDATE_CODEC_BUFFER_SIZE bytes
+#ifdef SXUPDATE_USE_XZ
+  lzma_stream xz;
+#endif
+#ifdef SXUPDATE_USE_ZSTD
+  ZSTD_DCtx *zstd_d;
+  ZSTD_CCtx *zstd_c;
+  size_t zstd_hint; // from the last ZSTD_decompressStream(); 0 once a frame is complete
+#endif
+};
+
+int sxupdate_encoding_from_name(const char *name, enum sxupdate_encoding *encoding) {
+  if(!name || !*name || !strcmp(name, "identity"))
+    *encoding = sxupdate_encoding_identity;
+  else if(!strcmp(name, "xz"))
+    *encoding = sxupdate_encoding_xz;
+  else if(!strcmp(name, "zstd"))
+    *encoding = sxupdate_encoding_zstd;
+  else
+    return EINVAL;
+
+#ifndef SXUPDATE_USE_XZ
+  if(*encoding == sxupdate_encoding_xz)
+    return ENOTSUP;
+#endif
+#ifndef SXUPDATE_USE_ZSTD
+  if(*encoding == sxupdate_encoding_zstd)
+    return ENOTSUP;
+#endif
+  return 0;
+}
+
+#ifdef SXUPDATE_USE_XZ
+static void *sxupdate_lzma_alloc(void *opaque, size_t nmemb, size_t size) {
+  (void)(opaque);
+  return sxupdate_mem_alloc(nmemb * size);
+}
+
+static void sxupdate_lzma_free(void *opaque, void *ptr) {
+  (void)(opaque);
+  sxupdate_mem_free(ptr);
+}
+
+static const lzma_allocator sxupdate_lzma_allocator = { sxupdate_lzma_alloc, sxupdate_lzma_free, NULL };
+
+static int sxupdate_xz_run(struct sxupdate_codec *codec, const void *data, size_t len, int finish,
+                           sxupdate_codec_sink sink, void *ctx) {
+  codec->xz.next_in = data;
+  codec->xz.avail_in = len;
+  while(1) {
+    codec->xz.next_out = codec->buff;
+    codec->xz.avail_out = SXUPDATE_CODEC_BUFFER_SIZE;
+    lzma_ret ret = lzma_code(&codec->xz, finish ? LZMA_FINISH : LZMA_RUN);
+    size_t n = SXUPDATE_CODEC_BUFFER_SIZE - codec->xz.avail_out;
+    int err;
+    if(n && (err = sink(ctx, codec->buff, n)))
+      return err;
+    if(ret == LZMA_STREAM_END)
+      return 0;
+    if(ret != LZMA_OK)
+      return ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL; // LZMA_BUF_ERROR if truncated
+    if(!codec->xz.avail_in && codec->xz.avail_out && !finish)
+      return 0; // needs more input
+  }
+}
+#endif
+
+#ifdef SXUPDATE_USE_ZSTD
+static int sxupdate_zstd_run(struct sxupdate_codec *codec, const void *data, size_t len, int finish,
+                             sxupdate_codec_sink sink, void *ctx) {
+  ZSTD_inBuffer in = { data, len, 0 };
+  while(1) {
+    ZSTD_outBuffer out = { codec->buff, SXUPDATE_CODEC_BUFFER_SIZE, 0 };
+    size_t ret;
+    if(codec->encode)
+      ret = ZSTD_compressStream2(codec->zstd_c, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+    else
+      ret = codec->zstd_hint = ZSTD_decompressStream(codec->zstd_d, &out, &in);
+    if(ZSTD_isError(ret))
+      return EINVAL;
+    int err;
+    if(out.pos && (err = sink(ctx, codec->buff, out.pos)))
+      return err;
+    if(in.pos < in.size || out.pos == out.size)
+      continue; // more to process, or more output pending
+    if(!finish)
+      return 0;
+    if(codec->encode) {
+      if(!ret)
+        return 0; // frame complete
+    } else
+      return codec->zstd_hint ? EINVAL : 0; // non-zero: the last frame is incomplete
+  }
+}
+#endif
+
+static struct sxupdate_codec *sxupdate_codec_new(enum sxupdate_encoding encoding, int encode) {
+  struct sxupdate_codec *codec = sxupdate_mem_calloc(1, sizeof(*codec));
+  if(!codec)
+    return NULL;
+  codec->encoding = encoding;
+  codec->encode = encode;
+  int ok = (codec->buff = sxupdate_mem_alloc(SXUPDATE_CODEC_BUFFER_SIZE)) != NULL;
+  switch(encoding) {
+#ifdef SXUPDATE_USE_XZ
+  case sxupdate_encoding_xz:
+    {
+      lzma_stream init = LZMA_STREAM_INIT;
+      codec->xz = init;
+      codec->xz.allocator = &sxupdate_lzma_allocator;
+      if(ok)
+        ok = (encode ? lzma_easy_encoder(&codec->xz, SXUPDATE_XZ_PRESET, LZMA_CHECK_CRC64)
+              : lzma_stream_decoder(&codec->xz, UINT64_MAX, LZMA_CONCATENATED)) == LZMA_OK;
+    }
+    break;
+#endif
+#ifdef SXUPDATE_USE_ZSTD
+  case sxupdate_encoding_zstd:
+    if(ok && encode)
+      ok = (codec->zstd_c = ZSTD_createCCtx()) != NULL
+        && !ZSTD_isError(ZSTD_CCtx_setParameter(codec->zstd_c, ZSTD_c_compressionLevel, SXUPDATE_ZSTD_LEVEL));
+    else if(ok)
+      ok = (codec->zstd_d = ZSTD_createDCtx()) != NULL;
+    break;
+#endif
+  default:
+    ok = 0; // identity needs no codec; others are not built in
+  }
+  if(!ok) {
+    sxupdate_codec_free(codec);
+    return NULL;
+  }
+  return codec;
+}
+
+struct sxupdate_codec *sxupdate_decoder_new(enum sxupdate_encoding encoding) {
+  return sxupdate_codec_new(encoding, 0);
+}
+
+static int sxupdate_codec_run(struct sxupdate_codec *codec, const void *data, size_t len, int finish,
+                              sxupdate_codec_sink sink, void *ctx) {
+  switch(codec->encoding) {
+#ifdef SXUPDATE_USE_XZ
+  case sxupdate_encoding_xz:
+    return sxupdate_xz_run(codec, data, len, finish, sink, ctx);
+#endif
+#ifdef SXUPDATE_USE_ZSTD
+  case sxupdate_encoding_zstd:
+    return sxupdate_zstd_run(codec, data, len, finish, sink, ctx);
+#endif
+  default:
+    (void)(data);
+    (void)(len);
+    (void)(finish);
+    (void)(sink);
+    (void)(ctx);
+    return ENOTSUP;
+  }
+}
+
+int sxupdate_codec_write(struct sxupdate_codec *codec, const void *data, size_t len,
+                         sxupdate_codec_sink sink, void *ctx) {
+  return sxupdate_codec_run(codec, data, len, 0, sink, ctx);
+}
+
+int sxupdate_codec_finish(struct sxupdate_codec *codec, sxupdate_codec_sink sink, void *ctx) {
+  return sxupdate_codec_run(codec, NULL, 0, 1, sink, ctx);
+}
+
+void sxupdate_codec_free(struct sxupdate_codec *codec) {
+  if(!codec)
+    return;
+#ifdef SXUPDATE_USE_XZ
+  if(codec->encoding == sxupdate_encoding_xz)
+    lzma_end(&codec->xz);
+#endif
+#ifdef SXUPDATE_USE_ZSTD
+  ZSTD_freeDCtx(codec->zstd_d);
+  ZSTD_freeCCtx(codec->zstd_c);
+#endif
+  sxupdate_mem_free(codec->buff);
+  sxupdate_mem_free(codec);
+}
+
+struct sxupdate_encode_file_out {
+  FILE *f;
+  size_t length;
+};
+
+static int sxupdate_encode_file_sink(void *ctx, const void *data, size_t len) {
+  struct sxupdate_encode_file_out *out = ctx;
+  if(fwrite(data, 1, len, out->f) != len)
+    return errno ? errno : EIO;
+  out->length += len;
+  return 0;
+}
+
+int sxupdate_encode_file(enum sxupdate_encoding encoding, const char *in_path,
+                         const char *out_path, size_t *length) {
+  struct sxupdate_codec *codec = sxupdate_codec_new(encoding, 1);
+  if(!codec)
+    return encoding == sxupdate_encoding_identity ? EINVAL : ENOMEM;
+
+  struct sxupdate_encode_file_out out = { NULL, 0 };
+  unsigned char *buff = sxupdate_mem_alloc(SXUPDATE_CODEC_BUFFER_SIZE);
+  FILE *in = fopen(in_path, "rb");
+  int err = 0;
+  if(!buff)
+    err = ENOMEM;
+  else if(!in || !(out.f = fopen(out_path, "wb")))
+    err = errno ? errno : EIO;
+  else {
+    size_t n;
+    while(!err && (n = fread(buff, 1, SXUPDATE_CODEC_BUFFER_SIZE, in)) > 0)
+      err = sxupdate_codec_write(codec, buff, n, sxupdate_encode_file_sink, &out);
+    if(!err && ferror(in))
+      err = EIO;
+    if(!err)
+      err = sxupdate_codec_finish(codec, sxupdate_encode_file_sink, &out);
+  }
+
+  if(in)
+    fclose(in);
+  if(out.f && fclose(out.f) && !err)
+    err = errno ? errno : EIO;
+  if(err && out.f)
+    remove(out_path);
+  if(length)
+    *length = out.length;
+  sxupdate_mem_free(buff);
+  sxupdate_codec_free(codec);
+  return err;
+}
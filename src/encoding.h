@@ -0,0 +1,63 @@
+#ifndef SXUPDATE_ENCODING_H
+#define SXUPDATE_ENCODING_H
+
+#include <stddef.h>
+#include "../include/api.h"
+
+/**
+ * Compressed enclosures (see the enclosure "encoding" in schema/appcast.schema.json).
+ * The enclosure url serves the installer compressed; the signature is of the installer
+ * itself, so it is checked against the decompressed bytes. Each encoding is only
+ * available if sxupdate was built with its library (SXUPDATE_USE_XZ, SXUPDATE_USE_ZSTD)
+ */
+enum sxupdate_encoding {
+  sxupdate_encoding_identity = 0, // stored as is
+  sxupdate_encoding_xz,
+  sxupdate_encoding_zstd
+};
+
+/**
+ * Look up an encoding by the name used in the appcast
+ * @return 0 on success, EINVAL if the name is unknown, or ENOTSUP if this build does not
+ *         support it
+ */
+int sxupdate_encoding_from_name(const char *name, enum sxupdate_encoding *encoding);
+
+/**
+ * Receives the output of a decoder or encoder
+ * @return 0 to continue, else an errno, which stops the codec
+ */
+typedef int (*sxupdate_codec_sink)(void *ctx, const void *data, size_t len);
+
+struct sxupdate_codec;
+
+/**
+ * Create a streaming decompressor. Returns NULL if out of memory or if the encoding is
+ * not supported
+ */
+struct sxupdate_codec *sxupdate_decoder_new(enum sxupdate_encoding encoding);
+
+/**
+ * Decompress a chunk, passing any output to sink
+ * @return 0 on success, EINVAL if the data is corrupt, or the error returned by sink
+ */
+int sxupdate_codec_write(struct sxupdate_codec *codec, const void *data, size_t len,
+                         sxupdate_codec_sink sink, void *ctx);
+
+/**
+ * Flush any remaining output. For a decoder, fails with EINVAL if the input was truncated
+ * @return 0 on success, else errno
+ */
+int sxupdate_codec_finish(struct sxupdate_codec *codec, sxupdate_codec_sink sink, void *ctx);
+
+void sxupdate_codec_free(struct sxupdate_codec *codec);
+
+/**
+ * Compress the file at in_path into out_path, for sxupdate-publish
+ * @param length: if not NULL, set to the size of the compressed file
+ * @return 0 on success, else errno
+ */
+int sxupdate_encode_file(enum sxupdate_encoding encoding, const char *in_path,
+                         const char *out_path, size_t *length);
+
+#endif
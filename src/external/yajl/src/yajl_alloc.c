@@ -42,8 +42,19 @@ static void yajl_internal_free(void *ctx, void * ptr)
     free(ptr);
 }
 
+static yajl_alloc_funcs yajl_global_alloc_funcs;
+
+void yajl_set_global_alloc_funcs(const yajl_alloc_funcs * yaf)
+{
+    yajl_global_alloc_funcs = *yaf;
+}
+
 void yajl_set_default_alloc_funcs(yajl_alloc_funcs * yaf)
 {
+    if (yajl_global_alloc_funcs.malloc) {
+        *yaf = yajl_global_alloc_funcs;
+        return;
+    }
     yaf->malloc = yajl_internal_malloc;
     yaf->free = yajl_internal_free;
     yaf->realloc = yajl_internal_realloc;
@@ -31,4 +31,8 @@
 
 void yajl_set_default_alloc_funcs(yajl_alloc_funcs * yaf);
 
+/* sxupdate: replace the functions used when no yajl_alloc_funcs are given,
+ * process-wide. Must be called before any yajl object is allocated */
+void yajl_set_global_alloc_funcs(const yajl_alloc_funcs * yaf);
+
 #endif
@@ -3,12 +3,17 @@
 #include <stdlib.h> // getenv, mkstemp
 #include <errno.h>
 #include <unistd.h> // for close()
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #if defined(_WIN32) || defined(WIN32) || defined(WIN)
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
+#include "file.h"
+#include "alloc.h"
 #include "log.h"
 
 /**
@@ -22,84 +27,261 @@ static int dir_exists(const char *path) {
   return 0;
 }
 
-/**
- * Check if a file exists
- * return true (non-zero) or false (zero)
- */
-static int file_exists(const char* filename) {
-#if defined(_WIN32) || defined(WIN32) || defined(WIN)
-  DWORD attributes = GetFileAttributes(filename);
-  return (attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY));
-#else
-  struct stat buffer;
-  if(stat(filename, &buffer) == 0) {
-    char is_dir = buffer.st_mode & S_IFDIR ? 1 : 0;
-    if(!is_dir)
-      return 1;
-  }
-  return 0;
-#endif
-}
-
-#define SXUPDATE_GET_INSTALLER_PATH_MAX_TRIES 10000
-#define SXUPDATE_GET_INSTALLER_PATH_MAX_TRIES_MIN_STR_LEN 5
-char *sxupdate_get_installer_download_path(const char *basename) {
-  char *tmpdir;
-  char slash;
-  const char *suffix;
+/* where downloads go, and the path separator and executable suffix of the platform */
+static const char *sxupdate_download_dir(sxupdate_t handle, char *slash, const char **suffix) {
+  const char *tmpdir;
 #if defined(_WIN32) || defined(WIN32) || defined(WIN)
-  slash = '\\';
-  suffix = ".exe";
+  *slash = '\\';
+  *suffix = ".exe";
   tmpdir = getenv("TEMP");
   if(!tmpdir)
     tmpdir = getenv("TMP");
   if(!tmpdir)
     tmpdir = ".";
 #else
-  slash = '/';
-  suffix = "";
+  *slash = '/';
+  *suffix = "";
   tmpdir = getenv("TMPDIR");
   if(!tmpdir)
     tmpdir = "/tmp";
 #endif
+  if(handle->download.dir)
+    tmpdir = handle->download.dir;
+  return tmpdir;
+}
 
+char *sxupdate_get_installer_download_path(sxupdate_t handle, const char *basename) {
+  char slash;
+  const char *suffix;
+  const char *tmpdir = sxupdate_download_dir(handle, &slash, &suffix);
   if(!dir_exists(tmpdir)) {
-    sxupdate_printerr("Could not find temporary directory %s", tmpdir);
+    sxupdate_log_error(handle, "file.tmpdir", "Could not find temporary directory %s", tmpdir);
     return NULL;
   }
 
-  size_t len = strlen(tmpdir) + strlen(basename) + strlen(suffix) + SXUPDATE_GET_INSTALLER_PATH_MAX_TRIES_MIN_STR_LEN + 10;
-  char *s = calloc(1, len + 1);
+  size_t len = strlen(tmpdir) + strlen(basename) + strlen(SXUPDATE_DOWNLOAD_TEMPLATE) + 3;
+  char *s = sxupdate_mem_calloc(1, len + 1);
   if(!s) {
-    sxupdate_printerr("Out of memory!");
+    sxupdate_log_error(handle, "memory", "Out of memory!");
     return NULL;
   }
 
-  for(int i = 0; i < SXUPDATE_GET_INSTALLER_PATH_MAX_TRIES; i++) { // overusing malloc() but root of evil etc...
+  // a hidden, unique name, created atomically however many downloads share the directory
+  snprintf(s, len, "%s%c.%s%s", tmpdir, slash, basename, SXUPDATE_DOWNLOAD_TEMPLATE);
+  int fd = mkstemp(s);
+  if(fd < 0) {
+    sxupdate_log_error(handle, "file.tmpname", "Unable to create a temporary file %s: %s", s, strerror(errno));
+    sxupdate_mem_free(s);
+    return NULL;
+  }
+  close(fd);
+  return s;
+}
+
+int sxupdate_publish_download(sxupdate_t handle, char **path, const char *basename) {
+  char slash;
+  const char *suffix;
+  sxupdate_download_dir(handle, &slash, &suffix);
+  const char *sep = strrchr(*path, slash);
+  int dir_len = sep ? (int)(sep - *path) : 0;
+
+  size_t len = dir_len + strlen(basename) + strlen(suffix) + 16;
+  char *s = sxupdate_mem_calloc(1, len + 1);
+  if(!s)
+    return ENOMEM;
+
+  // never replace a file of the same name, which another updater may be running
+  int err = 0;
+  for(int i = 0; i < SXUPDATE_PUBLISH_MAX_TRIES; i++) {
     if(i == 0)
-      snprintf(s, len, "%s%c%s%s", tmpdir, slash, basename, suffix);
+      snprintf(s, len, "%.*s%c%s%s", dir_len, *path, slash, basename, suffix);
     else
-      snprintf(s, len, "%s%c%s (%i)%s", tmpdir, slash, basename, i, suffix);
-    if(!file_exists(s))
-      return s;
+      snprintf(s, len, "%.*s%c%s (%i)%s", dir_len, *path, slash, basename, i, suffix);
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+    if(MoveFileExA(*path, s, 0)) {
+      err = 0;
+      break;
+    }
+    DWORD last = GetLastError();
+    err = last == ERROR_ALREADY_EXISTS || last == ERROR_FILE_EXISTS ? EEXIST : EACCES;
+#else
+    if(!link(*path, s)) {
+      remove(*path);
+      err = 0;
+      break;
+    }
+    err = errno;
+#endif
+    if(err != EEXIST)
+      break;
+  }
+  if(err) {
+    sxupdate_log_warning(handle, "file.publish", "Unable to name %s after %s: %s", *path, basename, strerror(err));
+    sxupdate_mem_free(s);
+    return err;
+  }
+  sxupdate_mem_free(*path);
+  *path = s;
+  return 0;
+}
+
+char *sxupdate_file_url_path(const char *url) {
+  const char *path = url + strlen("file://");
+  if(!strncmp(path, "localhost/", strlen("localhost/")))
+    path += strlen("localhost");
+  if(*path != '/' || strchr(path, '%'))
+    return NULL;
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+  if(path[1] && path[2] == ':') // file:///C:/...
+    path++;
+#endif
+  return sxupdate_mem_strdup(path);
+}
+
+int sxupdate_map_file(const char *path, char **data, size_t *len) {
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+  HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if(f == INVALID_HANDLE_VALUE)
+    return GetLastError() == ERROR_FILE_NOT_FOUND || GetLastError() == ERROR_PATH_NOT_FOUND ? ENOENT : EACCES;
+  LARGE_INTEGER size;
+  HANDLE m = NULL;
+  int err = 0;
+  if(!GetFileSizeEx(f, &size))
+    err = EIO;
+  else if((unsigned long long)size.QuadPart > (size_t)-1)
+    err = EFBIG;
+  else if(size.QuadPart == 0) {
+    *data = NULL;
+    *len = 0;
+  } else if(!(m = CreateFileMappingA(f, NULL, PAGE_WRITECOPY, 0, 0, NULL))
+          || !(*data = MapViewOfFile(m, FILE_MAP_COPY, 0, 0, 0)))
+    err = ENOMEM;
+  else
+    *len = (size_t)size.QuadPart;
+  if(m)
+    CloseHandle(m);
+  CloseHandle(f);
+  return err;
+#else
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return errno;
+  struct stat st;
+  int err = 0;
+  void *p;
+  if(fstat(fd, &st))
+    err = errno;
+  else if((unsigned long long)st.st_size > (size_t)-1)
+    err = EFBIG;
+  else if(st.st_size == 0) {
+    *data = NULL;
+    *len = 0;
+  } else if((p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    err = errno;
+  else {
+    *data = p;
+    *len = (size_t)st.st_size;
+  }
+  close(fd); // the mapping stays valid
+  return err;
+#endif
+}
+
+void sxupdate_unmap_file(char *data, size_t len) {
+  if(!data)
+    return;
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+  (void)(len);
+  UnmapViewOfFile(data);
+#else
+  munmap(data, len);
+#endif
+}
+
+int sxupdate_copy_file(const char *from, const char *to, int hard_link) {
+#ifndef _WIN32
+  if(hard_link) {
+    remove(to); // link() does not replace an existing file
+    if(!link(from, to))
+      return 0; // else across file systems, or not supported: copy it
+  }
+#else
+  (void)(hard_link);
+#endif
+
+  int err = 0;
+  char *buff = sxupdate_mem_alloc(SXUPDATE_COPY_BUFFER_SIZE);
+  FILE *in = fopen(from, "rb");
+  FILE *out = in ? fopen(to, "wb") : NULL;
+  if(!buff)
+    err = ENOMEM;
+  else if(!out)
+    err = errno ? errno : EIO;
+  else {
+    size_t n;
+    while(!err && (n = fread(buff, 1, SXUPDATE_COPY_BUFFER_SIZE, in)) > 0)
+      if(fwrite(buff, 1, n, out) != n)
+        err = errno ? errno : EIO;
+    if(!err && ferror(in))
+      err = EIO;
+  }
+  if(in)
+    fclose(in);
+  if(out && fclose(out) && !err)
+    err = errno ? errno : EIO;
+  sxupdate_mem_free(buff);
+  return err;
+}
+
+char *sxupdate_join_path(const char *dir, const char *sep, const char *name) {
+  size_t len = strlen(dir) + strlen(sep) + strlen(name) + 1;
+  char *s = sxupdate_mem_alloc(len);
+  if(s)
+    snprintf(s, len, "%s%s%s", dir, sep, name);
+  return s;
+}
+
+void sxupdate_hex(const unsigned char *in, size_t len, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  for(size_t i = 0; i < len; i++) {
+    hex[2 * i] = digits[in[i] >> 4];
+    hex[2 * i + 1] = digits[in[i] & 15];
+  }
+  hex[2 * len] = '\0';
+}
+
+static int sxupdate_hex_digit(char c) {
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+int sxupdate_unhex(const char *hex, unsigned char *out, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    int hi = sxupdate_hex_digit(hex[2 * i]);
+    int lo = hi < 0 ? -1 : sxupdate_hex_digit(hex[2 * i + 1]);
+    if(lo < 0)
+      return EINVAL;
+    out[i] = (unsigned char)(hi << 4 | lo);
   }
-  free(s);
-  sxupdate_printerr("Unable to find an unused filename after %i tries with base:\n  %s%c%s",
-          SXUPDATE_GET_INSTALLER_PATH_MAX_TRIES, tmpdir, slash, basename);
-  return NULL;
+  return 0;
 }
 
 /**
  * Set executable permissions on a file
  * @return: 0 on success, else errno
  */
-int sxupdate_set_execute_permission(const char *path) {
+int sxupdate_set_execute_permission(sxupdate_t handle, const char *path) {
 #if !defined(_WIN32) && !defined(WIN32) && !defined(WIN)
   if(chmod(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) {
-    sxupdate_printerr("Could not set execute permissions: %s", path);
+    sxupdate_log_error(handle, "file.chmod", "Could not set execute permissions: %s", path);
     return errno;
   }
 #else
+  (void)(handle);
   (void)(path);
 #endif
   return 0;
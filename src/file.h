@@ -1,18 +1,75 @@
 #ifndef SXUPDATE_FILE_H
 #define SXUPDATE_FILE_H
+
+#include "../include/api.h"
+
+#define SXUPDATE_DOWNLOAD_TEMPLATE ".XXXXXX" // mkstemp() suffix of download file names
+#define SXUPDATE_PUBLISH_MAX_TRIES 100       // "basename (n)" names tried once verified
+#define SXUPDATE_COPY_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Create an empty file to download the installation executable to, under a hidden,
+ * unique name, atomically. The returned value, if any, will have been allocated with
+ * sxupdate_mem_calloc(), and the caller should free it using `sxupdate_mem_free()`
+ *
+ * @param basename name the file will be given by sxupdate_publish_download()
+ */
+char *sxupdate_get_installer_download_path(sxupdate_t handle, const char *basename);
+
+/**
+ * Once a download has been verified, give it its final name in the same directory:
+ * basename, or "basename (n)" if that is taken. Existing files are never replaced
+ *
+ * @param path: the download, replaced with the new path on success
+ * @return 0 on success, else errno, in which case the download keeps its name
+ */
+int sxupdate_publish_download(sxupdate_t handle, char **path, const char *basename);
+
+/**
+ * Local path of a file:// url, or NULL if it names another host or is percent-encoded, in
+ * which case reading it is left to curl. Free it with `sxupdate_mem_free()`
+ */
+char *sxupdate_file_url_path(const char *url);
+
 /**
- * Get a file name to download the installation executable to. The returned value,
- * if any, will have been allocated on the heap, and the caller should free it using `free()`
+ * Map a file into memory, privately: the mapping can be written to, e.g. to terminate
+ * strings in place, without changing the file. Release it with sxupdate_unmap_file()
  *
- * @param prefix string with which the resulting file name will be prefixed
+ * @return 0 on success, else errno. An empty file is mapped as NULL, 0
+ */
+int sxupdate_map_file(const char *path, char **data, size_t *len);
+
+void sxupdate_unmap_file(char *data, size_t len);
+
+/**
+ * Copy a file, replacing to if it exists
+ * @param hard_link: if non-zero, hard-link to to from instead where the platform and file
+ *                   system allow it, which is only safe if neither is then written to
+ * @return 0 on success, else errno
+ */
+int sxupdate_copy_file(const char *from, const char *to, int hard_link);
+
+/**
+ * @return <dir><sep><name>, or NULL if out of memory. Free it with `sxupdate_mem_free()`
+ */
+char *sxupdate_join_path(const char *dir, const char *sep, const char *name);
+
+/**
+ * Write len bytes as 2 * len lowercase hex digits, and a NUL
+ */
+void sxupdate_hex(const unsigned char *in, size_t len, char *hex);
+
+/**
+ * Read 2 * len lowercase hex digits as len bytes
+ * @return 0 on success, else EINVAL
  */
-char *sxupdate_get_installer_download_path(const char *basename);
+int sxupdate_unhex(const char *hex, unsigned char *out, size_t len);
 
 
 /**
  * Set executable permissions on a file
  * @return: 0 on success
  */
-int sxupdate_set_execute_permission(const char *path);
+int sxupdate_set_execute_permission(sxupdate_t handle, const char *path);
 
 #endif
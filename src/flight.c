@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+#include "internal.h"
+#include "flight.h"
+#include "background.h"
+#include "file.h"
+#include "alloc.h"
+#include "log.h"
+
+#define SXUPDATE_FLIGHT_MAGIC "sxupdate-flight 1"
+#define SXUPDATE_FLIGHT_INSTALLER_MAGIC "sxupdate-flight-installer 1"
+#define SXUPDATE_FLIGHT_LINE_MAX 4096
+
+#ifndef _WIN32
+int sxupdate_flight_lock(const char *dir, const char *name, long wait_ms) {
+  char *path = sxupdate_background_path(dir, name);
+  int lock = path ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+  sxupdate_mem_free(path);
+  if(lock < 0)
+    return -1;
+  for(long waited = 0; flock(lock, LOCK_EX | LOCK_NB); waited += SXUPDATE_FLIGHT_POLL_MS) {
+    if((errno != EWOULDBLOCK && errno != EINTR) || waited >= wait_ms) {
+      close(lock);
+      return -1;
+    }
+    struct timespec ts = { 0, SXUPDATE_FLIGHT_POLL_MS * 1000000L };
+    nanosleep(&ts, NULL);
+  }
+  return lock;
+}
+
+void sxupdate_flight_unlock(int *lock) {
+  if(*lock >= 0)
+    close(*lock); // releases the lock
+  *lock = -1;
+}
+
+/* write lines to <dir>/<name>, replacing it atomically */
+static int sxupdate_flight_write(const char *dir, const char *name, const char *lines) {
+  char *path = sxupdate_background_path(dir, name);
+  size_t len = path ? strlen(path) + 5 : 0;
+  char *tmp = path ? sxupdate_mem_alloc(len) : NULL;
+  int err = 0;
+  FILE *f = NULL;
+  if(!(path && tmp))
+    err = ENOMEM;
+  else if(snprintf(tmp, len, "%s.tmp", path), !(f = fopen(tmp, "wb")))
+    err = errno;
+  else {
+    if(fputs(lines, f) < 0)
+      err = errno ? errno : EIO;
+    if(fclose(f) && !err)
+      err = errno ? errno : EIO;
+    if(!err && rename(tmp, path))
+      err = errno;
+    if(err)
+      remove(tmp);
+  }
+  sxupdate_mem_free(path);
+  sxupdate_mem_free(tmp);
+  return err;
+}
+
+/* read <dir>/<name> into a buffer that the caller must free */
+static char *sxupdate_flight_read(const char *dir, const char *name, int *err) {
+  char *path = sxupdate_background_path(dir, name);
+  char *s = sxupdate_mem_alloc(SXUPDATE_FLIGHT_LINE_MAX * 3);
+  FILE *f = path && s ? fopen(path, "rb") : NULL;
+  size_t n = 0;
+  if(!(path && s))
+    *err = ENOMEM;
+  else if(!f)
+    *err = errno;
+  else if((n = fread(s, 1, SXUPDATE_FLIGHT_LINE_MAX * 3 - 1, f)) == SXUPDATE_FLIGHT_LINE_MAX * 3 - 1)
+    *err = EINVAL;
+  else
+    *err = 0;
+  if(f)
+    fclose(f);
+  sxupdate_mem_free(path);
+  if(*err) {
+    sxupdate_mem_free(s);
+    return NULL;
+  }
+  s[n] = '\0';
+  return s;
+}
+
+/* take the next line of *s, which must be followed by a newline */
+static char *sxupdate_flight_line(char **s) {
+  char *line = *s, *end = line ? strchr(line, '\n') : NULL;
+  if(!end)
+    return *s = NULL;
+  *end = '\0';
+  *s = end + 1;
+  return line;
+}
+
+int sxupdate_flight_write_result(sxupdate_t handle, const char *dir, const char *url,
+                                 const char *base_url) {
+  size_t len = strlen(url) + strlen(base_url) + 64;
+  char *lines = sxupdate_mem_alloc(len);
+  int err;
+  if(!lines)
+    err = ENOMEM;
+  else if(strlen(url) >= SXUPDATE_FLIGHT_LINE_MAX || strlen(base_url) >= SXUPDATE_FLIGHT_LINE_MAX)
+    err = ENAMETOOLONG;
+  else {
+    snprintf(lines, len, "%s\n%lld\n%s\n%s\n", SXUPDATE_FLIGHT_MAGIC, (long long)time(NULL), url, base_url);
+    err = sxupdate_flight_write(dir, SXUPDATE_FLIGHT_APPCAST_RESULT, lines);
+  }
+  if(err)
+    sxupdate_log_warning(handle, "flight.result", "Unable to share the appcast in %s: %s", dir, strerror(err));
+  sxupdate_mem_free(lines);
+  return err;
+}
+
+int sxupdate_flight_read_result(sxupdate_t handle, const char *dir, const char *url, time_t since,
+                                char **base_url) {
+  int err;
+  char *s = sxupdate_flight_read(dir, SXUPDATE_FLIGHT_APPCAST_RESULT, &err), *next = s;
+  *base_url = NULL;
+  if(s) {
+    const char *magic = sxupdate_flight_line(&next), *fetched_at = sxupdate_flight_line(&next);
+    const char *result_url = sxupdate_flight_line(&next), *result_base_url = sxupdate_flight_line(&next);
+    err = EINVAL;
+    if(result_base_url && *result_base_url && !strcmp(magic, SXUPDATE_FLIGHT_MAGIC)) {
+      if(strcmp(result_url, url) || strtoll(fetched_at, NULL, 10) < (long long)since)
+        err = ENOENT; // not for this url, or too old
+      else
+        err = (*base_url = sxupdate_mem_strdup(result_base_url)) ? 0 : ENOMEM;
+    }
+  }
+  sxupdate_mem_free(s);
+  if(!err)
+    sxupdate_log_info(handle, "flight.result", "Using the version info fetched by another process");
+  return err;
+}
+
+int sxupdate_flight_share_installer(sxupdate_t handle, const char *dir, const char *path,
+                                    const char *key) {
+  char *installer = sxupdate_background_path(dir, SXUPDATE_FLIGHT_INSTALLER);
+  char *tmp = sxupdate_background_path(dir, SXUPDATE_FLIGHT_INSTALLER ".tmp");
+  size_t len = strlen(key) + 64;
+  char *lines = sxupdate_mem_alloc(len);
+  int err;
+  if(!(installer && tmp && lines))
+    err = ENOMEM;
+  else if(!(err = sxupdate_copy_file(path, tmp, 1)) && rename(tmp, installer))
+    err = errno;
+  if(!err) {
+    snprintf(lines, len, "%s\n%s\n", SXUPDATE_FLIGHT_INSTALLER_MAGIC, key);
+    err = sxupdate_flight_write(dir, SXUPDATE_FLIGHT_INSTALLER_RESULT, lines);
+  } else if(tmp)
+    remove(tmp);
+  if(err)
+    sxupdate_log_warning(handle, "flight.share", "Unable to share the installer in %s: %s", dir, strerror(err));
+  else
+    sxupdate_log_debug(handle, "flight.share", "Shared the installer in %s", dir);
+  sxupdate_mem_free(installer);
+  sxupdate_mem_free(tmp);
+  sxupdate_mem_free(lines);
+  return err;
+}
+
+int sxupdate_flight_take_installer(sxupdate_t handle, const char *dir, const char *key,
+                                   const char *path) {
+  int err;
+  char *s = sxupdate_flight_read(dir, SXUPDATE_FLIGHT_INSTALLER_RESULT, &err), *next = s;
+  if(s) {
+    const char *magic = sxupdate_flight_line(&next);
+    size_t key_len = strlen(key);
+    err = magic && !strcmp(magic, SXUPDATE_FLIGHT_INSTALLER_MAGIC) && next && !strncmp(next, key, key_len)
+      && !strcmp(next + key_len, "\n") ? 0 : ENOENT; // else another version
+  }
+  sxupdate_mem_free(s);
+
+  char *installer = err ? NULL : sxupdate_background_path(dir, SXUPDATE_FLIGHT_INSTALLER);
+  if(!err && !installer)
+    err = ENOMEM;
+  if(!err && !(err = sxupdate_copy_file(installer, path, 1)))
+    sxupdate_log_info(handle, "flight.installer", "Using the installer downloaded by another process");
+  sxupdate_mem_free(installer);
+  return err;
+}
+
+#else
+int sxupdate_flight_lock(const char *dir, const char *name, long wait_ms) {
+  (void)(dir);
+  (void)(name);
+  (void)(wait_ms);
+  return -1;
+}
+
+void sxupdate_flight_unlock(int *lock) {
+  *lock = -1;
+}
+
+int sxupdate_flight_write_result(sxupdate_t handle, const char *dir, const char *url,
+                                 const char *base_url) {
+  (void)(handle);
+  (void)(dir);
+  (void)(url);
+  (void)(base_url);
+  return ENOSYS;
+}
+
+int sxupdate_flight_read_result(sxupdate_t handle, const char *dir, const char *url, time_t since,
+                                char **base_url) {
+  (void)(handle);
+  (void)(dir);
+  (void)(url);
+  (void)(since);
+  *base_url = NULL;
+  return ENOSYS;
+}
+
+int sxupdate_flight_share_installer(sxupdate_t handle, const char *dir, const char *path,
+                                    const char *key) {
+  (void)(handle);
+  (void)(dir);
+  (void)(path);
+  (void)(key);
+  return ENOSYS;
+}
+
+int sxupdate_flight_take_installer(sxupdate_t handle, const char *dir, const char *key,
+                                   const char *path) {
+  (void)(handle);
+  (void)(dir);
+  (void)(key);
+  (void)(path);
+  return ENOSYS;
+}
+#endif
@@ -0,0 +1,78 @@
+#ifndef SXUPDATE_FLIGHT_H
+#define SXUPDATE_FLIGHT_H
+
+#include <time.h>
+#include "../include/api.h"
+
+/**
+ * Host-wide single flight (see sxupdate_set_single_flight()). Processes that share a
+ * directory take turns to fetch the appcast and to download the installer, and leave
+ * what they got there for the others:
+ *
+ *   <dir>/appcast.lock     : held while fetching the appcast
+ *   <dir>/appcast.json     : the appcast last fetched
+ *   <dir>/appcast.result   : written last, naming the appcast url, the url relative urls
+ *                            resolve against (the shard, if the url serves an index), and
+ *                            when it was fetched. The appcast is shared only once this exists
+ *   <dir>/installer.lock   : held while downloading and verifying the installer
+ *   <dir>/installer        : the installer last downloaded and verified
+ *   <dir>/installer.result : written last, naming the enclosure url and signature it was
+ *                            verified against
+ *
+ * Files are replaced with rename(), so readers never see a partial one
+ */
+#define SXUPDATE_FLIGHT_APPCAST "appcast.json"
+#define SXUPDATE_FLIGHT_APPCAST_LOCK "appcast.lock"
+#define SXUPDATE_FLIGHT_APPCAST_RESULT "appcast.result"
+#define SXUPDATE_FLIGHT_INSTALLER "installer"
+#define SXUPDATE_FLIGHT_INSTALLER_LOCK "installer.lock"
+#define SXUPDATE_FLIGHT_INSTALLER_RESULT "installer.result"
+
+#define SXUPDATE_FLIGHT_WAIT_MS 30000   // default of sxupdate_single_flight_options.wait_ms
+#define SXUPDATE_FLIGHT_MAX_AGE 10      // ... of max_age_seconds
+#define SXUPDATE_FLIGHT_POLL_MS 20      // interval at which a waiting process retries the lock
+
+/**
+ * Take <dir>/<name>, waiting up to wait_ms for the process holding it
+ * @return the lock, to release with sxupdate_flight_unlock(), or -1 if not taken
+ */
+int sxupdate_flight_lock(const char *dir, const char *name, long wait_ms);
+
+/**
+ * Release a lock taken by sxupdate_flight_lock(), if any, and set it to -1
+ */
+void sxupdate_flight_unlock(int *lock);
+
+/**
+ * Record that <dir>/appcast.json, just renamed into place, is the appcast of url
+ * @param base_url: the url it was fetched from: url, or its shard
+ * @return 0 on success, else errno
+ */
+int sxupdate_flight_write_result(sxupdate_t handle, const char *dir, const char *url,
+                                 const char *base_url);
+
+/**
+ * Read the result for url, if it was fetched no earlier than since
+ * @param base_url: set to the url it was fetched from. Caller must free
+ * @return 0 if there is one, else errno
+ */
+int sxupdate_flight_read_result(sxupdate_t handle, const char *dir, const char *url, time_t since,
+                                char **base_url);
+
+/**
+ * Leave a copy of the installer at path, verified against key (its enclosure url and
+ * signature), for the other processes
+ * @return 0 on success, else errno
+ */
+int sxupdate_flight_share_installer(sxupdate_t handle, const char *dir, const char *path,
+                                    const char *key);
+
+/**
+ * If the installer left in dir was verified against key, copy it to path, which it
+ * replaces. The copy still has to be verified
+ * @return 0 on success, else errno
+ */
+int sxupdate_flight_take_installer(sxupdate_t handle, const char *dir, const char *key,
+                                   const char *path);
+
+#endif
@@ -9,32 +9,33 @@
 #endif
 
 #include "internal.h"
+#include "alloc.h"
 #include "log.h"
 
 #ifdef _WIN32
 
-static WCHAR *utf8ToWide(const char *s_utf8) {
+static WCHAR *utf8ToWide(sxupdate_t handle, const char *s_utf8) {
   int s_len = strlen(s_utf8);
 
   // Get the required size of the new buffer
   int wideCharSize = MultiByteToWideChar(CP_UTF8, 0, s_utf8, s_len, NULL, 0);
   if(wideCharSize == 0) {
-    sxupdate_printerr("Error in MultiByteToWideChar!");
+    sxupdate_log_error(handle, "spawn.encoding", "Error in MultiByteToWideChar!");
     return NULL;
   }
 
   // Allocate the new wide char buffer
-  WCHAR* result = (WCHAR*)malloc(sizeof(WCHAR) * (wideCharSize + 1));
+  WCHAR* result = (WCHAR*)sxupdate_mem_alloc(sizeof(WCHAR) * (wideCharSize + 1));
   if(result == NULL) {
-    sxupdate_printerr("Out of memory!");
+    sxupdate_log_error(handle, "memory", "Out of memory!");
     return NULL;
   }
 
   // Convert the string
   int rc = MultiByteToWideChar(CP_UTF8, 0, s_utf8, s_len, result, wideCharSize);
   if(rc == 0) {
-    sxupdate_printerr("Error in MultiByteToWideChar!");
-    free(result);
+    sxupdate_log_error(handle, "spawn.encoding", "Error in MultiByteToWideChar!");
+    sxupdate_mem_free(result);
     return NULL;
   }
 
@@ -49,7 +50,7 @@ static WCHAR *utf8ToWide(const char *s_utf8) {
  * command argument helper funcs
  */
 #ifdef _WIN32
-static char *prepare_cmd(char *executable_path, struct sxupdate_string_list *args) {
+static char *prepare_cmd(sxupdate_t handle, char *executable_path, struct sxupdate_string_list *args) {
   char *cmd = executable_path;
   if(args) {
     size_t len = strlen(executable_path);
@@ -57,9 +58,9 @@ static char *prepare_cmd(char *executable_path, struct sxupdate_string_list *arg
       len += 1 + strlen(arg->value);
     len += 2;
 
-    cmd = calloc(1, len + 3);
+    cmd = sxupdate_mem_calloc(1, len + 3);
     if(!cmd)
-      sxupdate_printerr("Out of memory!");
+      sxupdate_log_error(handle, "memory", "Out of memory!");
     else {
       // add surrounding double-quotes to executable name
       *cmd = '"';
@@ -76,14 +77,14 @@ static char *prepare_cmd(char *executable_path, struct sxupdate_string_list *arg
 }
 
 #else
-static char **prepare_argv(char *executable_path, struct sxupdate_string_list *args, size_t *argc) {
+static char **prepare_argv(sxupdate_t handle, char *executable_path, struct sxupdate_string_list *args, size_t *argc) {
   *argc = 1;
   for(struct sxupdate_string_list *arg = args; arg; arg = arg->next)
     (*argc)++;
 
-  char **argv = calloc(*argc + 1, sizeof(*argv));
+  char **argv = sxupdate_mem_calloc(*argc + 1, sizeof(*argv));
   if(!argv) {
-    sxupdate_printerr("Out of memory!");
+    sxupdate_log_error(handle, "memory", "Out of memory!");
     return NULL;
   }
 
@@ -103,28 +104,24 @@ static char **prepare_argv(char *executable_path, struct sxupdate_string_list *a
  *
  * @param executable_path: e.g. _T("C:\\Path\\To\\Your\\Executable.exe") or "/path/to/your/program"
  ****/
-int fork_and_exit(char *executable_path, struct sxupdate_string_list *args,
-                  unsigned char verbosity) {
-  if(verbosity) {
-    sxupdate_verbose("Executing: %s", executable_path);
-    if(args) {
-      for(struct sxupdate_string_list *arg = args; arg; arg = arg->next)
-        sxupdate_verbose("  %s", arg->value);
-    }
-    sxupdate_verbose("");
-  }
+int fork_and_exit(sxupdate_t handle, char *executable_path,
+                  struct sxupdate_string_list *args) {
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "spawn.start",
+                  ((const struct sxupdate_log_field[]){ { "path", executable_path }, { NULL, NULL } }),
+                  "Executing: %s", executable_path);
+  for(struct sxupdate_string_list *arg = args; arg; arg = arg->next)
+    sxupdate_log_info(handle, "spawn.arg", "  %s", arg->value);
 
 #ifdef _WIN32
-  char *cmd = prepare_cmd(executable_path, args);
+  char *cmd = prepare_cmd(handle, executable_path, args);
   if(!cmd)
     return ENOMEM;
 
-  if(verbosity)
-    sxupdate_verbose("Final cmd: %s", cmd);
+  sxupdate_log_info(handle, "spawn.cmd", "Final cmd: %s", cmd);
 
-  WCHAR *path_w = utf8ToWide(cmd);
+  WCHAR *path_w = utf8ToWide(handle, cmd);
   if(cmd != executable_path)
-    free(cmd);
+    sxupdate_mem_free(cmd);
   if(!path_w)
     return ENOMEM;
 
@@ -144,7 +141,7 @@ int fork_and_exit(char *executable_path, struct sxupdate_string_list *args,
                           NULL,           // Use parent's starting directory
                           &si,            // Pointer to STARTUPINFO structure
                           &pi);           // Pointer to PROCESS_INFORMATION structure
-  free(path_w);
+  sxupdate_mem_free(path_w);
   if(!rc) {
     DWORD errorMessageID = GetLastError();
     LPSTR messageBuffer = NULL;
@@ -152,21 +149,22 @@ int fork_and_exit(char *executable_path, struct sxupdate_string_list *args,
                                  NULL, errorMessageID, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
     // If FormatMessage returns a size greater than zero, it was able to format the error message
     if(size)
-      sxupdate_printerr("CreateProcess failed with error x: %s", messageBuffer);
+      sxupdate_log_error(handle, "spawn.error", "CreateProcess failed with error x: %s", messageBuffer);
     else
-      sxupdate_printerr("CreateProcess failed with error: %lu", errorMessageID);
+      sxupdate_log_error(handle, "spawn.error", "CreateProcess failed with error: %lu", errorMessageID);
     LocalFree(messageBuffer);
     return 1;
   }
 #else
   size_t argc = 0;
-  char **argv = prepare_argv(executable_path, args, &argc);
+  char **argv = prepare_argv(handle, executable_path, args, &argc);
   if(!argv)
     return 1;
 
   pid_t pid = fork();
   if(pid < 0) {
-    sxupdate_printerr("Fork Failed");
+    sxupdate_log_error(handle, "spawn.error", "Fork Failed");
+    sxupdate_mem_free(argv);
     return 1;
   }
 
@@ -174,10 +172,11 @@ int fork_and_exit(char *executable_path, struct sxupdate_string_list *args,
     // if execv succeeds, we won't get here and the OS will free argv
     // otherwise, execv failed and we need to free argv ourselves
     execv(argv[0], argv);
-    sxupdate_printerr("Execv Failed");
-    free(argv);
+    sxupdate_log_error(handle, "spawn.error", "Execv Failed");
+    sxupdate_mem_free(argv);
     return 1;
   }
+  sxupdate_mem_free(argv); // the child has its own copy
 #endif
 
   return 0;
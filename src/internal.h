@@ -3,34 +3,255 @@
 
 #ifndef NO_SIGNATURE
 #include "openssl/rsa.h"
+#include "openssl/sha.h"
 #endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include <time.h>
+#include <curl/curl.h>
 #include "../include/api.h"
 #include <yajl_helper/yajl_helper.h>
+#include "state.h"
+
+#define SXUPDATE_STALL_SECONDS 30         // default of sxupdate_fetch_options.stall_seconds
+#define SXUPDATE_HEDGE_DELAY_MS 1000      // ... of hedge_delay_ms, until latency is known
+#define SXUPDATE_FETCH_LATENCY_SAMPLES 32 // response times the hedge delay is derived from
+#define SXUPDATE_HEDGE_MIN_SAMPLES 5      // ... once there are at least this many
 
 struct sxupdate_string_list {
   struct sxupdate_string_list *next;
   char *value;
 };
 
+struct sxupdate_batch_product {
+  char *id;
+  struct sxupdate_semantic_version current_version;
+  sxupdate_interaction_handler interaction_handler;
+  struct sxupdate_version version; // its first item in the catalog, until its turn comes
+  unsigned char got_version:1;
+  unsigned char held:1; // an item newer than version was not yet rolled out to this client
+  unsigned char _:6;
+};
+
 struct sxupdate_data {
   struct {
     yajl_status stat;
     struct yajl_helper_parse_state st;
     size_t scanned_bytes;
+    char *document;      // the appcast mapped from a local file, if any (see sxupdate_parse_map())
+    size_t document_len;
   } parser;
   struct sxupdate_semantic_version (*get_current_version)();
   sxupdate_interaction_handler interaction_handler;
+  sxupdate_completion_handler completion_handler;
+  sxupdate_stage_handler stage_handler;
+  void *user_data;
   enum sxupdate_step step; // what step we are currently processing
 
+  struct {
+    enum sxupdate_stage current; // where the update is paused, waiting for the stage handler
+    char *path;                  // ... with this installer
+  } stage;
+
+  struct {
+    CURLM *multi; // non-NULL when driven by the caller's event loop
+    sxupdate_socket_callback socket_cb;
+    sxupdate_timer_callback timer_cb;
+    void *ctx;
+    void (*done)(sxupdate_t, CURL *, CURLcode); // completion of the in-flight transfer
+    CURL *curl; // the in-flight transfer, if any
+  } event;
+
+  void (*after_fetch)(sxupdate_t, enum sxupdate_status);
+  enum sxupdate_status fetch_status;
+  CURL *fetch_curl; // kept between checks, so that connections, DNS and TLS sessions are reused
+
+  struct {
+    FILE *f;
+    char *save_path;
+    char *resolved_url;
+    const char *dir; // download here instead of the temporary directory, if set
+    void (*next)(sxupdate_t, enum sxupdate_status, char *);
+    struct sxupdate_codec *decoder; // decompresses the enclosure on the way to f, if encoded
+    struct sxupdate_sink *sink; // written to instead of f, with sxupdate_set_write_options()
+    long long received;  // bytes received so far
+    long long max_bytes; // abort once more than this is received. 0: no limit
+#ifndef NO_SIGNATURE
+    SHA256_CTX sha256;                       // of the bytes written so far
+    unsigned char hash[SHA256_DIGEST_LENGTH]; // of the file just downloaded, if hashed
+#endif
+    unsigned char from_peer:1;  // resolved_url is a LAN peer, not the origin
+    unsigned char no_peer:1;    // peer copy already tried; go to the origin
+    unsigned char from_cache:1; // using the installer prefetched by a background check
+    unsigned char hashed:1;     // hash is set, and not yet used by sxupdate_verify_signature()
+    unsigned char from_delta:1; // rebuilt from local blocks (see sxupdate_set_delta())
+    unsigned char no_delta:1;   // rebuilt installer did not verify; download it in full
+    unsigned char from_flight:1; // copied from the one another process downloaded
+    unsigned char no_flight:1;   // ... and it did not verify; download it
+  } download;
+
+  struct {
+    struct sxupdate_string_list *seeds; // local files to take blocks from
+    char *cache_dir;                    // where the last verified installer is kept, if set
+    unsigned char enabled:1;            // set by sxupdate_set_delta()
+    unsigned char _:7;
+  } delta;
+
+  struct {
+    long long direct_min_bytes; // bypass the page cache for installers at least this large, if set
+    unsigned char async:1;      // write downloads with a sink (see sink.h)
+    unsigned char _:7;
+  } write;
+
+  struct {
+    long long max_recv_speed; // bytes per second, shared by parallel transfers. 0: no cap
+    int nice;                 // lower hashing and writing threads by this much
+    size_t hash_chunk;        // bytes hashed between yields. 0: no yielding
+    long hash_pause_us;       // ... and pause between chunks
+    unsigned char idle_io:1;  // idle I/O class for hashing and writing threads
+    unsigned char _:7;
+  } qos;
+
+  struct {
+    struct sxupdate_ring *ring; // events for the caller to poll, if set (see ring.h)
+    enum sxupdate_phase phase;  // last reported
+    double started;             // sxupdate_clock_now() time the check started
+    double download_started;
+    long long bytes;            // last progress reported
+  } events;
+
+  struct {
+    long deadline_ms;    // 0 for none
+    long stall_seconds;  // 0 for no stall detection
+    long stall_bytes_per_second;
+    long hedge_delay_ms; // 0 to derive it from latency
+    struct sxupdate_string_list *mirrors;
+    struct sxupdate_string_list *next_mirror; // for the next hedged request
+    double deadline; // sxupdate_clock_now() time the current check must be fetched by, or 0
+    double latency[SXUPDATE_FETCH_LATENCY_SAMPLES]; // response times of the last fetches
+    size_t latency_count;
+    CURL *winner; // first of the hedged requests to respond
+    unsigned char hedge:1;
+    unsigned char _:7;
+  } fetch;
+
+  struct {
+#ifndef _WIN32
+    pthread_t thread;     // runs the download unless driven by an event loop
+#endif
+    int cancel;           // set to abort the download, possibly from another thread
+    enum sxupdate_status stat; // result of the download, once done
+    char *path;                // downloaded file, once done
+    double answered_at;        // when the user proceeded
+    unsigned char enabled:1;   // set by sxupdate_set_speculative_download()
+    unsigned char started:1;   // the download started before the user answered
+    unsigned char done:1;      // ... and has finished
+    unsigned char proceed:1;   // the user proceeded before it finished (event loop only)
+    unsigned char _:4;
+  } speculative;
+
+  struct {
+    char *dir;          // NULL unless sxupdate_set_single_flight() was called
+    long wait_ms;
+    long max_age;       // seconds
+    int appcast_lock;   // held while this process fetches the appcast for the others, else -1
+    int installer_lock; // ... downloads the installer
+    unsigned char no_wait:1;
+    unsigned char from_result:1; // the current check uses the appcast another process fetched
+    unsigned char _:6;
+  } flight;
+
+  struct {
+    char *dir;       // NULL unless sxupdate_set_background() was called
+    FILE *appcast;   // in the helper, or for single flight: copy of the appcast as it is fetched
+    char *installer; // installer prefetched and verified by the helper
+    unsigned char prefetch:1;
+    unsigned char from_result:1; // the current check is the result of a background check
+    unsigned char _:6;
+  } background;
+
+#ifndef NO_SIGNATURE
+  struct {
+    char *share_dir;
+    char *group;
+    char *iface;
+    unsigned short port;
+    long timeout_ms;
+    unsigned char enabled:1;
+    unsigned char _:7;
+  } peer;
+#endif
+
+  struct {
+    char *path; // NULL unless sxupdate_set_state_file() was called
+    long ttl;   // seconds
+    struct sxupdate_state_record record; // as read before the current check
+    struct curl_slist *headers;          // custom headers plus validators, if sent
+    char etag[SXUPDATE_STATE_ETAG_MAX];  // validators received with the current fetch
+    char last_modified[SXUPDATE_STATE_LAST_MODIFIED_MAX];
+    unsigned char have_record:1;
+    unsigned char conditional:1;  // validators sent with the current fetch
+    unsigned char not_modified:1; // ... and the appcast had not changed
+    unsigned char fresh:1;        // no fetch needed; result taken from the record
+    unsigned char _:4;
+  } state;
+
+  struct {
+    char *machine_id; // set by sxupdate_set_rollout(), else read or generated when first needed
+    char *id_file;
+    struct {
+      double percentage; // of clients, once ramped up
+      long long start;   // time() from which clients are admitted
+      long long ramp;    // seconds over which the share admitted grows to percentage
+      unsigned char set:1; // the item being parsed has a rollout
+      unsigned char has_percentage:1; // ... else 100
+      unsigned char _:6;
+    } item;
+    unsigned char ignore:1;
+    unsigned char held:1; // the check skipped an item not yet rolled out to this client
+    unsigned char _:6;
+  } rollout;
+
+  struct {
+    struct sxupdate_batch_product *products; // NULL unless in sxupdate_execute_batch()
+    size_t count;
+    size_t next;                             // next product whose turn it is
+    struct sxupdate_batch_product *parsing;  // product whose catalog entry is being parsed
+    struct sxupdate_batch_product *current;  // product the interaction handler runs for
+    enum sxupdate_status stat;               // of the catalog fetch
+    unsigned char running:1; // taking products in turn, in sxupdate_batch_next()
+    unsigned char advance:1; // ... and the current one has completed
+    unsigned char _:6;
+  } batch;
+
+  struct {
+    char *platform, *arch, *channel; // set by sxupdate_set_shard(); NULL for the defaults
+    long index_ttl;                  // seconds
+    char *url;          // shard resolved from the index served at url, if any
+    time_t resolved_at; // when url was read from the index; 0 if only known as a base url
+    struct {
+      char *platform, *arch, *channel, *url;
+    } entry;     // index entry being parsed
+    char *match; // url of the first matching entry of the index being parsed
+    unsigned char is_index:1; // the document being parsed is an index
+    unsigned char _:7;
+  } shard;
+
+  char *install_dir; // updated from manifests, if set
   char *url;
+  const char *fetch_url; // url or shard.url: the document being fetched
   struct sxupdate_string_list *installer_args, **installer_args_next;
 
   struct curl_slist *http_headers;
   long http_code; // curl response
+  struct sxupdate_stats stats;
   struct sxupdate_version latest_version;
 
 #ifndef NO_SIGNATURE
   RSA *public_key;
+  char *public_key_pem; // parsed into public_key when first needed
+  size_t public_key_pem_len;
   struct {
     unsigned char *signature; // binary value of latest_version.signature
     size_t signature_length;
@@ -39,6 +260,16 @@ struct sxupdate_data {
 
   const char *err_msg;
 
+  struct {
+    sxupdate_log_sink sink; // if NULL, log to stderr subject to verbosity
+    void *ctx;
+    enum sxupdate_log_level max_level;
+  } log;
+
+  struct sxupdate_mem_account *mem; // memory charged to this handle
+
+  int stop; // set by sxupdate_stop(), possibly from another thread
+
   unsigned char verbosity;
 
   unsigned char url_is_file:1;
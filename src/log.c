@@ -1,20 +1,56 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include "alloc.h"
 #include "log.h"
+#include "ring.h"
 
-int sxupdate_printerr(const char *format, ...) {
-  int rc;
-  va_list args;
-  va_start(args, format);
-  rc = vfprintf(stderr, format, args);
-  va_end(args);
-  rc += fprintf(stderr, "\n");
-  return rc;
+static void sxupdate_log_stderr(void *ctx, enum sxupdate_log_level level, const char *event,
+                                const char *message,
+                                const struct sxupdate_log_field *fields, size_t field_count) {
+  (void)(ctx);
+  (void)(level);
+  (void)(event);
+  (void)(fields);
+  (void)(field_count);
+  fprintf(stderr, "%s\n", message);
 }
 
-void sxupdate_verbose(const char *format, ...) {
+int sxupdate_log_emit(sxupdate_t handle, int level, const char *event,
+                      const struct sxupdate_log_field *fields,
+                      const char *format, ...) {
+  char buff[256];
+  char *message = buff;
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  int len = vsnprintf(buff, sizeof(buff), format, args);
   va_end(args);
-  fprintf(stderr, "\n");
+  if(len < 0)
+    message = (char *)format;
+  else if((size_t)len >= sizeof(buff)) {
+    if(!(message = sxupdate_mem_alloc(len + 1)))
+      message = (char *)format;
+    else {
+      va_start(args, format);
+      vsnprintf(message, len + 1, format, args);
+      va_end(args);
+    }
+  }
+
+  size_t field_count = 0;
+  if(fields)
+    while(fields[field_count].key)
+      field_count++;
+
+  if(handle && handle->log.sink)
+    handle->log.sink(handle->log.ctx, (enum sxupdate_log_level)level, event, message,
+                     fields, field_count);
+  else
+    sxupdate_log_stderr(NULL, (enum sxupdate_log_level)level, event, message,
+                        fields, field_count);
+  if(handle && level == SXUPDATE_LOG_LEVEL_ERROR)
+    sxupdate_ring_error(handle, event);
+
+  if(message != buff && message != format)
+    sxupdate_mem_free(message);
+  return 1;
 }
@@ -2,8 +2,77 @@
 #define SXUPDATE_LOG_H
 
 #include <stdarg.h>
+#include "internal.h"
 
-int sxupdate_printerr(const char *format, ...);
-void sxupdate_verbose(const char *format, ...);
+/**
+ * Log levels as preprocessor constants, matching enum sxupdate_log_level
+ */
+#define SXUPDATE_LOG_LEVEL_ERROR   1
+#define SXUPDATE_LOG_LEVEL_WARNING 2
+#define SXUPDATE_LOG_LEVEL_INFO    3
+#define SXUPDATE_LOG_LEVEL_DEBUG   4
+#define SXUPDATE_LOG_LEVEL_TRACE   5
+
+/**
+ * Least severe level that is compiled in. Calls to any less severe level are
+ * constant-folded away, along with the evaluation of their arguments
+ */
+#ifndef SXUPDATE_LOG_MIN_LEVEL
+#define SXUPDATE_LOG_MIN_LEVEL SXUPDATE_LOG_LEVEL_TRACE
+#endif
+
+/**
+ * Return non-zero if a record of the given level will be consumed. handle may be NULL
+ */
+static inline int sxupdate_log_enabled(sxupdate_t handle, int level) {
+  if(handle && handle->log.sink)
+    return level <= (int)handle->log.max_level;
+
+  // default stderr sink: verbosity 1 = info, 2 = debug, 3+ = trace
+  unsigned char verbosity = handle ? handle->verbosity : 0;
+  return level <= (verbosity ? 2 + verbosity : SXUPDATE_LOG_LEVEL_WARNING);
+}
+
+/**
+ * Format and emit a record. Should only be called via the macros below, which
+ * skip the call altogether when the record would be discarded.
+ * `fields`, if not NULL, is terminated by an entry with a NULL key
+ *
+ * @return 1, so that error macros can be used to set error flags
+ */
+int sxupdate_log_emit(sxupdate_t handle, int level, const char *event,
+                      const struct sxupdate_log_field *fields,
+                      const char *format, ...)
+#if defined(__GNUC__)
+  __attribute__((format(printf, 5, 6)))
+#endif
+  ;
+
+/**
+ * Return non-zero if a record of the given level is both compiled in and will be consumed.
+ * Use to guard any work done only to produce log output
+ */
+#define sxupdate_log_wants(handle, level) \
+  ((level) <= SXUPDATE_LOG_MIN_LEVEL && sxupdate_log_enabled(handle, level))
+
+/* value of a skipped record; a call rather than a constant so the macros can be used as statements */
+static inline int sxupdate_log_skip(void) {
+  return 1;
+}
+
+#define sxupdate_log_kv(handle, level, event, fields, ...)              \
+  (sxupdate_log_wants(handle, level)                                    \
+   ? sxupdate_log_emit(handle, level, event, fields, __VA_ARGS__) : sxupdate_log_skip())
+
+#define sxupdate_log_error(handle, event, ...) \
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, event, NULL, __VA_ARGS__)
+#define sxupdate_log_warning(handle, event, ...) \
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_WARNING, event, NULL, __VA_ARGS__)
+#define sxupdate_log_info(handle, event, ...) \
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, event, NULL, __VA_ARGS__)
+#define sxupdate_log_debug(handle, event, ...) \
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_DEBUG, event, NULL, __VA_ARGS__)
+#define sxupdate_log_trace(handle, event, ...) \
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_TRACE, event, NULL, __VA_ARGS__)
 
 #endif
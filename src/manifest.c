@@ -0,0 +1,669 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // renameat2()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "internal.h"
+#include "manifest.h"
+#include "parse.h"
+#include "verify.h"
+#include "qos.h"
+#include "stats.h"
+#include "file.h"
+#include "alloc.h"
+#include "log.h"
+
+#define SXUPDATE_MANIFEST_LINE_MAX 4200 // digest, size and mode, and a path of up to 4096 bytes
+
+int sxupdate_manifest_wanted(sxupdate_t handle) {
+  return handle->install_dir && !handle->batch.products && handle->latest_version.manifest.url;
+}
+
+static size_t sxupdate_manifest_fetch_chunk(char *ptr, size_t size, size_t nmemb, void *f) {
+  return fwrite(ptr, size, nmemb, f) * size;
+}
+
+enum sxupdate_status sxupdate_manifest_fetch(sxupdate_t handle, const char *url, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if(!f) {
+    sxupdate_log_error(handle, "manifest.open", "%s: %s", path, strerror(errno));
+    return sxupdate_status_error;
+  }
+  CURL *curl = curl_easy_init();
+  if(!curl) {
+    fclose(f);
+    return sxupdate_status_memory;
+  }
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "manifest.fetch",
+                  ((const struct sxupdate_log_field[]){ { "url", url }, { NULL, NULL } }),
+                  "Fetching manifest %s", url);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  if(handle->http_headers && !sxupdate_url_is_file(url))
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, handle->http_headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sxupdate_manifest_fetch_chunk);
+  sxupdate_qos_curl(handle, curl, 1);
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+
+  enum sxupdate_status stat = sxupdate_status_ok;
+  if(res != CURLE_OK) {
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "manifest.error",
+                    ((const struct sxupdate_log_field[]){ { "url", url }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error fetching %s:\n  %s", url, curl_easy_strerror(res));
+    stat = sxupdate_status_error;
+  }
+  if(fclose(f) && stat == sxupdate_status_ok) {
+    sxupdate_log_error(handle, "manifest.write", "%s: %s", path, strerror(errno));
+    stat = sxupdate_status_error;
+  }
+  return stat;
+}
+
+/* a path that stays within the install dir: relative, with no empty, "." or ".." part */
+static int sxupdate_manifest_path_ok(const char *path) {
+  if(!*path || *path == '/')
+    return 0;
+  for(const char *part = path; part; ) {
+    const char *slash = strchr(part, '/');
+    size_t len = slash ? (size_t)(slash - part) : strlen(part);
+    if(!len || (len == 1 && *part == '.') || (len == 2 && !strncmp(part, "..", 2)))
+      return 0;
+    for(size_t i = 0; i < len; i++)
+      if((unsigned char)part[i] < 0x20 || part[i] == '\\')
+        return 0;
+    part = slash ? slash + 1 : NULL;
+  }
+  return 1;
+}
+
+/* parse "<hex SHA-256> <size> <octal mode> <path>" */
+static int sxupdate_manifest_parse_line(char *line, struct sxupdate_manifest_entry *e) {
+  if(sxupdate_unhex(line, e->digest, SHA256_DIGEST_LENGTH))
+    return EINVAL;
+  char *p = line + 2 * SHA256_DIGEST_LENGTH, *end;
+  if(*p++ != ' ' || *p < '0' || *p > '9')
+    return EINVAL;
+  errno = 0;
+  unsigned long long size = strtoull(p, &end, 10);
+  if(errno || *end != ' ')
+    return EINVAL;
+  p = end + 1;
+  if(*p < '0' || *p > '7')
+    return EINVAL;
+  unsigned long mode = strtoul(p, &end, 8);
+  if(*end != ' ' || mode > 0777 || !sxupdate_manifest_path_ok(end + 1))
+    return EINVAL;
+  e->size = size;
+  e->mode = (unsigned)mode;
+  e->path = end + 1;
+  return 0;
+}
+
+int sxupdate_manifest_read(const char *path, struct sxupdate_manifest *manifest) {
+  memset(manifest, 0, sizeof(*manifest));
+  FILE *f = fopen(path, "rb");
+  if(!f)
+    return errno;
+  char *line = sxupdate_mem_alloc(SXUPDATE_MANIFEST_LINE_MAX);
+  size_t capacity = 0;
+  int err = 0;
+  if(!line)
+    err = ENOMEM;
+  else if(!fgets(line, SXUPDATE_MANIFEST_LINE_MAX, f) || strcmp(line, SXUPDATE_MANIFEST_MAGIC "\n"))
+    err = EINVAL;
+  while(!err && fgets(line, SXUPDATE_MANIFEST_LINE_MAX, f)) {
+    size_t len = strlen(line);
+    struct sxupdate_manifest_entry e;
+    if(!len || line[len - 1] != '\n')
+      err = EINVAL; // too long, or truncated
+    else {
+      line[len - 1] = '\0';
+      err = sxupdate_manifest_parse_line(line, &e);
+    }
+    // sorted, so that a path listed twice is next to itself
+    if(!err && manifest->count && strcmp(manifest->entries[manifest->count - 1].path, e.path) >= 0)
+      err = EINVAL;
+    if(!err && manifest->count == capacity) {
+      size_t n = capacity ? capacity * 2 : 64;
+      struct sxupdate_manifest_entry *entries = sxupdate_mem_realloc(manifest->entries, n * sizeof(*entries));
+      if(!entries)
+        err = ENOMEM;
+      else {
+        manifest->entries = entries;
+        capacity = n;
+      }
+    }
+    if(!err) {
+      if(!(e.path = sxupdate_mem_strdup(e.path)))
+        err = ENOMEM;
+      else
+        manifest->entries[manifest->count++] = e;
+    }
+  }
+  if(!err && ferror(f))
+    err = EIO;
+  fclose(f);
+  sxupdate_mem_free(line);
+  if(err)
+    sxupdate_manifest_free(manifest);
+  return err;
+}
+
+void sxupdate_manifest_free(struct sxupdate_manifest *manifest) {
+  for(size_t i = 0; i < manifest->count; i++)
+    sxupdate_mem_free(manifest->entries[i].path);
+  sxupdate_mem_free(manifest->entries);
+  memset(manifest, 0, sizeof(*manifest));
+}
+
+#ifndef _WIN32
+/* remove path and, if it is a directory, everything under it, without following links */
+static int sxupdate_manifest_remove_tree(const char *path) {
+  struct stat st;
+  if(lstat(path, &st))
+    return errno == ENOENT ? 0 : errno;
+  if(!S_ISDIR(st.st_mode))
+    return unlink(path) ? errno : 0;
+
+  int err = 0;
+  DIR *dir = opendir(path);
+  if(!dir)
+    return errno;
+  struct dirent *de;
+  while(!err && (de = readdir(dir))) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    char *child = sxupdate_join_path(path, "/", de->d_name);
+    err = child ? sxupdate_manifest_remove_tree(child) : ENOMEM;
+    sxupdate_mem_free(child);
+  }
+  closedir(dir);
+  return err ? err : rmdir(path) ? errno : 0;
+}
+
+/* create the directories leading to path */
+static int sxupdate_manifest_mkdirs(char *path, size_t root_len) {
+  for(char *slash = strchr(path + root_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int err = mkdir(path, 0755) && errno != EEXIST ? errno : 0;
+    *slash = '/';
+    if(err)
+      return err;
+  }
+  return 0;
+}
+
+enum sxupdate_manifest_source {
+  sxupdate_manifest_installed, // the installed file at the same path is up to date
+  sxupdate_manifest_download,  // fetched from objects_url
+  sxupdate_manifest_duplicate  // same content as another entry's staged file
+};
+
+struct sxupdate_manifest_job {
+  const struct sxupdate_manifest_entry *entry;
+  enum sxupdate_manifest_source source;
+  const struct sxupdate_manifest_job *from; // if a duplicate
+  char *installed;                          // path in the install dir
+  char *staged;                             // path in the stage dir
+  unsigned char same_mode:1;                // the installed file already has the entry's mode
+  unsigned char _:7;
+
+  // while downloading
+  CURL *curl;
+  FILE *f;
+  SHA256_CTX sha256;
+  uint64_t received;
+};
+
+/* non-zero if the installed file has the size and digest of the entry */
+static int sxupdate_manifest_is_installed(sxupdate_t handle, struct sxupdate_manifest_job *job) {
+  struct stat st;
+  if(lstat(job->installed, &st) || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != job->entry->size)
+    return 0;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  double start = sxupdate_clock_now();
+  int err = sxupdate_sha256_file_qos(handle, job->installed, digest, NULL);
+  handle->stats.hash += sxupdate_clock_now() - start;
+  if(err || memcmp(digest, job->entry->digest, sizeof(digest)))
+    return 0;
+  job->same_mode = (unsigned)(st.st_mode & 0777) == job->entry->mode;
+  return 1;
+}
+
+/* order by content, installed copies first, then by path */
+static int sxupdate_manifest_job_cmp(const void *a, const void *b) {
+  const struct sxupdate_manifest_job *x = *(const struct sxupdate_manifest_job **)a;
+  const struct sxupdate_manifest_job *y = *(const struct sxupdate_manifest_job **)b;
+  int c = memcmp(x->entry->digest, y->entry->digest, SHA256_DIGEST_LENGTH);
+  if(!c)
+    c = (x->source != sxupdate_manifest_installed) - (y->source != sxupdate_manifest_installed);
+  return c ? c : x < y ? -1 : x > y;
+}
+
+/**
+ * Decide where each file comes from: its installed copy if up to date, else a single
+ * download per content, which other entries with that content then copy
+ * @return the downloads, in path order. Caller must free
+ */
+static struct sxupdate_manifest_job **sxupdate_manifest_plan(struct sxupdate_manifest_job *jobs, size_t count,
+                                                             size_t *downloads) {
+  struct sxupdate_manifest_job **by_content = sxupdate_mem_alloc((count ? count : 1) * sizeof(*by_content));
+  if(!by_content)
+    return NULL;
+  for(size_t i = 0; i < count; i++)
+    by_content[i] = &jobs[i];
+  qsort(by_content, count, sizeof(*by_content), sxupdate_manifest_job_cmp);
+  const struct sxupdate_manifest_job *first = NULL; // of the current content
+  for(size_t i = 0; i < count; i++) {
+    struct sxupdate_manifest_job *job = by_content[i];
+    if(!first || memcmp(first->entry->digest, job->entry->digest, SHA256_DIGEST_LENGTH)) {
+      first = job;
+      if(job->source != sxupdate_manifest_installed)
+        job->source = sxupdate_manifest_download;
+    } else if(job->source != sxupdate_manifest_installed) {
+      job->source = sxupdate_manifest_duplicate;
+      job->from = first;
+    }
+  }
+
+  *downloads = 0;
+  for(size_t i = 0; i < count; i++)
+    if(jobs[i].source == sxupdate_manifest_download)
+      by_content[(*downloads)++] = &jobs[i];
+  return by_content;
+}
+
+static size_t sxupdate_manifest_download_chunk(char *ptr, size_t size, size_t nmemb, void *j) {
+  struct sxupdate_manifest_job *job = j;
+  size_t len = size * nmemb;
+  if(job->received + len > job->entry->size || fwrite(ptr, 1, len, job->f) != len)
+    return 0; // aborts
+  SHA256_Update(&job->sha256, ptr, len);
+  job->received += len;
+  return len;
+}
+
+static enum sxupdate_status sxupdate_manifest_download_start(sxupdate_t handle, CURLM *multi,
+                                                             struct sxupdate_manifest_job *job,
+                                                             const char *objects_url) {
+  char hex[2 * SHA256_DIGEST_LENGTH + 1];
+  sxupdate_hex(job->entry->digest, SHA256_DIGEST_LENGTH, hex);
+  char *url = sxupdate_join_path(objects_url, "", hex);
+  if(!url || !(job->curl = curl_easy_init())) {
+    sxupdate_mem_free(url);
+    return sxupdate_status_memory;
+  }
+  if(!(job->f = fopen(job->staged, "wb"))) {
+    sxupdate_log_error(handle, "manifest.open", "%s: %s", job->staged, strerror(errno));
+    sxupdate_mem_free(url);
+    return sxupdate_status_error;
+  }
+  sxupdate_log_debug(handle, "manifest.download", "Downloading %s from %s", job->entry->path, url);
+  curl_easy_setopt(job->curl, CURLOPT_URL, url);
+  curl_easy_setopt(job->curl, CURLOPT_FAILONERROR, 1L);
+  if(handle->http_headers && !sxupdate_url_is_file(url))
+    curl_easy_setopt(job->curl, CURLOPT_HTTPHEADER, handle->http_headers);
+  curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, job);
+  curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, sxupdate_manifest_download_chunk);
+  curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+  sxupdate_qos_curl(handle, job->curl, SXUPDATE_MANIFEST_PARALLEL);
+  sxupdate_mem_free(url); // curl keeps its own copy
+  SHA256_Init(&job->sha256);
+  job->received = 0;
+  return curl_multi_add_handle(multi, job->curl) == CURLM_OK ? sxupdate_status_ok : sxupdate_status_error;
+}
+
+/* end a download, checking that it is complete and that its content is the entry's */
+static enum sxupdate_status sxupdate_manifest_download_done(sxupdate_t handle, CURLM *multi,
+                                                            struct sxupdate_manifest_job *job, CURLcode res) {
+  enum sxupdate_status stat = sxupdate_status_error;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &job->sha256);
+  if(res != CURLE_OK)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "manifest.error",
+                    ((const struct sxupdate_log_field[]){ { "path", job->entry->path }, { "error", curl_easy_strerror(res) }, { NULL, NULL } }),
+                    "Error downloading %s:\n  %s", job->entry->path, curl_easy_strerror(res));
+  else if(job->received != job->entry->size || memcmp(digest, job->entry->digest, sizeof(digest)))
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_ERROR, "manifest.verify",
+                    ((const struct sxupdate_log_field[]){ { "path", job->entry->path }, { NULL, NULL } }),
+                    "Downloaded %s does not match the manifest", job->entry->path);
+  else
+    stat = sxupdate_status_ok;
+  handle->stats.download.bytes += (double)job->received;
+
+  curl_multi_remove_handle(multi, job->curl);
+  curl_easy_cleanup(job->curl);
+  job->curl = NULL;
+  if(fclose(job->f) && stat == sxupdate_status_ok) {
+    sxupdate_log_error(handle, "manifest.write", "%s: %s", job->staged, strerror(errno));
+    stat = sxupdate_status_error;
+  }
+  job->f = NULL;
+  return stat;
+}
+
+/* download the files not installed yet, SXUPDATE_MANIFEST_PARALLEL at a time */
+static enum sxupdate_status sxupdate_manifest_download_all(sxupdate_t handle, struct sxupdate_manifest_job **downloads,
+                                                           size_t count, const char *objects_url) {
+  CURLM *multi = curl_multi_init();
+  if(!multi)
+    return sxupdate_status_memory;
+  double start = sxupdate_clock_now();
+  enum sxupdate_status stat = sxupdate_status_ok;
+  size_t next = 0, running = 0;
+  while(stat == sxupdate_status_ok && (next < count || running)) {
+    while(stat == sxupdate_status_ok && next < count && running < SXUPDATE_MANIFEST_PARALLEL)
+      if((stat = sxupdate_manifest_download_start(handle, multi, downloads[next++], objects_url)) == sxupdate_status_ok)
+        running++;
+
+    int still_running, left;
+    if(stat == sxupdate_status_ok && curl_multi_perform(multi, &still_running) != CURLM_OK)
+      stat = sxupdate_status_error;
+    CURLMsg *msg;
+    while(stat == sxupdate_status_ok && (msg = curl_multi_info_read(multi, &left))) {
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+      char *job = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &job);
+      stat = sxupdate_manifest_download_done(handle, multi, (struct sxupdate_manifest_job *)job,
+                                             msg->data.result);
+      running--;
+    }
+    if(stat == sxupdate_status_ok && running && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+      stat = sxupdate_status_error;
+  }
+
+  // on failure, abort the downloads still running
+  for(size_t i = 0; i < next; i++) {
+    struct sxupdate_manifest_job *job = downloads[i];
+    if(job->curl) {
+      curl_multi_remove_handle(multi, job->curl);
+      curl_easy_cleanup(job->curl);
+      job->curl = NULL;
+    }
+    if(job->f)
+      fclose(job->f);
+    job->f = NULL;
+  }
+  curl_multi_cleanup(multi);
+
+  struct sxupdate_transfer_stats *ts = &handle->stats.download;
+  ts->total = sxupdate_clock_now() - start;
+  ts->throughput = ts->total > 0 ? ts->bytes / ts->total : 0;
+  return stat;
+}
+
+/**
+ * Swap the staged tree into place, leaving the previous tree, if any, at old or stage.
+ * Where supported, both trees are exchanged in a single step; otherwise, install_dir is
+ * missing between two renames
+ */
+static int sxupdate_manifest_swap(const char *install_dir, const char *stage, const char *old) {
+#ifdef RENAME_EXCHANGE
+  if(!renameat2(AT_FDCWD, stage, AT_FDCWD, install_dir, RENAME_EXCHANGE))
+    return 0;
+  if(errno != EINVAL && errno != ENOSYS && errno != ENOENT) // ENOENT: nothing installed yet
+    return errno;
+#endif
+  int had_old = !rename(install_dir, old);
+  if(!had_old && errno != ENOENT)
+    return errno;
+  if(rename(stage, install_dir)) {
+    int err = errno;
+    if(had_old)
+      rename(old, install_dir);
+    return err;
+  }
+  return 0;
+}
+
+/* stage the tree listed in the manifest, then swap it into place */
+static enum sxupdate_status sxupdate_manifest_stage(sxupdate_t handle, const struct sxupdate_manifest *manifest,
+                                                    struct sxupdate_manifest_job *jobs,
+                                                    const char *install_dir, const char *stage,
+                                                    const char *old, const char *objects_url) {
+  const char *failed = NULL;
+  int err = 0;
+  for(size_t i = 0; i < manifest->count && !err; i++) {
+    jobs[i].entry = &manifest->entries[i];
+    jobs[i].source = sxupdate_manifest_download;
+    if(!(jobs[i].installed = sxupdate_join_path(install_dir, "/", jobs[i].entry->path))
+       || !(jobs[i].staged = sxupdate_join_path(stage, "/", jobs[i].entry->path)))
+      err = ENOMEM;
+    else {
+      if(sxupdate_manifest_is_installed(handle, &jobs[i]))
+        jobs[i].source = sxupdate_manifest_installed;
+      if((err = sxupdate_manifest_mkdirs(jobs[i].staged, strlen(stage))))
+        failed = jobs[i].staged;
+    }
+  }
+
+  size_t downloads = 0;
+  struct sxupdate_manifest_job **to_download = err ? NULL : sxupdate_manifest_plan(jobs, manifest->count, &downloads);
+  if(err || !to_download) {
+    if(failed)
+      sxupdate_log_error(handle, "manifest.stage", "%s: %s", failed, strerror(err));
+    sxupdate_mem_free(to_download);
+    return err && err != ENOMEM ? sxupdate_status_error : sxupdate_status_memory;
+  }
+
+  size_t installed = 0, duplicates = 0;
+  uint64_t download_bytes = 0;
+  for(size_t i = 0; i < manifest->count; i++) {
+    installed += jobs[i].source == sxupdate_manifest_installed;
+    duplicates += jobs[i].source == sxupdate_manifest_duplicate;
+    if(jobs[i].source == sxupdate_manifest_download)
+      download_bytes += jobs[i].entry->size;
+  }
+  sxupdate_log_info(handle, "manifest.plan", "%zu files: %zu up to date, %zu to download (%llu bytes), %zu duplicates",
+                    manifest->count, installed, downloads, (unsigned long long)download_bytes, duplicates);
+
+  // up-to-date files are linked, so that they need not be copied, unless their mode changes
+  for(size_t i = 0; i < manifest->count && !err; i++)
+    if(jobs[i].source == sxupdate_manifest_installed) {
+      if((!jobs[i].same_mode || link(jobs[i].installed, jobs[i].staged))
+         && (err = sxupdate_copy_file(jobs[i].installed, jobs[i].staged, 0)))
+        failed = jobs[i].staged;
+    }
+
+  enum sxupdate_status stat = err ? sxupdate_status_error
+    : sxupdate_manifest_download_all(handle, to_download, downloads, objects_url);
+  sxupdate_mem_free(to_download);
+
+  for(size_t i = 0; i < manifest->count && !err && stat == sxupdate_status_ok; i++) {
+    struct sxupdate_manifest_job *job = &jobs[i];
+    if(job->source == sxupdate_manifest_duplicate
+       && (err = sxupdate_copy_file(job->from->staged, job->staged, 0)))
+      failed = job->staged;
+    else if((job->source != sxupdate_manifest_installed || !job->same_mode)
+            && chmod(job->staged, job->entry->mode) && (err = errno))
+      failed = job->staged;
+  }
+
+  if(!err && stat == sxupdate_status_ok && (err = sxupdate_manifest_swap(install_dir, stage, old)))
+    failed = install_dir;
+  if(err) {
+    sxupdate_log_error(handle, "manifest.stage", "%s: %s", failed, strerror(err));
+    stat = sxupdate_status_error;
+  }
+  return stat;
+}
+#endif
+
+enum sxupdate_status sxupdate_manifest_apply(sxupdate_t handle, const struct sxupdate_manifest *manifest,
+                                             const char *install_dir, const char *objects_url) {
+#ifdef _WIN32
+  (void)(manifest);
+  (void)(install_dir);
+  (void)(objects_url);
+  sxupdate_log_error(handle, "manifest.unsupported", "Manifest updates are not supported on this platform");
+  return sxupdate_status_error;
+#else
+  char *stage = sxupdate_join_path(install_dir, "", SXUPDATE_MANIFEST_STAGE_SUFFIX);
+  char *old = sxupdate_join_path(install_dir, "", SXUPDATE_MANIFEST_OLD_SUFFIX);
+  struct sxupdate_manifest_job *jobs = sxupdate_mem_calloc(manifest->count ? manifest->count : 1, sizeof(*jobs));
+  enum sxupdate_status stat = sxupdate_status_memory;
+  int err;
+  if(stage && old && jobs) {
+    // left over from an interrupted update. If it stopped between the two renames of
+    // sxupdate_manifest_swap(), old is the installed tree: put it back first
+    struct stat st;
+    if(lstat(install_dir, &st) && errno == ENOENT && !rename(old, install_dir))
+      sxupdate_log_warning(handle, "manifest.recover", "Restored %s from an interrupted update", install_dir);
+    if((err = sxupdate_manifest_remove_tree(stage)) || (err = sxupdate_manifest_remove_tree(old))
+       || (mkdir(stage, 0755) && (err = errno))) {
+      sxupdate_log_error(handle, "manifest.stage", "%s: %s", stage, strerror(err));
+      stat = sxupdate_status_error;
+    } else if((stat = sxupdate_manifest_stage(handle, manifest, jobs, install_dir, stage, old, objects_url))
+              == sxupdate_status_ok)
+      sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "manifest.done",
+                      ((const struct sxupdate_log_field[]){ { "path", install_dir }, { NULL, NULL } }),
+                      "Updated %s", install_dir);
+    // the tree not in use any more
+    if((err = sxupdate_manifest_remove_tree(stage))
+       || (stat == sxupdate_status_ok && (err = sxupdate_manifest_remove_tree(old))))
+      sxupdate_log_warning(handle, "manifest.cleanup", "Unable to remove the previous tree: %s", strerror(err));
+  }
+  for(size_t i = 0; jobs && i < manifest->count; i++) {
+    sxupdate_mem_free(jobs[i].installed);
+    sxupdate_mem_free(jobs[i].staged);
+  }
+  sxupdate_mem_free(jobs);
+  sxupdate_mem_free(stage);
+  sxupdate_mem_free(old);
+  return stat;
+#endif
+}
+
+#ifndef _WIN32
+struct sxupdate_manifest_files {
+  char **paths; // relative to the tree
+  size_t count, capacity;
+};
+
+/* list the regular files under dir/prefix */
+static int sxupdate_manifest_list(sxupdate_t handle, const char *dir, const char *prefix,
+                                  struct sxupdate_manifest_files *files) {
+  char *path = *prefix ? sxupdate_join_path(dir, "/", prefix) : sxupdate_mem_strdup(dir);
+  DIR *d = path ? opendir(path) : NULL;
+  int err = !path ? ENOMEM : !d ? errno : 0;
+  struct dirent *de;
+  while(!err && (de = readdir(d))) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    char *rel = *prefix ? sxupdate_join_path(prefix, "/", de->d_name) : sxupdate_mem_strdup(de->d_name);
+    char *full = rel ? sxupdate_join_path(dir, "/", rel) : NULL;
+    struct stat st;
+    if(!full)
+      err = ENOMEM;
+    else if(lstat(full, &st))
+      err = errno;
+    else if(S_ISDIR(st.st_mode))
+      err = sxupdate_manifest_list(handle, dir, rel, files);
+    else if(!S_ISREG(st.st_mode) || !sxupdate_manifest_path_ok(rel)) {
+      sxupdate_log_error(handle, "manifest.unsupported", "%s: only regular files and directories can be published", full);
+      err = EINVAL;
+    } else {
+      if(files->count == files->capacity) {
+        size_t n = files->capacity ? files->capacity * 2 : 64;
+        char **paths = sxupdate_mem_realloc(files->paths, n * sizeof(*paths));
+        if(!paths)
+          err = ENOMEM;
+        else {
+          files->paths = paths;
+          files->capacity = n;
+        }
+      }
+      if(!err) {
+        files->paths[files->count++] = rel;
+        rel = NULL;
+      }
+    }
+    sxupdate_mem_free(rel);
+    sxupdate_mem_free(full);
+  }
+  if(d)
+    closedir(d);
+  sxupdate_mem_free(path);
+  return err;
+}
+
+static int sxupdate_manifest_strcmp(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+#endif
+
+int sxupdate_manifest_publish(sxupdate_t handle, const char *dir, const char *out_dir, size_t *count) {
+#ifdef _WIN32
+  (void)(dir);
+  (void)(out_dir);
+  (void)(count);
+  return ENOSYS;
+#else
+  struct sxupdate_manifest_files files = { 0 };
+  char *objects = sxupdate_join_path(out_dir, "/", SXUPDATE_MANIFEST_OBJECTS);
+  char *manifest_path = sxupdate_join_path(out_dir, "/", SXUPDATE_MANIFEST_FILENAME);
+  FILE *f = NULL;
+  int err = objects && manifest_path ? sxupdate_manifest_list(handle, dir, "", &files) : ENOMEM;
+  if(!err && mkdir(objects, 0755) && errno != EEXIST)
+    err = errno;
+  if(!err && !(f = fopen(manifest_path, "wb")))
+    err = errno;
+  if(!err) {
+    qsort(files.paths, files.count, sizeof(*files.paths), sxupdate_manifest_strcmp);
+    fprintf(f, "%s\n", SXUPDATE_MANIFEST_MAGIC);
+  }
+
+  for(size_t i = 0; i < files.count && !err; i++) {
+    char *path = sxupdate_join_path(dir, "/", files.paths[i]);
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    size_t length;
+    struct stat st;
+    char *object = NULL;
+    if(!path)
+      err = ENOMEM;
+    else if(stat(path, &st) || (err = sxupdate_sha256_file(path, digest, &length)))
+      err = err ? err : errno;
+    else {
+      // content-addressed: an object already published is the same file
+      sxupdate_hex(digest, SHA256_DIGEST_LENGTH, hex);
+      if(!(object = sxupdate_join_path(objects, "", hex)))
+        err = ENOMEM;
+      else if(access(object, F_OK) && (err = sxupdate_copy_file(path, object, 0)))
+        remove(object);
+      else if(fprintf(f, "%s %zu %o %s\n", hex, length, (unsigned)(st.st_mode & 0777), files.paths[i]) < 0)
+        err = errno ? errno : EIO;
+    }
+    if(err)
+      sxupdate_log_error(handle, "manifest.publish", "%s: %s", path ? path : files.paths[i], strerror(err));
+    sxupdate_mem_free(path);
+    sxupdate_mem_free(object);
+  }
+
+  if(f && fclose(f) && !err)
+    err = errno ? errno : EIO;
+  if(err && f)
+    remove(manifest_path);
+  if(count)
+    *count = files.count;
+  for(size_t i = 0; i < files.count; i++)
+    sxupdate_mem_free(files.paths[i]);
+  sxupdate_mem_free(files.paths);
+  sxupdate_mem_free(objects);
+  sxupdate_mem_free(manifest_path);
+  return err;
+#endif
+}
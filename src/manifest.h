@@ -0,0 +1,81 @@
+#ifndef SXUPDATE_MANIFEST_H
+#define SXUPDATE_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include "../include/api.h"
+
+/**
+ * File-level differential updates (see the item "manifest" in schema/appcast.schema.json,
+ * and sxupdate_set_install_dir()). The manifest is a signed text file listing every file
+ * of the version, sorted by path:
+ *
+ *   sxupdate-manifest 1
+ *   <hex SHA-256> <size> <octal mode> <path>
+ *   ...
+ *
+ * Paths are relative to the install directory, with '/' separators. Each file is served
+ * by content, at <directory of the manifest>/objects/<hex SHA-256>, so that a file that
+ * does not change keeps its url across versions, and identical files are fetched once
+ */
+#define SXUPDATE_MANIFEST_MAGIC "sxupdate-manifest 1"
+#define SXUPDATE_MANIFEST_FILENAME "manifest"
+#define SXUPDATE_MANIFEST_OBJECTS "objects/"
+#define SXUPDATE_MANIFEST_PARALLEL 4 // concurrent object downloads
+#define SXUPDATE_MANIFEST_STAGE_SUFFIX ".sxupdate-stage" // new tree, built next to the install dir
+#define SXUPDATE_MANIFEST_OLD_SUFFIX ".sxupdate-old"     // previous tree, until removed
+
+struct sxupdate_manifest_entry {
+  char *path;
+  uint64_t size;
+  unsigned mode; // permission bits
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+struct sxupdate_manifest {
+  struct sxupdate_manifest_entry *entries;
+  size_t count;
+};
+
+/**
+ * Whether the newer version is to be installed from its manifest rather than by running
+ * its enclosure: it has one, an install dir is set, and this is not a batch check
+ */
+int sxupdate_manifest_wanted(sxupdate_t handle);
+
+/**
+ * Download the manifest at url to path
+ */
+enum sxupdate_status sxupdate_manifest_fetch(sxupdate_t handle, const char *url, const char *path);
+
+/**
+ * Read a manifest, checking its format and that every path stays within the install dir
+ * @return 0 on success, EINVAL if it is not a valid manifest, else errno
+ */
+int sxupdate_manifest_read(const char *path, struct sxupdate_manifest *manifest);
+
+void sxupdate_manifest_free(struct sxupdate_manifest *manifest);
+
+/**
+ * Replace install_dir with the tree listed in the manifest. The new tree is staged next
+ * to install_dir: installed files whose content matches are linked (or copied) into it,
+ * and the others downloaded from objects_url, SXUPDATE_MANIFEST_PARALLEL at a time, each
+ * checked against its size and digest. Only then is the staged tree swapped with
+ * install_dir, so that the install dir is always either the old or the new tree
+ *
+ * Blocks until done, even when the handle is driven by an event loop
+ */
+enum sxupdate_status sxupdate_manifest_apply(sxupdate_t handle, const struct sxupdate_manifest *manifest,
+                                             const char *install_dir, const char *objects_url);
+
+/**
+ * Publish the tree at dir, for sxupdate-publish: copy each file to out_dir/objects/<hex>,
+ * and write out_dir/manifest
+ * @param handle: for logging, or NULL to log to stderr
+ * @param count : if not NULL, set to the number of files
+ * @return 0 on success, else errno
+ */
+int sxupdate_manifest_publish(sxupdate_t handle, const char *dir, const char *out_dir, size_t *count);
+
+#endif
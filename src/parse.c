@@ -1,32 +1,139 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include "parse.h"
+#include "file.h"
+#include "version.h"
 #include "verify.h"
+#include "encoding.h"
+#include "shard.h"
+#include "batch.h"
+#include "manifest.h"
+#include "rollout.h"
+#include "alloc.h"
 #include "log.h"
 
+static void sxupdate_shard_entry_reset(sxupdate_t handle) {
+  sxupdate_mem_free(handle->shard.entry.platform);
+  sxupdate_mem_free(handle->shard.entry.arch);
+  sxupdate_mem_free(handle->shard.entry.channel);
+  sxupdate_mem_free(handle->shard.entry.url);
+  memset(&handle->shard.entry, 0, sizeof(handle->shard.entry));
+}
+
+/**
+ * The version to parse values into: the first item of the appcast that is rolled out to
+ * this client (see rollout.h), or of the product whose entry in a catalog is being parsed. NULL once it has been parsed, or outside the
+ * entries of the products being checked
+ */
+static struct sxupdate_version *sxupdate_parse_target(sxupdate_t handle) {
+  if(!handle->batch.products)
+    return handle->got_version ? NULL : &handle->latest_version;
+  struct sxupdate_batch_product *p = handle->batch.parsing;
+  return p && !p->got_version ? &p->version : NULL;
+}
+
+/* in a catalog, parse the entry of each product being checked as an appcast */
+static int sxupdate_start_map(yajl_helper_t yh) {
+  sxupdate_t handle = yajl_helper_ctx(yh);
+  if(handle->batch.products && yajl_helper_got_path(yh, 3, "{products{*{")) {
+    handle->batch.parsing = sxupdate_batch_find(handle, yajl_helper_get_map_key(yh, 1));
+    if(handle->batch.parsing)
+      yajl_helper_level_offset(yh, 2);
+  }
+  return 1;
+}
+
 static int sxupdate_end_map(yajl_helper_t yh) {
 //  yajl_helper_t yh = ctx;
   sxupdate_t handle = yajl_helper_ctx(yh);
-  if(yajl_helper_got_path(yh, 2, "{items["))
-    handle->got_version = 1;
+  if(handle->batch.parsing && yajl_helper_level(yh) == 0) { // end of the product's entry
+    yajl_helper_level_offset(yh, 0);
+    handle->batch.parsing = NULL;
+  } else if(yajl_helper_got_path(yh, 2, "{items[")) {
+    struct sxupdate_version *v = sxupdate_parse_target(handle);
+    if(v && !sxupdate_rollout_admits(handle, v)) {
+      // not yet available to this client: take the next (previous) item instead
+      if(handle->batch.parsing)
+        handle->batch.parsing->held = 1;
+      handle->rollout.held = 1;
+      sxupdate_version_free(handle, v);
+      memset(v, 0, sizeof(*v));
+      v->version.major = v->version.minor = v->version.patch = -1;
+    } else if(handle->batch.parsing)
+      handle->batch.parsing->got_version = 1;
+    else
+      handle->got_version = 1;
+    sxupdate_rollout_item_reset(handle);
+  } else if(yajl_helper_got_path(yh, 2, "{shards[")) {
+    // keep the first matching shard
+    if(!handle->shard.match && handle->shard.entry.url
+       && sxupdate_shard_matches(handle, handle->shard.entry.platform, handle->shard.entry.arch,
+                                 handle->shard.entry.channel)) {
+      handle->shard.match = handle->shard.entry.url;
+      handle->shard.entry.url = NULL;
+    }
+    sxupdate_shard_entry_reset(handle);
+  }
   return 1;
 }
 
-static int sxupdate_process_value(yajl_helper_t yh, struct json_value *value) {
+/* a top-level "shards" array makes the document an index rather than an appcast */
+static int sxupdate_start_array(yajl_helper_t yh) {
   sxupdate_t handle = yajl_helper_ctx(yh);
-  if(handle->got_version) // already parsed a version, so nothing else to do
-    return 1;
+  if(yajl_helper_got_path(yh, 2, "{shards["))
+    handle->shard.is_index = 1;
+  return 1;
+}
+
+/* whether s points into the mapped document, and so must not be freed */
+static int sxupdate_parse_is_view(sxupdate_t handle, const char *s) {
+  const char *doc = handle->parser.document;
+  return doc && s >= doc && s < doc + handle->parser.document_len;
+}
+
+void sxupdate_parse_string_free(sxupdate_t handle, char *s) {
+  if(!sxupdate_parse_is_view(handle, s))
+    sxupdate_mem_free(s);
+}
 
+/**
+ * like json_value_to_string_dup(), but allocates through the sxupdate allocator. If view
+ * is set, a string read as is from the mapped document is not copied: it is terminated in
+ * place, over its closing quote, which the parser has gone past
+ */
+static void sxupdate_json_value_to_string_dup(sxupdate_t handle, struct json_value *value,
+                                              char **target, int view) {
+  struct json_value_string jvs;
+  json_value_to_string(value, &jvs, 1);
+  char *s = (char *)jvs.s, *dupe;
+  if(!jvs.len || !s)
+    dupe = NULL;
+  else if(view && sxupdate_parse_is_view(handle, s)
+          && sxupdate_parse_is_view(handle, s + jvs.len) && s[jvs.len] == '"') {
+    s[jvs.len] = '\0';
+    dupe = s;
+  } else
+    dupe = sxupdate_mem_strndup(s, jvs.len);
+  sxupdate_parse_string_free(handle, *target);
+  *target = dupe;
+}
+
+static int sxupdate_process_value(yajl_helper_t yh, struct json_value *value) {
+  sxupdate_t handle = yajl_helper_ctx(yh);
   char **str_target = NULL;
+  int view = 1; // strings of versions only live as long as the document is mapped
   int *int_target = NULL;
   size_t *sz_target = NULL;
 
-  struct sxupdate_version *v = &handle->latest_version;
+  struct sxupdate_version *v = sxupdate_parse_target(handle);
   const char *prop_name = yajl_helper_get_map_key(yh, 0);
 
-  if(yajl_helper_got_path(yh, 3, "{items[{")) {
+  if(!v) {
+    // already parsed a version, or not one we need
+  } else if(yajl_helper_got_path(yh, 3, "{items[{")) {
     if(prop_name && !strcmp(prop_name, "title"))
       str_target = &v->title;
     else if(prop_name && !strcmp(prop_name, "link"))
@@ -57,27 +164,64 @@ static int sxupdate_process_value(yajl_helper_t yh, struct json_value *value) {
       str_target = &v->enclosure.signature;
     else if(prop_name && !strcmp(prop_name, "filename"))
       str_target = &v->enclosure.filename;
+    else if(prop_name && !strcmp(prop_name, "encoding"))
+      str_target = &v->enclosure.encoding;
+    else if(prop_name && !strcmp(prop_name, "blocks"))
+      str_target = &v->enclosure.blocks;
+  } else if(yajl_helper_got_path(yh, 4, "{items[{manifest{")) {
+    if(prop_name && !strcmp(prop_name, "url"))
+      str_target = &v->manifest.url;
+    else if(prop_name && !strcmp(prop_name, "signature"))
+      str_target = &v->manifest.signature;
+  } else if(yajl_helper_got_path(yh, 4, "{items[{rollout{")) {
+    int err = 0;
+    handle->rollout.item.set = 1;
+    if(prop_name && !strcmp(prop_name, "percentage")) {
+      double pct = json_value_dbl(value, &err);
+      if(err || pct < 0 || pct > 100)
+        sxupdate_log_warning(handle, "parse.invalid", "Warning! invalid rollout percentage ignored");
+      else {
+        handle->rollout.item.percentage = pct;
+        handle->rollout.item.has_percentage = 1;
+      }
+    } else if(prop_name && !strcmp(prop_name, "start"))
+      handle->rollout.item.start = json_value_long(value, &err);
+    else if(prop_name && !strcmp(prop_name, "ramp"))
+      handle->rollout.item.ramp = json_value_long(value, &err);
+    if(err)
+      sxupdate_log_warning(handle, "parse.invalid", "Warning! invalid rollout %s ignored", prop_name ? prop_name : "value");
+  }
+  if(yajl_helper_got_path(yh, 3, "{shards[{") && !handle->shard.match) {
+    if(prop_name && !strcmp(prop_name, "platform"))
+      str_target = &handle->shard.entry.platform;
+    else if(prop_name && !strcmp(prop_name, "arch"))
+      str_target = &handle->shard.entry.arch;
+    else if(prop_name && !strcmp(prop_name, "channel"))
+      str_target = &handle->shard.entry.channel;
+    else if(prop_name && !strcmp(prop_name, "url"))
+      str_target = &handle->shard.entry.url;
+    view = 0; // the shard url is kept for later checks
   }
 
   if(str_target)
-    json_value_to_string_dup(value, str_target, 1);
+    sxupdate_json_value_to_string_dup(handle, value, str_target, view);
   else if(int_target || sz_target) {
-    int err;
+    int err = 0; // only set on error
     long long i = json_value_long(value, &err);
     if(int_target && (i < 0 || i >= INTMAX_MAX))
-      err = sxupdate_printerr("Warning! invalid integer value ignored"); // to do: use custom error handler
+      err = sxupdate_log_warning(handle, "parse.invalid", "Warning! invalid integer value ignored");
     else if(sz_target && i < 0)
-      err = sxupdate_printerr("Warning! invalid integer (size_t) value ignored: %lli", i); // to do: use custom error handler
+      err = sxupdate_log_warning(handle, "parse.invalid", "Warning! invalid integer (size_t) value ignored: %lli", i);
     else if(int_target)
       *int_target = (int)i;
     else if(sz_target)
       *sz_target = (size_t)i;
-    if(err) {
+    if(err && sxupdate_log_wants(handle, SXUPDATE_LOG_LEVEL_WARNING)) {
       char *s = NULL;
-      json_value_to_string_dup(value, &s, 1);
+      sxupdate_json_value_to_string_dup(handle, value, &s, 0);
       if(s)
-        sxupdate_printerr("Value on error: %s", s);
-      free(s);
+        sxupdate_log_warning(handle, "parse.invalid", "Value on error: %s", s);
+      sxupdate_mem_free(s);
     }
   }
   return 1; // 1 = continue; 0 = halt
@@ -139,48 +283,87 @@ int sxupdate_is_relative_filename(const char *s) {
   return 1;
 }
 
+/**
+ * see schema/appcast.schema.json
+ * return 1 if s is a relative filename without slashes, other than . and ..
+ **/
+int sxupdate_is_valid_filename(const char *s) {
+  if(!sxupdate_is_relative_filename(s) || strchr(s, '/'))
+    return 0;
+  return strcmp(s, ".") && strcmp(s, "..");
+}
+
 
-/***
- * sxupdate_parse_ok: return 1 if ok, 0 if NOT OK
- *
- * TO DO: use custom error handler
- */
-static int sxupdate_parse_ok(sxupdate_t handle) {
+int sxupdate_parse_ok(sxupdate_t handle) {
   struct sxupdate_version *v = &handle->latest_version;
   int err = 0;
 
+  if(handle->rollout.held && v->version.major < 0 && !v->enclosure.url && !v->manifest.url) {
+    // every item is still being rolled out to others: nothing to update to yet
+    sxupdate_log_info(handle, "rollout.none", "No version is rolled out to this client yet");
+    v->version.major = v->version.minor = v->version.patch = 0;
+    return 1;
+  }
+
   // check filename
-  if(!v->enclosure.filename || !*v->enclosure.filename)
-    err = sxupdate_printerr("Version enclosure: missing filename");
+  int manifest = sxupdate_manifest_wanted(handle);
+  if(manifest)
+    ; // installed from its manifest: the enclosure is not needed
+  else if(!v->enclosure.filename || !*v->enclosure.filename)
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: missing filename");
+  else if(!sxupdate_is_valid_filename(v->enclosure.filename))
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: bad filename (%s)", v->enclosure.filename);
   else if(str_ends_with(v->enclosure.filename, ".exe"))
     // if filename ends with .exe, remove that suffix
     v->enclosure.filename[strlen(v->enclosure.filename) - 4] = '\0';
 
   // check url
-  if(!v->enclosure.url)
-    err = sxupdate_printerr("Version enclosure: missing url");
+  if(!manifest && !v->enclosure.url)
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: missing url");
 
-  if(v->enclosure.url
+  if(!manifest && v->enclosure.url
      && !sxupdate_url_is_https(v->enclosure.url)
      && !sxupdate_url_is_file(v->enclosure.url)
      && !sxupdate_is_relative_filename(v->enclosure.url))
-    err = sxupdate_printerr("Version enclosure: bad url (%s)", v->enclosure.url);
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: bad url (%s)", v->enclosure.url);
+
+  if(!manifest && v->enclosure.blocks
+     && !sxupdate_url_is_https(v->enclosure.blocks)
+     && !sxupdate_url_is_file(v->enclosure.blocks)
+     && !sxupdate_is_relative_filename(v->enclosure.blocks))
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: bad blocks url (%s)", v->enclosure.blocks);
+
+  if(manifest
+     && !sxupdate_url_is_https(v->manifest.url)
+     && !sxupdate_url_is_file(v->manifest.url)
+     && !sxupdate_is_relative_filename(v->manifest.url))
+    err = sxupdate_log_error(handle, "parse.invalid", "Version manifest: bad url (%s)", v->manifest.url);
+
+  // check encoding
+  enum sxupdate_encoding encoding;
+  int encoding_err = manifest ? 0 : sxupdate_encoding_from_name(v->enclosure.encoding, &encoding);
+  if(encoding_err == ENOTSUP)
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: encoding not supported by this build (%s)", v->enclosure.encoding);
+  else if(encoding_err)
+    err = sxupdate_log_error(handle, "parse.invalid", "Version enclosure: unknown encoding (%s)", v->enclosure.encoding);
 
   // check major / minor / patch
   if(v->version.major < 0 || v->version.minor < 0 || v->version.patch < 0)
-    err = sxupdate_printerr("Invalid or unspecified version major, minor and/or patch");
+    err = sxupdate_log_error(handle, "parse.invalid", "Invalid or unspecified version major, minor and/or patch");
 
   if(!err) {
+    const char *what = manifest ? "manifest" : "enclosure";
+    const char *signature = manifest ? v->manifest.signature : v->enclosure.signature;
     if(!handle->no_public_key) {
-      if(!v->enclosure.signature)
-        err = sxupdate_printerr("Version enclosure: missing signature");
+      if(!signature)
+        err = sxupdate_log_error(handle, "parse.invalid", "Version %s: missing signature", what);
       else {
-        if(sxupdate_set_signature_from_b64(handle, v->enclosure.signature)
+        if(sxupdate_set_signature_from_b64(handle, signature)
            != sxupdate_status_ok)
-          err = sxupdate_printerr("Version enclosure: unable to convert signature from base64");
+          err = sxupdate_log_error(handle, "parse.invalid", "Version %s: unable to convert signature from base64", what);
       }
-    } else if(v->enclosure.signature)
-      err = sxupdate_printerr("Version is signed, but no public key provided to verify");
+    } else if(signature)
+      err = sxupdate_log_error(handle, "parse.invalid", "Version is signed, but no public key provided to verify");
   }
   if(err)
     return 0; // not ok
@@ -208,18 +391,63 @@ enum sxupdate_status sxupdate_parse(sxupdate_t handle, const char *data, size_t
 enum sxupdate_status sxupdate_parse_finish(sxupdate_t handle) {
   if(handle->parser.stat == yajl_status_ok
      && (handle->parser.stat = yajl_complete_parse(handle->parser.st.yajl)) == yajl_status_ok
-     && sxupdate_parse_ok(handle))
+     && (handle->shard.is_index || handle->batch.products || sxupdate_parse_ok(handle)))
     return sxupdate_status_ok;
   return sxupdate_status_error;
 }
 
+/* copy the strings of v that point into the document, before it is unmapped */
+static int sxupdate_version_own(sxupdate_t handle, struct sxupdate_version *v) {
+  char **strings[SXUPDATE_VERSION_STRINGS];
+  int err = 0;
+  sxupdate_version_strings(v, strings);
+  for(size_t i = 0; i < SXUPDATE_VERSION_STRINGS; i++)
+    if(sxupdate_parse_is_view(handle, *strings[i])
+       && !(*strings[i] = sxupdate_mem_strdup(*strings[i])))
+      err = ENOMEM;
+  return err;
+}
+
+int sxupdate_parse_map(sxupdate_t handle, const char *path) {
+  if(handle->parser.document)
+    return EBUSY;
+  return sxupdate_map_file(path, &handle->parser.document, &handle->parser.document_len);
+}
+
+void sxupdate_parse_reset(sxupdate_t handle) {
+  if(handle->parser.document) {
+    // usually released first, but versions parsed may outlive the document
+    int err = sxupdate_version_own(handle, &handle->latest_version);
+    for(size_t i = 0; i < handle->batch.count; i++)
+      err |= sxupdate_version_own(handle, &handle->batch.products[i].version);
+    if(err)
+      sxupdate_log_error(handle, "memory", "Out of memory!");
+    sxupdate_unmap_file(handle->parser.document, handle->parser.document_len);
+    handle->parser.document = NULL;
+    handle->parser.document_len = 0;
+  }
+  yajl_helper_delete(handle->parser.yh);
+  handle->parser.yh = NULL;
+  handle->parser.stat = yajl_status_ok;
+  handle->parser.scanned_bytes = 0;
+  handle->got_version = 0;
+  handle->batch.parsing = NULL;
+  sxupdate_rollout_item_reset(handle);
+  handle->rollout.held = 0;
+  sxupdate_shard_entry_reset(handle);
+  sxupdate_mem_free(handle->shard.match);
+  handle->shard.match = NULL;
+  handle->shard.is_index = 0;
+}
+
 enum sxupdate_status sxupdate_parse_init(sxupdate_t handle) {
-  handle->parser.yh
+  sxupdate_parse_reset(handle);
+  handle->parser.yh =
     yajl_helper_new(32,
-                    NULL, // start_map,
+                    sxupdate_start_map,
                     sxupdate_end_map,
                     NULL, // map_key,
-                    NULL, // start_array,
+                    sxupdate_start_array,
                     NULL, // end_array,
                     sxupdate_process_value,
                     handle);
@@ -9,6 +9,11 @@
 
 enum sxupdate_status sxupdate_parse_init(sxupdate_t handle);
 
+/***
+ * Release the parser state left over from a previous fetch
+ */
+void sxupdate_parse_reset(sxupdate_t handle);
+
 /***
  * Parse a chunk of metadata (JSON)
  * @param sxu : sxupdate handle
@@ -21,6 +26,29 @@ enum sxupdate_status sxupdate_parse(sxupdate_t handle, const char *data, size_t
 
 enum sxupdate_status sxupdate_parse_finish(sxupdate_t handle);
 
+/**
+ * Map the local file at path, for the document to be parsed from it with a single call to
+ * sxupdate_parse(). Strings of the version parsed then point into the mapping, instead of
+ * being copied, until sxupdate_parse_reset() unmaps it
+ *
+ * @return 0 on success, else errno
+ */
+int sxupdate_parse_map(sxupdate_t handle, const char *path);
+
+/**
+ * Free a string parsed into a version, unless it points into the mapped document
+ */
+void sxupdate_parse_string_free(sxupdate_t handle, char *s);
+
+/***
+ * sxupdate_parse_ok: check the latest version parsed, and decode its signature. Called by
+ * sxupdate_parse_finish(), or for each product of a batch check once its turn comes
+ * return 1 if ok, 0 if NOT OK
+ *
+ * TO DO: use custom error handler
+ */
+int sxupdate_parse_ok(sxupdate_t handle);
+
 int sxupdate_url_is_file(const char *s);
 int sxupdate_url_is_https(const char *s);
 
@@ -30,4 +58,10 @@ int sxupdate_url_is_https(const char *s);
  **/
 int sxupdate_is_relative_filename(const char *s);
 
+/**
+ * see schema/appcast.schema.json
+ * return 1 if s is a relative filename without slashes, other than . and ..
+ **/
+int sxupdate_is_valid_filename(const char *s);
+
 #endif
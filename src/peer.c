@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/sha.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include "internal.h"
+#include "peer.h"
+#include "stats.h"
+#include "file.h"
+#include "alloc.h"
+#include "log.h"
+
+
+void sxupdate_peer_key(const unsigned char *signature, size_t signature_length,
+                       char key[SXUPDATE_PEER_KEY_LENGTH + 1]) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(signature, signature_length, hash);
+  for(size_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    key[i * 2] = hex[hash[i] >> 4];
+    key[i * 2 + 1] = hex[hash[i] & 15];
+  }
+  key[SXUPDATE_PEER_KEY_LENGTH] = '\0';
+}
+
+int sxupdate_peer_key_valid(const char *s) {
+  size_t i = 0;
+  for(; s[i] && i < SXUPDATE_PEER_KEY_LENGTH; i++)
+    if(!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+      return 0;
+  return i == SXUPDATE_PEER_KEY_LENGTH && !s[i];
+}
+
+enum sxupdate_peer_verb sxupdate_peer_parse(const char *msg, size_t len,
+                                            char key[SXUPDATE_PEER_KEY_LENGTH + 1],
+                                            unsigned short *http_port) {
+  char buff[SXUPDATE_PEER_MESSAGE_MAX];
+  if(len >= sizeof(buff))
+    return sxupdate_peer_verb_invalid;
+  memcpy(buff, msg, len);
+  buff[len] = '\0';
+
+  size_t magic_len = strlen(SXUPDATE_PEER_MAGIC);
+  if(strncmp(buff, SXUPDATE_PEER_MAGIC " ", magic_len + 1))
+    return sxupdate_peer_verb_invalid;
+  const char *s = buff + magic_len + 1;
+
+  enum sxupdate_peer_verb verb;
+  if(!strncmp(s, "WANT ", 5))
+    verb = sxupdate_peer_verb_want;
+  else if(!strncmp(s, "HAVE ", 5))
+    verb = sxupdate_peer_verb_have;
+  else
+    return sxupdate_peer_verb_invalid;
+  s += 5;
+
+  memcpy(key, s, strnlen(s, SXUPDATE_PEER_KEY_LENGTH));
+  key[strnlen(s, SXUPDATE_PEER_KEY_LENGTH)] = '\0';
+  if(!sxupdate_peer_key_valid(key))
+    return sxupdate_peer_verb_invalid;
+  s += SXUPDATE_PEER_KEY_LENGTH;
+
+  if(verb == sxupdate_peer_verb_want)
+    return *s ? sxupdate_peer_verb_invalid : verb;
+
+  char *end;
+  long port = *s == ' ' ? strtol(s + 1, &end, 10) : 0;
+  if(port <= 0 || port > 65535 || *end)
+    return sxupdate_peer_verb_invalid;
+  if(http_port)
+    *http_port = (unsigned short)port;
+  return verb;
+}
+
+#ifndef _WIN32
+
+static int sxupdate_peer_addr(sxupdate_t handle, const char *s, struct in_addr *addr) {
+  if(inet_pton(AF_INET, s, addr) != 1) {
+    sxupdate_log_error(handle, "peer.config", "Invalid IPv4 address: %s", s);
+    return -1;
+  }
+  return 0;
+}
+
+int sxupdate_peer_listen(sxupdate_t handle, const char *group, unsigned short port, const char *iface) {
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if(sxupdate_peer_addr(handle, group ? group : SXUPDATE_PEER_DEFAULT_GROUP, &mreq.imr_multiaddr)
+     || (iface && sxupdate_peer_addr(handle, iface, &mreq.imr_interface)))
+    return -1;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0) {
+    sxupdate_log_error(handle, "peer.socket", "socket: %s", strerror(errno));
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port ? port : SXUPDATE_PEER_DEFAULT_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+     || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+    sxupdate_log_error(handle, "peer.socket", "Unable to join %s on port %u: %s",
+                       group ? group : SXUPDATE_PEER_DEFAULT_GROUP,
+                       (unsigned)ntohs(addr.sin_port), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+char *sxupdate_peer_discover(sxupdate_t handle, const char *group, unsigned short port,
+                             const char *iface, long timeout_ms, const char *key) {
+  struct sockaddr_in dest;
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port ? port : SXUPDATE_PEER_DEFAULT_PORT);
+  if(sxupdate_peer_addr(handle, group ? group : SXUPDATE_PEER_DEFAULT_GROUP, &dest.sin_addr))
+    return NULL;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0) {
+    sxupdate_log_warning(handle, "peer.socket", "socket: %s", strerror(errno));
+    return NULL;
+  }
+
+  unsigned char ttl = 1, loop = 1; // stay on the local network, but include peers on this host
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+  if(iface) {
+    struct in_addr if_addr;
+    if(sxupdate_peer_addr(handle, iface, &if_addr)
+       || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr))) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  char query[SXUPDATE_PEER_MESSAGE_MAX];
+  int query_len = snprintf(query, sizeof(query), "%s WANT %s", SXUPDATE_PEER_MAGIC, key);
+
+  if(timeout_ms <= 0)
+    timeout_ms = SXUPDATE_PEER_DEFAULT_TIMEOUT_MS;
+  double deadline = sxupdate_clock_now() + timeout_ms / 1000.0;
+  double resend_at = sxupdate_clock_now() + timeout_ms / 2000.0;
+  int sends = 0;
+  char *url = NULL;
+
+  sxupdate_log_debug(handle, "peer.query", "Asking peers for %s", key);
+  while(!url) {
+    double now = sxupdate_clock_now();
+    if(now >= deadline)
+      break;
+
+    // datagrams can be lost, so ask twice
+    if(sends == 0 || (sends == 1 && now >= resend_at)) {
+      if(sendto(fd, query, query_len, 0, (struct sockaddr *)&dest, sizeof(dest)) != query_len) {
+        sxupdate_log_warning(handle, "peer.query", "sendto: %s", strerror(errno));
+        break;
+      }
+      sends++;
+    }
+
+    double wait_until = sends == 1 && resend_at < deadline ? resend_at : deadline;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, (int)((wait_until - now) * 1000) + 1);
+    if(n < 0 && errno != EINTR)
+      break;
+    if(n <= 0)
+      continue;
+
+    char msg[SXUPDATE_PEER_MESSAGE_MAX];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+    char have_key[SXUPDATE_PEER_KEY_LENGTH + 1];
+    unsigned short http_port = 0;
+    if(len <= 0
+       || sxupdate_peer_parse(msg, (size_t)len, have_key, &http_port) != sxupdate_peer_verb_have
+       || strcmp(have_key, key))
+      continue;
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host));
+    size_t url_len = strlen(host) + SXUPDATE_PEER_KEY_LENGTH + 20;
+    if((url = sxupdate_mem_alloc(url_len)))
+      snprintf(url, url_len, "http://%s:%u/%s", host, (unsigned)http_port, key);
+  }
+  close(fd);
+
+  if(url)
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "peer.found",
+                    ((const struct sxupdate_log_field[]){ { "key", key }, { "url", url }, { NULL, NULL } }),
+                    "Found peer copy at %s", url);
+  else
+    sxupdate_log_info(handle, "peer.none", "No peer has %s", key);
+  return url;
+}
+
+#else // _WIN32
+
+int sxupdate_peer_listen(sxupdate_t handle, const char *group, unsigned short port, const char *iface) {
+  (void)(group);
+  (void)(port);
+  (void)(iface);
+  sxupdate_log_error(handle, "peer.unsupported", "Peer cache is not supported on this platform");
+  return -1;
+}
+
+char *sxupdate_peer_discover(sxupdate_t handle, const char *group, unsigned short port,
+                             const char *iface, long timeout_ms, const char *key) {
+  (void)(group);
+  (void)(port);
+  (void)(iface);
+  (void)(timeout_ms);
+  (void)(key);
+  sxupdate_log_debug(handle, "peer.unsupported", "Peer discovery is not supported on this platform");
+  return NULL;
+}
+
+#endif
+
+int sxupdate_peer_share(sxupdate_t handle, const char *dir, const char *key, const char *filepath) {
+  size_t len = strlen(dir) + SXUPDATE_PEER_KEY_LENGTH + 32;
+  char *dest = sxupdate_mem_alloc(len);
+  char *tmp = sxupdate_mem_alloc(len);
+  int err = 0;
+  if(!(dest && tmp))
+    err = ENOMEM;
+  else {
+    snprintf(dest, len, "%s/%s", dir, key);
+    snprintf(tmp, len, "%s/.%s.%lu.tmp", dir, key, (unsigned long)getpid());
+    err = sxupdate_copy_file(filepath, tmp, 0);
+  }
+
+  if(!err) {
+#ifdef _WIN32
+    remove(dest); // rename() does not replace an existing file
+#endif
+    if(rename(tmp, dest))
+      err = errno ? errno : EIO;
+  }
+  if(dest && tmp && err)
+    remove(tmp);
+
+  if(err)
+    sxupdate_log_warning(handle, "peer.share", "Unable to share %s in %s: %s", filepath, dir, strerror(err));
+  else
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "peer.share",
+                    ((const struct sxupdate_log_field[]){ { "key", key }, { "path", dest }, { NULL, NULL } }),
+                    "Sharing verified installer as %s", dest);
+  sxupdate_mem_free(dest);
+  sxupdate_mem_free(tmp);
+  return err;
+}
@@ -0,0 +1,78 @@
+#ifndef SXUPDATE_PEER_H
+#define SXUPDATE_PEER_H
+
+#include <stddef.h>
+#include "../include/api.h"
+
+/**
+ * LAN peer cache discovery protocol. Each message is a single UDP datagram of text:
+ *
+ *   query (multicast)     : "SXUPDATE-PEER 1 WANT <key>"
+ *   response (unicast)   : "SXUPDATE-PEER 1 HAVE <key> <http port>"
+ *
+ * where <key> identifies an installer by the hex SHA-256 of its binary signature. A peer
+ * that responds serves the installer at http://<peer address>:<http port>/<key>
+ */
+#define SXUPDATE_PEER_MAGIC "SXUPDATE-PEER 1"
+#define SXUPDATE_PEER_DEFAULT_GROUP "239.255.77.77"
+#define SXUPDATE_PEER_DEFAULT_PORT 7645
+#define SXUPDATE_PEER_DEFAULT_TIMEOUT_MS 250
+#define SXUPDATE_PEER_KEY_LENGTH 64
+#define SXUPDATE_PEER_MESSAGE_MAX 256
+#define SXUPDATE_PEER_MAX_BYTES (4LL << 30) // fetched from a peer if the appcast does not give the size
+
+enum sxupdate_peer_verb {
+  sxupdate_peer_verb_invalid = 0,
+  sxupdate_peer_verb_want,
+  sxupdate_peer_verb_have
+};
+
+/**
+ * Compute the key that identifies an installer from its binary signature
+ */
+void sxupdate_peer_key(const unsigned char *signature, size_t signature_length,
+                       char key[SXUPDATE_PEER_KEY_LENGTH + 1]);
+
+/**
+ * Return non-zero if s is a well-formed key, which also makes it safe to use as a file name
+ */
+int sxupdate_peer_key_valid(const char *s);
+
+/**
+ * Parse a discovery message
+ * @param http_port: set for sxupdate_peer_verb_have messages
+ */
+enum sxupdate_peer_verb sxupdate_peer_parse(const char *msg, size_t len,
+                                            char key[SXUPDATE_PEER_KEY_LENGTH + 1],
+                                            unsigned short *http_port);
+
+/**
+ * Open a UDP socket bound to the discovery port and joined to the multicast group, for
+ * use by a peer that answers queries. Several sockets, in the same or different processes,
+ * can be bound to the same port at once
+ *
+ * @param group    : multicast group, or NULL for the default
+ * @param iface    : IPv4 address of the interface to join on, or NULL for any
+ * @return socket, or -1 on error
+ */
+int sxupdate_peer_listen(sxupdate_t handle, const char *group, unsigned short port, const char *iface);
+
+/**
+ * Ask peers for the installer identified by key, waiting up to timeout_ms for the first
+ * answer
+ *
+ * @return url of the installer on the first peer to answer, or NULL if none did. Caller must free
+ */
+char *sxupdate_peer_discover(sxupdate_t handle, const char *group, unsigned short port,
+                             const char *iface, long timeout_ms, const char *key);
+
+/**
+ * Copy a verified installer into dir, as <dir>/<key>, so that it can be served to other
+ * peers. The copy is written to a temporary file and renamed into place, so that peers
+ * never serve a partial file
+ *
+ * @return 0 on success, else errno
+ */
+int sxupdate_peer_share(sxupdate_t handle, const char *dir, const char *key, const char *filepath);
+
+#endif
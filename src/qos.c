@@ -0,0 +1,129 @@
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <sys/qos.h>
+#endif
+
+#include "internal.h"
+#include "qos.h"
+#include "alloc.h"
+#include "log.h"
+
+#if defined(__linux__)
+// from linux/ioprio.h, which older kernel headers lack
+#define SXUPDATE_IOPRIO_WHO_PROCESS 1
+#define SXUPDATE_IOPRIO_CLASS_IDLE 3
+#define SXUPDATE_IOPRIO_CLASS_SHIFT 13
+#endif
+
+int sxupdate_qos_lower_thread(int nice, int idle_io) {
+  int err = 0;
+#if defined(__linux__)
+  // with the thread id, these apply to the calling thread only
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  if(nice > 0) {
+    errno = 0;
+    int current = getpriority(PRIO_PROCESS, tid);
+    int lowered = current + nice > SXUPDATE_QOS_MAX_NICE ? SXUPDATE_QOS_MAX_NICE : current + nice;
+    if((current == -1 && errno) || setpriority(PRIO_PROCESS, tid, lowered))
+      err = errno;
+  }
+  if(idle_io && syscall(SYS_ioprio_set, SXUPDATE_IOPRIO_WHO_PROCESS, tid,
+                        SXUPDATE_IOPRIO_CLASS_IDLE << SXUPDATE_IOPRIO_CLASS_SHIFT))
+    err = errno;
+#elif defined(__APPLE__)
+  if(nice > 0 && (err = pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0)))
+    ;
+  else if(idle_io && setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE))
+    err = errno;
+#elif defined(_WIN32)
+  // lowers both CPU and I/O priority
+  if((nice > 0 || idle_io) && !SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN))
+    err = EPERM;
+#else
+  if(nice > 0 || idle_io)
+    err = ENOTSUP; // setpriority() would lower the whole process
+#endif
+  return err;
+}
+
+void sxupdate_qos_lower(sxupdate_t handle) {
+  if(!handle->qos.nice && !handle->qos.idle_io)
+    return;
+  int err = sxupdate_qos_lower_thread(handle->qos.nice, handle->qos.idle_io);
+  if(err)
+    sxupdate_log_warning(handle, "qos.priority", "Unable to lower priority: %s", strerror(err));
+}
+
+struct sxupdate_qos_job {
+  sxupdate_t handle;
+  int (*fn)(void *);
+  void *arg;
+  int result;
+};
+
+#if defined(_WIN32)
+int sxupdate_qos_run(sxupdate_t handle, int (*fn)(void *), void *arg) {
+  // background mode can be left again, so the calling thread is used
+  int lowered = (handle->qos.nice || handle->qos.idle_io)
+    && SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+  int result = fn(arg);
+  if(lowered)
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+  return result;
+}
+#else
+static void *sxupdate_qos_thread(void *j) {
+  struct sxupdate_qos_job *job = j;
+  struct sxupdate_mem_account *previous = sxupdate_mem_enter(job->handle->mem);
+  sxupdate_qos_lower(job->handle);
+  job->result = job->fn(job->arg);
+  sxupdate_mem_leave(previous);
+  return NULL;
+}
+
+int sxupdate_qos_run(sxupdate_t handle, int (*fn)(void *), void *arg) {
+  struct sxupdate_qos_job job = { handle, fn, arg, 0 };
+  pthread_t thread;
+  if(!(handle->qos.nice || handle->qos.idle_io) || pthread_create(&thread, NULL, sxupdate_qos_thread, &job))
+    return fn(arg);
+  pthread_join(thread, NULL);
+  return job.result;
+}
+#endif
+
+void sxupdate_qos_hashed(sxupdate_t handle, size_t len, size_t *since_yield) {
+  if(!handle || !handle->qos.hash_chunk || (*since_yield += len) < handle->qos.hash_chunk)
+    return;
+  *since_yield = 0;
+#ifdef _WIN32
+  if(handle->qos.hash_pause_us)
+    Sleep((DWORD)((handle->qos.hash_pause_us + 999) / 1000));
+  else
+    SwitchToThread();
+#else
+  if(handle->qos.hash_pause_us) {
+    struct timespec ts = { handle->qos.hash_pause_us / 1000000, (handle->qos.hash_pause_us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  } else
+    sched_yield();
+#endif
+}
+
+void sxupdate_qos_curl(sxupdate_t handle, CURL *curl, int parallel) {
+  if(handle->qos.max_recv_speed > 0)
+    curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+                     (curl_off_t)(handle->qos.max_recv_speed / (parallel > 1 ? parallel : 1)));
+}
@@ -0,0 +1,52 @@
+#ifndef SXUPDATE_QOS_H
+#define SXUPDATE_QOS_H
+
+#include <curl/curl.h>
+#include "../include/api.h"
+
+/**
+ * Background QoS (see sxupdate_set_qos()): transfers are capped to a rate, and hashing and
+ * writing run at a lower CPU and I/O priority than the application, hashing a chunk at a
+ * time and yielding the CPU in between.
+ *
+ * A thread cannot always raise its priority back once lowered (on Linux, not without
+ * CAP_SYS_NICE), so the application's threads are never lowered: the work runs on threads
+ * that sxupdate starts and lowers for good, or in the background helper process
+ */
+#define SXUPDATE_QOS_HASH_CHUNK (256 * 1024) // default bytes hashed between yields
+#define SXUPDATE_QOS_MAX_NICE 19
+
+/**
+ * Lower the CPU priority of the calling thread by nice (if > 0), and give its disk I/O the
+ * idle class (if idle_io is set). Linux; the nearest equivalents on macOS (background QoS
+ * class, throttled I/O) and Windows (background mode)
+ * @return 0 on success, else errno (ENOTSUP where neither is available)
+ */
+int sxupdate_qos_lower_thread(int nice, int idle_io);
+
+/**
+ * Lower the calling thread as set by sxupdate_set_qos(), if at all. Only for threads and
+ * processes that sxupdate has started
+ */
+void sxupdate_qos_lower(sxupdate_t handle);
+
+/**
+ * Run fn(arg) at the priority set by sxupdate_set_qos(): on a thread of its own, lowered,
+ * which the caller waits for. Without lowered priorities, or if no thread can be started,
+ * on the calling thread
+ * @return what fn returned
+ */
+int sxupdate_qos_run(sxupdate_t handle, int (*fn)(void *), void *arg);
+
+/**
+ * Call after hashing len bytes: once a chunk has been hashed, yield the CPU, and pause if
+ * asked to
+ */
+void sxupdate_qos_hashed(sxupdate_t handle, size_t len, size_t *since_yield);
+
+/**
+ * Cap the receive rate of a transfer, which shares the cap with parallel - 1 others
+ */
+void sxupdate_qos_curl(sxupdate_t handle, CURL *curl, int parallel);
+
+#endif
@@ -0,0 +1,154 @@
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+#include "ring.h"
+#include "stats.h"
+#include "alloc.h"
+
+struct sxupdate_ring {
+  size_t mask; // capacity - 1; not written after creation
+
+  // written by the consumer only
+  char pad_head[SXUPDATE_RING_CACHE_LINE];
+  size_t head; // next slot to read
+
+  // written by the producer only
+  char pad_tail[SXUPDATE_RING_CACHE_LINE];
+  size_t tail;        // next slot to write
+  size_t cached_head; // head, as last read: reread only once the ring looks full
+  unsigned long long coalesced;
+  unsigned long long dropped;
+  struct sxupdate_event pending; // progress held back while the ring was full
+  unsigned char has_pending:1;
+  unsigned char _:7;
+
+  char pad_slots[SXUPDATE_RING_CACHE_LINE];
+  struct sxupdate_event slots[];
+};
+
+struct sxupdate_ring *sxupdate_ring_new(size_t capacity) {
+  size_t n = SXUPDATE_RING_MIN_CAPACITY;
+  while(n < capacity)
+    n *= 2;
+  struct sxupdate_ring *ring = sxupdate_mem_alloc(sizeof(*ring) + n * sizeof(struct sxupdate_event));
+  if(ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = n - 1;
+  }
+  return ring;
+}
+
+void sxupdate_ring_free(struct sxupdate_ring *ring) {
+  sxupdate_mem_free(ring);
+}
+
+/* non-zero if fewer than limit slots are in use from tail */
+static int sxupdate_ring_room(struct sxupdate_ring *ring, size_t tail, size_t limit) {
+  if(tail - ring->cached_head < limit)
+    return 1;
+  ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  return tail - ring->cached_head < limit;
+}
+
+/* write e at tail, and hand it over */
+static void sxupdate_ring_put(struct sxupdate_ring *ring, size_t tail, const struct sxupdate_event *e) {
+  ring->slots[tail & ring->mask] = *e;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int sxupdate_ring_push(struct sxupdate_ring *ring, const struct sxupdate_event *e) {
+  const size_t capacity = ring->mask + 1;
+  size_t tail = ring->tail;
+  if(e->type == sxupdate_event_progress) {
+    if(ring->has_pending) // superseded by e, whether e is written or held back in turn
+      __atomic_store_n(&ring->coalesced, ring->coalesced + 1, __ATOMIC_RELAXED);
+    if(!sxupdate_ring_room(ring, tail, capacity - SXUPDATE_RING_RESERVED)) {
+      ring->pending = *e;
+      ring->has_pending = 1;
+      return EAGAIN;
+    }
+    ring->has_pending = 0;
+    sxupdate_ring_put(ring, tail, e);
+    return 0;
+  }
+
+  // the progress held back comes first, if there is room for both
+  if(ring->has_pending && sxupdate_ring_room(ring, tail, capacity - 1)) {
+    sxupdate_ring_put(ring, tail++, &ring->pending);
+    ring->has_pending = 0;
+  }
+  if(!sxupdate_ring_room(ring, tail, capacity)) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return EAGAIN;
+  }
+  sxupdate_ring_put(ring, tail, e);
+  return 0;
+}
+
+size_t sxupdate_ring_pop(struct sxupdate_ring *ring, struct sxupdate_event *events, size_t max) {
+  size_t head = ring->head;
+  size_t available = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+  size_t n = available < max ? available : max;
+  for(size_t i = 0; i < n; i++)
+    events[i] = ring->slots[(head + i) & ring->mask];
+  __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+void sxupdate_ring_stats(const struct sxupdate_ring *ring, struct sxupdate_event_ring_stats *stats) {
+  stats->published = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  stats->coalesced = __atomic_load_n(&ring->coalesced, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+void sxupdate_ring_phase(sxupdate_t handle, enum sxupdate_phase phase, enum sxupdate_status stat) {
+  if(!handle->events.ring)
+    return;
+  double now = sxupdate_clock_now();
+  if(phase == sxupdate_phase_checking)
+    handle->events.started = now;
+  else if(phase == sxupdate_phase_downloading) {
+    handle->events.download_started = now;
+    handle->events.bytes = 0;
+  }
+  handle->events.phase = phase;
+
+  struct sxupdate_event e;
+  memset(&e, 0, sizeof(e));
+  e.type = sxupdate_event_phase;
+  e.phase = phase;
+  e.status = stat;
+  e.time = now - handle->events.started;
+  sxupdate_ring_push(handle->events.ring, &e);
+}
+
+void sxupdate_ring_progress(sxupdate_t handle, long long bytes, long long total) {
+  if(!handle->events.ring || bytes == handle->events.bytes) // curl also calls back when idle, or before any data
+    return;
+  handle->events.bytes = bytes;
+  double now = sxupdate_clock_now(), elapsed = now - handle->events.download_started;
+
+  struct sxupdate_event e;
+  memset(&e, 0, sizeof(e));
+  e.type = sxupdate_event_progress;
+  e.phase = handle->events.phase;
+  e.time = now - handle->events.started;
+  e.bytes = bytes;
+  e.total = total;
+  e.bytes_per_second = elapsed > 0 ? bytes / elapsed : 0;
+  sxupdate_ring_push(handle->events.ring, &e);
+}
+
+void sxupdate_ring_error(sxupdate_t handle, const char *event) {
+  if(!handle->events.ring)
+    return;
+  struct sxupdate_event e;
+  memset(&e, 0, sizeof(e));
+  e.type = sxupdate_event_error;
+  e.phase = handle->events.phase;
+  e.status = sxupdate_status_error;
+  e.time = sxupdate_clock_now() - handle->events.started;
+  e.error = event;
+  sxupdate_ring_push(handle->events.ring, &e);
+}
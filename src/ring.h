@@ -0,0 +1,67 @@
+#ifndef SXUPDATE_RING_H
+#define SXUPDATE_RING_H
+
+#include <stddef.h>
+#include "../include/api.h"
+
+/**
+ * Lock-free ring of events (see sxupdate_set_event_ring()), with a single producer, the
+ * thread running the update, and a single consumer, e.g. a UI thread. Each side owns its
+ * index, on a cache line of its own, and only reads the other's, so neither ever waits for
+ * the other, and they share a cache line only to hand events over.
+ *
+ * The producer never blocks: when the ring is full, a progress event is held back, to be
+ * written, or replaced by a later one, once there is room again (so only the latest
+ * progress is ever reported late, never lost). Progress events leave the last
+ * SXUPDATE_RING_RESERVED slots to phase and error events, which are only dropped if the
+ * consumer has not read any of those either
+ */
+#define SXUPDATE_RING_DEFAULT_CAPACITY 256
+#define SXUPDATE_RING_RESERVED 16 // slots that progress events leave free for the others
+#define SXUPDATE_RING_MIN_CAPACITY (SXUPDATE_RING_RESERVED * 2)
+#define SXUPDATE_RING_CACHE_LINE 64
+
+struct sxupdate_ring;
+
+/**
+ * @param capacity: rounded up to a power of two, of at least SXUPDATE_RING_MIN_CAPACITY
+ * @return a new ring, or NULL if out of memory
+ */
+struct sxupdate_ring *sxupdate_ring_new(size_t capacity);
+
+void sxupdate_ring_free(struct sxupdate_ring *ring);
+
+/**
+ * Producer: write an event, without blocking
+ * @return 0 if written, else EAGAIN (held back if progress, else dropped)
+ */
+int sxupdate_ring_push(struct sxupdate_ring *ring, const struct sxupdate_event *e);
+
+/**
+ * Consumer: read up to max events, without blocking
+ * @return the number read
+ */
+size_t sxupdate_ring_pop(struct sxupdate_ring *ring, struct sxupdate_event *events, size_t max);
+
+/**
+ * Counters, as of now. Safe to call from the consumer
+ */
+void sxupdate_ring_stats(const struct sxupdate_ring *ring, struct sxupdate_event_ring_stats *stats);
+
+/**
+ * Report to the handle's ring, if it has one: the update has moved on to phase
+ */
+void sxupdate_ring_phase(sxupdate_t handle, enum sxupdate_phase phase, enum sxupdate_status stat);
+
+/**
+ * Report to the handle's ring, if it has one: bytes of total have been received
+ */
+void sxupdate_ring_progress(sxupdate_t handle, long long bytes, long long total);
+
+/**
+ * Report to the handle's ring, if it has one: an error was logged with this event id,
+ * which must be a string literal
+ */
+void sxupdate_ring_error(sxupdate_t handle, const char *event);
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <uuid/uuid.h>
+#endif
+
+#include "internal.h"
+#include "rollout.h"
+#include "state.h"
+#include "alloc.h"
+#include "log.h"
+
+/* spread the bits of an FNV-1a hash, whose low bits alone are poorly mixed (MurmurHash3's finalizer) */
+static uint64_t sxupdate_rollout_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* the bucket of machine_id for version v */
+static unsigned sxupdate_rollout_bucket(const char *machine_id, const struct sxupdate_semantic_version *v) {
+  char version[96]; // a longer prerelease is cut short, which only makes its buckets less distinct
+  snprintf(version, sizeof(version), "%i.%i.%i%s%s", v->major, v->minor, v->patch,
+           v->prerelease ? "-" : "", v->prerelease ? v->prerelease : "");
+  uint64_t h = sxupdate_rollout_mix(sxupdate_state_hash(machine_id, strlen(machine_id)));
+  h = sxupdate_rollout_mix(h ^ sxupdate_state_hash(version, strlen(version)));
+  return (unsigned)(h % SXUPDATE_ROLLOUT_BUCKETS);
+}
+
+/* read the first line of path, which must not be empty, into a string that the caller must free */
+static char *sxupdate_rollout_read_id(const char *path) {
+  char line[SXUPDATE_ROLLOUT_ID_MAX + 2];
+  FILE *f = fopen(path, "rb");
+  if(!f)
+    return NULL;
+  size_t n = fread(line, 1, sizeof(line) - 1, f);
+  fclose(f);
+  line[n] = '\0';
+  line[strcspn(line, "\r\n")] = '\0';
+  return *line && strlen(line) <= SXUPDATE_ROLLOUT_ID_MAX ? sxupdate_mem_strdup(line) : NULL;
+}
+
+/* the id of the operating system installation, if there is one */
+static char *sxupdate_rollout_system_id(void) {
+#if defined(_WIN32)
+  char guid[64];
+  DWORD len = sizeof(guid);
+  if(RegGetValueA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Microsoft\\Cryptography", "MachineGuid",
+                  RRF_RT_REG_SZ | RRF_SUBKEY_WOW6464KEY, NULL, guid, &len) == ERROR_SUCCESS)
+    return sxupdate_mem_strdup(guid);
+  return NULL;
+#elif defined(__APPLE__)
+  uuid_t uuid;
+  struct timespec wait = { 1, 0 };
+  uuid_string_t s;
+  if(gethostuuid(uuid, &wait))
+    return NULL;
+  uuid_unparse(uuid, s);
+  return sxupdate_mem_strdup(s);
+#else
+  char *id = sxupdate_rollout_read_id("/etc/machine-id");
+  return id ? id : sxupdate_rollout_read_id("/var/lib/dbus/machine-id");
+#endif
+}
+
+/* a new random id */
+static char *sxupdate_rollout_new_id(void) {
+  unsigned char bytes[16];
+  size_t n = 0;
+#ifndef _WIN32
+  FILE *f = fopen("/dev/urandom", "rb");
+  if(f) {
+    n = fread(bytes, 1, sizeof(bytes), f);
+    fclose(f);
+  }
+#endif
+  if(n < sizeof(bytes)) { // not random, but unlikely to be repeated
+    uint64_t seed[4] = { (uint64_t)time(NULL), (uint64_t)clock(), (uint64_t)getpid(), (uint64_t)(uintptr_t)&n };
+    uint64_t h = sxupdate_rollout_mix(sxupdate_state_hash(seed, sizeof(seed)));
+    uint64_t h2 = sxupdate_rollout_mix(h ^ sxupdate_state_hash(&h, sizeof(h)));
+    memcpy(bytes, &h, 8);
+    memcpy(bytes + 8, &h2, 8);
+  }
+  char *id = sxupdate_mem_alloc(sizeof(bytes) * 2 + 1);
+  if(id)
+    for(size_t i = 0; i < sizeof(bytes); i++)
+      snprintf(id + i * 2, 3, "%02x", bytes[i]);
+  return id;
+}
+
+/* the id kept in path, which is created with a new one if it does not exist yet */
+static char *sxupdate_rollout_file_id(sxupdate_t handle, const char *path) {
+  char *id = sxupdate_rollout_read_id(path);
+  if(id)
+    return id;
+
+  size_t len = strlen(path) + 32;
+  char *tmp = sxupdate_mem_alloc(len);
+  if(!tmp || !(id = sxupdate_rollout_new_id())) {
+    sxupdate_mem_free(tmp);
+    return id;
+  }
+  snprintf(tmp, len, "%s.%lu.tmp", path, (unsigned long)getpid());
+  FILE *f = fopen(tmp, "wb");
+  int err = !f || fprintf(f, "%s\n", id) < 0;
+  if(f && fclose(f))
+    err = 1;
+  // keep the first id written, if another process got there first
+#ifdef _WIN32
+  if(!err && rename(tmp, path))
+#else
+  if(!err && link(tmp, path))
+#endif
+    err = 1;
+  remove(tmp);
+  sxupdate_mem_free(tmp);
+  char *kept = sxupdate_rollout_read_id(path);
+  if(kept) {
+    sxupdate_mem_free(id);
+    return kept;
+  }
+  if(err)
+    sxupdate_log_warning(handle, "rollout.id", "Unable to keep the machine id in %s", path);
+  return id;
+}
+
+/* the id that places this client in rollouts: set, else read or generated once per handle */
+static const char *sxupdate_rollout_machine_id(sxupdate_t handle) {
+  if(!handle->rollout.machine_id) {
+    if(handle->rollout.id_file)
+      handle->rollout.machine_id = sxupdate_rollout_file_id(handle, handle->rollout.id_file);
+    else if(!(handle->rollout.machine_id = sxupdate_rollout_system_id())) {
+      sxupdate_log_warning(handle, "rollout.id", "No machine id; staged rollouts will place this process at random");
+      handle->rollout.machine_id = sxupdate_rollout_new_id();
+    }
+  }
+  return handle->rollout.machine_id;
+}
+
+/* the number of buckets admitted at now to the rollout of the item being parsed */
+static unsigned sxupdate_rollout_admitted(sxupdate_t handle, long long now) {
+  const double percentage = handle->rollout.item.has_percentage ? handle->rollout.item.percentage : 100;
+  long long start = handle->rollout.item.start, ramp = handle->rollout.item.ramp;
+  double share = percentage / 100;
+  if(now < start)
+    share = 0;
+  else if(ramp > 0 && now - start < ramp)
+    share *= (double)(now - start) / ramp;
+  if(share <= 0)
+    return 0;
+  if(share >= 1)
+    return SXUPDATE_ROLLOUT_BUCKETS;
+  return (unsigned)(share * SXUPDATE_ROLLOUT_BUCKETS);
+}
+
+int sxupdate_rollout_admits(sxupdate_t handle, const struct sxupdate_version *v) {
+  if(!handle->rollout.item.set || handle->rollout.ignore)
+    return 1;
+  unsigned admitted = sxupdate_rollout_admitted(handle, (long long)time(NULL));
+  if(admitted >= SXUPDATE_ROLLOUT_BUCKETS)
+    return 1;
+
+  const char *machine_id = sxupdate_rollout_machine_id(handle);
+  if(!machine_id) {
+    sxupdate_log_error(handle, "memory", "Out of memory!");
+    return 0;
+  }
+  unsigned bucket = sxupdate_rollout_bucket(machine_id, &v->version);
+  int admits = bucket < admitted;
+  sxupdate_log_debug(handle, "rollout.bucket", "Version %i.%i.%i: rolled out to %.2f%%, this client is at %.2f%%",
+                     v->version.major, v->version.minor, v->version.patch,
+                     admitted * 100.0 / SXUPDATE_ROLLOUT_BUCKETS, bucket * 100.0 / SXUPDATE_ROLLOUT_BUCKETS);
+  if(!admits)
+    sxupdate_log_info(handle, "rollout.held", "Version %i.%i.%i is not yet rolled out to this client",
+                      v->version.major, v->version.minor, v->version.patch);
+  return admits;
+}
+
+void sxupdate_rollout_item_reset(sxupdate_t handle) {
+  memset(&handle->rollout.item, 0, sizeof(handle->rollout.item));
+}
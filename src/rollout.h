@@ -0,0 +1,32 @@
+#ifndef SXUPDATE_ROLLOUT_H
+#define SXUPDATE_ROLLOUT_H
+
+#include "../include/api.h"
+
+/**
+ * Staged rollouts (see sxupdate_set_rollout() and schema/appcast.schema.json). An appcast
+ * item may carry
+ *
+ *   "rollout": {"percentage": 25, "start": 1760000000, "ramp": 86400}
+ *
+ * From start (a Unix time), the share of clients admitted grows linearly over ramp seconds
+ * to percentage. Each client hashes its machine id and the item's version into a bucket
+ * from 0 to 9999, and takes the item only once the share reaches its bucket; until then it
+ * skips the item, and takes the next one instead. Hashing the version too means a client
+ * that is early for one release is not always early
+ */
+#define SXUPDATE_ROLLOUT_BUCKETS 10000
+#define SXUPDATE_ROLLOUT_ID_MAX 128 // longest machine id read from a file
+
+/**
+ * @return non-zero if the item just parsed into v is available to this client: it has no
+ *         rollout, or the rollout has reached the client's bucket
+ */
+int sxupdate_rollout_admits(sxupdate_t handle, const struct sxupdate_version *v);
+
+/**
+ * Forget the rollout of the item being parsed, before the next one
+ */
+void sxupdate_rollout_item_reset(sxupdate_t handle);
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "internal.h"
+#include "shard.h"
+
+const char *sxupdate_shard_default_platform(void) {
+#if defined(_WIN32)
+  return "windows";
+#elif defined(__APPLE__)
+  return "macos";
+#elif defined(__linux__)
+  return "linux";
+#elif defined(__FreeBSD__)
+  return "freebsd";
+#else
+  return "unknown";
+#endif
+}
+
+const char *sxupdate_shard_default_arch(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+  return "x86_64";
+#elif defined(__aarch64__) || defined(_M_ARM64)
+  return "arm64";
+#elif defined(__i386__) || defined(_M_IX86)
+  return "x86";
+#elif defined(__arm__) || defined(_M_ARM)
+  return "arm";
+#else
+  return "unknown";
+#endif
+}
+
+const char *sxupdate_shard_platform(sxupdate_t handle) {
+  return handle->shard.platform ? handle->shard.platform : sxupdate_shard_default_platform();
+}
+
+const char *sxupdate_shard_arch(sxupdate_t handle) {
+  return handle->shard.arch ? handle->shard.arch : sxupdate_shard_default_arch();
+}
+
+const char *sxupdate_shard_channel(sxupdate_t handle) {
+  return handle->shard.channel ? handle->shard.channel : SXUPDATE_SHARD_DEFAULT_CHANNEL;
+}
+
+/* an omitted shard field matches anything; names are compared case-insensitively */
+static int sxupdate_shard_field_matches(const char *shard_value, const char *wanted) {
+  if(!shard_value)
+    return 1;
+  for(; *shard_value && *wanted; shard_value++, wanted++) {
+    char a = *shard_value, b = *wanted;
+    if(a >= 'A' && a <= 'Z')
+      a += 'a' - 'A';
+    if(b >= 'A' && b <= 'Z')
+      b += 'a' - 'A';
+    if(a != b)
+      return 0;
+  }
+  return *shard_value == *wanted;
+}
+
+int sxupdate_shard_matches(sxupdate_t handle, const char *platform, const char *arch,
+                           const char *channel) {
+  return sxupdate_shard_field_matches(platform, sxupdate_shard_platform(handle))
+    && sxupdate_shard_field_matches(arch, sxupdate_shard_arch(handle))
+    && sxupdate_shard_field_matches(channel, sxupdate_shard_channel(handle));
+}
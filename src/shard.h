@@ -0,0 +1,40 @@
+#ifndef SXUPDATE_SHARD_H
+#define SXUPDATE_SHARD_H
+
+#include "../include/api.h"
+
+/**
+ * Sharded appcasts (see sxupdate_set_shard() and schema/index.schema.json). The appcast
+ * url may serve a small index instead of an appcast:
+ *
+ *   {"shards":[{"platform":"linux","arch":"x86_64","channel":"stable","url":"linux-x64.json"}, ...]}
+ *
+ * The client fetches the first shard whose platform, arch and channel match its own; a
+ * shard that omits one of them matches any value. Relative shard urls are resolved
+ * against the index url
+ */
+#define SXUPDATE_SHARD_DEFAULT_CHANNEL "stable"
+#define SXUPDATE_SHARD_DEFAULT_INDEX_TTL 86400
+
+/**
+ * The platform and architecture sxupdate was built for, as named in indexes
+ */
+const char *sxupdate_shard_default_platform(void);
+const char *sxupdate_shard_default_arch(void);
+
+/**
+ * The platform, architecture and channel the handle looks up in indexes: those set with
+ * sxupdate_set_shard(), else the defaults
+ */
+const char *sxupdate_shard_platform(sxupdate_t handle);
+const char *sxupdate_shard_arch(sxupdate_t handle);
+const char *sxupdate_shard_channel(sxupdate_t handle);
+
+/**
+ * @return non-zero if a shard with the given fields (any of which may be NULL, matching
+ *         any value) applies to the handle
+ */
+int sxupdate_shard_matches(sxupdate_t handle, const char *platform, const char *arch,
+                           const char *channel);
+
+#endif
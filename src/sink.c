@@ -0,0 +1,434 @@
+#include <string.h>
+#include <errno.h>
+
+#include "sink.h"
+#include "qos.h"
+#include "alloc.h"
+
+#ifdef _WIN32
+
+int sxupdate_sink_open(const char *path, int flags, struct sxupdate_sink **sink) {
+  (void)(path);
+  (void)(flags);
+  *sink = NULL;
+  return ENOTSUP;
+}
+
+int sxupdate_sink_write(struct sxupdate_sink *sink, const void *data, size_t len) {
+  (void)(sink);
+  (void)(data);
+  (void)(len);
+  return ENOTSUP;
+}
+
+int sxupdate_sink_close(struct sxupdate_sink *sink) {
+  (void)(sink);
+  return ENOTSUP;
+}
+
+int sxupdate_sink_uses_uring(const struct sxupdate_sink *sink) {
+  (void)(sink);
+  return 0;
+}
+
+#else
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef SXUPDATE_USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define SXUPDATE_SINK_IOPRIO_IDLE (3 << 13) // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+
+/* submission and completion rings, set up with the raw system calls */
+struct sxupdate_uring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+#endif
+
+struct sxupdate_sink_buffer {
+  unsigned char *data; // SXUPDATE_SINK_BUFFER_SIZE bytes, aligned to SXUPDATE_SINK_ALIGN
+  void *alloc;         // as allocated, before alignment
+  size_t len;
+  off_t offset;
+  int busy;            // queued or being written
+};
+
+struct sxupdate_sink {
+  int fd;
+  int flags;
+  int err;      // of the first write that failed
+  off_t offset; // in the file, of the buffer being filled
+  size_t current;
+  struct sxupdate_sink_buffer buffers[SXUPDATE_SINK_BUFFERS];
+
+#ifdef SXUPDATE_USE_IO_URING
+  struct sxupdate_uring ring;
+  int use_uring;
+#endif
+
+  // writer thread, unless io_uring is used
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t queue[SXUPDATE_SINK_BUFFERS]; // buffers to write, in order
+  size_t queue_head, queue_count;
+  int stop;
+  int thread_started;
+};
+
+/* write all of len bytes at offset */
+static int sxupdate_sink_pwrite(int fd, const unsigned char *data, size_t len, off_t offset) {
+  while(len) {
+    ssize_t n = pwrite(fd, data, len, offset);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return errno;
+    }
+    if(n == 0)
+      return EIO;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+#ifdef SXUPDATE_USE_IO_URING
+static int sxupdate_uring_setup(struct sxupdate_uring *ring) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = (int)syscall(__NR_io_uring_setup, SXUPDATE_SINK_BUFFERS, &p);
+  if(ring->fd < 0)
+    return errno;
+  if(!(p.features & IORING_FEAT_RW_CUR_POS)) { // kernels without IORING_OP_WRITE
+    close(ring->fd);
+    return ENOTSUP;
+  }
+
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = 0;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ptr = ring->cq_size == 0 ? ring->sq_ptr
+    : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    int err = errno;
+    if(ring->sq_ptr != MAP_FAILED)
+      munmap(ring->sq_ptr, ring->sq_size);
+    if(ring->cq_size && ring->cq_ptr != MAP_FAILED)
+      munmap(ring->cq_ptr, ring->cq_size);
+    if(ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    return err;
+  }
+
+  unsigned char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void sxupdate_uring_free(struct sxupdate_uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_size)
+    munmap(ring->cq_ptr, ring->cq_size);
+  munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+}
+
+static int sxupdate_uring_submit(struct sxupdate_sink *sink, size_t i) {
+  struct sxupdate_uring *ring = &sink->ring;
+  struct sxupdate_sink_buffer *b = &sink->buffers[i];
+  unsigned tail = *ring->sq_tail; // only this thread moves the tail
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = sink->fd;
+  sqe->addr = (uint64_t)(uintptr_t)b->data;
+  sqe->len = (uint32_t)b->len;
+  sqe->off = (uint64_t)b->offset;
+  sqe->user_data = i;
+  if(sink->flags & SXUPDATE_SINK_IDLE_IO)
+    sqe->ioprio = SXUPDATE_SINK_IOPRIO_IDLE;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return errno;
+  }
+  return 0;
+}
+
+/* collect completed writes, waiting for at least one if wait is set */
+static int sxupdate_uring_reap(struct sxupdate_sink *sink, int wait) {
+  struct sxupdate_uring *ring = &sink->ring;
+  while(wait && syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+    if(errno != EINTR)
+      return errno;
+  }
+  unsigned head = *ring->cq_head;
+  while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    struct sxupdate_sink_buffer *b = &sink->buffers[cqe->user_data];
+    int err = 0;
+    if(cqe->res < 0)
+      err = -cqe->res;
+    else if((size_t)cqe->res < b->len) // short write: finish it here
+      err = sxupdate_sink_pwrite(sink->fd, b->data + cqe->res, b->len - cqe->res, b->offset + cqe->res);
+    if(err && !sink->err)
+      sink->err = err;
+    b->busy = 0;
+    b->len = 0;
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+#endif
+
+static void *sxupdate_sink_thread(void *s) {
+  struct sxupdate_sink *sink = s;
+  if(sink->flags & SXUPDATE_SINK_IDLE_IO)
+    sxupdate_qos_lower_thread(0, 1); // best effort
+  pthread_mutex_lock(&sink->lock);
+  while(1) {
+    while(!sink->queue_count && !sink->stop)
+      pthread_cond_wait(&sink->cond, &sink->lock);
+    if(!sink->queue_count)
+      break;
+    size_t i = sink->queue[sink->queue_head];
+    pthread_mutex_unlock(&sink->lock);
+
+    struct sxupdate_sink_buffer *b = &sink->buffers[i];
+    int err = sxupdate_sink_pwrite(sink->fd, b->data, b->len, b->offset);
+
+    pthread_mutex_lock(&sink->lock);
+    sink->queue_head = (sink->queue_head + 1) % SXUPDATE_SINK_BUFFERS;
+    sink->queue_count--;
+    if(err && !sink->err)
+      sink->err = err;
+    b->busy = 0;
+    b->len = 0;
+    pthread_cond_broadcast(&sink->cond);
+  }
+  pthread_mutex_unlock(&sink->lock);
+  return NULL;
+}
+
+/* hand the buffer being filled to the writer, and move on to the next */
+static int sxupdate_sink_submit(struct sxupdate_sink *sink) {
+  size_t i = sink->current;
+  struct sxupdate_sink_buffer *b = &sink->buffers[i];
+  b->offset = sink->offset;
+  b->busy = 1;
+  sink->offset += b->len;
+  sink->current = (i + 1) % SXUPDATE_SINK_BUFFERS;
+#ifdef SXUPDATE_USE_IO_URING
+  if(sink->use_uring)
+    return sxupdate_uring_submit(sink, i);
+#endif
+  pthread_mutex_lock(&sink->lock);
+  sink->queue[(sink->queue_head + sink->queue_count) % SXUPDATE_SINK_BUFFERS] = i;
+  sink->queue_count++;
+  pthread_cond_broadcast(&sink->cond);
+  pthread_mutex_unlock(&sink->lock);
+  return 0;
+}
+
+/* wait until buffer i has been written */
+static int sxupdate_sink_wait(struct sxupdate_sink *sink, size_t i) {
+  struct sxupdate_sink_buffer *b = &sink->buffers[i];
+#ifdef SXUPDATE_USE_IO_URING
+  if(sink->use_uring) {
+    int err = 0;
+    while(b->busy && !(err = sxupdate_uring_reap(sink, 1)))
+      ;
+    return err;
+  }
+#endif
+  pthread_mutex_lock(&sink->lock);
+  while(b->busy)
+    pthread_cond_wait(&sink->cond, &sink->lock);
+  pthread_mutex_unlock(&sink->lock);
+  return 0;
+}
+
+static int sxupdate_sink_wait_all(struct sxupdate_sink *sink) {
+  int err = 0;
+  for(size_t i = 0; i < SXUPDATE_SINK_BUFFERS && !err; i++)
+    err = sxupdate_sink_wait(sink, i);
+  return err;
+}
+
+static int sxupdate_sink_error(struct sxupdate_sink *sink) {
+#ifdef SXUPDATE_USE_IO_URING
+  if(sink->use_uring) {
+    sxupdate_uring_reap(sink, 0);
+    return sink->err;
+  }
+#endif
+  pthread_mutex_lock(&sink->lock);
+  int err = sink->err;
+  pthread_mutex_unlock(&sink->lock);
+  return err;
+}
+
+static void sxupdate_sink_free(struct sxupdate_sink *sink) {
+  if(sink->thread_started) {
+    pthread_mutex_lock(&sink->lock);
+    sink->stop = 1;
+    pthread_cond_broadcast(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->thread, NULL);
+  }
+#ifdef SXUPDATE_USE_IO_URING
+  if(sink->use_uring)
+    sxupdate_uring_free(&sink->ring);
+#endif
+  pthread_cond_destroy(&sink->cond);
+  pthread_mutex_destroy(&sink->lock);
+  for(size_t i = 0; i < SXUPDATE_SINK_BUFFERS; i++)
+    sxupdate_mem_free(sink->buffers[i].alloc);
+  if(sink->fd >= 0)
+    close(sink->fd);
+  sxupdate_mem_free(sink);
+}
+
+int sxupdate_sink_open(const char *path, int flags, struct sxupdate_sink **sinkp) {
+  *sinkp = NULL;
+  struct sxupdate_sink *sink = sxupdate_mem_calloc(1, sizeof(*sink));
+  if(!sink)
+    return ENOMEM;
+  sink->fd = -1;
+  sink->flags = flags;
+  pthread_mutex_init(&sink->lock, NULL);
+  pthread_cond_init(&sink->cond, NULL);
+
+  int err = 0;
+  for(size_t i = 0; i < SXUPDATE_SINK_BUFFERS && !err; i++) {
+    struct sxupdate_sink_buffer *b = &sink->buffers[i];
+    if(!(b->alloc = sxupdate_mem_alloc(SXUPDATE_SINK_BUFFER_SIZE + SXUPDATE_SINK_ALIGN)))
+      err = ENOMEM;
+    else
+      b->data = (unsigned char *)(((uintptr_t)b->alloc + SXUPDATE_SINK_ALIGN - 1)
+                                  & ~(uintptr_t)(SXUPDATE_SINK_ALIGN - 1));
+  }
+
+  if(!err) {
+    int oflags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if(flags & SXUPDATE_SINK_DIRECT)
+      sink->fd = open(path, oflags | O_DIRECT, 0600);
+#endif
+    if(sink->fd < 0) // not asked for, or not supported by the file system, e.g. tmpfs
+      sink->fd = open(path, oflags, 0600);
+    if(sink->fd < 0)
+      err = errno;
+  }
+
+#ifdef SXUPDATE_USE_IO_URING
+  if(!err && !(flags & SXUPDATE_SINK_NO_URING))
+    sink->use_uring = !sxupdate_uring_setup(&sink->ring);
+  if(!err && !sink->use_uring)
+#else
+  if(!err)
+#endif
+  {
+    if((err = pthread_create(&sink->thread, NULL, sxupdate_sink_thread, sink)) == 0)
+      sink->thread_started = 1;
+  }
+
+  if(err) {
+    sxupdate_sink_free(sink);
+    return err;
+  }
+  *sinkp = sink;
+  return 0;
+}
+
+int sxupdate_sink_write(struct sxupdate_sink *sink, const void *data, size_t len) {
+  const unsigned char *p = data;
+  int err;
+  while(len) {
+    struct sxupdate_sink_buffer *b = &sink->buffers[sink->current];
+    if((err = sxupdate_sink_wait(sink, sink->current)) || (err = sxupdate_sink_error(sink)))
+      return err;
+    size_t n = SXUPDATE_SINK_BUFFER_SIZE - b->len;
+    if(n > len)
+      n = len;
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    p += n;
+    len -= n;
+    if(b->len == SXUPDATE_SINK_BUFFER_SIZE && (err = sxupdate_sink_submit(sink)))
+      return err;
+  }
+  return 0;
+}
+
+int sxupdate_sink_close(struct sxupdate_sink *sink) {
+  struct sxupdate_sink_buffer *b = &sink->buffers[sink->current];
+  int err = 0;
+  if(b->len) {
+#ifdef O_DIRECT
+    // O_DIRECT writes must be whole blocks: write the tail through the page cache
+    if(sink->flags & SXUPDATE_SINK_DIRECT && b->len % SXUPDATE_SINK_ALIGN) {
+      int fl = fcntl(sink->fd, F_GETFL);
+      if(!(err = sxupdate_sink_wait_all(sink)) && fl != -1 && (fl & O_DIRECT))
+        fcntl(sink->fd, F_SETFL, fl & ~O_DIRECT);
+    }
+#endif
+    if(!err)
+      err = sxupdate_sink_submit(sink);
+  }
+  if(!err)
+    err = sxupdate_sink_wait_all(sink);
+  if(!err)
+    err = sxupdate_sink_error(sink);
+  if(close(sink->fd) && !err)
+    err = errno;
+  sink->fd = -1;
+  sxupdate_sink_free(sink);
+  return err;
+}
+
+int sxupdate_sink_uses_uring(const struct sxupdate_sink *sink) {
+#ifdef SXUPDATE_USE_IO_URING
+  return sink->use_uring;
+#else
+  (void)(sink);
+  return 0;
+#endif
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SXUPDATE_SINK_H
+#define SXUPDATE_SINK_H
+
+#include <stddef.h>
+
+/**
+ * Asynchronous file writer for downloads (see sxupdate_set_write_options()). Incoming
+ * bytes are copied into a few large, page-aligned buffers; each full buffer is written at
+ * its offset by io_uring (SXUPDATE_USE_IO_URING, Linux 5.6+) or else by a writer thread
+ * with pwrite(), so the transfer thread only waits for the disk once every buffer is in
+ * flight. With O_DIRECT, the buffers go to the disk without passing through the page cache
+ *
+ * Not available on Windows, where downloads are written with stdio
+ */
+#define SXUPDATE_SINK_BUFFER_SIZE (1024 * 1024)
+#define SXUPDATE_SINK_BUFFERS 4
+#define SXUPDATE_SINK_ALIGN 4096
+
+#define SXUPDATE_SINK_DIRECT 1   // open with O_DIRECT, where the file system supports it
+#define SXUPDATE_SINK_NO_URING 2 // write from a thread even if io_uring is available
+#define SXUPDATE_SINK_IDLE_IO 4  // write at the idle I/O class (see sxupdate_set_qos())
+
+struct sxupdate_sink;
+
+/**
+ * Create or truncate path, and start its writer
+ * @param flags: SXUPDATE_SINK_DIRECT, SXUPDATE_SINK_NO_URING, SXUPDATE_SINK_IDLE_IO
+ * @return 0 on success, else errno (ENOTSUP on Windows)
+ */
+int sxupdate_sink_open(const char *path, int flags, struct sxupdate_sink **sink);
+
+/**
+ * Queue len bytes after those already written, waiting for a free buffer if need be
+ * @return 0 on success, else errno, including that of an earlier write that failed
+ */
+int sxupdate_sink_write(struct sxupdate_sink *sink, const void *data, size_t len);
+
+/**
+ * Write what is left, wait for all writes to complete, close the file and free the sink
+ * @return 0 if every write succeeded, else errno
+ */
+int sxupdate_sink_close(struct sxupdate_sink *sink);
+
+/**
+ * Whether writes are made with io_uring rather than a thread, e.g. for benchmarks
+ */
+int sxupdate_sink_uses_uring(const struct sxupdate_sink *sink);
+
+#endif
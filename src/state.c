@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#define SXUPDATE_STATE_OPEN_FLAGS O_BINARY
+#else
+#include <unistd.h>
+#include <sys/file.h>
+#define SXUPDATE_STATE_OPEN_FLAGS O_CLOEXEC
+#endif
+
+#include "state.h"
+#include "alloc.h"
+#include "log.h"
+
+uint64_t sxupdate_state_hash(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t sxupdate_state_checksum(const struct sxupdate_state_record *record) {
+  return sxupdate_state_hash(record, offsetof(struct sxupdate_state_record, checksum));
+}
+
+int sxupdate_state_read(const char *path, struct sxupdate_state_record *record) {
+  // a single read() of a few hundred bytes is cheaper than mapping the file
+  int fd = open(path, O_RDONLY | SXUPDATE_STATE_OPEN_FLAGS);
+  if(fd < 0)
+    return errno;
+  ssize_t n = read(fd, record, sizeof(*record));
+  int err = n < 0 ? errno : 0;
+  close(fd);
+  if(err)
+    return err;
+
+  if(n != (ssize_t)sizeof(*record)
+     || memcmp(record->magic, SXUPDATE_STATE_MAGIC, sizeof(record->magic))
+     || record->checksum != sxupdate_state_checksum(record)
+     || !memchr(record->prerelease, '\0', sizeof(record->prerelease))
+     || !memchr(record->etag, '\0', sizeof(record->etag))
+     || !memchr(record->last_modified, '\0', sizeof(record->last_modified))
+     || !memchr(record->shard_url, '\0', sizeof(record->shard_url)))
+    return EINVAL;
+  return 0;
+}
+
+/* write all of record to a new file at path */
+static int sxupdate_state_write_file(const char *path, const struct sxupdate_state_record *record) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | SXUPDATE_STATE_OPEN_FLAGS, 0644);
+  if(fd < 0)
+    return errno;
+  int err = write(fd, record, sizeof(*record)) == (ssize_t)sizeof(*record) ? 0 : errno ? errno : EIO;
+  if(close(fd) && !err)
+    err = errno;
+  return err;
+}
+
+int sxupdate_state_write(sxupdate_t handle, const char *path, struct sxupdate_state_record *record) {
+  memcpy(record->magic, SXUPDATE_STATE_MAGIC, sizeof(record->magic));
+  record->checksum = sxupdate_state_checksum(record);
+
+  size_t len = strlen(path) + 32;
+  char *tmp = sxupdate_mem_alloc(len);
+  char *lock_path = sxupdate_mem_alloc(len);
+  if(!(tmp && lock_path)) {
+    sxupdate_mem_free(tmp);
+    sxupdate_mem_free(lock_path);
+    return ENOMEM;
+  }
+  snprintf(tmp, len, "%s.%lu.tmp", path, (unsigned long)getpid());
+  snprintf(lock_path, len, "%s.lock", path);
+
+  int err = 0;
+#ifndef _WIN32
+  int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(lock < 0 || flock(lock, LOCK_EX))
+    err = errno;
+#endif
+  // on Windows, there is no lock: concurrent writers may race, but the file is still
+  // always replaced as a whole
+
+  struct sxupdate_state_record current;
+  if(!err && !sxupdate_state_read(path, &current) && current.url_hash == record->url_hash
+     && current.checked_at > record->checked_at)
+    sxupdate_log_debug(handle, "state.write", "%s already holds a more recent check", path);
+  else if(!err) {
+    if(!(err = sxupdate_state_write_file(tmp, record))) {
+#ifdef _WIN32
+      if(!MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+        err = EACCES;
+#else
+      if(rename(tmp, path))
+        err = errno;
+#endif
+    }
+    if(err)
+      remove(tmp);
+  }
+
+#ifndef _WIN32
+  if(lock >= 0)
+    close(lock); // releases the lock
+#endif
+  sxupdate_mem_free(tmp);
+  sxupdate_mem_free(lock_path);
+  return err;
+}
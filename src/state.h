@@ -0,0 +1,54 @@
+#ifndef SXUPDATE_STATE_H
+#define SXUPDATE_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../include/api.h"
+
+/**
+ * Check-throttle state, shared between processes through a small file (see
+ * sxupdate_set_state_file()). The file holds a single fixed-size record in native byte
+ * order, so reading it needs no parsing. Writers replace the whole file with rename(), so
+ * readers never see a partial record, and serialize on <path>.lock
+ */
+#define SXUPDATE_STATE_MAGIC "SXUPST02"
+#define SXUPDATE_STATE_PRERELEASE_MAX 64
+#define SXUPDATE_STATE_ETAG_MAX 128
+#define SXUPDATE_STATE_LAST_MODIFIED_MAX 64
+#define SXUPDATE_STATE_SHARD_URL_MAX 512
+
+struct sxupdate_state_record {
+  char magic[8];
+  uint64_t url_hash;            // appcast url the record applies to
+  int64_t checked_at;           // time() of the last successful check
+  int32_t major, minor, patch;  // latest version found by that check
+  uint32_t _;
+  char prerelease[SXUPDATE_STATE_PRERELEASE_MAX];
+  char etag[SXUPDATE_STATE_ETAG_MAX]; // validators of the appcast response, if any
+  char last_modified[SXUPDATE_STATE_LAST_MODIFIED_MAX];
+  uint64_t shard_key;           // platform, arch and channel the shard was chosen for
+  int64_t shard_resolved_at;    // time() the shard url was read from the index
+  char shard_url[SXUPDATE_STATE_SHARD_URL_MAX]; // if the url serves an index: the shard
+                                // fetched, to which the validators then apply
+  uint64_t checksum;            // of all the above
+};
+
+/**
+ * 64-bit FNV-1a hash
+ */
+uint64_t sxupdate_state_hash(const void *data, size_t len);
+
+/**
+ * Read the state file
+ * @return 0 on success, else errno. EINVAL if the file is not a valid state file
+ */
+int sxupdate_state_read(const char *path, struct sxupdate_state_record *record);
+
+/**
+ * Replace the state file with record, after filling in its magic and checksum, unless
+ * another process has meanwhile recorded a more recent check of the same url
+ * @return 0 on success, else errno
+ */
+int sxupdate_state_write(sxupdate_t handle, const char *path, struct sxupdate_state_record *record);
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+#include <windows.h>
+#endif
+
+#include "stats.h"
+
+double sxupdate_clock_now(void) {
+#if defined(_WIN32) || defined(WIN32) || defined(WIN)
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static double sxupdate_curl_seconds(CURL *curl, CURLINFO info) {
+  curl_off_t us = 0;
+  if(curl_easy_getinfo(curl, info, &us) != CURLE_OK)
+    return 0;
+  return (double)us / 1e6;
+}
+
+void sxupdate_stats_from_curl(struct sxupdate_transfer_stats *ts, CURL *curl) {
+  // curl reports each timing cumulatively from the start of the transfer
+  double namelookup = sxupdate_curl_seconds(curl, CURLINFO_NAMELOOKUP_TIME_T);
+  double connect = sxupdate_curl_seconds(curl, CURLINFO_CONNECT_TIME_T);
+  double appconnect = sxupdate_curl_seconds(curl, CURLINFO_APPCONNECT_TIME_T);
+
+  ts->dns = namelookup;
+  ts->connect = connect > namelookup ? connect - namelookup : 0;
+  ts->tls = appconnect > connect ? appconnect - connect : 0;
+  ts->ttfb = sxupdate_curl_seconds(curl, CURLINFO_STARTTRANSFER_TIME_T);
+  ts->total = sxupdate_curl_seconds(curl, CURLINFO_TOTAL_TIME_T);
+
+  curl_off_t n = 0;
+  if(curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &n) == CURLE_OK)
+    ts->bytes = (double)n;
+  n = 0;
+  if(curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &n) == CURLE_OK)
+    ts->throughput = (double)n;
+}
+
+#define SXUPDATE_TRANSFER_STATS_JSON_FMT                                 \
+  "{\"dns\":%.6f,\"connect\":%.6f,\"tls\":%.6f,\"ttfb\":%.6f,"           \
+  "\"total\":%.6f,\"bytes\":%.0f,\"throughput\":%.0f}"
+
+#define SXUPDATE_TRANSFER_STATS_JSON_ARGS(ts) \
+  (ts).dns, (ts).connect, (ts).tls, (ts).ttfb, (ts).total, (ts).bytes, (ts).throughput
+
+char *sxupdate_stats_json(const struct sxupdate_stats *stats) {
+  const char *fmt = "{\"state\":%.6f,\"index\":" SXUPDATE_TRANSFER_STATS_JSON_FMT
+    ",\"appcast\":" SXUPDATE_TRANSFER_STATS_JSON_FMT
+    ",\"parse\":%.6f,\"version_compare\":%.6f,\"peer_discovery\":%.6f"
+    ",\"download\":" SXUPDATE_TRANSFER_STATS_JSON_FMT ",\"download_wait\":%.6f"
+    ",\"hash\":%.6f,\"verify\":%.6f,\"spawn\":%.6f}";
+#define SXUPDATE_STATS_JSON_ARGS \
+  stats->state, SXUPDATE_TRANSFER_STATS_JSON_ARGS(stats->index), \
+    SXUPDATE_TRANSFER_STATS_JSON_ARGS(stats->appcast), \
+    stats->parse, stats->version_compare, stats->peer_discovery, \
+    SXUPDATE_TRANSFER_STATS_JSON_ARGS(stats->download), stats->download_wait, \
+    stats->hash, stats->verify, stats->spawn
+
+  int len = snprintf(NULL, 0, fmt, SXUPDATE_STATS_JSON_ARGS);
+  if(len < 0)
+    return NULL;
+  char *s = malloc(len + 1);
+  if(s)
+    snprintf(s, len + 1, fmt, SXUPDATE_STATS_JSON_ARGS);
+  return s;
+#undef SXUPDATE_STATS_JSON_ARGS
+}
@@ -0,0 +1,22 @@
+#ifndef SXUPDATE_STATS_H
+#define SXUPDATE_STATS_H
+
+#include <curl/curl.h>
+#include "../include/api.h"
+
+/**
+ * Monotonic clock, in seconds
+ */
+double sxupdate_clock_now(void);
+
+/**
+ * Fill in transfer phase timings from a completed curl easy handle
+ */
+void sxupdate_stats_from_curl(struct sxupdate_transfer_stats *ts, CURL *curl);
+
+/**
+ * Return a JSON representation of stats. Caller must free
+ */
+char *sxupdate_stats_json(const struct sxupdate_stats *stats);
+
+#endif
@@ -0,0 +1,200 @@
+#include <curl/curl.h>
+
+#include "internal.h"
+#include "transfer.h"
+#include "log.h"
+#include "stats.h"
+
+static int sxupdate_multi_socket_callback(CURL *easy, curl_socket_t s, int what,
+                                          void *h, void *socketp) {
+  (void)(easy);
+  (void)(socketp);
+  sxupdate_t handle = h;
+  handle->event.socket_cb(handle, (sxupdate_socket_t)s, (enum sxupdate_poll)what, handle->event.ctx);
+  return 0;
+}
+
+static int sxupdate_multi_timer_callback(CURLM *multi, long timeout_ms, void *h) {
+  (void)(multi);
+  sxupdate_t handle = h;
+  handle->event.timer_cb(handle, timeout_ms, handle->event.ctx);
+  return 0;
+}
+
+enum sxupdate_status sxupdate_transfer_init_multi(sxupdate_t handle) {
+  if(!handle->event.multi) {
+    handle->event.multi = curl_multi_init();
+    if(!handle->event.multi)
+      return sxupdate_status_memory;
+  }
+  curl_multi_setopt(handle->event.multi, CURLMOPT_SOCKETFUNCTION, sxupdate_multi_socket_callback);
+  curl_multi_setopt(handle->event.multi, CURLMOPT_SOCKETDATA, handle);
+  curl_multi_setopt(handle->event.multi, CURLMOPT_TIMERFUNCTION, sxupdate_multi_timer_callback);
+  curl_multi_setopt(handle->event.multi, CURLMOPT_TIMERDATA, handle);
+  return sxupdate_status_ok;
+}
+
+enum sxupdate_status sxupdate_transfer_start(sxupdate_t handle, CURL *curl,
+                                             void (*done)(sxupdate_t, CURL *, CURLcode)) {
+  if(!handle->event.multi) {
+    CURLcode res = curl_easy_perform(curl);
+    done(handle, curl, res);
+    return sxupdate_status_ok;
+  }
+
+  if(handle->event.curl) {
+    sxupdate_log_error(handle, "transfer.busy", "A transfer is already in progress");
+    return sxupdate_status_error;
+  }
+
+  handle->event.done = done;
+  handle->event.curl = curl;
+  if(curl_multi_add_handle(handle->event.multi, curl) != CURLM_OK) {
+    handle->event.done = NULL;
+    handle->event.curl = NULL;
+    return sxupdate_status_error;
+  }
+  return sxupdate_status_ok;
+}
+
+enum sxupdate_status sxupdate_transfer_hedged(sxupdate_t handle, CURL *curl, CURL *hedge,
+                                              double delay, double deadline,
+                                              void (*done)(sxupdate_t, CURL *, CURLcode)) {
+  CURLM *multi = curl_multi_init();
+  if(!multi)
+    return sxupdate_status_memory;
+  if(curl_multi_add_handle(multi, curl) != CURLM_OK) {
+    curl_multi_cleanup(multi);
+    return sxupdate_status_error;
+  }
+
+  CURL *racing[2] = { curl, NULL }; // first request, then the hedge once sent
+  CURL *result = NULL, *failed = NULL;
+  CURLcode res = CURLE_OK, failed_res = CURLE_OK;
+  double start = sxupdate_clock_now();
+  handle->fetch.winner = NULL;
+  while(!result) {
+    int running;
+    curl_multi_perform(multi, &running);
+    double now = sxupdate_clock_now();
+    int expired = deadline && now >= deadline;
+
+    CURLMsg *msg;
+    int msgs_left;
+    while(!result && (msg = curl_multi_info_read(multi, &msgs_left))) {
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+      CURL *easy = msg->easy_handle;
+      CURLcode easy_res = msg->data.result;
+      curl_multi_remove_handle(multi, easy);
+      racing[easy == racing[1]] = NULL;
+      if(easy == handle->fetch.winner) {
+        result = easy;
+        res = easy_res;
+      } else { // failed without responding, or aborted by its callbacks after losing
+        if(failed)
+          curl_easy_cleanup(failed);
+        failed = easy;
+        failed_res = easy_res;
+      }
+    }
+    if(result)
+      break;
+
+    if(handle->fetch.winner) { // the others are out of the race
+      for(int i = 0; i < 2; i++) {
+        if(racing[i] && racing[i] != handle->fetch.winner) {
+          curl_multi_remove_handle(multi, racing[i]);
+          curl_easy_cleanup(racing[i]);
+          racing[i] = NULL;
+        }
+      }
+      if(hedge)
+        curl_easy_cleanup(hedge);
+      hedge = NULL;
+    } else if(hedge && !expired && (!racing[0] || now - start >= delay)) {
+      sxupdate_log_info(handle, "fetch.hedge", "%s after %.0f ms: sending a second request",
+                        racing[0] ? "No response" : "First request failed", (now - start) * 1000);
+      if(deadline)
+        curl_easy_setopt(hedge, CURLOPT_TIMEOUT_MS, (long)((deadline - now) * 1000) + 1);
+      if(curl_multi_add_handle(multi, hedge) == CURLM_OK)
+        racing[1] = hedge;
+      else
+        curl_easy_cleanup(hedge);
+      hedge = NULL;
+    }
+
+    if(!racing[0] && !racing[1] && (!hedge || expired)) { // nothing left that could respond
+      result = failed;
+      res = failed_res;
+      failed = NULL;
+      break;
+    }
+
+    int timeout_ms = 1000;
+    if(hedge && racing[0] && !expired && (now - start) * 1000 + timeout_ms > delay * 1000)
+      timeout_ms = (int)((start + delay - now) * 1000) + 1;
+    curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+  }
+
+  for(int i = 0; i < 2; i++) {
+    if(racing[i]) {
+      curl_multi_remove_handle(multi, racing[i]);
+      curl_easy_cleanup(racing[i]);
+    }
+  }
+  if(hedge)
+    curl_easy_cleanup(hedge);
+  if(failed)
+    curl_easy_cleanup(failed);
+  curl_multi_cleanup(multi);
+
+  handle->fetch.winner = NULL;
+  done(handle, result, res);
+  return sxupdate_status_ok;
+}
+
+enum sxupdate_status sxupdate_transfer_socket_action(sxupdate_t handle, curl_socket_t fd, int events) {
+  if(!handle->event.multi)
+    return sxupdate_status_invalid;
+
+  int running = 0;
+  CURLMcode mc = curl_multi_socket_action(handle->event.multi, fd, events, &running);
+  if(mc != CURLM_OK) {
+    sxupdate_log_error(handle, "transfer.error", "curl_multi_socket_action: %s", curl_multi_strerror(mc));
+    return sxupdate_status_error;
+  }
+
+  CURLMsg *msg;
+  int msgs_left;
+  while((msg = curl_multi_info_read(handle->event.multi, &msgs_left))) {
+    if(msg->msg != CURLMSG_DONE || msg->easy_handle != handle->event.curl)
+      continue;
+
+    // detach before calling done(), which may start the next transfer
+    CURL *curl = msg->easy_handle;
+    CURLcode res = msg->data.result;
+    void (*done)(sxupdate_t, CURL *, CURLcode) = handle->event.done;
+    curl_multi_remove_handle(handle->event.multi, curl);
+    handle->event.curl = NULL;
+    handle->event.done = NULL;
+    done(handle, curl, res);
+  }
+  return sxupdate_status_ok;
+}
+
+void sxupdate_transfer_cancel(sxupdate_t handle) {
+  if(handle->event.curl) {
+    curl_multi_remove_handle(handle->event.multi, handle->event.curl);
+    curl_easy_cleanup(handle->event.curl);
+    handle->event.curl = NULL;
+    handle->event.done = NULL;
+  }
+}
+
+void sxupdate_transfer_cleanup(sxupdate_t handle) {
+  sxupdate_transfer_cancel(handle);
+  if(handle->event.multi)
+    curl_multi_cleanup(handle->event.multi);
+  handle->event.multi = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef SXUPDATE_TRANSFER_H
+#define SXUPDATE_TRANSFER_H
+
+#include "internal.h"
+
+/***
+ * Run a fully-configured curl easy handle. If the handle is driven by an event loop,
+ * the transfer is added to the multi handle and `done` is called from
+ * sxupdate_transfer_socket_action() once it completes; otherwise, the transfer is
+ * performed synchronously and `done` is called before this function returns.
+ *
+ * `done` takes ownership of the easy handle
+ *
+ * @return sxupdate_status_ok if the transfer was performed or started
+ */
+enum sxupdate_status sxupdate_transfer_start(sxupdate_t handle, CURL *curl,
+                                             void (*done)(sxupdate_t, CURL *, CURLcode));
+
+/***
+ * Run a fully-configured curl easy handle synchronously, racing it against `hedge`, a
+ * copy of the request started after `delay` seconds, or as soon as `curl` fails without
+ * responding. The callbacks of each transfer set handle->fetch.winner to it when it
+ * first responds, and return an error if another transfer got there first; the loser is
+ * then aborted
+ *
+ * `done` is called with the winner, or else with the last transfer to fail, and takes
+ * ownership of it; the other is freed
+ *
+ * @param deadline: sxupdate_clock_now() time to abort both transfers at, or 0 for none
+ */
+enum sxupdate_status sxupdate_transfer_hedged(sxupdate_t handle, CURL *curl, CURL *hedge,
+                                              double delay, double deadline,
+                                              void (*done)(sxupdate_t, CURL *, CURLcode));
+
+enum sxupdate_status sxupdate_transfer_init_multi(sxupdate_t handle);
+
+enum sxupdate_status sxupdate_transfer_socket_action(sxupdate_t handle, curl_socket_t fd, int events);
+
+/***
+ * Abort the in-flight transfer, if any, without calling its `done`
+ */
+void sxupdate_transfer_cancel(sxupdate_t handle);
+
+void sxupdate_transfer_cleanup(sxupdate_t handle);
+
+#endif
@@ -2,36 +2,104 @@
 #include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <openssl/bio.h>
+#include <openssl/evp.h>
 #include <string.h>
+#include <errno.h>
 
 #include "internal.h"
+#include "verify.h"
+#include "qos.h"
+#include "stats.h"
+#include "alloc.h"
 #include "log.h"
 
+#define SXUPDATE_HASH_CHUNK_SIZE (64 * 1024)
+#define SXUPDATE_PEM_BEGIN "-----BEGIN PUBLIC KEY-----"
+#define SXUPDATE_PEM_END "-----END PUBLIC KEY-----"
+#define SXUPDATE_PEM_MAX (64 * 1024)
+
 /**
- * return 1 on success, 0 on failure
+ * Compute the SHA-256 digest of a file, reading it in chunks, yielding as set by the handle's
+ * QoS if there is one
+ * @return 0 on success, else errno
  */
-static int verify_signature(const char *filename, RSA *public_key, unsigned char *signature, unsigned int signature_length) {
-  FILE *file = fopen(filename, "rb");
-  fseek(file, 0, SEEK_END);
-  long filesize = ftell(file);
-  rewind(file);
-  unsigned char *buffer = malloc(filesize);
-  fread(buffer, filesize, 1, file);
+static int sxupdate_sha256_file_yielding(sxupdate_t handle, const char *filepath,
+                                         unsigned char hash[SHA256_DIGEST_LENGTH], size_t *length) {
+  FILE *file = fopen(filepath, "rb");
+  if(!file)
+    return errno ? errno : ENOENT;
+
+  unsigned char *buffer = sxupdate_mem_alloc(SXUPDATE_HASH_CHUNK_SIZE);
+  if(!buffer) {
+    fclose(file);
+    return ENOMEM;
+  }
+
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  size_t total = 0, since_yield = 0, n;
+  while((n = fread(buffer, 1, SXUPDATE_HASH_CHUNK_SIZE, file)) > 0) {
+    SHA256_Update(&ctx, buffer, n);
+    total += n;
+    sxupdate_qos_hashed(handle, n, &since_yield);
+  }
+  int err = ferror(file) ? EIO : 0;
+  SHA256_Final(hash, &ctx);
+
+  sxupdate_mem_free(buffer);
   fclose(file);
+  if(length)
+    *length = total;
+  return err;
+}
+
+int sxupdate_sha256_file(const char *filepath, unsigned char hash[SHA256_DIGEST_LENGTH], size_t *length) {
+  return sxupdate_sha256_file_yielding(NULL, filepath, hash, length);
+}
+
+struct sxupdate_sha256_job {
+  sxupdate_t handle;
+  const char *filepath;
+  unsigned char *hash;
+  size_t *length;
+};
+
+static int sxupdate_sha256_run(void *j) {
+  struct sxupdate_sha256_job *job = j;
+  return sxupdate_sha256_file_yielding(job->handle, job->filepath, job->hash, job->length);
+}
+
+int sxupdate_sha256_file_qos(sxupdate_t handle, const char *filepath,
+                             unsigned char hash[SHA256_DIGEST_LENGTH], size_t *length) {
+  struct sxupdate_sha256_job job = { handle, filepath, hash, length };
+  return sxupdate_qos_run(handle, sxupdate_sha256_run, &job);
+}
 
+/**
+ * return 1 on success, 0 on failure
+ */
+static int verify_signature(sxupdate_t handle, const char *filename, const unsigned char *streamed_hash,
+                            RSA *public_key, unsigned char *signature, unsigned int signature_length,
+                            struct sxupdate_stats *stats) {
   unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256(buffer, filesize, hash);
+  double start = sxupdate_clock_now();
+  if(streamed_hash)
+    memcpy(hash, streamed_hash, SHA256_DIGEST_LENGTH);
+  else if(sxupdate_sha256_file_qos(handle, filename, hash, NULL))
+    return 0;
+  double hashed = sxupdate_clock_now();
 
   int result = RSA_verify(NID_sha256, hash, SHA256_DIGEST_LENGTH, signature, signature_length, public_key);
-
-  free(buffer);
+  if(!streamed_hash) // else already timed while downloading
+    stats->hash = hashed - start;
+  stats->verify = sxupdate_clock_now() - hashed;
   return result;
 }
 
 static unsigned char *base64_decode(const char *input, int length, int *outlen) {
   BIO *b64, *bmem;
 
-  unsigned char *buffer = (unsigned char*)malloc(length);
+  unsigned char *buffer = (unsigned char*)sxupdate_mem_alloc(length);
   memset(buffer, 0, length);
 
   b64 = BIO_new(BIO_f_base64());
@@ -49,31 +117,34 @@ static unsigned char *base64_decode(const char *input, int length, int *outlen)
 
 enum sxupdate_status sxupdate_set_signature_from_b64(sxupdate_t handle,
                                                      const char *b64) {
-  if(handle->verbosity)
-    sxupdate_verbose("Converting signature from base64: %s\n...", b64);
-  free(handle->latest_version_internal.signature);
+  // the encoded signature is large, so only include it at trace level
+  if(sxupdate_log_wants(handle, SXUPDATE_LOG_LEVEL_TRACE))
+    sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_TRACE, "signature.decode",
+                    ((const struct sxupdate_log_field[]){ { "signature", b64 }, { NULL, NULL } }),
+                    "Converting signature from base64: %s\n...", b64);
+  else
+    sxupdate_log_info(handle, "signature.decode", "Converting signature from base64 (%zu bytes)...", strlen(b64));
+  sxupdate_mem_free(handle->latest_version_internal.signature);
 
   /* convert from base64 */
   int outlen_i = 0;
   handle->latest_version_internal.signature = base64_decode(b64, strlen(b64), &outlen_i);
   if(outlen_i > 0) {
     handle->latest_version_internal.signature_length = (size_t)outlen_i;
-    if(handle->verbosity)
-      sxupdate_verbose("Success!");
+    sxupdate_log_info(handle, "signature.decode", "Success!");
     return sxupdate_status_ok;
   }
 
-  if(handle->verbosity)
-    sxupdate_verbose("Error!!!");
-  free(handle->latest_version_internal.signature);
+  sxupdate_log_info(handle, "signature.decode", "Error!!!");
+  sxupdate_mem_free(handle->latest_version_internal.signature);
   handle->latest_version_internal.signature = NULL;
   return sxupdate_status_error;
 }
 
-RSA *sxupdate_public_key_from_pem_file(const char *filepath) {
+RSA *sxupdate_public_key_from_pem_file(sxupdate_t handle, const char *filepath) {
   FILE *pubkey_file = fopen(filepath, "r");
   if (pubkey_file == NULL) {
-    perror(filepath);
+    sxupdate_log_error(handle, "key.open", "%s: %s", filepath, strerror(errno));
     return NULL;
   }
 
@@ -82,23 +153,121 @@ RSA *sxupdate_public_key_from_pem_file(const char *filepath) {
   fclose(pubkey_file);
 
   if(!public_key)
-    sxupdate_printerr("Unable to load public key from %s", filepath);
+    sxupdate_log_error(handle, "key.load", "Unable to load public key from %s", filepath);
 
   return public_key;
 }
 
+/* non-zero if pem has a public key block, with a non-empty base64 body, as
+   PEM_read_bio_RSA_PUBKEY() reads */
+static int sxupdate_public_key_pem_ok(const char *pem) {
+  const char *begin = strstr(pem, SXUPDATE_PEM_BEGIN);
+  if(!begin || (begin != pem && begin[-1] != '\n'))
+    return 0;
+  const char *body = begin + strlen(SXUPDATE_PEM_BEGIN);
+  const char *end = strstr(body, SXUPDATE_PEM_END);
+  if(!end || (*body != '\n' && *body != '\r'))
+    return 0;
+  size_t chars = 0;
+  for(const char *c = body; c < end; c++)
+    if((*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')
+       || *c == '+' || *c == '/' || *c == '=')
+      chars++;
+    else if(!strchr(" \t\r\n", *c))
+      return 0;
+  return chars && chars % 4 == 0;
+}
+
+char *sxupdate_public_key_pem_read(sxupdate_t handle, const char *filepath, size_t *len) {
+  FILE *f = fopen(filepath, "rb");
+  if(!f) {
+    sxupdate_log_error(handle, "key.open", "%s: %s", filepath, strerror(errno));
+    return NULL;
+  }
+  char *pem = sxupdate_mem_alloc(SXUPDATE_PEM_MAX + 1);
+  size_t n = pem ? fread(pem, 1, SXUPDATE_PEM_MAX + 1, f) : 0;
+  int err = !pem ? ENOMEM : ferror(f) ? (errno ? errno : EIO) : 0;
+  fclose(f);
+  if(err) {
+    sxupdate_log_error(handle, "key.open", "%s: %s", filepath, strerror(err));
+    sxupdate_mem_free(pem);
+    return NULL;
+  }
+  if(n > SXUPDATE_PEM_MAX || (pem[n] = '\0', !sxupdate_public_key_pem_ok(pem))) {
+    sxupdate_log_error(handle, "key.load", "%s is not a PEM public key", filepath);
+    sxupdate_mem_free(pem);
+    return NULL;
+  }
+  *len = n;
+  return pem;
+}
+
+RSA *sxupdate_public_key_from_pem(sxupdate_t handle, const char *pem, size_t len) {
+  BIO *bio = BIO_new_mem_buf(pem, (int)len);
+  RSA *public_key = bio ? PEM_read_bio_RSA_PUBKEY(bio, NULL, NULL, NULL) : NULL;
+  BIO_free(bio);
+  if(!public_key)
+    sxupdate_log_error(handle, "key.load", "Unable to load public key");
+  return public_key;
+}
+
+RSA *sxupdate_private_key_from_pem_file(sxupdate_t handle, const char *filepath) {
+  FILE *key_file = fopen(filepath, "r");
+  if(key_file == NULL) {
+    sxupdate_log_error(handle, "key.open", "%s: %s", filepath, strerror(errno));
+    return NULL;
+  }
+
+  RSA *private_key = PEM_read_RSAPrivateKey(key_file, NULL, NULL, NULL);
+  fclose(key_file);
+
+  if(!private_key)
+    sxupdate_log_error(handle, "key.load", "Unable to load private key from %s", filepath);
+
+  return private_key;
+}
+
+char *sxupdate_sign_sha256_b64(sxupdate_t handle, RSA *private_key,
+                               const unsigned char hash[SHA256_DIGEST_LENGTH]) {
+  unsigned char *signature = sxupdate_mem_alloc(RSA_size(private_key));
+  if(!signature) {
+    sxupdate_log_error(handle, "memory", "Out of memory!");
+    return NULL;
+  }
+
+  char *b64 = NULL;
+  unsigned int signature_length = 0;
+  if(!RSA_sign(NID_sha256, hash, SHA256_DIGEST_LENGTH, signature, &signature_length, private_key))
+    sxupdate_log_error(handle, "sign.failed", "Unable to sign");
+  else if(!(b64 = sxupdate_mem_alloc(4 * ((signature_length + 2) / 3) + 1)))
+    sxupdate_log_error(handle, "memory", "Out of memory!");
+  else
+    EVP_EncodeBlock((unsigned char *)b64, signature, signature_length);
+
+  sxupdate_mem_free(signature);
+  return b64;
+}
+
 enum sxupdate_status sxupdate_verify_signature(sxupdate_t handle, const char *filepath) {
-  if(handle->verbosity)
-    sxupdate_verbose("Verifying the signature for %s\n...", filepath);
-  if(!(handle->public_key && !handle->no_public_key))
+  sxupdate_log_kv(handle, SXUPDATE_LOG_LEVEL_INFO, "verify.start",
+                  ((const struct sxupdate_log_field[]){ { "path", filepath }, { NULL, NULL } }),
+                  "Verifying the signature for %s\n...", filepath);
+  // if filepath was just downloaded, it was hashed as it was written
+  const unsigned char *streamed_hash = handle->download.hashed ? handle->download.hash : NULL;
+  handle->download.hashed = 0;
+  if(handle->no_public_key)
     return sxupdate_status_ok; // no signature check
+  if(!handle->public_key) { // e.g. sxupdate_set_public_key_from_file() key not loaded yet
+    sxupdate_log_error(handle, "verify.no_key", "No public key loaded to verify with");
+    return sxupdate_status_error;
+  }
 
-  if(verify_signature(filepath, handle->public_key, handle->latest_version_internal.signature, handle->latest_version_internal.signature_length)) {
-    if(handle->verbosity)
-      sxupdate_verbose("OK!");
+  if(verify_signature(handle, filepath, streamed_hash, handle->public_key, handle->latest_version_internal.signature, handle->latest_version_internal.signature_length,
+                      &handle->stats)) {
+    sxupdate_log_info(handle, "verify.ok", "OK!");
     return sxupdate_status_ok;
   }
 
-  sxupdate_printerr("Signature verification failed!!");
+  sxupdate_log_error(handle, "verify.failed", "Signature verification failed!!");
   return sxupdate_status_error;
 }
@@ -1,9 +1,48 @@
 #ifndef SXUPDATE_VERIFY_H
 #define SXUPDATE_VERIFY_H
 
+#include <stddef.h>
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include "../include/api.h"
 
-RSA *sxupdate_public_key_from_pem_file(const char *filepath);
+RSA *sxupdate_public_key_from_pem_file(sxupdate_t handle, const char *filepath);
+
+/**
+ * Read a PEM public key file, checking that it holds one without parsing it, so without
+ * initializing OpenSSL. Caller must free
+ * @param len: set to the number of bytes read
+ * @return the file's contents, NUL-terminated, or NULL if unreadable or not a public key
+ */
+char *sxupdate_public_key_pem_read(sxupdate_t handle, const char *filepath, size_t *len);
+
+/**
+ * Parse a public key read with sxupdate_public_key_pem_read()
+ */
+RSA *sxupdate_public_key_from_pem(sxupdate_t handle, const char *pem, size_t len);
+
+RSA *sxupdate_private_key_from_pem_file(sxupdate_t handle, const char *filepath);
+
+/**
+ * Compute the SHA-256 digest of a file, reading it in chunks
+ * @param length: if not NULL, set to the number of bytes read
+ * @return 0 on success, else errno
+ */
+int sxupdate_sha256_file(const char *filepath, unsigned char hash[SHA256_DIGEST_LENGTH], size_t *length);
+
+/**
+ * sxupdate_sha256_file(), at the CPU and I/O priority set by sxupdate_set_qos() and yielding
+ * between chunks. For files hashed on behalf of a handle
+ */
+int sxupdate_sha256_file_qos(sxupdate_t handle, const char *filepath,
+                             unsigned char hash[SHA256_DIGEST_LENGTH], size_t *length);
+
+/**
+ * Sign a SHA-256 digest and return the base64-encoded signature, in the same form as
+ * `openssl dgst -sha256 -sign key.pem | openssl base64 -A`. Caller must free
+ */
+char *sxupdate_sign_sha256_b64(sxupdate_t handle, RSA *private_key,
+                               const unsigned char hash[SHA256_DIGEST_LENGTH]);
 
 enum sxupdate_status sxupdate_set_signature_from_b64(sxupdate_t handle,
                                                      const char *b64);
@@ -2,6 +2,9 @@
 #include <string.h>
 
 #include "internal.h"
+#include "version.h"
+#include "alloc.h"
+#include "parse.h"
 #include "log.h"
 
 static size_t version_prerelease_next_identifier_len(char *s) {
@@ -59,13 +62,12 @@ static int version_prerelease_cmp(char *x, char *y) {
 }
 
 /* compare two versions. return 1 if v1 > v2, -1 if v1 < v2, or 0 if they are equal */
-int sxupdate_version_cmp(struct sxupdate_semantic_version v1, struct sxupdate_semantic_version v2, unsigned char verbose) {
-  if(verbose)
-    sxupdate_verbose("comparing versions: v1 = %i.%i.%i-%s; v2 = %i.%i.%i-%s",
-            v1.major, v1.minor, v1.patch, v1.prerelease ? v1.prerelease : "",
-            v2.major, v2.minor, v2.patch, v2.prerelease ? v2.prerelease : ""
-            );
-#define SXUPDATE_VERSION_CMP_EXIT(part, rc) do { if(verbose) sxupdate_verbose("result " #part " = %i", rc); return rc; } while(0)
+int sxupdate_version_cmp(sxupdate_t handle, struct sxupdate_semantic_version v1, struct sxupdate_semantic_version v2) {
+  sxupdate_log_info(handle, "version.compare", "comparing versions: v1 = %i.%i.%i-%s; v2 = %i.%i.%i-%s",
+                    v1.major, v1.minor, v1.patch, v1.prerelease ? v1.prerelease : "",
+                    v2.major, v2.minor, v2.patch, v2.prerelease ? v2.prerelease : ""
+                    );
+#define SXUPDATE_VERSION_CMP_EXIT(part, rc) do { sxupdate_log_info(handle, "version.result", "result " #part " = %i", rc); return rc; } while(0)
 
 #define SXUPDATE_VERSION_CMP_VALUE(X) \
   if(v1.X > v2.X) SXUPDATE_VERSION_CMP_EXIT(X, 1); \
@@ -79,31 +81,46 @@ int sxupdate_version_cmp(struct sxupdate_semantic_version v1, struct sxupdate_se
   if(!v2.prerelease && v1.prerelease) SXUPDATE_VERSION_CMP_EXIT(prerelease, -1);
 
   if(v1.prerelease && v2.prerelease && strcmp(v1.prerelease, v2.prerelease)) {
-    char *pr1 = strdup(v1.prerelease);
-    char *pr2 = strdup(v2.prerelease);
+    char *pr1 = sxupdate_mem_strdup(v1.prerelease);
+    char *pr2 = sxupdate_mem_strdup(v2.prerelease);
     int rc = 0;
     if(!(pr1 && pr2))
-      sxupdate_printerr("Out of memory!");
+      sxupdate_log_error(handle, "memory", "Out of memory!");
     else
       rc = version_prerelease_cmp(pr1, pr2);
-    free(pr1);
-    free(pr2);
+    sxupdate_mem_free(pr1);
+    sxupdate_mem_free(pr2);
     SXUPDATE_VERSION_CMP_EXIT(prerelease, rc);
   }
   SXUPDATE_VERSION_CMP_EXIT("", 0);
 }
 
-void sxupdate_version_free(struct sxupdate_version *v) {
-  free(v->title);
-  free(v->link);
-  free(v->description);
-  free(v->pubDate);
-
-  free(v->version.prerelease);
-  free(v->version.meta);
+void sxupdate_version_strings(struct sxupdate_version *v, char **strings[SXUPDATE_VERSION_STRINGS]) {
+  size_t i = 0;
+  strings[i++] = &v->title;
+  strings[i++] = &v->link;
+  strings[i++] = &v->description;
+  strings[i++] = &v->pubDate;
+
+  strings[i++] = &v->version.prerelease;
+  strings[i++] = &v->version.meta;
+
+  strings[i++] = &v->enclosure.url;
+  strings[i++] = &v->enclosure.type;
+  strings[i++] = &v->enclosure.signature;
+  strings[i++] = &v->enclosure.filename;
+  strings[i++] = &v->enclosure.encoding;
+  strings[i++] = &v->enclosure.blocks;
+
+  strings[i++] = &v->manifest.url;
+  strings[i++] = &v->manifest.signature;
+}
 
-  free(v->enclosure.url);
-  free(v->enclosure.type);
-  free(v->enclosure.signature);
-  free(v->enclosure.filename);
+void sxupdate_version_free(sxupdate_t handle, struct sxupdate_version *v) {
+  char **strings[SXUPDATE_VERSION_STRINGS];
+  sxupdate_version_strings(v, strings);
+  for(size_t i = 0; i < SXUPDATE_VERSION_STRINGS; i++) {
+    sxupdate_parse_string_free(handle, *strings[i]);
+    *strings[i] = NULL;
+  }
 }
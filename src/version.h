@@ -1,8 +1,19 @@
 #ifndef SXUPDATE_VERSION_H
 #define SXUPDATE_VERSION_H
 
-int sxupdate_version_cmp(struct sxupdate_semantic_version v1, struct sxupdate_semantic_version v2, unsigned char verbose);
+int sxupdate_version_cmp(sxupdate_t handle, struct sxupdate_semantic_version v1, struct sxupdate_semantic_version v2);
 
-void sxupdate_version_free(struct sxupdate_version *v);
+#define SXUPDATE_VERSION_STRINGS 14
+
+/**
+ * Pointers to each string of v, to apply the same function to all of them
+ */
+void sxupdate_version_strings(struct sxupdate_version *v, char **strings[SXUPDATE_VERSION_STRINGS]);
+
+/**
+ * Free the strings of v, except those that point into the document being parsed, and
+ * set them to NULL
+ */
+void sxupdate_version_free(sxupdate_t handle, struct sxupdate_version *v);
 
 #endif